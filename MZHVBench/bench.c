@@ -0,0 +1,885 @@
+/**
+ * @file bench.c
+ * @brief Benchmarks for the MZHV driver.
+ *
+ * Every result is printed as a single line JSON object, so runs can be compared against a
+ * baseline by scripts. Cycle counts are TSC ticks measured with RDTSCP on a single core,
+ * latencies of driver calls are measured with QueryPerformanceCounter, since threads
+ * submitting them may migrate.
+ */
+
+
+#include <intrin.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <windows.h>
+#include "client.h"
+
+
+/**************************************************************************************************
+* Defines
+**************************************************************************************************/
+#define PAGE_SIZE             4096
+#define LARGE_PAGE_SIZE       (512 * PAGE_SIZE)
+
+/**
+ * @name Benchmark parameters
+ * @brief Number of samples per benchmark, maximal number of submitting threads, size
+ * and passes of the split benchmark buffer, and VMCALL samples taken per driver call.
+ * @anchor BENCHParameters
+ */
+///@{
+#define EXIT_ITERATIONS       100000
+#define VIOLATION_ITERATIONS  100000
+#define REMAP_ITERATIONS      2000
+#define MAX_THREADS           64
+#define SPLIT_BUFFER_SIZE     (32 * LARGE_PAGE_SIZE)
+#define SPLIT_PASSES          16
+#define VMCALL_SAMPLES        4096
+///@}
+
+
+/**************************************************************************************************
+* Local type declarations
+**************************************************************************************************/
+/**
+ * @brief Summary of a set of samples.
+ *
+ * @param noOfSamples Number of samples.
+ * @param min Smallest sample.
+ * @param p50 Median.
+ * @param p99 99th percentile.
+ * @param p999 99.9th percentile.
+ * @param max Largest sample.
+ * @param mean Arithmetic mean.
+ */
+typedef struct BENCH_Summary
+{
+  UINT64 noOfSamples;
+  UINT64 min;
+  UINT64 p50;
+  UINT64 p99;
+  UINT64 p999;
+  UINT64 max;
+  double mean;
+} BENCH_Summary;
+
+
+/**
+ * @brief Work of a single thread of the remap benchmark.
+ *
+ * @param client Client shared by all threads.
+ * @param startEvent Event the thread waits for before it starts.
+ * @param processor Processor the thread is pinned to.
+ * @param originalPage Page the thread changes the mapping of.
+ * @param targetPage Page used for read/write access while the mapping is changed.
+ * @param mapLatencies Latencies of the maps in nanoseconds.
+ * @param unmapLatencies Latencies of the unmaps in nanoseconds.
+ * @param noOfSamples Number of successful map/unmap pairs.
+ * @param noOfFailures Number of failed maps or unmaps.
+ */
+typedef struct BENCH_RemapThread
+{
+  CLIENT_Client* client;
+  HANDLE startEvent;
+  DWORD processor;
+  VOID* originalPage;
+  VOID* targetPage;
+  UINT64* mapLatencies;
+  UINT64* unmapLatencies;
+  UINT64 noOfSamples;
+  UINT64 noOfFailures;
+} BENCH_RemapThread;
+
+
+/**************************************************************************************************
+* Local globals definitions
+**************************************************************************************************/
+static CLIENT_Client client;
+static LARGE_INTEGER performanceFrequency;
+static volatile UINT64 sink;
+
+
+/**************************************************************************************************
+* Local function declarations
+**************************************************************************************************/
+static VOID benchTimer(UINT64* const samples);
+
+
+static VOID benchCpuid(UINT64* const samples, const INT32 leaf);
+
+
+static VOID benchVmCall(UINT64* const samples);
+
+
+static VOID benchEptViolation(UINT64* const samples);
+
+
+static VOID benchRemap(const DWORD noOfThreads, const UINT64 noOfLiveMappings);
+
+
+static DWORD WINAPI remapThread(VOID* parameter);
+
+
+static VOID benchSplit(VOID);
+
+
+static VOID measureSplitBuffer(
+  const CHAR* const state,
+  const UINT64 noOfSplitRegions,
+  const BYTE* const buffer);
+
+
+static BOOL mapLivePages(BYTE* const pages, const UINT64 noOfPages);
+
+
+static VOID unmapPages(BYTE* const pages, const UINT64 noOfPages, const UINT64 stride);
+
+
+static VOID* allocatePages(const SIZE_T size);
+
+
+static BOOL enableLockMemoryPrivilege(VOID);
+
+
+static UINT64 getNanoseconds(const LARGE_INTEGER start, const LARGE_INTEGER end);
+
+
+static int compareSamples(const VOID* first, const VOID* second);
+
+
+static BENCH_Summary summarize(UINT64* const samples, const UINT64 noOfSamples);
+
+
+static VOID printSummary(
+  const CHAR* const benchmark,
+  const CHAR* const unit,
+  const CHAR* const parameters,
+  UINT64* const samples,
+  const UINT64 noOfSamples);
+
+
+/**************************************************************************************************
+* Global function definitions
+**************************************************************************************************/
+int main(void)
+{
+  if (!CLIENT_open(&client, NULL))
+  {
+    printf("{\"error\":\"driver not available\"}\n");
+    return 1;
+  }
+
+  QueryPerformanceFrequency(&performanceFrequency);
+  SetProcessWorkingSetSize(GetCurrentProcess(), 256 * 1024 * 1024, 512 * 1024 * 1024);
+
+  SYSTEM_INFO systemInfo = { 0 };
+  GetSystemInfo(&systemInfo);
+  printf(
+    "{\"benchmark\":\"system\",\"processors\":%lu,\"qpcFrequency\":%lld}\n",
+    systemInfo.dwNumberOfProcessors,
+    performanceFrequency.QuadPart);
+
+  UINT64* const samples = malloc(max(EXIT_ITERATIONS, VIOLATION_ITERATIONS) * sizeof(UINT64));
+  if (samples == NULL)
+  {
+    CLIENT_close(&client);
+    return 1;
+  }
+
+  SetThreadAffinityMask(GetCurrentThread(), 1);
+  SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+  benchTimer(samples);
+  benchCpuid(samples, 0);
+  benchCpuid(samples, 1);
+  benchVmCall(samples);
+  benchEptViolation(samples);
+  free(samples);
+
+  const DWORD noOfThreads = min(systemInfo.dwNumberOfProcessors, MAX_THREADS);
+  const UINT64 liveMappings[] = { 0, 128, 512 };
+  for (UINT64 index = 0; index < ARRAYSIZE(liveMappings); index++)
+  {
+    for (DWORD threads = 1; threads <= noOfThreads; threads *= 2)
+    {
+      benchRemap(threads, liveMappings[index]);
+    }
+  }
+
+  benchSplit();
+
+  CLIENT_close(&client);
+  return 0;
+}
+
+
+/**************************************************************************************************
+* Local function definitions
+**************************************************************************************************/
+/**
+ * @brief Measures the cost of the timing itself, to be subtracted from other cycle counts.
+ *
+ * @param samples Buffer for EXIT_ITERATIONS samples.
+ *
+ * @return VOID
+ */
+static VOID benchTimer(UINT64* const samples)
+{
+  UINT32 processor = 0;
+  for (UINT64 index = 0; index < EXIT_ITERATIONS; index++)
+  {
+    const UINT64 start = __rdtscp(&processor);
+    const UINT64 end = __rdtscp(&processor);
+    samples[index] = end - start;
+  }
+
+  printSummary("timer", "cycles", "", samples, EXIT_ITERATIONS);
+}
+
+
+/**
+ * @brief Measures the round trip of a CPUID VM exit.
+ *
+ * @param samples Buffer for EXIT_ITERATIONS samples.
+ * @param leaf CPUID leaf to query.
+ *
+ * @return VOID
+ */
+static VOID benchCpuid(UINT64* const samples, const INT32 leaf)
+{
+  INT32 registers[4] = { 0 };
+  UINT32 processor = 0;
+  for (UINT64 index = 0; index < EXIT_ITERATIONS; index++)
+  {
+    const UINT64 start = __rdtscp(&processor);
+    __cpuid(registers, leaf);
+    const UINT64 end = __rdtscp(&processor);
+    samples[index] = end - start;
+  }
+
+  CHAR parameters[32] = { 0 };
+  sprintf_s(parameters, sizeof(parameters), ",\"leaf\":%d", leaf);
+  printSummary("cpuid", "cycles", parameters, samples, EXIT_ITERATIONS);
+}
+
+
+/**
+ * @brief Measures the round trip of a VMCALL VM exit with no work done by the handler.
+ *
+ * VMCALLs are rejected from user mode, so the driver issues them and returns the samples,
+ * VMCALL_SAMPLES per call. The samples do not include the IOCTL itself.
+ *
+ * @param samples Buffer for EXIT_ITERATIONS samples.
+ *
+ * @return VOID
+ */
+static VOID benchVmCall(UINT64* const samples)
+{
+  UINT64 noOfFailures = 0;
+  UINT64 noOfSamples = 0;
+  while (noOfSamples < EXIT_ITERATIONS)
+  {
+    const UINT64 noOfCallSamples = min(EXIT_ITERATIONS - noOfSamples, VMCALL_SAMPLES);
+    if (!CLIENT_benchVmCall(&client, noOfCallSamples, samples + noOfSamples))
+    {
+      noOfFailures++;
+      break;
+    }
+    noOfSamples += noOfCallSamples;
+  }
+
+  CHAR parameters[32] = { 0 };
+  sprintf_s(parameters, sizeof(parameters), ",\"failures\":%llu", noOfFailures);
+  printSummary("vmcall_nop", "cycles", parameters, samples, noOfSamples);
+}
+
+
+/**
+ * @brief Measures the cost of EPT violations switching between the views of a page.
+ *
+ * A sample is a data read from the page followed by a call into it. The baseline is measured
+ * before the mapping is changed. While it is changed, both cause an EPT violation, so the
+ * cost of a single violation is half of the difference from the baseline. With MTF
+ * assistance enabled, the mapping becomes MTF assisted after a few switches and data reads
+ * cause an EPT violation followed by an MTF exit instead.
+ *
+ * @param samples Buffer for VIOLATION_ITERATIONS samples.
+ *
+ * @return VOID
+ */
+static VOID benchEptViolation(UINT64* const samples)
+{
+  BYTE* const page = allocatePages(PAGE_SIZE);
+  BYTE* const fetchPage = allocatePages(PAGE_SIZE);
+  if (page == NULL || fetchPage == NULL)
+  {
+    VirtualFree(page, 0, MEM_RELEASE);
+    VirtualFree(fetchPage, 0, MEM_RELEASE);
+    return;
+  }
+
+  // ret
+  page[0] = 0xC3;
+  fetchPage[0] = 0xC3;
+  FlushInstructionCache(GetCurrentProcess(), page, PAGE_SIZE);
+  FlushInstructionCache(GetCurrentProcess(), fetchPage, PAGE_SIZE);
+  VOID(*const function)(VOID) = (VOID(*)(VOID))page;
+  volatile BYTE* const data = page + 64;
+
+  for (UINT64 pass = 0; pass < 2; pass++)
+  {
+    if (pass == 1 && !CLIENT_map(&client, page, page, fetchPage))
+    {
+      printf("{\"benchmark\":\"ept_violation_pair\",\"skipped\":\"page could not be mapped\"}\n");
+      break;
+    }
+
+    UINT32 processor = 0;
+    for (UINT64 index = 0; index < VIOLATION_ITERATIONS; index++)
+    {
+      const UINT64 start = __rdtscp(&processor);
+      (VOID)*data;
+      function();
+      const UINT64 end = __rdtscp(&processor);
+      samples[index] = end - start;
+    }
+
+    printSummary(
+      pass == 0 ? "ept_violation_baseline" : "ept_violation_pair",
+      "cycles",
+      "",
+      samples,
+      VIOLATION_ITERATIONS);
+
+    if (pass == 1)
+    {
+      CLIENT_unmap(&client, page);
+    }
+  }
+
+  VirtualFree(page, 0, MEM_RELEASE);
+  VirtualFree(fetchPage, 0, MEM_RELEASE);
+}
+
+
+/**
+ * @brief Measures DRIVER_MAP and DRIVER_UNMAP latency and throughput.
+ *
+ * Every thread is pinned to its own processor and repeatedly maps and unmaps its own page,
+ * while noOfLiveMappings other pages stay mapped. The driver applies each request on all
+ * processors, so the number of processors is fixed by the system, printed by the system
+ * line, and the thread count only varies the number of concurrent submitters.
+ *
+ * @param noOfThreads Number of submitting threads.
+ * @param noOfLiveMappings Number of mappings changed for the whole run.
+ *
+ * @return VOID
+ */
+static VOID benchRemap(const DWORD noOfThreads, const UINT64 noOfLiveMappings)
+{
+  BYTE* const livePages =
+    noOfLiveMappings != 0 ? allocatePages((noOfLiveMappings + 1) * PAGE_SIZE) : NULL;
+  BYTE* const threadPages = allocatePages(2 * (SIZE_T)noOfThreads * PAGE_SIZE);
+  UINT64* const latencies = malloc(2 * (SIZE_T)noOfThreads * REMAP_ITERATIONS * sizeof(UINT64));
+  HANDLE startEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+  BENCH_RemapThread threads[MAX_THREADS] = { 0 };
+  HANDLE threadHandles[MAX_THREADS] = { 0 };
+  if ((noOfLiveMappings != 0 && livePages == NULL) ||
+    threadPages == NULL ||
+    latencies == NULL ||
+    startEvent == NULL)
+  {
+    goto cleanup;
+  }
+
+  if (!mapLivePages(livePages, noOfLiveMappings))
+  {
+    printf(
+      "{\"benchmark\":\"driver_remap\",\"threads\":%lu,\"liveMappings\":%llu,"
+      "\"skipped\":\"live mappings could not be mapped\"}\n",
+      noOfThreads,
+      noOfLiveMappings);
+    goto cleanup;
+  }
+
+  UINT64* const mapLatencies = latencies;
+  UINT64* const unmapLatencies = latencies + (SIZE_T)noOfThreads * REMAP_ITERATIONS;
+  DWORD noOfStartedThreads = 0;
+  for (; noOfStartedThreads < noOfThreads; noOfStartedThreads++)
+  {
+    threads[noOfStartedThreads] = (BENCH_RemapThread)
+    {
+      .client = &client,
+      .startEvent = startEvent,
+      .processor = noOfStartedThreads,
+      .originalPage = threadPages + 2 * (SIZE_T)noOfStartedThreads * PAGE_SIZE,
+      .targetPage = threadPages + (2 * (SIZE_T)noOfStartedThreads + 1) * PAGE_SIZE,
+      .mapLatencies = mapLatencies + (SIZE_T)noOfStartedThreads * REMAP_ITERATIONS,
+      .unmapLatencies = unmapLatencies + (SIZE_T)noOfStartedThreads * REMAP_ITERATIONS,
+      .noOfSamples = 0,
+      .noOfFailures = 0
+    };
+    threadHandles[noOfStartedThreads] =
+      CreateThread(NULL, 0, remapThread, &threads[noOfStartedThreads], 0, NULL);
+    if (threadHandles[noOfStartedThreads] == NULL)
+    {
+      break;
+    }
+  }
+
+  LARGE_INTEGER start = { 0 };
+  LARGE_INTEGER end = { 0 };
+  QueryPerformanceCounter(&start);
+  SetEvent(startEvent);
+  WaitForMultipleObjects(noOfStartedThreads, threadHandles, TRUE, INFINITE);
+  QueryPerformanceCounter(&end);
+
+  unmapPages(livePages, noOfLiveMappings, PAGE_SIZE);
+
+  // Samples of each kind are packed at the start of their half of the buffer
+  UINT64 noOfSamples = 0;
+  UINT64 noOfFailures = 0;
+  for (DWORD index = 0; index < noOfStartedThreads; index++)
+  {
+    const SIZE_T size = threads[index].noOfSamples * sizeof(UINT64);
+    memmove(mapLatencies + noOfSamples, threads[index].mapLatencies, size);
+    memmove(unmapLatencies + noOfSamples, threads[index].unmapLatencies, size);
+    noOfSamples += threads[index].noOfSamples;
+    noOfFailures += threads[index].noOfFailures;
+    CloseHandle(threadHandles[index]);
+  }
+
+  const UINT64 elapsed = getNanoseconds(start, end);
+  CHAR parameters[160] = { 0 };
+  sprintf_s(
+    parameters,
+    sizeof(parameters),
+    ",\"threads\":%lu,\"liveMappings\":%llu,\"failures\":%llu,\"opsPerSecond\":%.0f",
+    noOfStartedThreads,
+    noOfLiveMappings,
+    noOfFailures,
+    elapsed != 0 ? 2.0 * noOfSamples * 1e9 / elapsed : 0.0);
+  printSummary("driver_map", "ns", parameters, mapLatencies, noOfSamples);
+  printSummary("driver_unmap", "ns", parameters, unmapLatencies, noOfSamples);
+
+cleanup:
+  if (startEvent != NULL)
+  {
+    CloseHandle(startEvent);
+  }
+  free(latencies);
+  VirtualFree(threadPages, 0, MEM_RELEASE);
+  VirtualFree(livePages, 0, MEM_RELEASE);
+}
+
+
+/**
+ * @brief Thread of the remap benchmark.
+ *
+ * @param parameter Pointer to the thread's BENCH_RemapThread.
+ *
+ * @return 0
+ */
+static DWORD WINAPI remapThread(VOID* parameter)
+{
+  BENCH_RemapThread* const thread = parameter;
+  SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << thread->processor);
+  WaitForSingleObject(thread->startEvent, INFINITE);
+
+  for (UINT64 index = 0; index < REMAP_ITERATIONS; index++)
+  {
+    LARGE_INTEGER start = { 0 };
+    LARGE_INTEGER mapped = { 0 };
+    LARGE_INTEGER unmapped = { 0 };
+    QueryPerformanceCounter(&start);
+    if (!CLIENT_map(thread->client, thread->originalPage, thread->targetPage, thread->originalPage))
+    {
+      thread->noOfFailures++;
+      continue;
+    }
+    QueryPerformanceCounter(&mapped);
+    const BOOL isUnmapped = CLIENT_unmap(thread->client, thread->originalPage);
+    QueryPerformanceCounter(&unmapped);
+    if (!isUnmapped)
+    {
+      thread->noOfFailures++;
+      break;
+    }
+
+    thread->mapLatencies[thread->noOfSamples] = getNanoseconds(start, mapped);
+    thread->unmapLatencies[thread->noOfSamples] = getNanoseconds(mapped, unmapped);
+    thread->noOfSamples++;
+  }
+
+  return 0;
+}
+
+
+/**
+ * @brief Measures memory bandwidth and TLB miss cost with unsplit and split EPT PDEs.
+ *
+ * The buffer is made of large pages, so each of its 2 MB regions is backed by a single EPT
+ * PDE. Changing the mapping of the first page of every region splits all of them into page
+ * tables, after which the same measurements are repeated. The first pages are mapped to
+ * themselves for read/write access, so the buffer content does not change.
+ *
+ * @return VOID
+ */
+static VOID benchSplit(VOID)
+{
+  BYTE* buffer = NULL;
+  if (enableLockMemoryPrivilege())
+  {
+    buffer = VirtualAlloc(
+      NULL,
+      SPLIT_BUFFER_SIZE,
+      MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES,
+      PAGE_READWRITE);
+  }
+  BYTE* const fetchPage = allocatePages(PAGE_SIZE);
+  if (buffer == NULL || fetchPage == NULL)
+  {
+    printf("{\"benchmark\":\"pde_split\",\"skipped\":\"large pages unavailable\"}\n");
+    VirtualFree(buffer, 0, MEM_RELEASE);
+    VirtualFree(fetchPage, 0, MEM_RELEASE);
+    return;
+  }
+
+  // Pointer chase visiting every page once in random order, at varying cache line offsets
+  const UINT64 noOfPages = SPLIT_BUFFER_SIZE / PAGE_SIZE;
+  UINT64* const order = malloc(noOfPages * sizeof(UINT64));
+  if (order == NULL)
+  {
+    VirtualFree(buffer, 0, MEM_RELEASE);
+    VirtualFree(fetchPage, 0, MEM_RELEASE);
+    return;
+  }
+  for (UINT64 index = 0; index < noOfPages; index++)
+  {
+    order[index] = index;
+  }
+  srand(0x4D5A);
+  for (UINT64 index = noOfPages - 1; index > 0; index--)
+  {
+    const UINT64 other = (((UINT64)rand() << 15) | (UINT64)rand()) % (index + 1);
+    const UINT64 page = order[index];
+    order[index] = order[other];
+    order[other] = page;
+  }
+  for (UINT64 index = 0; index < noOfPages; index++)
+  {
+    const UINT64 page = order[index];
+    const UINT64 nextPage = order[(index + 1) % noOfPages];
+    BYTE** const slot = (BYTE**)(buffer + page * PAGE_SIZE + (page % 64) * 64);
+    *slot = buffer + nextPage * PAGE_SIZE + (nextPage % 64) * 64;
+  }
+  free(order);
+
+  measureSplitBuffer("unsplit", 0, buffer);
+
+  UINT64 noOfMappedRegions = 0;
+  for (; noOfMappedRegions < SPLIT_BUFFER_SIZE / LARGE_PAGE_SIZE; noOfMappedRegions++)
+  {
+    BYTE* const region = buffer + noOfMappedRegions * LARGE_PAGE_SIZE;
+    if (!CLIENT_map(&client, region, region, fetchPage))
+    {
+      break;
+    }
+  }
+
+  measureSplitBuffer("split", noOfMappedRegions, buffer);
+
+  unmapPages(buffer, noOfMappedRegions, LARGE_PAGE_SIZE);
+
+  VirtualFree(buffer, 0, MEM_RELEASE);
+  VirtualFree(fetchPage, 0, MEM_RELEASE);
+}
+
+
+/**
+ * @brief Measures sequential read bandwidth and pointer chase latency of the split buffer.
+ *
+ * The pointer chase touches a different page on every access, so it mostly measures
+ * TLB misses and page walks.
+ *
+ * @param state Name of the EPT state, "unsplit" or "split".
+ * @param noOfSplitRegions Number of 2 MB regions split by changed mappings.
+ * @param buffer Buffer of SPLIT_BUFFER_SIZE bytes holding the pointer chase.
+ *
+ * @return VOID
+ */
+static VOID measureSplitBuffer(
+  const CHAR* const state,
+  const UINT64 noOfSplitRegions,
+  const BYTE* const buffer)
+{
+  const UINT64* const words = (const UINT64*)buffer;
+  const UINT64 noOfWords = SPLIT_BUFFER_SIZE / sizeof(UINT64);
+  UINT64 sum = 0;
+  for (UINT64 index = 0; index < noOfWords; index++)
+  {
+    sum += words[index];
+  }
+
+  LARGE_INTEGER start = { 0 };
+  LARGE_INTEGER end = { 0 };
+  QueryPerformanceCounter(&start);
+  for (UINT64 pass = 0; pass < SPLIT_PASSES; pass++)
+  {
+    for (UINT64 index = 0; index < noOfWords; index++)
+    {
+      sum += words[index];
+    }
+  }
+  QueryPerformanceCounter(&end);
+  sink = sum;
+
+  const UINT64 elapsed = getNanoseconds(start, end);
+  printf(
+    "{\"benchmark\":\"pde_split_bandwidth\",\"state\":\"%s\",\"splitRegions\":%llu,"
+    "\"bytesPerSecond\":%.0f}\n",
+    state,
+    noOfSplitRegions,
+    elapsed != 0 ? (double)SPLIT_BUFFER_SIZE * SPLIT_PASSES * 1e9 / elapsed : 0.0);
+
+  const UINT64 noOfAccesses = (SPLIT_BUFFER_SIZE / PAGE_SIZE) * SPLIT_PASSES;
+  BYTE* const* pointer = (BYTE* const*)buffer;
+  UINT32 processor = 0;
+  const UINT64 startTimestamp = __rdtscp(&processor);
+  for (UINT64 index = 0; index < noOfAccesses; index++)
+  {
+    pointer = (BYTE* const*)*pointer;
+  }
+  const UINT64 endTimestamp = __rdtscp(&processor);
+  sink = (UINT64)pointer;
+
+  printf(
+    "{\"benchmark\":\"pde_split_tlb\",\"state\":\"%s\",\"splitRegions\":%llu,"
+    "\"unit\":\"cycles\",\"perAccess\":%.2f}\n",
+    state,
+    noOfSplitRegions,
+    (double)(endTimestamp - startTimestamp) / noOfAccesses);
+}
+
+
+/**
+ * @brief Changes the mappings of pages which stay changed during a benchmark.
+ *
+ * All pages share the page after them as the read/write and fetch target. The pages are
+ * never accessed while they are mapped.
+ *
+ * @param pages Buffer of noOfPages + 1 pages.
+ * @param noOfPages Number of pages to map.
+ *
+ * @return TRUE if all pages were mapped, FALSE otherwise, in which case none is left mapped.
+ */
+static BOOL mapLivePages(BYTE* const pages, const UINT64 noOfPages)
+{
+  BYTE* const targetPage = pages + noOfPages * PAGE_SIZE;
+  for (UINT64 index = 0; index < noOfPages; index++)
+  {
+    if (!CLIENT_queueMap(&client, pages + index * PAGE_SIZE, targetPage, targetPage))
+    {
+      CLIENT_flush(&client, NULL);
+      unmapPages(pages, index, PAGE_SIZE);
+      return FALSE;
+    }
+  }
+
+  CLIENT_Completion completion = { 0 };
+  if (!CLIENT_flush(&client, &completion))
+  {
+    unmapPages(pages, noOfPages, PAGE_SIZE);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+
+/**
+ * @brief Removes mapping changes of pages, ignoring pages which are not mapped.
+ *
+ * @param pages First page.
+ * @param noOfPages Number of pages.
+ * @param stride Distance between the pages in bytes.
+ *
+ * @return VOID
+ */
+static VOID unmapPages(BYTE* const pages, const UINT64 noOfPages, const UINT64 stride)
+{
+  for (UINT64 index = 0; index < noOfPages; index++)
+  {
+    if (!CLIENT_queueUnmap(&client, pages + index * stride))
+    {
+      CLIENT_flush(&client, NULL);
+      CLIENT_queueUnmap(&client, pages + index * stride);
+    }
+  }
+
+  CLIENT_flush(&client, NULL);
+}
+
+
+/**
+ * @brief Allocates executable pages which stay resident while the benchmarks run.
+ *
+ * Pages are locked and written, so they are backed by physical memory before their
+ * physical addresses are taken by the driver.
+ *
+ * @param size Size in bytes, multiple of PAGE_SIZE.
+ *
+ * @return Allocated pages, or NULL on failure.
+ */
+static VOID* allocatePages(const SIZE_T size)
+{
+  BYTE* const pages = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+  if (pages == NULL)
+  {
+    return NULL;
+  }
+
+  memset(pages, 0, size);
+  if (!VirtualLock(pages, size))
+  {
+    VirtualFree(pages, 0, MEM_RELEASE);
+    return NULL;
+  }
+
+  return pages;
+}
+
+
+/**
+ * @brief Enables SeLockMemoryPrivilege, required for large page allocations.
+ *
+ * The privilege has to be granted to the account, this only enables it in the token.
+ *
+ * @return TRUE if the privilege is enabled, FALSE otherwise.
+ */
+static BOOL enableLockMemoryPrivilege(VOID)
+{
+  HANDLE token = NULL;
+  if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+  {
+    return FALSE;
+  }
+
+  TOKEN_PRIVILEGES privileges = { .PrivilegeCount = 1 };
+  privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+  BOOL isSuccessful =
+    LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid);
+  if (isSuccessful)
+  {
+    isSuccessful = AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL) &&
+      GetLastError() == ERROR_SUCCESS;
+  }
+
+  CloseHandle(token);
+  return isSuccessful;
+}
+
+
+/**
+ * @brief Converts a QueryPerformanceCounter interval to nanoseconds.
+ *
+ * @param start Counter at the start of the interval.
+ * @param end Counter at the end of the interval.
+ *
+ * @return Length of the interval in nanoseconds.
+ */
+static UINT64 getNanoseconds(const LARGE_INTEGER start, const LARGE_INTEGER end)
+{
+  const UINT64 ticks = (UINT64)(end.QuadPart - start.QuadPart);
+  const UINT64 frequency = (UINT64)performanceFrequency.QuadPart;
+
+  return (ticks / frequency) * 1000000000 + (ticks % frequency) * 1000000000 / frequency;
+}
+
+
+/**
+ * @brief qsort comparator of samples.
+ *
+ * @param first First sample.
+ * @param second Second sample.
+ *
+ * @return Negative, zero, or positive value, as required by qsort.
+ */
+static int compareSamples(const VOID* first, const VOID* second)
+{
+  const UINT64 firstSample = *(const UINT64*)first;
+  const UINT64 secondSample = *(const UINT64*)second;
+
+  return (firstSample > secondSample) - (firstSample < secondSample);
+}
+
+
+/**
+ * @brief Summarizes samples, which are sorted in place.
+ *
+ * @param samples Samples.
+ * @param noOfSamples Number of samples, can be 0.
+ *
+ * @return Summary of the samples.
+ */
+static BENCH_Summary summarize(UINT64* const samples, const UINT64 noOfSamples)
+{
+  BENCH_Summary summary = { .noOfSamples = noOfSamples };
+  if (noOfSamples == 0)
+  {
+    return summary;
+  }
+
+  qsort(samples, noOfSamples, sizeof(UINT64), compareSamples);
+
+  double sum = 0.0;
+  for (UINT64 index = 0; index < noOfSamples; index++)
+  {
+    sum += (double)samples[index];
+  }
+
+  summary.min = samples[0];
+  summary.p50 = samples[noOfSamples / 2];
+  summary.p99 = samples[noOfSamples * 99 / 100];
+  summary.p999 = samples[noOfSamples * 999 / 1000];
+  summary.max = samples[noOfSamples - 1];
+  summary.mean = sum / noOfSamples;
+
+  return summary;
+}
+
+
+/**
+ * @brief Prints a summary of samples as a single line JSON object.
+ *
+ * @param benchmark Name of the benchmark.
+ * @param unit Unit of the samples.
+ * @param parameters Additional fields, each starting with a comma, or an empty string.
+ * @param samples Samples, sorted in place.
+ * @param noOfSamples Number of samples.
+ *
+ * @return VOID
+ */
+static VOID printSummary(
+  const CHAR* const benchmark,
+  const CHAR* const unit,
+  const CHAR* const parameters,
+  UINT64* const samples,
+  const UINT64 noOfSamples)
+{
+  const BENCH_Summary summary = summarize(samples, noOfSamples);
+
+  printf(
+    "{\"benchmark\":\"%s\",\"unit\":\"%s\"%s,\"samples\":%llu,\"min\":%llu,\"p50\":%llu,"
+    "\"p99\":%llu,\"p999\":%llu,\"max\":%llu,\"mean\":%.2f}\n",
+    benchmark,
+    unit,
+    parameters,
+    summary.noOfSamples,
+    summary.min,
+    summary.p50,
+    summary.p99,
+    summary.p999,
+    summary.max,
+    summary.mean);
+}
@@ -0,0 +1,1493 @@
+/**
+ * @file client.c
+ * @brief Implements the MZHV user-mode client library.
+ *
+ * Queued requests are flushed in order, as runs of requests of the same type. A run of
+ * a single request uses DRIVER_MAP or DRIVER_UNMAP, or their asynchronous variants on an
+ * overlapped handle, longer runs use the batch IOCTLs. Every run is one IOCTL, so the order
+ * of maps and unmaps of the same page is kept.
+ *
+ * A command ring has one producer on each side. Commands are written at the private head
+ * and published all at once by CLIENT_ringSubmit, which rings the doorbell. The driver
+ * applies everything it finds with a single broadcast, and completions are read back without
+ * entering the kernel.
+ *
+ * Hot pages are aggregated from the trace rings mapped with DRIVER_MAP_TRACE. Samples are
+ * grouped by address space and page, so the same virtual page of two processes is counted
+ * separately, while kernel pages are counted once for all of them.
+ */
+
+
+#include <stdlib.h>
+#include "client.h"
+
+
+/**************************************************************************************************
+* Defines
+**************************************************************************************************/
+/**
+ * @name Driver interface
+ * @brief Device name and IOCTL codes, must match driver.h.
+ * @anchor CLIENTDriverInterface
+ */
+///@{
+#define DEVICE_NAME         L"\\\\.\\MZHV"
+#define DRIVER_MAP          CTL_CODE(FILE_DEVICE_UNKNOWN, 0x1337, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_UNMAP        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x2137, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_MAP_BATCH    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x1338, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_UNMAP_BATCH  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x2138, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_MAP_ASYNC    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x133A, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_UNMAP_ASYNC  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x213A, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_OPEN_RING    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x133B, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_CLOSE_RING   CTL_CODE(FILE_DEVICE_UNKNOWN, 0x213B, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_PREPARE      CTL_CODE(FILE_DEVICE_UNKNOWN, 0x133C, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_UNPREPARE    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x213C, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_GROUP_BATCH  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x133D, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_MAP_TRACE    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x4138, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_START_SAMPLE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x413D, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_STOP_SAMPLE  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x413E, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_BENCH_VMCALL CTL_CODE(FILE_DEVICE_UNKNOWN, 0x413F, METHOD_BUFFERED, FILE_ANY_ACCESS)
+///@}
+
+/**
+ * @name Trace interface
+ * @brief Type of sample events, must match CONTEXT_TRACE_EVENT_SAMPLE, and the constants
+ * used to aggregate samples by page.
+ * @anchor CLIENTTraceInterface
+ */
+///@{
+#define TRACE_EVENT_SAMPLE   3
+#define PAGE_OFFSET_MASK     0xFFFULL
+#define KERNEL_ADDRESS_BASE  0xFFFF800000000000ULL
+///@}
+
+
+/**************************************************************************************************
+* Local type declarations
+**************************************************************************************************/
+#pragma warning(disable:4200)
+/**
+ * @brief Overlapped IOCTL in flight.
+ *
+ * @param overlapped Overlapped structure passed to DeviceIoControl.
+ * @param noOfRequests Number of requests sent with the IOCTL.
+ * @param isBatch TRUE if a batch IOCTL was used and statuses are valid.
+ * @param statuses Output buffer of a batch IOCTL, one status per request.
+ */
+typedef struct CLIENT_Operation
+{
+  OVERLAPPED overlapped;
+  UINT64 noOfRequests;
+  BOOL isBatch;
+  LONG statuses[];
+} CLIENT_Operation;
+
+
+/**
+ * @brief Input of DRIVER_PREPARE and DRIVER_UNPREPARE, must match PAGE_SWAPPER_PrepareRequest.
+ *
+ * @param address First page of the region.
+ * @param size Size of the region in bytes.
+ */
+typedef struct CLIENT_PrepareRequest
+{
+  VOID* address;
+  UINT64 size;
+} CLIENT_PrepareRequest;
+
+
+/**
+ * @brief Entry of DRIVER_GROUP_BATCH input, must match PAGE_SWAPPER_GroupRequest.
+ *
+ * @param originalAddress Changed page, first page of a range mapping.
+ * @param groupId Group to move the mapping to, 0 to remove it from its group.
+ */
+typedef struct CLIENT_GroupRequest
+{
+  VOID* originalAddress;
+  UINT64 groupId;
+} CLIENT_GroupRequest;
+
+
+/**
+ * @brief Trace rings mapped by DRIVER_MAP_TRACE, must match TRACE_Mapping.
+ *
+ * @param address Address of the read-only view.
+ * @param size Size of the view in bytes.
+ * @param ringSize Size of a single ring in bytes.
+ * @param noOfRings Number of rings, one per logical core.
+ */
+typedef struct CLIENT_TraceMapping
+{
+  VOID* address;
+  UINT64 size;
+  UINT64 ringSize;
+  UINT64 noOfRings;
+} CLIENT_TraceMapping;
+
+
+/**
+ * @brief Traced event, must match Context_TraceEvent.
+ *
+ * @param timestamp TSC value when the event was recorded.
+ * @param guestRip Guest RIP.
+ * @param address Guest CR3 for samples.
+ * @param vmCallCode VMCALL code.
+ * @param type Event type.
+ * @param accessType Access type of EPT violations.
+ * @param view EPT view of EPT violations.
+ * @param reserved Reserved.
+ */
+typedef struct CLIENT_TraceEvent
+{
+  UINT64 timestamp;
+  UINT64 guestRip;
+  UINT64 address;
+  UINT32 vmCallCode;
+  UINT8 type;
+  UINT8 accessType;
+  UINT8 view;
+  UINT8 reserved;
+} CLIENT_TraceEvent;
+
+
+/**
+ * @brief Trace ring of a single logical core, must match Context_TraceRing.
+ *
+ * @param head Number of events recorded so far.
+ * @param capacity Number of events in the ring, power of 2.
+ * @param reserved Reserved.
+ * @param events Events.
+ */
+typedef struct CLIENT_TraceRing
+{
+  volatile UINT64 head;
+  UINT64 capacity;
+  UINT64 reserved[6];
+  CLIENT_TraceEvent events[];
+} CLIENT_TraceRing;
+
+
+/**
+ * @brief Header of a command ring, must match COMMAND_RING_Header.
+ *
+ * @param submissionHead Number of commands submitted.
+ * @param completionTail Number of completions read.
+ * @param reserved0 Reserved.
+ * @param submissionTail Number of commands consumed by the driver.
+ * @param completionHead Number of completions posted by the driver.
+ * @param capacity Number of entries of each queue.
+ * @param reserved1 Reserved.
+ */
+typedef struct CLIENT_RingHeader
+{
+  volatile UINT64 submissionHead;
+  volatile UINT64 completionTail;
+  UINT64 reserved0[6];
+  volatile UINT64 submissionTail;
+  volatile UINT64 completionHead;
+  UINT64 capacity;
+  UINT64 reserved1[5];
+} CLIENT_RingHeader;
+
+
+/**
+ * @brief Command of a command ring, must match COMMAND_RING_Submission.
+ *
+ * @param userData Value copied into the completion.
+ * @param type CLIENT_REQUEST_MAP or CLIENT_REQUEST_UNMAP.
+ * @param originalAddress Page to be changed or restored.
+ * @param rwAddress Page mapped for read/write access, unused for unmaps.
+ * @param fetchAddress Page mapped for code execution, unused for unmaps.
+ */
+typedef struct CLIENT_RingSubmission
+{
+  UINT64 userData;
+  UINT64 type;
+  VOID* originalAddress;
+  VOID* rwAddress;
+  VOID* fetchAddress;
+} CLIENT_RingSubmission;
+
+
+/**
+ * @brief Input of DRIVER_OPEN_RING, must match COMMAND_RING_Registration.
+ *
+ * @param doorbellEvent Event signaled after commands are submitted.
+ * @param completionEvent Event signaled by the driver after it posted completions.
+ * @param noOfEntries Requested number of entries of each queue, 0 for the driver default.
+ */
+typedef struct CLIENT_RingRegistration
+{
+  HANDLE doorbellEvent;
+  HANDLE completionEvent;
+  UINT64 noOfEntries;
+} CLIENT_RingRegistration;
+
+
+/**
+ * @brief Output of DRIVER_OPEN_RING, must match COMMAND_RING_Mapping.
+ *
+ * @param address Address of the view.
+ * @param size Size of the view in bytes.
+ * @param capacity Number of entries of each queue.
+ */
+typedef struct CLIENT_RingMapping
+{
+  VOID* address;
+  UINT64 size;
+  UINT64 capacity;
+} CLIENT_RingMapping;
+#pragma warning(default:4200)
+
+
+/**************************************************************************************************
+* Local function declarations
+**************************************************************************************************/
+static BOOL sendRequest(
+  const CLIENT_Client* const client,
+  const DWORD ioControlCode,
+  VOID* const input,
+  const DWORD inputLength,
+  VOID* const output,
+  const DWORD outputLength);
+
+
+static BOOL sendRun(
+  CLIENT_Client* const client,
+  const UINT64 noOfRequests,
+  const CLIENT_Request* const requests,
+  CLIENT_Completion* const completion);
+
+
+static BOOL submitRun(
+  CLIENT_Client* const client,
+  const UINT64 noOfRequests,
+  const CLIENT_Request* const requests,
+  CLIENT_Completion* const completion);
+
+
+static DWORD getIoControlCode(const UINT64 type, const UINT64 noOfRequests, const BOOL isAsync);
+
+
+static VOID* buildInput(
+  const UINT64 noOfRequests,
+  const CLIENT_Request* const requests,
+  DWORD* const inputLength);
+
+
+static UINT64 countFailures(const UINT64 noOfStatuses, const LONG* const statuses);
+
+
+static VOID compactQueue(CLIENT_Client* const client);
+
+
+static VOID mergeCompletion(CLIENT_Completion* const total, const CLIENT_Completion* const part);
+
+
+static UINT64 collectSamples(
+  const CLIENT_TraceMapping* const mapping,
+  CLIENT_HotPage* const samples);
+
+
+static UINT64 mergeSamples(const UINT64 noOfSamples, CLIENT_HotPage* const samples);
+
+
+static BOOL pushCommand(CLIENT_Ring* const ring, const CLIENT_RingSubmission* const command);
+
+
+static int compareByPage(const VOID* const first, const VOID* const second);
+
+
+static int compareBySamples(const VOID* const first, const VOID* const second);
+
+
+/**************************************************************************************************
+* Global function definitions
+**************************************************************************************************/
+/**
+ * @brief Opens a client.
+ *
+ * If a completion port is given, the device is opened for overlapped I/O and associated
+ * with the port, using the client's address as the completion key. Flushes are then sent
+ * without waiting, and their results have to be collected with CLIENT_complete or CLIENT_wait.
+ *
+ * @param client Client to open.
+ * @param completionPort Completion port for flushes, NULL for a synchronous client.
+ *
+ * @return TRUE if the client was opened, FALSE otherwise.
+ */
+BOOL CLIENT_open(CLIENT_Client* const client, const HANDLE completionPort)
+{
+  *client = (CLIENT_Client)
+  {
+    .deviceHandle = INVALID_HANDLE_VALUE,
+    .completionPort = NULL,
+    .syncEvent = NULL,
+    .noOfPendingOperations = 0,
+    .noOfQueuedRequests = 0,
+    .queuedRequests = malloc(CLIENT_MAX_QUEUED_REQUESTS * sizeof(CLIENT_Request))
+  };
+  if (client->queuedRequests == NULL)
+  {
+    return FALSE;
+  }
+
+  client->deviceHandle = CreateFile(
+    DEVICE_NAME,
+    GENERIC_READ | GENERIC_WRITE,
+    0,
+    NULL,
+    OPEN_EXISTING,
+    FILE_ATTRIBUTE_NORMAL | (completionPort != NULL ? FILE_FLAG_OVERLAPPED : 0),
+    NULL);
+  if (client->deviceHandle == INVALID_HANDLE_VALUE)
+  {
+    CLIENT_close(client);
+    return FALSE;
+  }
+
+  if (completionPort != NULL)
+  {
+    client->syncEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (client->syncEvent == NULL ||
+      CreateIoCompletionPort(client->deviceHandle, completionPort, (ULONG_PTR)client, 0) == NULL)
+    {
+      CLIENT_close(client);
+      return FALSE;
+    }
+    client->completionPort = completionPort;
+  }
+
+  return TRUE;
+}
+
+
+/**
+ * @brief Closes a client.
+ *
+ * Queued requests which were not flushed are dropped. Overlapped operations must be
+ * completed before the client is closed.
+ *
+ * @param client Client to close.
+ *
+ * @return VOID
+ */
+VOID CLIENT_close(CLIENT_Client* const client)
+{
+  if (client->syncEvent != NULL)
+  {
+    CloseHandle(client->syncEvent);
+  }
+
+  if (client->deviceHandle != INVALID_HANDLE_VALUE)
+  {
+    CloseHandle(client->deviceHandle);
+  }
+
+  free(client->queuedRequests);
+  *client = (CLIENT_Client){ .deviceHandle = INVALID_HANDLE_VALUE };
+}
+
+
+/**
+ * @brief Changes the mapping of a page right away.
+ *
+ * Waits for the driver also if the client is overlapped, the completion port is not used.
+ *
+ * @param client Client to use.
+ * @param originalAddress Page to be changed.
+ * @param rwAddress Page to be mapped for read/write access.
+ * @param fetchAddress Page to be mapped for code execution.
+ *
+ * @return TRUE if the mapping was changed successfully, FALSE otherwise.
+ */
+BOOL CLIENT_map(
+  CLIENT_Client* const client,
+  VOID* const originalAddress,
+  VOID* const rwAddress,
+  VOID* const fetchAddress)
+{
+  VOID* addresses[3] = { originalAddress, rwAddress, fetchAddress };
+  return sendRequest(client, DRIVER_MAP, addresses, sizeof(addresses), NULL, 0);
+}
+
+
+/**
+ * @brief Removes the mapping change of a page right away.
+ *
+ * @param client Client to use.
+ * @param originalAddress Page to be restored.
+ *
+ * @return TRUE if the mapping change was restored to default, FALSE otherwise.
+ */
+BOOL CLIENT_unmap(CLIENT_Client* const client, VOID* const originalAddress)
+{
+  VOID* addresses[1] = { originalAddress };
+  return sendRequest(client, DRIVER_UNMAP, addresses, sizeof(addresses), NULL, 0);
+}
+
+
+/**
+ * @brief Splits a region into 4 KB pages ahead of mapping changes.
+ *
+ * Later changes of pages in the region only write their page table entries, and the region
+ * stays split when they are removed, until it is released with CLIENT_unprepare. The pages
+ * must be resident, e.g. locked with VirtualLock.
+ *
+ * @param client Client to use.
+ * @param address First page of the region.
+ * @param size Size of the region in bytes, multiple of the page size.
+ *
+ * @return TRUE if the region was prepared, FALSE otherwise.
+ */
+BOOL CLIENT_prepare(CLIENT_Client* const client, VOID* const address, const UINT64 size)
+{
+  CLIENT_PrepareRequest request = { .address = address, .size = size };
+  return sendRequest(client, DRIVER_PREPARE, &request, sizeof(request), NULL, 0);
+}
+
+
+/**
+ * @brief Releases a region prepared by CLIENT_prepare.
+ *
+ * @param client Client to use.
+ * @param address First page of the region.
+ * @param size Size of the region in bytes, the same as when it was prepared.
+ *
+ * @return TRUE if the region was released, FALSE otherwise.
+ */
+BOOL CLIENT_unprepare(CLIENT_Client* const client, VOID* const address, const UINT64 size)
+{
+  CLIENT_PrepareRequest request = { .address = address, .size = size };
+  return sendRequest(client, DRIVER_UNPREPARE, &request, sizeof(request), NULL, 0);
+}
+
+
+/**
+ * @brief Moves a changed page to a mapping group.
+ *
+ * An EPT violation of any page of a group switches all of them to the same view, so a hook
+ * spanning several pages takes a single violation. Groups only apply when EPTP switching is
+ * not used, up to 64 pages can share a group. The group is dropped when the mapping change
+ * is removed.
+ *
+ * @param client Client to use.
+ * @param originalAddress Changed page, first page of a range mapping.
+ * @param groupId Group to move the page to, 0 to remove it from its group.
+ *
+ * @return TRUE if the group was set, FALSE otherwise.
+ */
+BOOL CLIENT_setGroup(
+  CLIENT_Client* const client,
+  VOID* const originalAddress,
+  const UINT64 groupId)
+{
+  CLIENT_GroupRequest request = { .originalAddress = originalAddress, .groupId = groupId };
+  LONG status = 0;
+  return sendRequest(client, DRIVER_GROUP_BATCH, &request, sizeof(request), &status, sizeof(status))
+    && status >= 0;
+}
+
+
+/**
+ * @brief Queues a mapping change until the next flush.
+ *
+ * @param client Client to use.
+ * @param originalAddress Page to be changed.
+ * @param rwAddress Page to be mapped for read/write access.
+ * @param fetchAddress Page to be mapped for code execution.
+ *
+ * @return TRUE if the request was queued, FALSE if the queue is full and has to be flushed.
+ */
+BOOL CLIENT_queueMap(
+  CLIENT_Client* const client,
+  VOID* const originalAddress,
+  VOID* const rwAddress,
+  VOID* const fetchAddress)
+{
+  if (client->noOfQueuedRequests >= CLIENT_MAX_QUEUED_REQUESTS)
+  {
+    return FALSE;
+  }
+
+  client->queuedRequests[client->noOfQueuedRequests] = (CLIENT_Request)
+  {
+    .type = CLIENT_REQUEST_MAP,
+    .originalAddress = originalAddress,
+    .rwAddress = rwAddress,
+    .fetchAddress = fetchAddress
+  };
+  client->noOfQueuedRequests++;
+
+  return TRUE;
+}
+
+
+/**
+ * @brief Queues removal of a mapping change until the next flush.
+ *
+ * If the latest queued request for the page is a map, and an unmap of the page is queued
+ * before it, both the map and this unmap are dropped. The earlier unmap leaves the page
+ * without a mapping change, so the map would have been applied and the page ends up with its
+ * original mapping anyway. Without such an unmap, the page may already have been changed
+ * when the map was queued, in which case the driver rejects the map and this unmap removes
+ * the earlier change, so the unmap is queued.
+ *
+ * @param client Client to use.
+ * @param originalAddress Page to be restored.
+ *
+ * @return TRUE if the request was queued or cancelled a queued map, FALSE if the queue is
+ * full and has to be flushed.
+ */
+BOOL CLIENT_queueUnmap(CLIENT_Client* const client, VOID* const originalAddress)
+{
+  CLIENT_Request* queuedMap = NULL;
+  for (UINT64 index = client->noOfQueuedRequests; index > 0; index--)
+  {
+    CLIENT_Request* const request = &client->queuedRequests[index - 1];
+    if (request->type == CLIENT_REQUEST_NONE || request->originalAddress != originalAddress)
+    {
+      continue;
+    }
+
+    if (queuedMap == NULL && request->type == CLIENT_REQUEST_MAP)
+    {
+      queuedMap = request;
+      continue;
+    }
+
+    if (queuedMap != NULL && request->type == CLIENT_REQUEST_UNMAP)
+    {
+      queuedMap->type = CLIENT_REQUEST_NONE;
+      return TRUE;
+    }
+    break;
+  }
+
+  if (client->noOfQueuedRequests >= CLIENT_MAX_QUEUED_REQUESTS)
+  {
+    return FALSE;
+  }
+
+  client->queuedRequests[client->noOfQueuedRequests] = (CLIENT_Request)
+  {
+    .type = CLIENT_REQUEST_UNMAP,
+    .originalAddress = originalAddress
+  };
+  client->noOfQueuedRequests++;
+
+  return TRUE;
+}
+
+
+/**
+ * @brief Sends all queued requests to the driver.
+ *
+ * A synchronous client waits for every IOCTL, and the completion describes all of them.
+ * An overlapped client only submits them, the completion then counts the submitted requests
+ * and the ones that could not be submitted, and results arrive on the completion port. The
+ * queue is empty afterwards in both cases.
+ *
+ * @param client Client to use.
+ * @param completion Pointer receiving the result, can be NULL.
+ *
+ * @return TRUE if all requests were applied (or submitted), FALSE otherwise.
+ */
+BOOL CLIENT_flush(CLIENT_Client* const client, CLIENT_Completion* const completion)
+{
+  compactQueue(client);
+
+  CLIENT_Completion total = { .noOfRequests = 0, .noOfFailures = 0, .error = ERROR_SUCCESS };
+  BOOL isSuccessful = TRUE;
+  UINT64 index = 0;
+  while (index < client->noOfQueuedRequests)
+  {
+    const CLIENT_Request* const run = &client->queuedRequests[index];
+    UINT64 runLength = 1;
+    while (index + runLength < client->noOfQueuedRequests && run[runLength].type == run->type)
+    {
+      runLength++;
+    }
+
+    CLIENT_Completion part = { 0 };
+    const BOOL isRunSuccessful = client->completionPort == NULL ?
+      sendRun(client, runLength, run, &part) :
+      submitRun(client, runLength, run, &part);
+    isSuccessful = isSuccessful && isRunSuccessful;
+    mergeCompletion(&total, &part);
+
+    index += runLength;
+  }
+  client->noOfQueuedRequests = 0;
+
+  if (completion != NULL)
+  {
+    *completion = total;
+  }
+
+  return isSuccessful;
+}
+
+
+/**
+ * @brief Completes an overlapped operation dequeued from the completion port.
+ *
+ * Must be called for every packet dequeued with the client's completion key.
+ *
+ * @param client Client the operation belongs to.
+ * @param overlapped Overlapped structure of the dequeued packet.
+ * @param completion Pointer receiving the result of the operation.
+ *
+ * @return TRUE if all requests of the operation were applied, FALSE otherwise.
+ */
+BOOL CLIENT_complete(
+  CLIENT_Client* const client,
+  OVERLAPPED* const overlapped,
+  CLIENT_Completion* const completion)
+{
+  CLIENT_Operation* const operation = CONTAINING_RECORD(overlapped, CLIENT_Operation, overlapped);
+
+  DWORD bytesReturned = 0;
+  const BOOL isSuccessful =
+    GetOverlappedResult(client->deviceHandle, overlapped, &bytesReturned, FALSE);
+
+  *completion = (CLIENT_Completion)
+  {
+    .noOfRequests = operation->noOfRequests,
+    .noOfFailures = operation->noOfRequests,
+    .error = isSuccessful ? ERROR_SUCCESS : GetLastError()
+  };
+  if (isSuccessful)
+  {
+    completion->noOfFailures =
+      operation->isBatch ? countFailures(operation->noOfRequests, operation->statuses) : 0;
+  }
+
+  free(operation);
+  client->noOfPendingOperations--;
+
+  return isSuccessful && completion->noOfFailures == 0;
+}
+
+
+/**
+ * @brief Waits for the next overlapped operation of the client and completes it.
+ *
+ * Can only be used if the completion port is not shared with other handles.
+ *
+ * @param client Client to use.
+ * @param timeout Maximal wait in milliseconds, or INFINITE.
+ * @param completion Pointer receiving the result of the operation.
+ *
+ * @return TRUE if all requests of the operation were applied, FALSE if they were not,
+ * if the wait timed out, or if there is nothing to wait for.
+ */
+BOOL CLIENT_wait(
+  CLIENT_Client* const client,
+  const DWORD timeout,
+  CLIENT_Completion* const completion)
+{
+  *completion = (CLIENT_Completion){ .noOfRequests = 0, .noOfFailures = 0, .error = ERROR_SUCCESS };
+  if (client->completionPort == NULL || client->noOfPendingOperations == 0)
+  {
+    completion->error = ERROR_NO_MORE_ITEMS;
+    return FALSE;
+  }
+
+  DWORD bytesTransferred = 0;
+  ULONG_PTR completionKey = 0;
+  OVERLAPPED* overlapped = NULL;
+  GetQueuedCompletionStatus(
+    client->completionPort,
+    &bytesTransferred,
+    &completionKey,
+    &overlapped,
+    timeout);
+  if (overlapped == NULL)
+  {
+    completion->error = GetLastError();
+    return FALSE;
+  }
+
+  return CLIENT_complete(client, overlapped, completion);
+}
+
+
+/**
+ * @brief Starts sampling guest RIPs into the trace rings.
+ *
+ * @param client Client to use.
+ * @param period Sampling period in TSC ticks, 0 for the driver default.
+ *
+ * @return TRUE if sampling was started, FALSE otherwise.
+ */
+BOOL CLIENT_startSampling(CLIENT_Client* const client, const UINT64 period)
+{
+  UINT64 input = period;
+  return sendRequest(client, DRIVER_START_SAMPLE, &input, sizeof(input), NULL, 0);
+}
+
+
+/**
+ * @brief Stops sampling guest RIPs.
+ *
+ * Samples already recorded stay in the trace rings until they are overwritten.
+ *
+ * @param client Client to use.
+ *
+ * @return TRUE if sampling was stopped, FALSE otherwise.
+ */
+BOOL CLIENT_stopSampling(CLIENT_Client* const client)
+{
+  return sendRequest(client, DRIVER_STOP_SAMPLE, NULL, 0, NULL, 0);
+}
+
+
+/**
+ * @brief Measures round trips of a VMCALL that does nothing.
+ *
+ * The driver issues the VMCALLs itself, since they are rejected from user mode, and takes
+ * all samples on the same processor.
+ *
+ * @param client Client to use.
+ * @param noOfSamples Number of samples, at most 4096.
+ * @param samples Array receiving TSC ticks of each round trip.
+ *
+ * @return TRUE if all VMCALLs succeeded, FALSE otherwise.
+ */
+BOOL CLIENT_benchVmCall(
+  CLIENT_Client* const client,
+  const UINT64 noOfSamples,
+  UINT64* const samples)
+{
+  return sendRequest(
+    client,
+    DRIVER_BENCH_VMCALL,
+    NULL,
+    0,
+    samples,
+    (DWORD)(noOfSamples * sizeof(UINT64)));
+}
+
+
+/**
+ * @brief Aggregates samples in the trace rings into the pages with most samples.
+ *
+ * Only the events still held by the rings are considered, so the result covers the last
+ * capacity events of every logical core. Rings are read while cores keep recording, so an
+ * event overwritten during the read may be counted in its new form.
+ *
+ * @param client Client to use.
+ * @param maxPages Number of entries in pages.
+ * @param pages Array receiving the pages, sorted by number of samples, most sampled first.
+ * @param noOfPages Pointer receiving the number of pages written.
+ *
+ * @return TRUE if the rings were aggregated, FALSE otherwise.
+ */
+BOOL CLIENT_getHotPages(
+  CLIENT_Client* const client,
+  const UINT64 maxPages,
+  CLIENT_HotPage* const pages,
+  UINT64* const noOfPages)
+{
+  *noOfPages = 0;
+
+  CLIENT_TraceMapping mapping = { 0 };
+  if (!sendRequest(client, DRIVER_MAP_TRACE, NULL, 0, &mapping, sizeof(mapping)))
+  {
+    return FALSE;
+  }
+
+  const UINT64 maxEvents =
+    mapping.noOfRings * ((mapping.ringSize - sizeof(CLIENT_TraceRing)) / sizeof(CLIENT_TraceEvent));
+  CLIENT_HotPage* const samples = malloc((maxEvents + 1) * sizeof(CLIENT_HotPage));
+  if (samples == NULL)
+  {
+    UnmapViewOfFile(mapping.address);
+    return FALSE;
+  }
+
+  const UINT64 noOfSamples = collectSamples(&mapping, samples);
+  UnmapViewOfFile(mapping.address);
+
+  const UINT64 noOfSampledPages = mergeSamples(noOfSamples, samples);
+  qsort(samples, noOfSampledPages, sizeof(CLIENT_HotPage), compareBySamples);
+
+  *noOfPages = min(maxPages, noOfSampledPages);
+  memcpy(pages, samples, *noOfPages * sizeof(CLIENT_HotPage));
+  free(samples);
+
+  return TRUE;
+}
+
+
+/**
+ * @brief Opens a command ring shared with the driver.
+ *
+ * Only one ring can be open at a time. It has to be closed with CLIENT_closeRing before
+ * the client is closed.
+ *
+ * @param client Client to use.
+ * @param noOfEntries Requested number of entries of each queue, 0 for the driver default.
+ * @param ring Ring to open.
+ *
+ * @return TRUE if the ring was opened, FALSE otherwise.
+ */
+BOOL CLIENT_openRing(
+  CLIENT_Client* const client,
+  const UINT64 noOfEntries,
+  CLIENT_Ring* const ring)
+{
+  *ring = (CLIENT_Ring)
+  {
+    .address = NULL,
+    .capacity = 0,
+    .submissionHead = 0,
+    .doorbellEvent = CreateEvent(NULL, FALSE, FALSE, NULL),
+    .completionEvent = CreateEvent(NULL, FALSE, FALSE, NULL)
+  };
+  if (ring->doorbellEvent == NULL || ring->completionEvent == NULL)
+  {
+    CLIENT_closeRing(client, ring);
+    return FALSE;
+  }
+
+  CLIENT_RingRegistration registration = (CLIENT_RingRegistration)
+  {
+    .doorbellEvent = ring->doorbellEvent,
+    .completionEvent = ring->completionEvent,
+    .noOfEntries = noOfEntries
+  };
+  CLIENT_RingMapping mapping = { 0 };
+  if (!sendRequest(
+    client,
+    DRIVER_OPEN_RING,
+    &registration,
+    sizeof(registration),
+    &mapping,
+    sizeof(mapping)))
+  {
+    CLIENT_closeRing(client, ring);
+    return FALSE;
+  }
+
+  ring->address = mapping.address;
+  ring->capacity = mapping.capacity;
+
+  return TRUE;
+}
+
+
+/**
+ * @brief Closes a command ring.
+ *
+ * Commands not consumed by the driver yet are dropped, and completions not read are lost.
+ *
+ * @param client Client the ring was opened with.
+ * @param ring Ring to close.
+ *
+ * @return VOID
+ */
+VOID CLIENT_closeRing(CLIENT_Client* const client, CLIENT_Ring* const ring)
+{
+  if (ring->address != NULL)
+  {
+    sendRequest(client, DRIVER_CLOSE_RING, NULL, 0, NULL, 0);
+    UnmapViewOfFile(ring->address);
+  }
+
+  if (ring->completionEvent != NULL)
+  {
+    CloseHandle(ring->completionEvent);
+  }
+
+  if (ring->doorbellEvent != NULL)
+  {
+    CloseHandle(ring->doorbellEvent);
+  }
+
+  *ring = (CLIENT_Ring){ 0 };
+}
+
+
+/**
+ * @brief Writes a map command into a command ring.
+ *
+ * The command is not seen by the driver before CLIENT_ringSubmit.
+ *
+ * @param ring Ring to use.
+ * @param userData Value returned in the command's completion.
+ * @param originalAddress Page to be changed.
+ * @param rwAddress Page to be mapped for read/write access.
+ * @param fetchAddress Page to be mapped for code execution.
+ *
+ * @return TRUE if the command was written, FALSE if the submission queue is full.
+ */
+BOOL CLIENT_ringMap(
+  CLIENT_Ring* const ring,
+  const UINT64 userData,
+  VOID* const originalAddress,
+  VOID* const rwAddress,
+  VOID* const fetchAddress)
+{
+  const CLIENT_RingSubmission command = (CLIENT_RingSubmission)
+  {
+    .userData = userData,
+    .type = CLIENT_REQUEST_MAP,
+    .originalAddress = originalAddress,
+    .rwAddress = rwAddress,
+    .fetchAddress = fetchAddress
+  };
+  return pushCommand(ring, &command);
+}
+
+
+/**
+ * @brief Writes an unmap command into a command ring.
+ *
+ * The command is not seen by the driver before CLIENT_ringSubmit.
+ *
+ * @param ring Ring to use.
+ * @param userData Value returned in the command's completion.
+ * @param originalAddress Page to be restored.
+ *
+ * @return TRUE if the command was written, FALSE if the submission queue is full.
+ */
+BOOL CLIENT_ringUnmap(CLIENT_Ring* const ring, const UINT64 userData, VOID* const originalAddress)
+{
+  const CLIENT_RingSubmission command = (CLIENT_RingSubmission)
+  {
+    .userData = userData,
+    .type = CLIENT_REQUEST_UNMAP,
+    .originalAddress = originalAddress
+  };
+  return pushCommand(ring, &command);
+}
+
+
+/**
+ * @brief Publishes the written commands and rings the doorbell.
+ *
+ * Commands are applied in the order they were written. The driver stops consuming when the
+ * completion queue is full, until completions are reaped and the doorbell is rung again.
+ *
+ * @param ring Ring to use.
+ *
+ * @return TRUE if the doorbell was rung, FALSE otherwise.
+ */
+BOOL CLIENT_ringSubmit(CLIENT_Ring* const ring)
+{
+  CLIENT_RingHeader* const header = ring->address;
+
+  // Commands must be visible before the head covering them
+  MemoryBarrier();
+  header->submissionHead = ring->submissionHead;
+
+  return SetEvent(ring->doorbellEvent);
+}
+
+
+/**
+ * @brief Reads completions posted by the driver.
+ *
+ * Completions are returned in the order the commands were submitted, without a syscall.
+ *
+ * @param ring Ring to use.
+ * @param maxCompletions Number of entries in completions.
+ * @param completions Array receiving the completions.
+ *
+ * @return Number of completions read.
+ */
+UINT64 CLIENT_ringReap(
+  CLIENT_Ring* const ring,
+  const UINT64 maxCompletions,
+  CLIENT_RingCompletion* const completions)
+{
+  CLIENT_RingHeader* const header = ring->address;
+  const CLIENT_RingSubmission* const submissions = (const CLIENT_RingSubmission*)(header + 1);
+  const CLIENT_RingCompletion* const postedCompletions =
+    (const CLIENT_RingCompletion*)(submissions + ring->capacity);
+
+  const UINT64 tail = header->completionTail;
+  const UINT64 noOfCompletions = min(header->completionHead - tail, maxCompletions);
+
+  // Completions are read after the head covering them, and released after they are read
+  MemoryBarrier();
+  for (UINT64 index = 0; index < noOfCompletions; index++)
+  {
+    completions[index] = postedCompletions[(tail + index) & (ring->capacity - 1)];
+  }
+  MemoryBarrier();
+  header->completionTail = tail + noOfCompletions;
+
+  return noOfCompletions;
+}
+
+
+/**
+ * @brief Waits until the driver posts completions.
+ *
+ * The event is signaled once per drain, so completions posted before the last reap may
+ * have consumed the signal already, reap first and wait only if nothing was read.
+ *
+ * @param ring Ring to use.
+ * @param timeout Maximal wait in milliseconds, or INFINITE.
+ *
+ * @return TRUE if completions were posted, FALSE if the wait timed out or failed.
+ */
+BOOL CLIENT_ringWait(CLIENT_Ring* const ring, const DWORD timeout)
+{
+  return WaitForSingleObject(ring->completionEvent, timeout) == WAIT_OBJECT_0;
+}
+
+
+/**************************************************************************************************
+* Local function definitions
+**************************************************************************************************/
+/**
+ * @brief Sends an IOCTL and waits for its completion.
+ *
+ * On an overlapped handle, the low bit of the event handle is set, so the completion is not
+ * queued to the completion port.
+ *
+ * @param client Client to use.
+ * @param ioControlCode IOCTL code.
+ * @param input Input buffer.
+ * @param inputLength Size of the input buffer.
+ * @param output Output buffer, can be NULL.
+ * @param outputLength Size of the output buffer.
+ *
+ * @return TRUE if the driver completed the IOCTL successfully, FALSE otherwise.
+ */
+static BOOL sendRequest(
+  const CLIENT_Client* const client,
+  const DWORD ioControlCode,
+  VOID* const input,
+  const DWORD inputLength,
+  VOID* const output,
+  const DWORD outputLength)
+{
+  DWORD bytesReturned = 0;
+  if (client->completionPort == NULL)
+  {
+    return DeviceIoControl(
+      client->deviceHandle,
+      ioControlCode,
+      input,
+      inputLength,
+      output,
+      outputLength,
+      &bytesReturned,
+      NULL);
+  }
+
+  OVERLAPPED overlapped = { .hEvent = (HANDLE)((ULONG_PTR)client->syncEvent | 1) };
+  const BOOL isSuccessful = DeviceIoControl(
+    client->deviceHandle,
+    ioControlCode,
+    input,
+    inputLength,
+    output,
+    outputLength,
+    NULL,
+    &overlapped);
+  if (!isSuccessful && GetLastError() != ERROR_IO_PENDING)
+  {
+    return FALSE;
+  }
+
+  return GetOverlappedResult(client->deviceHandle, &overlapped, &bytesReturned, TRUE);
+}
+
+
+/**
+ * @brief Sends a run of requests of the same type and waits for the result.
+ *
+ * @param client Client to use.
+ * @param noOfRequests Number of requests in the run.
+ * @param requests Requests of the run.
+ * @param completion Pointer receiving the result of the run.
+ *
+ * @return TRUE if all requests were applied, FALSE otherwise.
+ */
+static BOOL sendRun(
+  CLIENT_Client* const client,
+  const UINT64 noOfRequests,
+  const CLIENT_Request* const requests,
+  CLIENT_Completion* const completion)
+{
+  *completion = (CLIENT_Completion)
+  {
+    .noOfRequests = noOfRequests,
+    .noOfFailures = noOfRequests,
+    .error = ERROR_SUCCESS
+  };
+
+  DWORD inputLength = 0;
+  VOID* const input = buildInput(noOfRequests, requests, &inputLength);
+  LONG* const statuses = malloc(noOfRequests * sizeof(LONG));
+  if (input == NULL || statuses == NULL)
+  {
+    free(input);
+    free(statuses);
+    completion->error = ERROR_NOT_ENOUGH_MEMORY;
+    return FALSE;
+  }
+
+  const BOOL isBatch = noOfRequests > 1;
+  const BOOL isSuccessful = sendRequest(
+    client,
+    getIoControlCode(requests->type, noOfRequests, FALSE),
+    input,
+    inputLength,
+    isBatch ? statuses : NULL,
+    isBatch ? (DWORD)(noOfRequests * sizeof(LONG)) : 0);
+  if (isSuccessful)
+  {
+    completion->noOfFailures = isBatch ? countFailures(noOfRequests, statuses) : 0;
+  }
+  else
+  {
+    completion->error = GetLastError();
+  }
+
+  free(input);
+  free(statuses);
+
+  return isSuccessful && completion->noOfFailures == 0;
+}
+
+
+/**
+ * @brief Submits a run of requests of the same type as an overlapped operation.
+ *
+ * A single request uses the asynchronous IOCTLs, so the driver does not hold all processors
+ * while it is applied.
+ *
+ * @param client Client to use.
+ * @param noOfRequests Number of requests in the run.
+ * @param requests Requests of the run.
+ * @param completion Pointer receiving the number of requests that could not be submitted.
+ *
+ * @return TRUE if the run was submitted, FALSE otherwise.
+ */
+static BOOL submitRun(
+  CLIENT_Client* const client,
+  const UINT64 noOfRequests,
+  const CLIENT_Request* const requests,
+  CLIENT_Completion* const completion)
+{
+  *completion = (CLIENT_Completion)
+  {
+    .noOfRequests = noOfRequests,
+    .noOfFailures = noOfRequests,
+    .error = ERROR_SUCCESS
+  };
+
+  DWORD inputLength = 0;
+  VOID* const input = buildInput(noOfRequests, requests, &inputLength);
+  CLIENT_Operation* const operation =
+    calloc(1, sizeof(CLIENT_Operation) + noOfRequests * sizeof(LONG));
+  if (input == NULL || operation == NULL)
+  {
+    free(input);
+    free(operation);
+    completion->error = ERROR_NOT_ENOUGH_MEMORY;
+    return FALSE;
+  }
+
+  operation->noOfRequests = noOfRequests;
+  operation->isBatch = noOfRequests > 1;
+  const BOOL isSuccessful = DeviceIoControl(
+    client->deviceHandle,
+    getIoControlCode(requests->type, noOfRequests, TRUE),
+    input,
+    inputLength,
+    operation->isBatch ? operation->statuses : NULL,
+    operation->isBatch ? (DWORD)(noOfRequests * sizeof(LONG)) : 0,
+    NULL,
+    &operation->overlapped);
+
+  // Buffered IOCTLs copy the input when they are sent
+  free(input);
+
+  // Requests failed right away are not queued to the completion port
+  if (!isSuccessful && GetLastError() != ERROR_IO_PENDING)
+  {
+    completion->error = GetLastError();
+    free(operation);
+    return FALSE;
+  }
+
+  client->noOfPendingOperations++;
+  completion->noOfFailures = 0;
+
+  return TRUE;
+}
+
+
+/**
+ * @brief Returns the IOCTL used to send a run of requests.
+ *
+ * @param type CLIENT_REQUEST_MAP or CLIENT_REQUEST_UNMAP.
+ * @param noOfRequests Number of requests in the run.
+ * @param isAsync TRUE if a single request should use the asynchronous IOCTL.
+ *
+ * @return IOCTL code.
+ */
+static DWORD getIoControlCode(const UINT64 type, const UINT64 noOfRequests, const BOOL isAsync)
+{
+  if (type == CLIENT_REQUEST_MAP)
+  {
+    return noOfRequests > 1 ? DRIVER_MAP_BATCH : (isAsync ? DRIVER_MAP_ASYNC : DRIVER_MAP);
+  }
+
+  return noOfRequests > 1 ? DRIVER_UNMAP_BATCH : (isAsync ? DRIVER_UNMAP_ASYNC : DRIVER_UNMAP);
+}
+
+
+/**
+ * @brief Builds the input buffer of a run of requests of the same type.
+ *
+ * Map requests are laid out as address triples, unmap requests as single addresses.
+ *
+ * @param noOfRequests Number of requests in the run.
+ * @param requests Requests of the run.
+ * @param inputLength Pointer receiving the size of the buffer.
+ *
+ * @return Buffer allocated with malloc, or NULL if allocation failed.
+ */
+static VOID* buildInput(
+  const UINT64 noOfRequests,
+  const CLIENT_Request* const requests,
+  DWORD* const inputLength)
+{
+  const UINT64 noOfAddresses = requests->type == CLIENT_REQUEST_MAP ? 3 : 1;
+  VOID** const addresses = malloc(noOfRequests * noOfAddresses * sizeof(VOID*));
+  if (addresses == NULL)
+  {
+    return NULL;
+  }
+
+  for (UINT64 index = 0; index < noOfRequests; index++)
+  {
+    VOID** const entry = &addresses[index * noOfAddresses];
+    entry[0] = requests[index].originalAddress;
+    if (noOfAddresses == 3)
+    {
+      entry[1] = requests[index].rwAddress;
+      entry[2] = requests[index].fetchAddress;
+    }
+  }
+
+  *inputLength = (DWORD)(noOfRequests * noOfAddresses * sizeof(VOID*));
+  return addresses;
+}
+
+
+/**
+ * @brief Counts failed entries of a batch IOCTL.
+ *
+ * @param noOfStatuses Number of statuses.
+ * @param statuses NTSTATUS values returned by the driver.
+ *
+ * @return Number of statuses which are not success codes.
+ */
+static UINT64 countFailures(const UINT64 noOfStatuses, const LONG* const statuses)
+{
+  UINT64 noOfFailures = 0;
+  for (UINT64 index = 0; index < noOfStatuses; index++)
+  {
+    if (statuses[index] < 0)
+    {
+      noOfFailures++;
+    }
+  }
+
+  return noOfFailures;
+}
+
+
+/**
+ * @brief Removes cancelled requests from the queue, keeping the order of the others.
+ *
+ * @param client Client whose queue is compacted.
+ *
+ * @return VOID
+ */
+static VOID compactQueue(CLIENT_Client* const client)
+{
+  UINT64 noOfKeptRequests = 0;
+  for (UINT64 index = 0; index < client->noOfQueuedRequests; index++)
+  {
+    if (client->queuedRequests[index].type != CLIENT_REQUEST_NONE)
+    {
+      client->queuedRequests[noOfKeptRequests] = client->queuedRequests[index];
+      noOfKeptRequests++;
+    }
+  }
+
+  client->noOfQueuedRequests = noOfKeptRequests;
+}
+
+
+/**
+ * @brief Adds the result of a run to the result of a flush.
+ *
+ * @param total Result of the flush.
+ * @param part Result of the run.
+ *
+ * @return VOID
+ */
+static VOID mergeCompletion(CLIENT_Completion* const total, const CLIENT_Completion* const part)
+{
+  total->noOfRequests += part->noOfRequests;
+  total->noOfFailures += part->noOfFailures;
+  if (total->error == ERROR_SUCCESS)
+  {
+    total->error = part->error;
+  }
+}
+
+
+/**
+ * @brief Copies samples held by the trace rings, as one entry per sample.
+ *
+ * @param mapping Mapped trace rings.
+ * @param samples Array receiving the samples, with an entry for every event of every ring.
+ *
+ * @return Number of samples copied.
+ */
+static UINT64 collectSamples(
+  const CLIENT_TraceMapping* const mapping,
+  CLIENT_HotPage* const samples)
+{
+  UINT64 noOfSamples = 0;
+  for (UINT64 ringIndex = 0; ringIndex < mapping->noOfRings; ringIndex++)
+  {
+    const CLIENT_TraceRing* const ring =
+      (const CLIENT_TraceRing*)((const CHAR*)mapping->address + ringIndex * mapping->ringSize);
+    const UINT64 head = ring->head;
+    const UINT64 noOfEvents = min(head, ring->capacity);
+    for (UINT64 index = head - noOfEvents; index < head; index++)
+    {
+      const CLIENT_TraceEvent* const event = &ring->events[index & (ring->capacity - 1)];
+      if (event->type != TRACE_EVENT_SAMPLE)
+      {
+        continue;
+      }
+
+      const BOOL isKernelPage = event->guestRip >= KERNEL_ADDRESS_BASE;
+      samples[noOfSamples] = (CLIENT_HotPage)
+      {
+        .cr3 = isKernelPage ? 0 : event->address & ~PAGE_OFFSET_MASK,
+        .page = event->guestRip & ~PAGE_OFFSET_MASK,
+        .noOfSamples = 1
+      };
+      noOfSamples++;
+    }
+  }
+
+  return noOfSamples;
+}
+
+
+/**
+ * @brief Merges samples of the same page into a single entry.
+ *
+ * @param noOfSamples Number of entries in samples.
+ * @param samples Samples, replaced by one entry per page.
+ *
+ * @return Number of pages.
+ */
+static UINT64 mergeSamples(const UINT64 noOfSamples, CLIENT_HotPage* const samples)
+{
+  qsort(samples, noOfSamples, sizeof(CLIENT_HotPage), compareByPage);
+
+  UINT64 noOfPages = 0;
+  for (UINT64 index = 0; index < noOfSamples; index++)
+  {
+    CLIENT_HotPage* const last = noOfPages > 0 ? &samples[noOfPages - 1] : NULL;
+    if (last != NULL && last->cr3 == samples[index].cr3 && last->page == samples[index].page)
+    {
+      last->noOfSamples += samples[index].noOfSamples;
+      continue;
+    }
+
+    samples[noOfPages] = samples[index];
+    noOfPages++;
+  }
+
+  return noOfPages;
+}
+
+
+/**
+ * @brief Writes a command at the private head of the submission queue.
+ *
+ * @param ring Ring to use.
+ * @param command Command to write.
+ *
+ * @return TRUE if the command was written, FALSE if the submission queue is full.
+ */
+static BOOL pushCommand(CLIENT_Ring* const ring, const CLIENT_RingSubmission* const command)
+{
+  CLIENT_RingHeader* const header = ring->address;
+  if (ring->submissionHead - header->submissionTail >= ring->capacity)
+  {
+    return FALSE;
+  }
+
+  CLIENT_RingSubmission* const submissions = (CLIENT_RingSubmission*)(header + 1);
+  submissions[ring->submissionHead & (ring->capacity - 1)] = *command;
+  ring->submissionHead++;
+
+  return TRUE;
+}
+
+
+/**
+ * @brief Orders pages by address space, then by address.
+ *
+ * @param first First page.
+ * @param second Second page.
+ *
+ * @return Negative, zero or positive, as required by qsort.
+ */
+static int compareByPage(const VOID* const first, const VOID* const second)
+{
+  const CLIENT_HotPage* const firstPage = first;
+  const CLIENT_HotPage* const secondPage = second;
+  if (firstPage->cr3 != secondPage->cr3)
+  {
+    return firstPage->cr3 < secondPage->cr3 ? -1 : 1;
+  }
+  if (firstPage->page != secondPage->page)
+  {
+    return firstPage->page < secondPage->page ? -1 : 1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * @brief Orders pages by number of samples, most sampled first.
+ *
+ * @param first First page.
+ * @param second Second page.
+ *
+ * @return Negative, zero or positive, as required by qsort.
+ */
+static int compareBySamples(const VOID* const first, const VOID* const second)
+{
+  const CLIENT_HotPage* const firstPage = first;
+  const CLIENT_HotPage* const secondPage = second;
+  if (firstPage->noOfSamples != secondPage->noOfSamples)
+  {
+    return firstPage->noOfSamples > secondPage->noOfSamples ? -1 : 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,263 @@
+/**
+ * @file client.h
+ * @brief User-mode client library for the MZHV driver.
+ *
+ * The client keeps a single handle to the driver. Mapping changes can be sent right away,
+ * or queued and flushed through the batch IOCTLs, in which case a map followed by an unmap
+ * of the same page within one flush window is dropped on both sides, if an unmap queued
+ * before the map shows the page was not changed yet. A client opened with
+ * a completion port sends flushes as overlapped I/O, and their results are picked up from
+ * the port.
+ *
+ * A command ring shared with the driver can be opened next to the handle. Commands written
+ * into it are picked up by a driver thread once the doorbell is rung, and completions are
+ * read back from the ring, so a stream of mapping changes takes no IOCTL per request.
+ *
+ * The client can also start guest RIP sampling, and aggregate the samples recorded in the
+ * driver's trace rings into the pages most of them fell into.
+ */
+
+
+#pragma once
+
+
+#include <windows.h>
+
+
+/**************************************************************************************************
+* Defines
+**************************************************************************************************/
+/**
+ * @name Queue limits
+ * @brief Number of requests queued before they are flushed, same as the driver's batch limit.
+ * @anchor CLIENTQueueLimits
+ */
+///@{
+#define CLIENT_MAX_QUEUED_REQUESTS  4096
+///@}
+
+/**
+ * @name Request types
+ * @brief Types of queued requests, cancelled requests are kept as CLIENT_REQUEST_NONE. Maps
+ * and unmaps are also the command types of the command ring, and must match command_ring.h.
+ * @anchor CLIENTRequestTypes
+ */
+///@{
+#define CLIENT_REQUEST_NONE   0
+#define CLIENT_REQUEST_MAP    1
+#define CLIENT_REQUEST_UNMAP  2
+///@}
+
+
+/**************************************************************************************************
+* Type declarations
+**************************************************************************************************/
+/**
+ * @brief Queued mapping change.
+ *
+ * @param type One of @ref CLIENTRequestTypes.
+ * @param originalAddress Page to be changed or restored.
+ * @param rwAddress Page mapped for read/write access, unused for unmap requests.
+ * @param fetchAddress Page mapped for code execution, unused for unmap requests.
+ */
+typedef struct CLIENT_Request
+{
+  UINT64 type;
+  VOID* originalAddress;
+  VOID* rwAddress;
+  VOID* fetchAddress;
+} CLIENT_Request;
+
+
+/**
+ * @brief Result of a flush, or of a single overlapped operation.
+ *
+ * @param noOfRequests Number of requests sent to the driver.
+ * @param noOfFailures Number of requests the driver did not apply.
+ * @param error ERROR_SUCCESS, or the error of the first IOCTL that failed as a whole.
+ */
+typedef struct CLIENT_Completion
+{
+  UINT64 noOfRequests;
+  UINT64 noOfFailures;
+  DWORD error;
+} CLIENT_Completion;
+
+
+/**
+ * @brief Page of guest code, with the number of samples whose RIP fell into it.
+ *
+ * @param cr3 Page table base of the address space, without PCID, 0 for kernel pages, which
+ * are shared by all address spaces.
+ * @param page Page aligned guest virtual address.
+ * @param noOfSamples Number of samples in the page.
+ */
+typedef struct CLIENT_HotPage
+{
+  UINT64 cr3;
+  UINT64 page;
+  UINT64 noOfSamples;
+} CLIENT_HotPage;
+
+
+/**
+ * @brief Completion read from a command ring, must match COMMAND_RING_Completion.
+ *
+ * @param userData Value given when the command was written.
+ * @param status NTSTATUS of the command, negative if it was not applied.
+ * @param reserved Reserved.
+ */
+typedef struct CLIENT_RingCompletion
+{
+  UINT64 userData;
+  LONG status;
+  UINT32 reserved;
+} CLIENT_RingCompletion;
+
+
+/**
+ * @brief Command ring state.
+ *
+ * @param address Address of the ring's view.
+ * @param capacity Number of entries of each queue.
+ * @param submissionHead Number of commands written, including the ones not submitted yet.
+ * @param doorbellEvent Event signaled to make the driver consume submitted commands.
+ * @param completionEvent Event signaled by the driver after it posted completions.
+ */
+typedef struct CLIENT_Ring
+{
+  VOID* address;
+  UINT64 capacity;
+  UINT64 submissionHead;
+  HANDLE doorbellEvent;
+  HANDLE completionEvent;
+} CLIENT_Ring;
+
+
+/**
+ * @brief Client state.
+ *
+ * @param deviceHandle Handle to the driver's device.
+ * @param completionPort Completion port receiving overlapped operations, NULL if the client
+ * is synchronous.
+ * @param syncEvent Event used to wait for operations on an overlapped handle.
+ * @param noOfPendingOperations Number of overlapped operations not completed yet.
+ * @param noOfQueuedRequests Number of entries used in queuedRequests.
+ * @param queuedRequests Requests waiting for the next flush.
+ */
+typedef struct CLIENT_Client
+{
+  HANDLE deviceHandle;
+  HANDLE completionPort;
+  HANDLE syncEvent;
+  UINT64 noOfPendingOperations;
+  UINT64 noOfQueuedRequests;
+  CLIENT_Request* queuedRequests;
+} CLIENT_Client;
+
+
+/**************************************************************************************************
+* Global function declarations
+**************************************************************************************************/
+BOOL CLIENT_open(CLIENT_Client* const client, const HANDLE completionPort);
+
+
+VOID CLIENT_close(CLIENT_Client* const client);
+
+
+BOOL CLIENT_map(
+  CLIENT_Client* const client,
+  VOID* const originalAddress,
+  VOID* const rwAddress,
+  VOID* const fetchAddress);
+
+
+BOOL CLIENT_unmap(CLIENT_Client* const client, VOID* const originalAddress);
+
+
+BOOL CLIENT_prepare(CLIENT_Client* const client, VOID* const address, const UINT64 size);
+
+
+BOOL CLIENT_unprepare(CLIENT_Client* const client, VOID* const address, const UINT64 size);
+
+
+BOOL CLIENT_setGroup(
+  CLIENT_Client* const client,
+  VOID* const originalAddress,
+  const UINT64 groupId);
+
+
+BOOL CLIENT_queueMap(
+  CLIENT_Client* const client,
+  VOID* const originalAddress,
+  VOID* const rwAddress,
+  VOID* const fetchAddress);
+
+
+BOOL CLIENT_queueUnmap(CLIENT_Client* const client, VOID* const originalAddress);
+
+
+BOOL CLIENT_flush(CLIENT_Client* const client, CLIENT_Completion* const completion);
+
+
+BOOL CLIENT_complete(
+  CLIENT_Client* const client,
+  OVERLAPPED* const overlapped,
+  CLIENT_Completion* const completion);
+
+
+BOOL CLIENT_wait(
+  CLIENT_Client* const client,
+  const DWORD timeout,
+  CLIENT_Completion* const completion);
+
+
+BOOL CLIENT_startSampling(CLIENT_Client* const client, const UINT64 period);
+
+
+BOOL CLIENT_stopSampling(CLIENT_Client* const client);
+
+
+BOOL CLIENT_benchVmCall(
+  CLIENT_Client* const client,
+  const UINT64 noOfSamples,
+  UINT64* const samples);
+
+
+BOOL CLIENT_getHotPages(
+  CLIENT_Client* const client,
+  const UINT64 maxPages,
+  CLIENT_HotPage* const pages,
+  UINT64* const noOfPages);
+
+
+BOOL CLIENT_openRing(
+  CLIENT_Client* const client,
+  const UINT64 noOfEntries,
+  CLIENT_Ring* const ring);
+
+
+VOID CLIENT_closeRing(CLIENT_Client* const client, CLIENT_Ring* const ring);
+
+
+BOOL CLIENT_ringMap(
+  CLIENT_Ring* const ring,
+  const UINT64 userData,
+  VOID* const originalAddress,
+  VOID* const rwAddress,
+  VOID* const fetchAddress);
+
+
+BOOL CLIENT_ringUnmap(CLIENT_Ring* const ring, const UINT64 userData, VOID* const originalAddress);
+
+
+BOOL CLIENT_ringSubmit(CLIENT_Ring* const ring);
+
+
+UINT64 CLIENT_ringReap(
+  CLIENT_Ring* const ring,
+  const UINT64 maxCompletions,
+  CLIENT_RingCompletion* const completions);
+
+
+BOOL CLIENT_ringWait(CLIENT_Ring* const ring, const DWORD timeout);
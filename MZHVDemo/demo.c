@@ -10,17 +10,21 @@
 #include <stdlib.h>
 #include <time.h>
 #include <windows.h>
+#include "client.h"
 
 
  /**************************************************************************************************
  * Defines
  **************************************************************************************************/
-#define DRIVER_MAP       CTL_CODE(FILE_DEVICE_UNKNOWN, 0x1337, METHOD_BUFFERED, FILE_ANY_ACCESS)
-#define DRIVER_UNMAP     CTL_CODE(FILE_DEVICE_UNKNOWN, 0x2137, METHOD_BUFFERED, FILE_ANY_ACCESS)
-#define DEVICE_NAME      L"\\\\.\\MZHV"
 #define PAGE_SIZE        4096
 
 
+ /**************************************************************************************************
+ * Local globals definitions
+ **************************************************************************************************/
+static CLIENT_Client client;
+
+
  /**************************************************************************************************
  * Local function declarations
  **************************************************************************************************/
@@ -189,9 +193,18 @@ VOID functionPatchingDemo(VOID)
 
 int main(void)
 {
+  if (!CLIENT_open(&client, NULL))
+  {
+    printf("Failed to open the driver\n");
+    return 1;
+  }
+
   swapPageDemo();
   //hideCodeDemo();
   functionPatchingDemo();
+
+  CLIENT_close(&client);
+  return 0;
 }
 
 
@@ -201,7 +214,7 @@ int main(void)
 /**
  * @brief Changes the mapping of a page.
  * 
- * Calls the driver to change the mapping of a page.
+ * Calls the driver through the shared client to change the mapping of a page.
  * 
  * @param originalAddress Page to be changed.
  * @param rwAddress Page to be mapped for read/write access.
@@ -211,40 +224,14 @@ int main(void)
  */
 static BOOL changeMapping(VOID* originalAddress, VOID* rwAddress, VOID* fetchAddress)
 {
-  HANDLE deviceHandle = CreateFile(
-    DEVICE_NAME,
-    GENERIC_READ | GENERIC_WRITE,
-    0,
-    NULL,
-    CREATE_ALWAYS,
-    FILE_ATTRIBUTE_NORMAL,
-    NULL);
-
-  if (deviceHandle == INVALID_HANDLE_VALUE)
-  {
-    return FALSE;
-  }
-
-  VOID* addresses[3] = { originalAddress, rwAddress, fetchAddress };
-  BOOL isSuccessful = DeviceIoControl(
-    deviceHandle,
-    DRIVER_MAP,
-    &addresses,
-    sizeof(addresses),
-    NULL,
-    0,
-    NULL,
-    NULL);
-
-  CloseHandle(deviceHandle);
-  return isSuccessful;
+  return CLIENT_map(&client, originalAddress, rwAddress, fetchAddress);
 }
 
 
 /**
  * @brief Removes a mapping change.
  * 
- * Calls the driver to remove a mapping change.
+ * Calls the driver through the shared client to remove a mapping change.
  * 
  * @param originalAddress Page to be restored.
  * 
@@ -252,33 +239,7 @@ static BOOL changeMapping(VOID* originalAddress, VOID* rwAddress, VOID* fetchAdd
  */
 static BOOL removeMappingChange(VOID* originalAddress)
 {
-  HANDLE deviceHandle = CreateFile(
-    DEVICE_NAME,
-    GENERIC_READ | GENERIC_WRITE,
-    0,
-    NULL,
-    CREATE_ALWAYS,
-    FILE_ATTRIBUTE_NORMAL,
-    NULL);
-
-  if (deviceHandle == INVALID_HANDLE_VALUE)
-  {
-    return FALSE;
-  }
-
-  VOID* addresses[1] = { originalAddress };
-  BOOL isSuccessful = DeviceIoControl(
-    deviceHandle,
-    DRIVER_UNMAP,
-    &addresses,
-    sizeof(addresses),
-    NULL,
-    0,
-    NULL,
-    NULL);
-
-  CloseHandle(deviceHandle);
-  return isSuccessful;
+  return CLIENT_unmap(&client, originalAddress);
 }
 
 
@@ -1,60 +1,160 @@
 EXTERN VMEXIT_handler:PROC
 EXTERN VMCS_restore:PROC
+EXTERN VE_handler:PROC
 
 ; Tested on i7-4710HQ
 ; It supports the following Instruction Set Extensions
 ; Intel SSE4.1, Intel SSE4.2, Intel AVX2
+;
+; Only registers that the C handlers may clobber are saved on VM exit: the volatile GPRs,
+; RBX (written by the CPUID handler), and the volatile XMM0-XMM5. The driver is compiled
+; without AVX, so handlers only use legacy SSE encodings, which leave the upper halves of YMM
+; and ZMM registers intact. Exits that are not dispatched on the fast path save the whole
+; extended state with XSAVE (or FXSAVE if the OS has not enabled XSAVE) instead.
+
+VMCS_EXIT_REASON EQU 00004402h
+VMCS_GUEST_RSP EQU 0000681Ch
+VMCS_GUEST_RIP EQU 0000681Eh
+
+EXIT_REASON_CPUID EQU 10
+EXIT_REASON_VMCALL EQU 18
+EXIT_REASON_MONITOR_TRAP EQU 37
+EXIT_REASON_EPT_VIOLATION EQU 48
+EXIT_REASON_PREEMPTION_TIMER EQU 52
+EXIT_REASON_PML_FULL EQU 62
+
+CR4_OSXSAVE_BIT EQU 18
+XSAVE_AREA_SIZE EQU 4096 ; Standard format area up to AVX-512 and PKRU
+XSAVE_MASK EQU 02FFh ; x87, SSE, AVX, MPX, AVX-512, PKRU
 
 SAVE_REGISTERS MACRO
-  SUB RSP, 512
-  FXSAVE [RSP]
   PUSH RAX
-  PUSH RBX
   PUSH RCX
   PUSH RDX
-  PUSH RBP
-  SUB RSP, 8 ;RSP is stored in VMCS
-  PUSH RSI
-  PUSH RDI
+  PUSH RBX
   PUSH R8
   PUSH R9
   PUSH R10
   PUSH R11
-  PUSH R12
-  PUSH R13
-  PUSH R14
-  PUSH R15
 ENDM
 
 RESTORE_REGISTERS MACRO
-  POP R15
-  POP R14
-  POP R13
-  POP R12
   POP R11
   POP R10
   POP R9
   POP R8
-  POP RDI
-  POP RSI
-  ADD RSP, 8 ;RSP is stored in VMCS
-  POP RBP
+  POP RBX
   POP RDX
   POP RCX
-  POP RBX
   POP RAX
-  FXRSTOR [RSP]
-  ADD RSP, 512
+ENDM
+
+SAVE_VOLATILE_XMM MACRO
+  SUB RSP, 96
+  MOVAPS [RSP], XMM0
+  MOVAPS [RSP + 16], XMM1
+  MOVAPS [RSP + 32], XMM2
+  MOVAPS [RSP + 48], XMM3
+  MOVAPS [RSP + 64], XMM4
+  MOVAPS [RSP + 80], XMM5
+ENDM
+
+RESTORE_VOLATILE_XMM MACRO
+  MOVAPS XMM0, [RSP]
+  MOVAPS XMM1, [RSP + 16]
+  MOVAPS XMM2, [RSP + 32]
+  MOVAPS XMM3, [RSP + 48]
+  MOVAPS XMM4, [RSP + 64]
+  MOVAPS XMM5, [RSP + 80]
+  ADD RSP, 96
+ENDM
+
+; RCX = registers, RDX = exit reason, AL = TRUE on shutdown
+; Host state is restored before the caller restores the guest's vector state
+CALL_HANDLER MACRO
+  LOCAL HANDLER_RESUME
+  SUB RSP, 32
+  CALL VMEXIT_handler
+  TEST AL, AL
+  JZ HANDLER_RESUME
+  CALL VMCS_restore
+  MOV AL, 1
+HANDLER_RESUME:
+  ADD RSP, 32
 ENDM
 
 .code
   ASMPROC_vmExitHandler PROC
     SAVE_REGISTERS
-    MOV RCX, RSP
-    SUB RSP, 32
-    CALL VMEXIT_handler
-    ADD RSP, 32
-    OR AL, AL
+    MOV RAX, VMCS_EXIT_REASON
+    VMREAD RDX, RAX
+    CMP DX, EXIT_REASON_CPUID
+    JE FAST_PATH
+    CMP DX, EXIT_REASON_VMCALL
+    JE FAST_PATH
+    CMP DX, EXIT_REASON_EPT_VIOLATION
+    JE FAST_PATH
+    CMP DX, EXIT_REASON_MONITOR_TRAP
+    JE FAST_PATH
+    CMP DX, EXIT_REASON_PML_FULL
+    JE FAST_PATH
+    CMP DX, EXIT_REASON_PREEMPTION_TIMER
+    JE FAST_PATH
+
+    ; Full path, the area header must be zero for XRSTOR
+    MOV R11, RSP
+    SUB RSP, XSAVE_AREA_SIZE
+    AND RSP, -64
+    XOR EAX, EAX
+    MOV [RSP + 512], RAX
+    MOV [RSP + 520], RAX
+    MOV [RSP + 528], RAX
+    MOV [RSP + 536], RAX
+    MOV [RSP + 544], RAX
+    MOV [RSP + 552], RAX
+    MOV [RSP + 560], RAX
+    MOV [RSP + 568], RAX
+    MOV R10, RDX
+    MOV RAX, CR4
+    BT RAX, CR4_OSXSAVE_BIT
+    JNC FXSAVE_ENTRY
+    MOV EAX, XSAVE_MASK
+    XOR EDX, EDX
+    XSAVE [RSP]
+    JMP FULL_PATH_CALL
+  FXSAVE_ENTRY:
+    FXSAVE [RSP]
+  FULL_PATH_CALL:
+    SUB RSP, 16
+    MOV [RSP], R11
+    MOV RCX, R11
+    MOV RDX, R10
+    CALL_HANDLER
+    MOV R11, [RSP]
+    ADD RSP, 16
+    MOVZX R10, AL
+    MOV RAX, CR4
+    BT RAX, CR4_OSXSAVE_BIT
+    JNC FXRSTOR_EXIT
+    MOV EAX, XSAVE_MASK
+    XOR EDX, EDX
+    XRSTOR [RSP]
+    JMP FULL_PATH_EXIT
+  FXRSTOR_EXIT:
+    FXRSTOR [RSP]
+  FULL_PATH_EXIT:
+    MOV RSP, R11
+    JMP EXIT_COMMON
+
+  FAST_PATH:
+    SAVE_VOLATILE_XMM
+    LEA RCX, [RSP + 96]
+    CALL_HANDLER
+    MOVZX R10, AL
+    RESTORE_VOLATILE_XMM
+
+  EXIT_COMMON:
+    TEST R10, R10
     JNZ ASMPROC_vmxoffHandler
     RESTORE_REGISTERS
     VMRESUME
@@ -62,7 +162,7 @@ ENDM
   ASMPROC_vmExitHandler ENDP
 
   ASMPROC_enterVmcs PROC
-    MOV RAX, 0000681Ch ; VMCS_GUEST_RSP
+    MOV RAX, VMCS_GUEST_RSP
     VMWRITE RAX, RSP
     VMLAUNCH
     MOV RAX, 0C0000001h ; STATUS_UNSUCCESSFUL
@@ -74,27 +174,58 @@ ENDM
     RET
   ASMPROC_vmcsEntryPoint ENDP
 
+  ; Entered with RSP pointing to the saved registers, host state already restored
   ASMPROC_vmxoffHandler PROC
-    SUB RSP, 32
-    CALL VMCS_restore
-    ADD RSP, 32
-
-    MOV RAX, 0000681Ch ; VMCS_GUEST_RSP
-    MOV RBX, 0000681Eh ; VMCS_GUEST_RIP
+    MOV RAX, VMCS_GUEST_RSP
+    MOV RBX, VMCS_GUEST_RIP
     VMREAD RCX, RAX ; GUEST_RSP
     VMREAD RDX, RBX ; GUEST_RIP
-    MOV RAX, RSP
-    MOV RSP, RCX
-    PUSH RDX
-    MOV RCX, RSP
-    MOV RSP, RAX
-    PUSH RCX
-    ADD RSP, 8
+    SUB RCX, 8
+    MOV [RCX], RDX ; Return address on the guest stack
+    MOV [RSP - 8], RCX
 
     VMXOFF
     RESTORE_REGISTERS
-    MOV RSP, [RSP-648]
+    MOV RSP, [RSP - 72]
     RET
   ASMPROC_vmxoffHandler ENDP
 
+  ; Raw IDT gate, so the volatile XMM registers and MXCSR the C handler may clobber are saved
+  ; as well. RSP is 16 byte aligned after the interrupt frame and the 7 pushes.
+  ASMPROC_veHandler PROC
+    TEST BYTE PTR [RSP + 8], 3 ; CS of the interrupted code
+    JZ VE_KERNEL_ENTRY
+    SWAPGS
+  VE_KERNEL_ENTRY:
+    PUSH RAX
+    PUSH RCX
+    PUSH RDX
+    PUSH R8
+    PUSH R9
+    PUSH R10
+    PUSH R11
+    MOV RCX, [RSP + 56] ; RIP of the interrupted code
+    SAVE_VOLATILE_XMM
+    SUB RSP, 16
+    STMXCSR DWORD PTR [RSP]
+    SUB RSP, 32
+    CALL VE_handler
+    ADD RSP, 32
+    LDMXCSR DWORD PTR [RSP]
+    ADD RSP, 16
+    RESTORE_VOLATILE_XMM
+    POP R11
+    POP R10
+    POP R9
+    POP R8
+    POP RDX
+    POP RCX
+    POP RAX
+    TEST BYTE PTR [RSP + 8], 3
+    JZ VE_KERNEL_EXIT
+    SWAPGS
+  VE_KERNEL_EXIT:
+    IRETQ
+  ASMPROC_veHandler ENDP
+
 END
\ No newline at end of file
@@ -44,3 +44,15 @@ NTSTATUS ASMPROC_enterVmcs(VOID);
  * @return STATUS_SUCCESS
  */
 NTSTATUS ASMPROC_vmcsEntryPoint(VOID);
+
+
+/**
+ * @brief Virtualization exception entry point
+ * 
+ * This function is installed as the #VE handler of every logical core's IDT. It preserves
+ * volatile general purpose registers, calls VE_handler with the RIP of the interrupted code,
+ * and returns with IRETQ.
+ * 
+ * @return VOID
+ */
+VOID ASMPROC_veHandler(VOID);
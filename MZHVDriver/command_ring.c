@@ -0,0 +1,615 @@
+/**
+ * @file command_ring.c
+ * @brief Implements the command ring.
+ *
+ * The ring lives in a pagefile backed section, mapped writable into the registering process
+ * and into system space. It is only accessed at PASSIVE_LEVEL, so unlike trace rings it is
+ * not locked. The process is the only producer of the submission queue and the driver's
+ * worker thread the only producer of the completion queue, each publishes entries by
+ * advancing the head after the entries are written.
+ *
+ * The worker waits on the doorbell, copies all submitted commands that have a free
+ * completion slot, and applies them with a single PAGE_SWAPPER_applyBatch, which is one
+ * broadcast to all logical cores. Positions written by the process are only used to bound
+ * the copy, and commands are validated after they are copied, so a misbehaving process can
+ * only get its own commands wrong. Only one ring can be registered at a time, it is
+ * released when the handle it was registered with is closed.
+ */
+
+
+#include <intrin.h>
+#include "command_ring.h"
+#include "context.h"
+#include "memory.h"
+
+
+/**************************************************************************************************
+* Local type declarations
+**************************************************************************************************/
+/**
+ * @brief Registered command ring.
+ *
+ * @param owner File object the ring was registered with.
+ * @param process Registering process, the worker attaches to it to translate its addresses.
+ * @param doorbellEvent Referenced doorbell event.
+ * @param completionEvent Referenced completion event, NULL if none was given.
+ * @param section Kernel handle of the section.
+ * @param sectionObject Referenced section object.
+ * @param header View of the section in system space.
+ * @param submissions Submission queue.
+ * @param completions Completion queue.
+ * @param capacity Number of entries of each queue, power of 2.
+ * @param submissionTail Driver's copy of the submission tail.
+ * @param completionHead Driver's copy of the completion head.
+ * @param commands Commands copied out of the submission queue.
+ * @param requests Requests passed to the page swapper.
+ * @param statuses Statuses returned by the page swapper.
+ * @param stopEvent Event asking the worker to exit.
+ * @param thread Referenced worker thread.
+ */
+typedef struct COMMAND_RING_Ring
+{
+  PFILE_OBJECT owner;
+  PEPROCESS process;
+  PKEVENT doorbellEvent;
+  PKEVENT completionEvent;
+  HANDLE section;
+  PVOID sectionObject;
+  COMMAND_RING_Header* header;
+  COMMAND_RING_Submission* submissions;
+  COMMAND_RING_Completion* completions;
+  UINT64 capacity;
+  UINT64 submissionTail;
+  UINT64 completionHead;
+  COMMAND_RING_Submission* commands;
+  PAGE_SWAPPER_MapRequest* requests;
+  NTSTATUS* statuses;
+  KEVENT stopEvent;
+  PVOID thread;
+} COMMAND_RING_Ring;
+
+
+/**************************************************************************************************
+* Local globals definitions
+**************************************************************************************************/
+/**
+ * @brief Mutex serializing registration and release of the ring.
+ */
+static FAST_MUTEX ringMutex;
+
+
+/**
+ * @brief Registered ring, NULL if there is none.
+ */
+static COMMAND_RING_Ring* registeredRing;
+
+
+/**************************************************************************************************
+* Local function declarations
+**************************************************************************************************/
+static KSTART_ROUTINE COMMAND_RING_worker;
+
+
+static NTSTATUS createRing(
+  const COMMAND_RING_Registration* const registration,
+  COMMAND_RING_Ring* const ring);
+
+
+static NTSTATUS startWorker(COMMAND_RING_Ring* const ring);
+
+
+static VOID destroyRing(COMMAND_RING_Ring* const ring);
+
+
+static UINT64 drain(COMMAND_RING_Ring* const ring);
+
+
+static BOOLEAN isValidCommand(const COMMAND_RING_Submission* const command);
+
+
+/**************************************************************************************************
+* Global function definitions
+**************************************************************************************************/
+/**
+ * @brief Initializes the command ring.
+ *
+ * @return VOID
+ */
+VOID COMMAND_RING_init(VOID)
+{
+  ExInitializeFastMutex(&ringMutex);
+  registeredRing = NULL;
+}
+
+
+/**
+ * @brief Registers a command ring and maps it into the current process.
+ *
+ * Must be called at PASSIVE_LEVEL in the context of the registering process, since the
+ * event handles are resolved in its handle table. The view is owned by the process, which
+ * unmaps it with UnmapViewOfFile once the ring is released.
+ *
+ * @param owner File object of the request, the ring is released when it is closed.
+ * @param registration Doorbell and completion events, and the requested number of entries.
+ * @param mapping Structure receiving the view's address and layout.
+ *
+ * @return STATUS_SUCCESS if successful, STATUS_INVALID_DEVICE_STATE if a ring is already
+ * registered, error code otherwise.
+ */
+NTSTATUS COMMAND_RING_register(
+  const PFILE_OBJECT owner,
+  const COMMAND_RING_Registration* const registration,
+  COMMAND_RING_Mapping* const mapping)
+{
+  if (Context_getContext() == NULL)
+  {
+    return STATUS_NOT_SUPPORTED;
+  }
+
+  ExAcquireFastMutex(&ringMutex);
+  if (registeredRing != NULL)
+  {
+    ExReleaseFastMutex(&ringMutex);
+    return STATUS_INVALID_DEVICE_STATE;
+  }
+
+  COMMAND_RING_Ring* const ring = Memory_allocate(sizeof(COMMAND_RING_Ring), FALSE);
+  if (ring == NULL)
+  {
+    ExReleaseFastMutex(&ringMutex);
+    return STATUS_UNSUCCESSFUL;
+  }
+  ring->owner = owner;
+  KeInitializeEvent(&ring->stopEvent, NotificationEvent, FALSE);
+
+  NTSTATUS ntStatus = createRing(registration, ring);
+  if (NT_SUCCESS(ntStatus))
+  {
+    ntStatus = startWorker(ring);
+  }
+
+  VOID* address = NULL;
+  SIZE_T viewSize = 0;
+  if (NT_SUCCESS(ntStatus))
+  {
+    ntStatus = ZwMapViewOfSection(
+      ring->section,
+      ZwCurrentProcess(),
+      &address,
+      0,
+      0,
+      NULL,
+      &viewSize,
+      ViewUnmap,
+      0,
+      PAGE_READWRITE);
+  }
+  if (!NT_SUCCESS(ntStatus))
+  {
+    destroyRing(ring);
+    ExReleaseFastMutex(&ringMutex);
+    return ntStatus;
+  }
+
+  *mapping = (COMMAND_RING_Mapping)
+  {
+    .address = address,
+    .size = viewSize,
+    .capacity = ring->capacity
+  };
+  registeredRing = ring;
+  ExReleaseFastMutex(&ringMutex);
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Releases the registered command ring.
+ *
+ * Waits for the worker to finish its current drain. Commands submitted afterwards are not
+ * consumed. Must be called at PASSIVE_LEVEL.
+ *
+ * @param owner File object the ring was registered with, NULL to release it regardless.
+ *
+ * @return STATUS_SUCCESS if the ring was released, STATUS_INVALID_DEVICE_STATE if there is
+ * no ring registered with the file object.
+ */
+NTSTATUS COMMAND_RING_unregister(const PFILE_OBJECT owner)
+{
+  ExAcquireFastMutex(&ringMutex);
+  COMMAND_RING_Ring* const ring = registeredRing;
+  if (ring == NULL || (owner != NULL && ring->owner != owner))
+  {
+    ExReleaseFastMutex(&ringMutex);
+    return STATUS_INVALID_DEVICE_STATE;
+  }
+
+  registeredRing = NULL;
+  destroyRing(ring);
+  ExReleaseFastMutex(&ringMutex);
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Releases the registered command ring, if any.
+ *
+ * Must be called at PASSIVE_LEVEL, before logical cores are devirtualized.
+ *
+ * @return VOID
+ */
+VOID COMMAND_RING_destroy(VOID)
+{
+  COMMAND_RING_unregister(NULL);
+}
+
+
+/**************************************************************************************************
+* Local function definitions
+**************************************************************************************************/
+/**
+ * @brief Worker thread consuming the submission queue.
+ *
+ * Every doorbell drains the queue until it is empty, the completion queue is full, or the
+ * ring is being released.
+ *
+ * @param context COMMAND_RING_Ring structure.
+ *
+ * @return VOID
+ */
+_Use_decl_annotations_
+static VOID COMMAND_RING_worker(PVOID context)
+{
+  COMMAND_RING_Ring* const ring = context;
+  PVOID waitObjects[2] = { &ring->stopEvent, ring->doorbellEvent };
+  NTSTATUS waitStatus =
+    KeWaitForMultipleObjects(2, waitObjects, WaitAny, Executive, KernelMode, FALSE, NULL, NULL);
+  while (waitStatus != STATUS_WAIT_0)
+  {
+    // User addresses of the commands are translated in the registering process
+    KAPC_STATE apcState = { 0 };
+    KeStackAttachProcess(ring->process, &apcState);
+    UINT64 noOfCommands = drain(ring);
+    while (noOfCommands != 0 && KeReadStateEvent(&ring->stopEvent) == 0)
+    {
+      noOfCommands = drain(ring);
+    }
+    KeUnstackDetachProcess(&apcState);
+
+    waitStatus =
+      KeWaitForMultipleObjects(2, waitObjects, WaitAny, Executive, KernelMode, FALSE, NULL, NULL);
+  }
+
+  PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+
+/**
+ * @brief References the ring's events and process and allocates its memory.
+ *
+ * Can leave the ring partially initialized, destroyRing releases what was acquired.
+ *
+ * @param registration Doorbell and completion events, and the requested number of entries.
+ * @param ring Zeroed ring with an initialized stop event.
+ *
+ * @return STATUS_SUCCESS if successful, error code otherwise.
+ */
+static NTSTATUS createRing(
+  const COMMAND_RING_Registration* const registration,
+  COMMAND_RING_Ring* const ring)
+{
+  ring->process = PsGetCurrentProcess();
+  ObReferenceObject(ring->process);
+
+  NTSTATUS ntStatus = ObReferenceObjectByHandle(
+    registration->doorbellEvent,
+    SYNCHRONIZE,
+    *ExEventObjectType,
+    UserMode,
+    (PVOID*)&ring->doorbellEvent,
+    NULL);
+  if (!NT_SUCCESS(ntStatus))
+  {
+    ring->doorbellEvent = NULL;
+    return ntStatus;
+  }
+
+  if (registration->completionEvent != NULL)
+  {
+    ntStatus = ObReferenceObjectByHandle(
+      registration->completionEvent,
+      EVENT_MODIFY_STATE,
+      *ExEventObjectType,
+      UserMode,
+      (PVOID*)&ring->completionEvent,
+      NULL);
+    if (!NT_SUCCESS(ntStatus))
+    {
+      ring->completionEvent = NULL;
+      return ntStatus;
+    }
+  }
+
+  ULONG highestBit = 0;
+  _BitScanReverse64(
+    &highestBit,
+    registration->noOfEntries == 0 ?
+      COMMAND_RING_DEFAULT_ENTRIES :
+      min(registration->noOfEntries, COMMAND_RING_MAX_ENTRIES));
+  ring->capacity = 1ULL << highestBit;
+
+  ring->commands = Memory_allocate(ring->capacity * sizeof(COMMAND_RING_Submission), FALSE);
+  ring->requests = Memory_allocate(ring->capacity * sizeof(PAGE_SWAPPER_MapRequest), FALSE);
+  ring->statuses = Memory_allocate(ring->capacity * sizeof(NTSTATUS), FALSE);
+  if (ring->commands == NULL || ring->requests == NULL || ring->statuses == NULL)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  const UINT64 size = ROUND_TO_PAGES(sizeof(COMMAND_RING_Header) +
+    ring->capacity * (sizeof(COMMAND_RING_Submission) + sizeof(COMMAND_RING_Completion)));
+  OBJECT_ATTRIBUTES attributes = { 0 };
+  InitializeObjectAttributes(&attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+  LARGE_INTEGER maximumSize = { .QuadPart = (LONGLONG)size };
+  ntStatus = ZwCreateSection(
+    &ring->section,
+    SECTION_ALL_ACCESS,
+    &attributes,
+    &maximumSize,
+    PAGE_READWRITE,
+    SEC_COMMIT,
+    NULL);
+  if (!NT_SUCCESS(ntStatus))
+  {
+    ring->section = NULL;
+    return ntStatus;
+  }
+
+  ntStatus = ObReferenceObjectByHandle(
+    ring->section,
+    SECTION_ALL_ACCESS,
+    NULL,
+    KernelMode,
+    &ring->sectionObject,
+    NULL);
+  if (!NT_SUCCESS(ntStatus))
+  {
+    ring->sectionObject = NULL;
+    return ntStatus;
+  }
+
+  VOID* systemView = NULL;
+  SIZE_T viewSize = size;
+  ntStatus = MmMapViewInSystemSpace(ring->sectionObject, &systemView, &viewSize);
+  if (!NT_SUCCESS(ntStatus))
+  {
+    return ntStatus;
+  }
+
+  // Committed section pages are zeroed, only the capacity needs to be set
+  ring->header = systemView;
+  ring->header->capacity = ring->capacity;
+  ring->submissions = (COMMAND_RING_Submission*)(ring->header + 1);
+  ring->completions = (COMMAND_RING_Completion*)(ring->submissions + ring->capacity);
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Starts the ring's worker thread.
+ *
+ * @param ring Ring with its events and memory acquired.
+ *
+ * @return STATUS_SUCCESS if successful, error code otherwise.
+ */
+static NTSTATUS startWorker(COMMAND_RING_Ring* const ring)
+{
+  OBJECT_ATTRIBUTES attributes = { 0 };
+  InitializeObjectAttributes(&attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+  HANDLE thread = NULL;
+  NTSTATUS ntStatus = PsCreateSystemThread(
+    &thread,
+    THREAD_ALL_ACCESS,
+    &attributes,
+    NULL,
+    NULL,
+    COMMAND_RING_worker,
+    ring);
+  if (!NT_SUCCESS(ntStatus))
+  {
+    return ntStatus;
+  }
+
+  ntStatus = ObReferenceObjectByHandle(
+    thread,
+    SYNCHRONIZE,
+    *PsThreadType,
+    KernelMode,
+    &ring->thread,
+    NULL);
+  if (!NT_SUCCESS(ntStatus))
+  {
+    ring->thread = NULL;
+    KeSetEvent(&ring->stopEvent, IO_NO_INCREMENT, FALSE);
+    ZwWaitForSingleObject(thread, FALSE, NULL);
+  }
+  ZwClose(thread);
+
+  return ntStatus;
+}
+
+
+/**
+ * @brief Stops the worker and releases everything the ring acquired.
+ *
+ * Can be called on a partially initialized ring.
+ *
+ * @param ring Ring to destroy.
+ *
+ * @return VOID
+ */
+static VOID destroyRing(COMMAND_RING_Ring* const ring)
+{
+  if (ring->thread != NULL)
+  {
+    KeSetEvent(&ring->stopEvent, IO_NO_INCREMENT, FALSE);
+    KeWaitForSingleObject(ring->thread, Executive, KernelMode, FALSE, NULL);
+    ObDereferenceObject(ring->thread);
+  }
+
+  if (ring->header != NULL)
+  {
+    MmUnmapViewInSystemSpace(ring->header);
+  }
+
+  if (ring->sectionObject != NULL)
+  {
+    ObDereferenceObject(ring->sectionObject);
+  }
+
+  // The process's view keeps the section alive until it is unmapped
+  if (ring->section != NULL)
+  {
+    ZwClose(ring->section);
+  }
+
+  if (ring->statuses != NULL)
+  {
+    Memory_free(ring->statuses);
+  }
+
+  if (ring->requests != NULL)
+  {
+    Memory_free(ring->requests);
+  }
+
+  if (ring->commands != NULL)
+  {
+    Memory_free(ring->commands);
+  }
+
+  if (ring->completionEvent != NULL)
+  {
+    ObDereferenceObject(ring->completionEvent);
+  }
+
+  if (ring->doorbellEvent != NULL)
+  {
+    ObDereferenceObject(ring->doorbellEvent);
+  }
+
+  ObDereferenceObject(ring->process);
+  Memory_free(ring);
+}
+
+
+/**
+ * @brief Applies the submitted commands and posts their completions.
+ *
+ * Slots of the copied commands are returned to the process before the commands are
+ * applied, so it can keep submitting meanwhile. Commands are applied in the order they were
+ * submitted. Must be called attached to the registering process.
+ *
+ * @param ring Ring to drain.
+ *
+ * @return Number of commands completed, 0 if there was nothing to do.
+ */
+static UINT64 drain(COMMAND_RING_Ring* const ring)
+{
+  COMMAND_RING_Header* const header = ring->header;
+  const UINT64 indexMask = ring->capacity - 1;
+  const UINT64 noOfSubmitted = min(header->submissionHead - ring->submissionTail, ring->capacity);
+  const UINT64 noOfUnconsumed = min(ring->completionHead - header->completionTail, ring->capacity);
+  const UINT64 noOfCommands = min(noOfSubmitted, ring->capacity - noOfUnconsumed);
+  if (noOfCommands == 0)
+  {
+    return 0;
+  }
+
+  // Commands are read after the head, and only once, since the process can rewrite them
+  KeMemoryBarrierWithoutFence();
+  UINT64 noOfRequests = 0;
+  for (UINT64 commandIndex = 0; commandIndex < noOfCommands; commandIndex++)
+  {
+    COMMAND_RING_Submission* const command = &ring->commands[commandIndex];
+    *command = ring->submissions[(ring->submissionTail + commandIndex) & indexMask];
+    if (!isValidCommand(command))
+    {
+      continue;
+    }
+
+    ring->requests[noOfRequests] = command->type == COMMAND_RING_UNMAP ?
+      (PAGE_SWAPPER_MapRequest){ .originalAddress = command->request.originalAddress } :
+      command->request;
+    noOfRequests++;
+  }
+  KeMemoryBarrierWithoutFence();
+  ring->submissionTail += noOfCommands;
+  header->submissionTail = ring->submissionTail;
+
+  const NTSTATUS batchStatus = noOfRequests == 0 ?
+    STATUS_SUCCESS :
+    PAGE_SWAPPER_applyBatch(noOfRequests, ring->requests, ring->statuses);
+
+  UINT64 requestIndex = 0;
+  for (UINT64 commandIndex = 0; commandIndex < noOfCommands; commandIndex++)
+  {
+    const COMMAND_RING_Submission* const command = &ring->commands[commandIndex];
+    NTSTATUS status = STATUS_INVALID_PARAMETER;
+    if (isValidCommand(command))
+    {
+      status = NT_SUCCESS(batchStatus) ? ring->statuses[requestIndex] : batchStatus;
+      requestIndex++;
+    }
+
+    ring->completions[(ring->completionHead + commandIndex) & indexMask] =
+      (COMMAND_RING_Completion){ .userData = command->userData, .status = status };
+  }
+  KeMemoryBarrierWithoutFence();
+  ring->completionHead += noOfCommands;
+  header->completionHead = ring->completionHead;
+
+  if (ring->completionEvent != NULL)
+  {
+    KeSetEvent(ring->completionEvent, IO_NO_INCREMENT, FALSE);
+  }
+
+  return noOfCommands;
+}
+
+
+/**
+ * @brief Checks a command copied out of the submission queue.
+ *
+ * A map without both target pages would be taken for an unmap by the page swapper.
+ *
+ * @param command Command to check.
+ *
+ * @return TRUE if the command can be applied, FALSE otherwise.
+ */
+static BOOLEAN isValidCommand(const COMMAND_RING_Submission* const command)
+{
+  if (command->request.originalAddress == NULL)
+  {
+    return FALSE;
+  }
+
+  switch (command->type)
+  {
+  case COMMAND_RING_MAP:
+  {
+    return command->request.rwAddress != NULL && command->request.fetchAddress != NULL;
+  }
+  case COMMAND_RING_UNMAP:
+  {
+    return TRUE;
+  }
+  default:
+  {
+    return FALSE;
+  }
+  }
+}
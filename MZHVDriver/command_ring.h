@@ -0,0 +1,149 @@
+/**
+ * @file command_ring.h
+ * @brief Command ring structures and function declarations.
+ *
+ * A process can register a ring shared with the driver, write map and unmap commands into
+ * its submission queue, and signal a doorbell event. A driver thread drains the queue and
+ * posts a completion for every command, so remapping takes no IOCTL per request.
+ */
+
+
+#pragma once
+
+
+#include <ntddk.h>
+#include "page_swapper.h"
+
+
+/**************************************************************************************************
+* Defines
+**************************************************************************************************/
+/**
+ * @name Command types
+ * @brief Types of commands in the submission queue.
+ * @anchor COMMAND_RINGCommandTypes
+ */
+///@{
+#define COMMAND_RING_MAP    1
+#define COMMAND_RING_UNMAP  2
+///@}
+
+/**
+ * @name Ring limits
+ * @brief Default and maximal number of entries of each queue.
+ * @anchor COMMAND_RINGRingLimits
+ */
+///@{
+#define COMMAND_RING_DEFAULT_ENTRIES  1024
+#define COMMAND_RING_MAX_ENTRIES      PAGE_SWAPPER_MAX_BATCH_SIZE
+///@}
+
+
+/**************************************************************************************************
+* Type declarations
+**************************************************************************************************/
+/**
+ * @brief Header of a command ring.
+ *
+ * The submission queue of capacity entries follows the header, and the completion queue of
+ * capacity entries follows the submission queue. Positions only grow, entry i of a queue is
+ * at index i % capacity. Fields written by the process and by the driver are kept in
+ * separate cache lines.
+ *
+ * @param submissionHead Number of commands submitted by the process.
+ * @param completionTail Number of completions consumed by the process.
+ * @param reserved0 Reserved.
+ * @param submissionTail Number of commands consumed by the driver, their slots can be reused.
+ * @param completionHead Number of completions posted by the driver.
+ * @param capacity Number of entries of each queue, power of 2.
+ * @param reserved1 Reserved.
+ */
+typedef struct COMMAND_RING_Header
+{
+  volatile UINT64 submissionHead;
+  volatile UINT64 completionTail;
+  UINT64 reserved0[6];
+  volatile UINT64 submissionTail;
+  volatile UINT64 completionHead;
+  UINT64 capacity;
+  UINT64 reserved1[5];
+} COMMAND_RING_Header;
+
+
+/**
+ * @brief Command in the submission queue.
+ *
+ * @param userData Value copied into the command's completion.
+ * @param type COMMAND_RING_MAP or COMMAND_RING_UNMAP.
+ * @param request Pages of the command, read/write and fetch pages are ignored for unmaps.
+ */
+typedef struct COMMAND_RING_Submission
+{
+  UINT64 userData;
+  UINT64 type;
+  PAGE_SWAPPER_MapRequest request;
+} COMMAND_RING_Submission;
+
+
+/**
+ * @brief Completion in the completion queue.
+ *
+ * @param userData Value of the completed command.
+ * @param status Status of the command.
+ * @param reserved Reserved.
+ */
+typedef struct COMMAND_RING_Completion
+{
+  UINT64 userData;
+  NTSTATUS status;
+  UINT32 reserved;
+} COMMAND_RING_Completion;
+
+
+/**
+ * @brief Input of DRIVER_OPEN_RING.
+ *
+ * @param doorbellEvent Event signaled by the process after submitting commands.
+ * @param completionEvent Event signaled by the driver after posting completions, can be NULL.
+ * @param noOfEntries Requested number of entries of each queue, rounded down to a power of 2,
+ * 0 for COMMAND_RING_DEFAULT_ENTRIES.
+ */
+typedef struct COMMAND_RING_Registration
+{
+  HANDLE doorbellEvent;
+  HANDLE completionEvent;
+  UINT64 noOfEntries;
+} COMMAND_RING_Registration;
+
+
+/**
+ * @brief Structure returned by DRIVER_OPEN_RING.
+ *
+ * @param address Address of the writable view in the calling process.
+ * @param size Size of the view in bytes.
+ * @param capacity Number of entries of each queue.
+ */
+typedef struct COMMAND_RING_Mapping
+{
+  VOID* address;
+  UINT64 size;
+  UINT64 capacity;
+} COMMAND_RING_Mapping;
+
+
+/**************************************************************************************************
+* Global function declarations
+**************************************************************************************************/
+VOID COMMAND_RING_init(VOID);
+
+
+NTSTATUS COMMAND_RING_register(
+  const PFILE_OBJECT owner,
+  const COMMAND_RING_Registration* const registration,
+  COMMAND_RING_Mapping* const mapping);
+
+
+NTSTATUS COMMAND_RING_unregister(const PFILE_OBJECT owner);
+
+
+VOID COMMAND_RING_destroy(VOID);
@@ -0,0 +1,140 @@
+/**
+ * @file config.c
+ * @brief Implements reading of the driver configuration.
+ *
+ * Configuration is read once from the driver's Parameters registry key when the driver
+ * is loaded. Missing values keep their defaults.
+ */
+
+
+#include "config.h"
+#include "context.h"
+#include "memory.h"
+
+
+/**************************************************************************************************
+* Local globals definitions
+**************************************************************************************************/
+/**
+ * @brief Driver configuration, initialized with default values.
+ */
+static Config_Config config =
+{
+  .sharedEpt = FALSE,
+  .maxMappings = CONTEXT_EPT_MAX_MAPPINGS,
+  .mtfThrashThreshold = CONTEXT_EPT_THRASH_THRESHOLD,
+  .eptpSwitching = FALSE,
+  .virtualizationExceptions = FALSE,
+  .traceRingEvents = CONTEXT_TRACE_RING_EVENTS,
+  .dirtyRingPages = CONTEXT_DIRTY_RING_PAGES,
+  .vpid = TRUE
+};
+
+
+/**************************************************************************************************
+* Global function definitions
+**************************************************************************************************/
+/**
+ * @brief Reads the configuration from the registry.
+ *
+ * Values are read from the Parameters subkey of the driver's service key. If the key
+ * or any of the values does not exist, or has a wrong type, the default is kept, so this
+ * function cannot fail. Out of range values are clamped.
+ *
+ * @param registryPath Driver's service key path, as passed to DriverEntry.
+ *
+ * @return VOID
+ */
+VOID Config_init(const PUNICODE_STRING registryPath)
+{
+  // The path passed to DriverEntry is not guaranteed to be NULL terminated
+  WCHAR* const path = Memory_allocate(registryPath->Length + sizeof(WCHAR), FALSE);
+  if (path == NULL)
+  {
+    return;
+  }
+  Memory_copy(path, registryPath->Buffer, registryPath->Length);
+  path[registryPath->Length / sizeof(WCHAR)] = L'\0';
+
+  Config_Config readConfig = config;
+  RTL_QUERY_REGISTRY_TABLE queryTable[] =
+  {
+    {
+      .Flags = RTL_QUERY_REGISTRY_SUBKEY,
+      .Name = CONFIG_PARAMETERS_KEY
+    },
+    {
+      .Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK,
+      .Name = CONFIG_VALUE_SHARED_EPT,
+      .EntryContext = &readConfig.sharedEpt,
+      .DefaultType = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE
+    },
+    {
+      .Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK,
+      .Name = CONFIG_VALUE_MAX_MAPPINGS,
+      .EntryContext = &readConfig.maxMappings,
+      .DefaultType = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE
+    },
+    {
+      .Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK,
+      .Name = CONFIG_VALUE_MTF_THRESHOLD,
+      .EntryContext = &readConfig.mtfThrashThreshold,
+      .DefaultType = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE
+    },
+    {
+      .Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK,
+      .Name = CONFIG_VALUE_EPTP_SWITCHING,
+      .EntryContext = &readConfig.eptpSwitching,
+      .DefaultType = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE
+    },
+    {
+      .Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK,
+      .Name = CONFIG_VALUE_VE,
+      .EntryContext = &readConfig.virtualizationExceptions,
+      .DefaultType = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE
+    },
+    {
+      .Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK,
+      .Name = CONFIG_VALUE_TRACE_EVENTS,
+      .EntryContext = &readConfig.traceRingEvents,
+      .DefaultType = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE
+    },
+    {
+      .Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK,
+      .Name = CONFIG_VALUE_DIRTY_PAGES,
+      .EntryContext = &readConfig.dirtyRingPages,
+      .DefaultType = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE
+    },
+    {
+      .Flags = RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK,
+      .Name = CONFIG_VALUE_VPID,
+      .EntryContext = &readConfig.vpid,
+      .DefaultType = (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_NONE
+    },
+    { 0 }
+  };
+
+  const NTSTATUS ntStatus =
+    RtlQueryRegistryValues(RTL_REGISTRY_ABSOLUTE, path, queryTable, NULL, NULL);
+  if (NT_SUCCESS(ntStatus))
+  {
+    config = readConfig;
+  }
+
+  config.maxMappings = max(1, min(config.maxMappings, CONTEXT_EPT_MAX_MAPPINGS_LIMIT));
+  config.traceRingEvents = min(config.traceRingEvents, CONTEXT_TRACE_RING_EVENTS_LIMIT);
+  config.dirtyRingPages = min(config.dirtyRingPages, CONTEXT_DIRTY_RING_PAGES_LIMIT);
+
+  Memory_free(path);
+}
+
+
+/**
+ * @brief Getter for configuration.
+ *
+ * @return Pointer to configuration.
+ */
+const Config_Config* Config_getConfig(VOID)
+{
+  return &config;
+}
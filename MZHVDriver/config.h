@@ -0,0 +1,77 @@
+/**
+ * @file config.h
+ * @brief Driver configuration structure and function declarations.
+ *
+ * Configuration is read once from the driver's Parameters registry key when the driver
+ * is loaded. Missing values keep their defaults.
+ */
+
+
+#pragma once
+
+
+#include <ntddk.h>
+
+
+/**************************************************************************************************
+* Defines
+**************************************************************************************************/
+/**
+ * @name Registry names
+ * @brief Names of the registry key and values holding the configuration.
+ * @anchor CONFIGRegistryNames
+ */
+///@{
+#define CONFIG_PARAMETERS_KEY       L"Parameters"
+#define CONFIG_VALUE_SHARED_EPT     L"SharedEpt"
+#define CONFIG_VALUE_MAX_MAPPINGS   L"MaxMappings"
+#define CONFIG_VALUE_MTF_THRESHOLD  L"MtfThrashThreshold"
+#define CONFIG_VALUE_EPTP_SWITCHING L"EptpSwitching"
+#define CONFIG_VALUE_VE             L"VirtualizationExceptions"
+#define CONFIG_VALUE_TRACE_EVENTS   L"TraceRingEvents"
+#define CONFIG_VALUE_DIRTY_PAGES    L"DirtyRingPages"
+#define CONFIG_VALUE_VPID           L"Vpid"
+///@}
+
+
+/**************************************************************************************************
+* Type declarations
+**************************************************************************************************/
+/**
+ * @brief Structure holding the driver configuration.
+ *
+ * Fields are ULONG, since they are filled directly from REG_DWORD values.
+ *
+ * @param sharedEpt Nonzero if all logical cores should use a single EPT hierarchy.
+ * @param maxMappings Maximal number of changed mappings per EPT hierarchy.
+ * @param mtfThrashThreshold Number of view switches after which a mapping is MTF assisted,
+ * 0 disables MTF assistance.
+ * @param eptpSwitching Nonzero if views should be kept in separate EPT hierarchies and
+ * switched with VMFUNC, when supported.
+ * @param virtualizationExceptions Nonzero if EPT violations on changed mappings should be
+ * resolved in the guest by a #VE handler, when supported.
+ * @param traceRingEvents Number of events in each logical core's trace ring, 0 disables tracing.
+ * @param dirtyRingPages Number of pages in each logical core's dirty ring, 0 disables dirty
+ * logging.
+ * @param vpid Nonzero if guest translations should be tagged with VPIDs, when supported.
+ */
+typedef struct Config_Config
+{
+  ULONG sharedEpt;
+  ULONG maxMappings;
+  ULONG mtfThrashThreshold;
+  ULONG eptpSwitching;
+  ULONG virtualizationExceptions;
+  ULONG traceRingEvents;
+  ULONG dirtyRingPages;
+  ULONG vpid;
+} Config_Config;
+
+
+/**************************************************************************************************
+* Global function declarations
+**************************************************************************************************/
+VOID Config_init(const PUNICODE_STRING registryPath);
+
+
+const Config_Config* Config_getConfig(VOID);
@@ -7,8 +7,16 @@
  */
 
 
+#include <intrin.h>
+#include "config.h"
 #include "context.h"
+#include "dirty_log.h"
+#include "mapping_table.h"
 #include "memory.h"
+#include "page_pool.h"
+#include "pfn_table.h"
+#include "sampler.h"
+#include "trace.h"
 
 
 /**************************************************************************************************
@@ -20,26 +28,126 @@
 static Context_Context* context = NULL;
 
 
+/**************************************************************************************************
+* Local function declarations
+**************************************************************************************************/
+static ULONG_PTR recordNumaNode(ULONG_PTR argument);
+
+
 /**************************************************************************************************
 * Global function definitions
 **************************************************************************************************/
 /**
  * @brief Initializes context.
  *
+ * Allocates context of each logical core, in all processor groups, on the core's NUMA node.
+ * Allocates EPT mappings data for each logical core on its node as well, or a single shared
+ * one if the shared EPT mode is configured. Each mappings data gets a changed mappings table
+ * sized according to the configuration and an empty split pool, which is filled when its EPT
+ * hierarchy is created. The PFN table is initialized before any pool, since pools register
+ * their pages in it.
+ * Trace rings of all logical cores are allocated as well.
+ *
  * @return STATUS_SUCCESS when successful, STATUS_UNSUCCESSFUL otherwise.
  */
 NTSTATUS Context_init(VOID)
 {
   const UINT64 noOfLogicalCores = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
   context = Memory_allocate(
-    sizeof(*context) + noOfLogicalCores * sizeof(Context_LogicalCore),
-    TRUE);
+    sizeof(*context) + noOfLogicalCores * sizeof(Context_LogicalCore*),
+    FALSE);
   if (context == NULL)
   {
     return STATUS_UNSUCCESSFUL;
   }
 
+  PFN_TABLE_init();
   context->noOfLogicalCores = noOfLogicalCores;
+  context->isEptShared = Config_getConfig()->sharedEpt != 0;
+  context->noOfEptMappingsData = context->isEptShared ? 1 : noOfLogicalCores;
+  context->eptMappingsData = Memory_allocate(
+    context->noOfEptMappingsData * sizeof(Context_EptMappingsData*),
+    FALSE);
+  USHORT* const numaNodes = Memory_allocate(noOfLogicalCores * sizeof(USHORT), FALSE);
+  if (context->eptMappingsData == NULL || numaNodes == NULL)
+  {
+    if (numaNodes != NULL)
+    {
+      Memory_free(numaNodes);
+    }
+    Context_destroy();
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  KeIpiGenericCall(recordNumaNode, (ULONG_PTR)numaNodes);
+
+  for (UINT64 logicalCoreIndex = 0; logicalCoreIndex < noOfLogicalCores; logicalCoreIndex++)
+  {
+    context->logicalCores[logicalCoreIndex] =
+      Memory_allocateOnNode(sizeof(Context_LogicalCore), TRUE, numaNodes[logicalCoreIndex]);
+    if (context->logicalCores[logicalCoreIndex] == NULL)
+    {
+      Memory_free(numaNodes);
+      Context_destroy();
+      return STATUS_UNSUCCESSFUL;
+    }
+  }
+
+  // Mappings data are indexed by logical cores, unless the EPT is shared
+  for (UINT64 mappingsDataIndex = 0;
+    mappingsDataIndex < context->noOfEptMappingsData;
+    mappingsDataIndex++)
+  {
+    const ULONG numaNode = numaNodes[mappingsDataIndex];
+    Context_EptMappingsData* const mappingData =
+      Memory_allocateOnNode(sizeof(Context_EptMappingsData), FALSE, numaNode);
+    if (mappingData == NULL)
+    {
+      Memory_free(numaNodes);
+      Context_destroy();
+      return STATUS_UNSUCCESSFUL;
+    }
+    mappingData->numaNode = numaNode;
+    // Only the shared hierarchy is expected to use a whole arena of tables
+    PAGE_POOL_init(
+      &mappingData->splitPool,
+      numaNode,
+      context->isEptShared ? PAGE_POOL_PAGES_PER_ARENA : PAGE_POOL_PAGES_PER_CHUNK);
+    PAGE_POOL_init(&mappingData->populatePool, numaNode, CONTEXT_EPT_POPULATE_RESERVE);
+    mappingData->isPopulateRefillNeeded = FALSE;
+    context->eptMappingsData[mappingsDataIndex] = mappingData;
+
+    const NTSTATUS ntStatus =
+      MAPPING_TABLE_init(&mappingData->changedMappings, Config_getConfig()->maxMappings);
+    if (!NT_SUCCESS(ntStatus))
+    {
+      Memory_free(numaNodes);
+      Context_destroy();
+      return ntStatus;
+    }
+  }
+  Memory_free(numaNodes);
+
+  for (UINT64 logicalCoreIndex = 0; logicalCoreIndex < noOfLogicalCores; logicalCoreIndex++)
+  {
+    context->logicalCores[logicalCoreIndex]->eptMappingData =
+      context->eptMappingsData[context->isEptShared ? 0 : logicalCoreIndex];
+  }
+
+  NTSTATUS ntStatus = TRACE_init();
+  if (!NT_SUCCESS(ntStatus))
+  {
+    Context_destroy();
+    return ntStatus;
+  }
+
+  ntStatus = DIRTY_LOG_init();
+  if (!NT_SUCCESS(ntStatus))
+  {
+    Context_destroy();
+    return ntStatus;
+  }
+  SAMPLER_init();
 
   return STATUS_SUCCESS;
 }
@@ -59,6 +167,9 @@ Context_Context* Context_getContext(VOID)
 /**
  * @brief Getter for this core's context.
  * 
+ * Contexts are indexed by system-wide processor index, which is unique across processor
+ * groups, unlike the group-relative processor number.
+ * 
  * @return Pointer to context of current logical core.
  */
 Context_LogicalCore* Context_getLogicalCore(VOID)
@@ -68,17 +179,113 @@ Context_LogicalCore* Context_getLogicalCore(VOID)
     return NULL;
   }
 
-  return &context->logicalCores[KeGetCurrentProcessorNumber()];
+  return context->logicalCores[KeGetCurrentProcessorNumberEx(NULL)];
+}
+
+
+/**
+ * @brief Acquires the EPT mappings data lock.
+ * 
+ * Spins until the lock is acquired. It is meant to be used in root mode, where interrupts
+ * are disabled, so the holder can never be preempted.
+ * 
+ * @param mappingData EPT mappings data to lock.
+ * 
+ * @return VOID
+ */
+VOID Context_lockEptMappings(Context_EptMappingsData* const mappingData)
+{
+  while (InterlockedCompareExchange(&mappingData->lock, 1, 0) != 0)
+  {
+    while (mappingData->lock != 0)
+    {
+      _mm_pause();
+    }
+  }
+}
+
+
+/**
+ * @brief Releases the EPT mappings data lock.
+ * 
+ * @param mappingData EPT mappings data to unlock.
+ * 
+ * @return VOID
+ */
+VOID Context_unlockEptMappings(Context_EptMappingsData* const mappingData)
+{
+  InterlockedExchange(&mappingData->lock, 0);
 }
 
 
 /**
  * @brief Destroys the context.
  * 
+ * Can be called on a partially initialized context.
+ * 
  * @return VOID
  */
 VOID Context_destroy(VOID)
 {
+  TRACE_destroy();
+  DIRTY_LOG_destroy();
+
+  if (context->eptMappingsData != NULL)
+  {
+    for (UINT64 mappingsDataIndex = 0;
+      mappingsDataIndex < context->noOfEptMappingsData;
+      mappingsDataIndex++)
+    {
+      Context_EptMappingsData* const mappingData = context->eptMappingsData[mappingsDataIndex];
+      if (mappingData == NULL)
+      {
+        continue;
+      }
+
+      MAPPING_TABLE_destroy(&mappingData->changedMappings);
+      PAGE_POOL_destroy(&mappingData->splitPool);
+      PAGE_POOL_destroy(&mappingData->populatePool);
+      Memory_free(mappingData);
+    }
+
+    Memory_free(context->eptMappingsData);
+  }
+
+  if (context->memoryTypeMap != NULL)
+  {
+    Memory_free(context->memoryTypeMap);
+  }
+
+  for (UINT64 logicalCoreIndex = 0; logicalCoreIndex < context->noOfLogicalCores; logicalCoreIndex++)
+  {
+    if (context->logicalCores[logicalCoreIndex] != NULL)
+    {
+      Memory_free(context->logicalCores[logicalCoreIndex]);
+    }
+  }
+
+  PFN_TABLE_destroy();
   Memory_free(context);
   context = NULL;
 }
+
+
+/**************************************************************************************************
+* Local function definitions
+**************************************************************************************************/
+/**
+ * @brief Records the NUMA node of the current logical core.
+ * 
+ * Run on all logical cores by KeIpiGenericCall.
+ * 
+ * @param argument Array of nodes, indexed by system-wide processor index.
+ * 
+ * @return 0
+ */
+static ULONG_PTR recordNumaNode(ULONG_PTR argument)
+{
+  USHORT* const numaNodes = (USHORT*)argument;
+  numaNodes[KeGetCurrentProcessorNumberEx(NULL)] = KeGetCurrentNodeNumber();
+
+  return 0;
+}
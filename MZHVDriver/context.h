@@ -12,6 +12,8 @@
 
 #include <ntddk.h>
 #include "ia32.h"
+#include "mtrr.h"
+#include "segmentation.h"
 
 
 /**************************************************************************************************
@@ -28,17 +30,138 @@
 #define CONTEXT_VMCS_REGION_SIZE      4096
 #define CONTEXT_MSR_BITMAP_SIZE       4096
 #define CONTEXT_ROOT_MODE_STACK_SIZE  32768
+#define CONTEXT_VE_INFORMATION_SIZE   4096
+#define CONTEXT_PML_BUFFER_SIZE       4096
 ///@}
 
 /**
  * @name Split limits
- * @brief Page split limits for EPT mappings.
+ * @brief Size of a page table used to split EPT large pages, number of page tables
+ * reserved for each EPT hierarchy when it is created, and number of page tables kept
+ * for populating it in root mode, enough for two populations of both views.
  * @anchor CONTEXTSplitLimits
  */
  ///@{
 #define CONTEXT_EPT_SPLIT_SIZE        4096
-#define CONTEXT_EPT_NO_SPLITS         32
-#define CONTEXT_EPT_MAX_MAPPINGS      32
+#define CONTEXT_EPT_SPLIT_RESERVE     32
+#define CONTEXT_EPT_POPULATE_RESERVE  8
+///@}
+
+/**
+ * @name Mapping limits
+ * @brief Default and maximal number of changed EPT mappings, the default can be overridden
+ * with the MaxMappings registry value, number of range mappings per EPT hierarchy, and
+ * number of mappings in a single mapping group.
+ * @anchor CONTEXTMappingLimits
+ */
+ ///@{
+#ifndef CONTEXT_EPT_MAX_MAPPINGS
+#define CONTEXT_EPT_MAX_MAPPINGS      1024
+#endif
+#define CONTEXT_EPT_MAX_MAPPINGS_LIMIT  65536
+#define CONTEXT_EPT_MAX_RANGES        64
+#define CONTEXT_EPT_MAX_GROUP_SIZE    64
+///@}
+
+/**
+ * @name Thrash detection
+ * @brief Default number of view switches within a window of TSC ticks after which a mapping
+ * is considered hot, the default can be overridden with the MtfThrashThreshold registry value.
+ * @anchor CONTEXTThrashDetection
+ */
+ ///@{
+#define CONTEXT_EPT_THRASH_THRESHOLD  64
+#define CONTEXT_EPT_THRASH_WINDOW     0x4000000ULL
+///@}
+
+/**
+ * @name Statistics sizes
+ * @brief Number of counted exit reasons, CPUID leaves per range, VMCALL codes, and buckets
+ * of the root mode cycles histogram. Exit reasons above the limit share the last counter.
+ * @anchor CONTEXTStatisticsSizes
+ */
+ ///@{
+#define CONTEXT_STATS_EXIT_REASONS        80
+#define CONTEXT_STATS_CPUID_LEAVES        32
+#define CONTEXT_STATS_VMCALLS             16
+#define CONTEXT_STATS_HISTOGRAM_BUCKETS   32
+///@}
+
+/**
+ * @name CPUID cache size
+ * @brief Number of cached basic and extended CPUID leaves.
+ * @anchor CONTEXTCpuidCacheSize
+ */
+ ///@{
+#define CONTEXT_CPUID_CACHED_LEAVES      32
+///@}
+
+/**
+ * @name Trace ring sizes
+ * @brief Default and maximal number of events in each logical core's trace ring, the default
+ * can be overridden with the TraceRingEvents registry value.
+ * @anchor CONTEXTTraceRingSizes
+ */
+ ///@{
+#define CONTEXT_TRACE_RING_EVENTS        8192
+#define CONTEXT_TRACE_RING_EVENTS_LIMIT  1048576
+///@}
+
+/**
+ * @name Trace event types
+ * @brief Values of the type field of a trace event.
+ * @anchor CONTEXTTraceEventTypes
+ */
+ ///@{
+#define CONTEXT_TRACE_EVENT_EPT_VIOLATION  1
+#define CONTEXT_TRACE_EVENT_VMCALL         2
+#define CONTEXT_TRACE_EVENT_SAMPLE         3
+///@}
+
+/**
+ * @name Sampling periods
+ * @brief Default and minimal number of TSC ticks between two guest RIP samples of a logical
+ * core, the default is used if DRIVER_START_SAMPLE does not give a period.
+ * @anchor CONTEXTSamplingPeriods
+ */
+ ///@{
+#define CONTEXT_SAMPLE_PERIOD            1000000
+#define CONTEXT_SAMPLE_PERIOD_MIN        10000
+///@}
+
+/**
+ * @name PFN table sizes
+ * @brief Number of directories of the PFN table, one for every 1GB of the physical address
+ * space EPT hierarchies can map, and number of entries in each directory and leaf.
+ * @anchor CONTEXTPfnTableSizes
+ */
+ ///@{
+#define CONTEXT_PFN_TABLE_DIRECTORIES    2048
+#define CONTEXT_PFN_TABLE_ENTRIES        512
+///@}
+
+/**
+ * @name Dirty ring sizes
+ * @brief Default and maximal number of pages in each logical core's dirty ring, the default
+ * can be overridden with the DirtyRingPages registry value. Dirty logging is disabled by default.
+ * @anchor CONTEXTDirtyRingSizes
+ */
+ ///@{
+#define CONTEXT_DIRTY_RING_PAGES         0
+#define CONTEXT_DIRTY_RING_PAGES_LIMIT   1048576
+///@}
+
+/**
+ * @name Dirty page sizes
+ * @brief Values stored in the low bits of a dirty ring entry, telling the size of the EPT page
+ * the logged address was written through.
+ * @anchor CONTEXTDirtyPageSizes
+ */
+ ///@{
+#define CONTEXT_DIRTY_PAGE_4KB           0
+#define CONTEXT_DIRTY_PAGE_2MB           1
+#define CONTEXT_DIRTY_PAGE_1GB           2
+#define CONTEXT_DIRTY_PAGE_SIZE_MASK     0xFFFULL
 ///@}
 
 /**************************************************************************************************
@@ -50,33 +173,343 @@
  * @param guestAddress Guest physical address.
  * @param hostRwAddress Physical address for read/write access.
  * @param hostFetchAddress Physical address for fetch access.
+ * @param size Size of the mapped range in bytes, PAGE_SIZE for a single page.
  * @param valid TRUE if mapping is valid, FALSE otherwise.
+ * @param isFetchView TRUE if the fetch view was granted last, FALSE otherwise.
+ * @param isMtfAssisted TRUE if data accesses are single stepped with the Monitor Trap Flag.
+ * @param noOfViewSwitches Number of view switches in the current thrash detection window.
+ * @param thrashWindowStart TSC value at the start of the current thrash detection window.
+ * @param noOfViolations Number of EPT violations handled in root mode for this mapping.
+ * @param groupId Group of mappings switched to the same view together, 0 if none.
+ * @param nextGroupAddress Guest address of the next mapping of the group, members form
+ * a cycle. Unused if groupId is 0.
  */
 typedef struct Context_EptChangedMapping
 {
   UINT64 guestAddress;
   UINT64 hostRwAddress;
   UINT64 hostFetchAddress;
+  UINT64 size;
   BOOLEAN valid;
+  BOOLEAN isFetchView;
+  BOOLEAN isMtfAssisted;
+  UINT32 noOfViewSwitches;
+  UINT64 thrashWindowStart;
+  UINT64 noOfViolations;
+  UINT64 groupId;
+  UINT64 nextGroupAddress;
 } Context_EptChangedMapping;
 
 
 /**
- * @brief Structure that combines the split buffer and changed mappings.
+ * @brief Structure counting references to a single host page.
+ * 
+ * @param pageFrameNumber Host page frame number.
+ * @param referenceCount Number of changed mappings targeting the page, 0 if the slot is free.
+ */
+typedef struct Context_EptHostReference
+{
+  UINT64 pageFrameNumber;
+  UINT64 referenceCount;
+} Context_EptHostReference;
+
+
+/**
+ * @brief Open addressing hash table of changed mappings.
+ * 
+ * Mappings are keyed by guest page frame number. Host page frame numbers used by the
+ * mappings are kept in a second table, so conflicts can be checked without a scan.
+ * Both tables are preallocated, they are used in root mode where allocation is not possible.
+ * 
+ * @param maxEntries Maximal number of mappings.
+ * @param noOfEntries Number of mappings currently stored.
+ * @param mappingsCapacity Number of mapping slots, power of 2.
+ * @param mappings Mapping slots.
+ * @param hostReferencesCapacity Number of host reference slots, power of 2.
+ * @param hostReferences Host reference slots.
+ * @param noOfRanges Number of range mappings currently stored.
+ * @param ranges Range mappings, sorted by guest address.
+ */
+typedef struct Context_EptMappingTable
+{
+  UINT64 maxEntries;
+  UINT64 noOfEntries;
+  UINT64 mappingsCapacity;
+  Context_EptChangedMapping* mappings;
+  UINT64 hostReferencesCapacity;
+  Context_EptHostReference* hostReferences;
+  UINT64 noOfRanges;
+  Context_EptChangedMapping ranges[CONTEXT_EPT_MAX_RANGES];
+} Context_EptMappingTable;
+
+
+/**
+ * @brief Single chunk of pages owned by a page pool.
+ * 
+ * @param next Next chunk.
+ * @param pages Pages of the chunk.
+ * @param isContiguous Whether the pages are physically contiguous and aligned to their size.
+ */
+typedef struct Context_EptPagePoolChunk
+{
+  struct Context_EptPagePoolChunk* next;
+  VOID* pages;
+  BOOLEAN isContiguous;
+} Context_EptPagePoolChunk;
+
+
+/**
+ * @brief Pool of page tables used to split EPT large pages.
+ * 
+ * Free pages are kept on a lock-free list, so they can be taken and returned in root mode.
+ * Pages released while they may still be cached by a logical core are retired first, and
+ * become free once EPT caches have been invalidated. The pool grows only at PASSIVE_LEVEL,
+ * chunks are guarded by the mutex.
+ * 
+ * @param freePages List of free pages.
+ * @param retiredPages List of released pages waiting for EPT invalidation.
+ * @param chunksMutex Mutex guarding the chunks list.
+ * @param chunks List of allocated chunks.
+ * @param noOfPages Number of pages in all chunks.
+ * @param numaNode NUMA node chunks are allocated on.
+ * @param noOfPagesPerChunk Number of pages in every chunk, a power of two.
+ */
+typedef struct Context_EptPagePool
+{
+  SLIST_HEADER freePages;
+  SLIST_HEADER retiredPages;
+  FAST_MUTEX chunksMutex;
+  Context_EptPagePoolChunk* chunks;
+  UINT64 noOfPages;
+  ULONG numaNode;
+  UINT64 noOfPagesPerChunk;
+} Context_EptPagePool;
+
+
+/**
+ * @brief Structure that combines an EPT hierarchy, or a pair of view hierarchies if EPTP
+ * switching is enabled, with its split pool and changed mappings.
  * 
- * @param splitBuffer Buffer used to split EPT large pages.
- * @param noOfUsedSplits Number of already used splits.
- * @param changedMappings Array of changed mappings.
+ * Every logical core either has its own instance, or all of them reference a shared one.
+ * The lock serializes root mode changes, it is only contended in the shared mode.
+ * 
+ * @param splitPool Pool of page tables used to split EPT large pages.
+ * @param populatePool Pool of page tables used to populate regions on first access.
+ * @param isPopulateRefillNeeded Set in root mode when the populate pool runs low, cleared
+ * once it is refilled at PASSIVE_LEVEL.
+ * @param changedMappings Table of changed mappings.
+ * @param eptp Extended Page Table Pointer bit representation, of the read/write view if EPTP
+ * switching is enabled.
+ * @param fetchEptp Extended Page Table Pointer of the execute view, 0 if EPTP switching is disabled.
+ * @param eptpList EPTP list used by VMFUNC, NULL if EPTP switching is disabled.
+ * @param lock Spinlock guarding the structure in root mode.
+ * @param numaNode NUMA node of the logical core the structure belongs to, where its EPT
+ * structures are allocated.
  */
 typedef struct Context_EptMappingsData
 {
-  __declspec(align(CONTEXT_ALIGN_REQUIREMENT)) CHAR
-    splitBuffer[CONTEXT_EPT_SPLIT_SIZE * CONTEXT_EPT_NO_SPLITS];
-  UINT64 noOfUsedSplits;
-  Context_EptChangedMapping changedMappings[CONTEXT_EPT_MAX_MAPPINGS];
+  Context_EptPagePool splitPool;
+  Context_EptPagePool populatePool;
+  volatile LONG isPopulateRefillNeeded;
+  Context_EptMappingTable changedMappings;
+  UINT64 eptp;
+  UINT64 fetchEptp;
+  UINT64* eptpList;
+  volatile LONG lock;
+  ULONG numaNode;
 } Context_EptMappingsData;
 
 
+/**
+ * @brief Structure holding VM exit statistics of a single logical core.
+ * 
+ * Counters are only written by the core they belong to, so no atomic operations are used.
+ * 
+ * @param exitReasons Number of VM exits per basic exit reason.
+ * @param cpuidBasicLeaves Number of CPUID exits per basic leaf.
+ * @param cpuidExtendedLeaves Number of CPUID exits per extended leaf, starting at 0x80000000.
+ * @param cpuidOtherLeaves Number of CPUID exits for all other leaves.
+ * @param vmCalls Number of VMCALLs per code, in the order of VMCALL codes, unknown codes last.
+ * @param noOfVirtualizationExceptions Number of EPT violations resolved by the #VE handler.
+ * @param rootCycles Number of TSC ticks spent in VMEXIT_handler.
+ * @param rootCyclesHistogram Number of VM exits per bucket, bucket n counts exits that took
+ * from 2^n to 2^(n+1)-1 TSC ticks.
+ */
+typedef struct Context_CoreStats
+{
+  UINT64 exitReasons[CONTEXT_STATS_EXIT_REASONS];
+  UINT64 cpuidBasicLeaves[CONTEXT_STATS_CPUID_LEAVES];
+  UINT64 cpuidExtendedLeaves[CONTEXT_STATS_CPUID_LEAVES];
+  UINT64 cpuidOtherLeaves;
+  UINT64 vmCalls[CONTEXT_STATS_VMCALLS];
+  UINT64 noOfVirtualizationExceptions;
+  UINT64 rootCycles;
+  UINT64 rootCyclesHistogram[CONTEXT_STATS_HISTOGRAM_BUCKETS];
+} Context_CoreStats;
+
+
+/**
+ * @brief Structure holding a single core's CPUID leaves precomputed before VM entry.
+ *
+ * @param cachedBasicLeaves Bit n is set if basic leaf n is cached.
+ * @param cachedExtendedLeaves Bit n is set if extended leaf 0x80000000 + n is cached.
+ * @param basicLeaves EAX, EBX, ECX and EDX of basic leaves.
+ * @param extendedLeaves EAX, EBX, ECX and EDX of extended leaves.
+ */
+typedef struct Context_CpuidCache
+{
+  UINT32 cachedBasicLeaves;
+  UINT32 cachedExtendedLeaves;
+  INT32 basicLeaves[CONTEXT_CPUID_CACHED_LEAVES][4];
+  INT32 extendedLeaves[CONTEXT_CPUID_CACHED_LEAVES][4];
+} Context_CpuidCache;
+
+
+/**
+ * @brief Structure describing a single traced event.
+ *
+ * @param timestamp TSC value when the event was recorded.
+ * @param guestRip Guest RIP of the instruction that caused the VM exit.
+ * @param address Guest physical address for EPT violations, first argument for VMCALLs,
+ * guest CR3 for samples.
+ * @param vmCallCode VMCALL code, 0 for other events.
+ * @param type Event type, one of @ref CONTEXTTraceEventTypes.
+ * @param accessType Read, write and fetch bits of the EPT violation exit qualification.
+ * @param view EPT view granted by the EPT violation handler.
+ * @param reserved Reserved.
+ */
+typedef struct Context_TraceEvent
+{
+  UINT64 timestamp;
+  UINT64 guestRip;
+  UINT64 address;
+  UINT32 vmCallCode;
+  UINT8 type;
+  UINT8 accessType;
+  UINT8 view;
+  UINT8 reserved;
+} Context_TraceEvent;
+
+
+/**
+ * @brief Structure defining a single core's trace ring.
+ *
+ * The ring has a single producer, the core's root mode, and is never written by readers,
+ * so old events are overwritten once it is full. The header occupies a cache line. It is
+ * only a copy published to readers, root mode keeps the producer state in its logical core,
+ * since a process can make its view of the ring writable.
+ *
+ * @param head Number of events recorded so far, the next event goes to head % capacity.
+ * @param capacity Number of events in the ring, power of 2.
+ * @param reserved Reserved.
+ * @param events Events.
+ */
+#pragma warning(disable:4200)
+typedef struct Context_TraceRing
+{
+  volatile UINT64 head;
+  UINT64 capacity;
+  UINT64 reserved[6];
+  Context_TraceEvent events[];
+} Context_TraceRing;
+#pragma warning(default:4200)
+
+
+/**
+ * @brief Leaf of the PFN table, virtual addresses of the pages of a 2MB physical region.
+ *
+ * @param pages Virtual address of every page, NULL if the page is not an EPT table.
+ */
+typedef struct Context_PfnTableLeaf
+{
+  VOID* volatile pages[CONTEXT_PFN_TABLE_ENTRIES];
+} Context_PfnTableLeaf;
+
+
+/**
+ * @brief Directory of the PFN table, leaves of a 1GB physical region.
+ *
+ * @param leaves Leaf of every 2MB region, NULL if the region holds no EPT table.
+ */
+typedef struct Context_PfnTableDirectory
+{
+  Context_PfnTableLeaf* volatile leaves[CONTEXT_PFN_TABLE_ENTRIES];
+} Context_PfnTableDirectory;
+
+
+/**
+ * @brief Table translating physical addresses of EPT tables to their virtual addresses.
+ *
+ * Every page used as an EPT table is registered when it is allocated, so walking a hierarchy
+ * in root mode never needs the memory manager. Directories and leaves are only added at
+ * PASSIVE_LEVEL under the mutex, and published after they are zeroed, so lookups in root
+ * mode take no lock.
+ *
+ * @param mutex Mutex serializing changes.
+ * @param directories Directory of every 1GB region, NULL if the region holds no EPT table.
+ */
+typedef struct Context_PfnTable
+{
+  FAST_MUTEX mutex;
+  Context_PfnTableDirectory* volatile directories[CONTEXT_PFN_TABLE_DIRECTORIES];
+} Context_PfnTable;
+
+
+/**
+ * @brief Structure defining a single core's dirty ring.
+ *
+ * The ring has a single producer, the core's root mode draining its PML buffer, and a single
+ * consumer, DRIVER_READ_DIRTY. Pages are dropped and counted once the ring is full,
+ * instead of overwriting pages not read yet. Each entry is a guest physical address aligned
+ * to the size of its EPT page, with one of @ref CONTEXTDirtyPageSizes in the low bits.
+ * The header occupies a cache line.
+ *
+ * @param head Number of pages logged so far, the next page goes to head % capacity.
+ * @param tail Number of pages read so far.
+ * @param capacity Number of pages in the ring, power of 2.
+ * @param noOfDroppedPages Number of pages dropped since dirty logging was started.
+ * @param reserved Reserved.
+ * @param pages Logged pages.
+ */
+#pragma warning(disable:4200)
+typedef struct Context_DirtyRing
+{
+  volatile UINT64 head;
+  volatile UINT64 tail;
+  UINT64 capacity;
+  volatile UINT64 noOfDroppedPages;
+  UINT64 reserved[4];
+  UINT64 pages[];
+} Context_DirtyRing;
+#pragma warning(default:4200)
+
+
+/**
+ * @brief Structure holding the memory of all trace rings.
+ *
+ * Rings are placed one after another in a pagefile backed section, which is locked and
+ * mapped into system space with an MDL, and can be mapped read-only into user processes.
+ *
+ * @param section Kernel handle of the section.
+ * @param sectionObject Referenced section object.
+ * @param systemView View of the section in system space.
+ * @param mdl MDL locking the system view.
+ * @param rings Nonpaged mapping of the MDL, root mode writes through it.
+ * @param size Size of the section in bytes.
+ * @param ringSize Size of a single ring in bytes, a multiple of PAGE_SIZE.
+ */
+typedef struct Context_Trace
+{
+  HANDLE section;
+  VOID* sectionObject;
+  VOID* systemView;
+  PMDL mdl;
+  CHAR* rings;
+  UINT64 size;
+  UINT64 ringSize;
+} Context_Trace;
+
+
 /**
  * @brief Structure defining a single core's context.
  * 
@@ -84,9 +517,22 @@ typedef struct Context_EptMappingsData
  * @param vmcsRegion MCS region.
  * @param msrBitmap MSR bitmap.
  * @param rootModeStack Root mode stack.
- * @param eptMappingData EPT mappings data.
- * @param eptp Extended Page Table Pointer bit representation.
+ * @param eptMappingData EPT mappings data used by this core, possibly shared.
  * @param isVirtualized TRUE if logical core is virtualized, FALSE otherwise.
+ * @param veInformation Virtualization exception information area.
+ * @param pmlBuffer Page-modification log, written by the processor while dirty logging is on.
+ * @param isMtfPending TRUE if the split view of a mapping is restored on the next MTF VM exit.
+ * @param mtfGuestAddress Guest physical address of the mapping to restore.
+ * @param isVeHandlerInstalled TRUE if the #VE gate of this core's IDT is replaced.
+ * @param originalVeGate The replaced #VE gate.
+ * @param veLastRip Guest RIP of the last virtualization exception resolved by switching views.
+ * @param stats VM exit statistics.
+ * @param traceRing Trace ring, NULL if tracing is disabled.
+ * @param traceHead Number of events recorded into the trace ring, published as its head.
+ * @param traceMask Number of events in the trace ring minus 1.
+ * @param isDirtyLogEnabled TRUE if page-modification logging is enabled in this core's VMCS.
+ * @param dirtyRing Dirty ring, NULL if dirty logging is disabled.
+ * @param cpuidCache CPUID leaves answered without executing CPUID.
  */
 typedef struct Context_LogicalCore
 {
@@ -94,9 +540,22 @@ typedef struct Context_LogicalCore
   __declspec(align(CONTEXT_ALIGN_REQUIREMENT)) CHAR vmcsRegion[CONTEXT_VMCS_REGION_SIZE];
   __declspec(align(CONTEXT_ALIGN_REQUIREMENT)) CHAR msrBitmap[CONTEXT_MSR_BITMAP_SIZE];
   __declspec(align(CONTEXT_ALIGN_REQUIREMENT)) CHAR rootModeStack[CONTEXT_ROOT_MODE_STACK_SIZE];
-  Context_EptMappingsData eptMappingData;
-  UINT64 eptp;
+  __declspec(align(CONTEXT_ALIGN_REQUIREMENT)) CHAR veInformation[CONTEXT_VE_INFORMATION_SIZE];
+  __declspec(align(CONTEXT_ALIGN_REQUIREMENT)) CHAR pmlBuffer[CONTEXT_PML_BUFFER_SIZE];
+  Context_EptMappingsData* eptMappingData;
   BOOLEAN isVirtualized;
+  BOOLEAN isMtfPending;
+  UINT64 mtfGuestAddress;
+  BOOLEAN isVeHandlerInstalled;
+  SEGMENTATION_InterruptGate originalVeGate;
+  UINT64 veLastRip;
+  Context_CoreStats stats;
+  Context_TraceRing* traceRing;
+  UINT64 traceHead;
+  UINT64 traceMask;
+  BOOLEAN isDirtyLogEnabled;
+  Context_DirtyRing* dirtyRing;
+  Context_CpuidCache cpuidCache;
 } Context_LogicalCore;
 
 
@@ -104,15 +563,54 @@ typedef struct Context_LogicalCore
  * @brief Structure defining whole processor context.
  *
  * @param systemCR3 CR3 value of the system.
- * @param noOfLogicalCores Number of logical cores in the system.
- * @param logicalCores Array of logical cores' contexts.
+ * @param isEptShared TRUE if all logical cores share a single EPT hierarchy, FALSE otherwise.
+ * @param isInveptSingleContextSupported TRUE if single-context INVEPT is supported.
+ * @param isEpt1GBPageSupported TRUE if EPT PDPT entries can map 1GB pages.
+ * @param isEptAccessDirtySupported TRUE if the processor sets accessed and dirty flags
+ * in EPT entries.
+ * @param isEptpSwitchingEnabled TRUE if views are switched with VMFUNC EPTP switching.
+ * @param isVeEnabled TRUE if EPT violations on changed mappings cause virtualization exceptions.
+ * @param isPmlEnabled TRUE if dirty pages can be logged with page-modification logging.
+ * @param isVpidEnabled TRUE if guest translations are tagged with VPIDs and survive VM exits.
+ * @param isSamplingEnabled TRUE if guest RIP can be sampled with the VMX-preemption timer.
+ * @param samplingPeriod VMX-preemption timer value the timer is armed with after every sample.
+ * @param mtfThrashThreshold Number of view switches after which a mapping is MTF assisted,
+ * 0 if MTF assistance is disabled or not supported.
+ * @param noOfEptMappingsData Number of EPT mappings data structures, 1 if shared.
+ * @param eptMappingsData Array of pointers to EPT mappings data structures, each allocated
+ * on the NUMA node of its logical core.
+ * @param eptSetupMicroseconds Time it took to set up all EPT hierarchies.
+ * @param memoryTypeMap Memory type map the EPT hierarchies were created with, used to
+ * populate their unpopulated entries.
+ * @param trace Memory of trace rings.
+ * @param pfnTable Virtual addresses of all EPT tables.
+ * @param noOfLogicalCores Number of logical cores in all processor groups.
+ * @param logicalCores Pointers to logical cores' contexts, indexed by system-wide processor
+ * index, each allocated on the NUMA node of its core.
  */
 #pragma warning(disable:4200)
 typedef struct Context_Context
 {
   IA32_Cr3 systemCR3;
+  BOOLEAN isEptShared;
+  BOOLEAN isInveptSingleContextSupported;
+  BOOLEAN isEpt1GBPageSupported;
+  BOOLEAN isEptAccessDirtySupported;
+  BOOLEAN isEptpSwitchingEnabled;
+  BOOLEAN isVeEnabled;
+  BOOLEAN isPmlEnabled;
+  BOOLEAN isVpidEnabled;
+  BOOLEAN isSamplingEnabled;
+  UINT32 samplingPeriod;
+  UINT64 mtfThrashThreshold;
+  UINT64 noOfEptMappingsData;
+  Context_EptMappingsData** eptMappingsData;
+  UINT64 eptSetupMicroseconds;
+  MTRR_Map* memoryTypeMap;
+  Context_Trace trace;
+  Context_PfnTable pfnTable;
   UINT64 noOfLogicalCores;
-  Context_LogicalCore logicalCores[];
+  Context_LogicalCore* logicalCores[];
 } Context_Context;
 #pragma warning(default:4200)
 
@@ -129,4 +627,10 @@ Context_Context* Context_getContext(VOID);
 Context_LogicalCore* Context_getLogicalCore(VOID);
 
 
+VOID Context_lockEptMappings(Context_EptMappingsData* const mappingData);
+
+
+VOID Context_unlockEptMappings(Context_EptMappingsData* const mappingData);
+
+
 VOID Context_destroy(VOID);
@@ -0,0 +1,142 @@
+/**
+ * @file cpuid.c
+ * @brief Implements CPUID cache.
+ *
+ * The cache is filled on each logical core by executing CPUID natively, so per core values
+ * like the initial APIC ID are correct. Leaves outside of the cache are executed in root mode
+ * and changed the same way.
+ */
+
+
+#include <intrin.h>
+#include "cpuid.h"
+#include "ia32.h"
+#include "memory.h"
+#include "vmcs.h"
+
+
+/**************************************************************************************************
+* Global function definitions
+**************************************************************************************************/
+/**
+ * @brief Fills the CPUID cache of the current logical core.
+ *
+ * Must be called on the core the cache belongs to, before it is virtualized. Only leaves up
+ * to the maximal basic and extended leaf reported by the processor are cached.
+ *
+ * @param cache Cache to fill.
+ *
+ * @return VOID
+ */
+VOID CPUID_setupCache(Context_CpuidCache* const cache)
+{
+  *cache = (Context_CpuidCache){ 0 };
+
+  INT32 maxLeaf[4] = { 0 };
+  __cpuid(maxLeaf, IA32_CPUID_BASIC_INFORMATION_0);
+  const UINT32 noOfBasicLeaves = min((UINT32)maxLeaf[0] + 1, CONTEXT_CPUID_CACHED_LEAVES);
+  for (UINT32 leaf = 0; leaf < noOfBasicLeaves; leaf++)
+  {
+    if ((CPUID_CACHED_BASIC_LEAVES & (1UL << leaf)) == 0)
+    {
+      continue;
+    }
+
+    __cpuidex(cache->basicLeaves[leaf], leaf, 0);
+    CPUID_applyChanges(leaf, cache->basicLeaves[leaf]);
+    cache->cachedBasicLeaves |= 1UL << leaf;
+  }
+
+  __cpuid(maxLeaf, IA32_CPUID_EXTENDED_LEAVES_BASE);
+  if ((UINT32)maxLeaf[0] < IA32_CPUID_EXTENDED_LEAVES_BASE)
+  {
+    return;
+  }
+
+  const UINT32 noOfExtendedLeaves = min(
+    (UINT32)maxLeaf[0] - IA32_CPUID_EXTENDED_LEAVES_BASE + 1,
+    CONTEXT_CPUID_CACHED_LEAVES);
+  for (UINT32 leafIndex = 0; leafIndex < noOfExtendedLeaves; leafIndex++)
+  {
+    const UINT32 leaf = IA32_CPUID_EXTENDED_LEAVES_BASE + leafIndex;
+    __cpuidex(cache->extendedLeaves[leafIndex], leaf, 0);
+    CPUID_applyChanges(leaf, cache->extendedLeaves[leafIndex]);
+    cache->cachedExtendedLeaves |= 1UL << leafIndex;
+  }
+}
+
+
+/**
+ * @brief Looks up a leaf in the CPUID cache.
+ *
+ * Must be called in root mode, since dynamic bits are taken from the guest state.
+ *
+ * @param cache Cache of the current logical core.
+ * @param leaf CPUID leaf.
+ * @param registers Array receiving EAX, EBX, ECX and EDX.
+ *
+ * @return TRUE if the leaf was cached, FALSE if CPUID has to be executed.
+ */
+BOOLEAN CPUID_readCached(
+  const Context_CpuidCache* const cache,
+  const UINT32 leaf,
+  INT32 registers[4])
+{
+  if (leaf < CONTEXT_CPUID_CACHED_LEAVES && (cache->cachedBasicLeaves & (1UL << leaf)) != 0)
+  {
+    Memory_copy(registers, cache->basicLeaves[leaf], sizeof(cache->basicLeaves[leaf]));
+  }
+  else if (leaf - IA32_CPUID_EXTENDED_LEAVES_BASE < CONTEXT_CPUID_CACHED_LEAVES &&
+    (cache->cachedExtendedLeaves & (1UL << (leaf - IA32_CPUID_EXTENDED_LEAVES_BASE))) != 0)
+  {
+    const UINT32 leafIndex = leaf - IA32_CPUID_EXTENDED_LEAVES_BASE;
+    Memory_copy(
+      registers,
+      cache->extendedLeaves[leafIndex],
+      sizeof(cache->extendedLeaves[leafIndex]));
+  }
+  else
+  {
+    return FALSE;
+  }
+
+  // OSXSAVE mirrors CR4.OSXSAVE, which the guest may change after the cache is filled
+  if (leaf == IA32_CPUID_BASIC_INFORMATION_1)
+  {
+    IA32_Cr4 guestCr4 = { 0 };
+    __vmx_vmread(VMCS_GUEST_CR4, &guestCr4.bits);
+    ((IA32_CpuidBasicInformation1*)registers)->osxsave = guestCr4.xsaveAndProcExtStateEnableBit;
+  }
+
+  return TRUE;
+}
+
+
+/**
+ * @brief Applies the hypervisor's changes to a CPUID leaf.
+ *
+ * There are two CPUID functions that are modified:
+ *  - IA32_CPUID_BASIC_INFORMATION_0: Vendor string is modified to "AvocadoIntel"
+ *  - IA32_CPUID_BASIC_INFORMATION_1: Hypervisor present bit is set to TRUE
+ *
+ * @param leaf CPUID leaf.
+ * @param registers EAX, EBX, ECX and EDX returned by the processor.
+ *
+ * @return VOID
+ */
+VOID CPUID_applyChanges(const UINT32 leaf, INT32 registers[4])
+{
+  if (leaf == IA32_CPUID_BASIC_INFORMATION_0)
+  {
+    IA32_CpuidBasicInformation0* const basicInformation0 = (IA32_CpuidBasicInformation0*)registers;
+    basicInformation0->vendor1 = 'covA';
+    basicInformation0->vendor2 = 'Ioda';
+    basicInformation0->vendor3 = 'letn';
+  }
+
+  if (leaf == IA32_CPUID_BASIC_INFORMATION_1)
+  {
+    IA32_CpuidBasicInformation1* const basicInformation1 = (IA32_CpuidBasicInformation1*)registers;
+    basicInformation1->hypervisorPresentBit = TRUE;
+  }
+}
@@ -0,0 +1,48 @@
+/**
+ * @file cpuid.h
+ * @brief CPUID cache constants and function declarations.
+ *
+ * Static CPUID leaves are executed once per logical core before VM entry, with the
+ * hypervisor's changes applied, so most CPUID VM exits are answered from memory.
+ */
+
+
+#pragma once
+
+
+#include <ntddk.h>
+#include "context.h"
+
+
+/**************************************************************************************************
+* Defines
+**************************************************************************************************/
+/**
+ * @name Cached basic leaves
+ * @brief Basic leaves that neither depend on the subleaf nor change at runtime.
+ *
+ * Leaves with subleaves (4, 7, 0Bh, 0Dh, 0Fh, 10h, 12h, 14h, 17h, 18h, 1Dh, 1Eh, 1Fh and above)
+ * are always executed, they also hold x2APIC IDs, XCR0 dependent XSAVE sizes and the OSPKE bit.
+ * The OSXSAVE bit of leaf 1 is taken from guest CR4 on every lookup.
+ * @anchor CPUIDCachedBasicLeaves
+ */
+///@{
+#define CPUID_CACHED_BASIC_LEAVES  \
+  ((1UL << 0x0) | (1UL << 0x1) | (1UL << 0x2) | (1UL << 0x3) | (1UL << 0x5) | (1UL << 0x6) | \
+  (1UL << 0x9) | (1UL << 0xA) | (1UL << 0x15) | (1UL << 0x16) | (1UL << 0x19) | (1UL << 0x1A))
+///@}
+
+
+/**************************************************************************************************
+* Global function declarations
+**************************************************************************************************/
+VOID CPUID_setupCache(Context_CpuidCache* const cache);
+
+
+BOOLEAN CPUID_readCached(
+  const Context_CpuidCache* const cache,
+  const UINT32 leaf,
+  INT32 registers[4]);
+
+
+VOID CPUID_applyChanges(const UINT32 leaf, INT32 registers[4]);
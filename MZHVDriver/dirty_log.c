@@ -0,0 +1,371 @@
+/**
+ * @file dirty_log.c
+ * @brief Implements dirty logging.
+ *
+ * While logging is on, the processor writes the guest physical address of every write that
+ * sets an EPT dirty flag into the core's PML buffer, and causes a VM exit only once all
+ * VMEXIT_PML_ENTRIES entries are used. Root mode then moves the entries into the core's
+ * dirty ring, from which they are read at PASSIVE_LEVEL. Dirty flags of all EPT hierarchies
+ * are cleared in bulk when logging is started or stopped, so every page written while
+ * logging is on is logged at least once.
+ *
+ * Starting, stopping and reading are serialized by a mutex. Each ring has a single producer,
+ * the core's root mode, and a single consumer, the reader holding the mutex.
+ */
+
+
+#include <intrin.h>
+#include "config.h"
+#include "context.h"
+#include "dirty_log.h"
+#include "ept.h"
+#include "memory.h"
+#include "page_swapper.h"
+#include "vmcs.h"
+#include "vmexit.h"
+#include "vmx.h"
+
+
+/**************************************************************************************************
+* Local globals definitions
+**************************************************************************************************/
+/**
+ * @brief Mutex serializing starting, stopping and reading of the dirty log.
+ */
+static FAST_MUTEX dirtyLogMutex;
+
+
+/**
+ * @brief TRUE if dirty logging was started and not stopped yet.
+ */
+static BOOLEAN isStarted;
+
+
+/**************************************************************************************************
+* Local function declarations
+**************************************************************************************************/
+static KIPI_BROADCAST_WORKER DIRTY_LOG_vmCallIpi;
+
+
+static UINT64 getRingEntry(
+  const Context_EptMappingsData* const mappingData,
+  const UINT64 address);
+
+
+static VOID push(Context_DirtyRing* const ring, const UINT64 page);
+
+
+/**************************************************************************************************
+* Global function definitions
+**************************************************************************************************/
+/**
+ * @brief Allocates dirty rings of all logical cores.
+ *
+ * The number of pages per ring is taken from the configuration and rounded down to a power
+ * of 2. Only the mutex is initialized if dirty logging is disabled. Must be called at
+ * PASSIVE_LEVEL, after the context is allocated.
+ *
+ * @return STATUS_SUCCESS if successful, error code otherwise.
+ */
+NTSTATUS DIRTY_LOG_init(VOID)
+{
+  ExInitializeFastMutex(&dirtyLogMutex);
+  isStarted = FALSE;
+
+  const UINT64 configuredPages = Config_getConfig()->dirtyRingPages;
+  if (configuredPages == 0)
+  {
+    return STATUS_SUCCESS;
+  }
+
+  ULONG highestBit = 0;
+  _BitScanReverse64(&highestBit, configuredPages);
+  const UINT64 noOfPages = 1ULL << highestBit;
+
+  Context_Context* const context = Context_getContext();
+  for (UINT64 logicalCoreIndex = 0; logicalCoreIndex < context->noOfLogicalCores; logicalCoreIndex++)
+  {
+    // Allocations are zeroed, only capacities need to be set
+    Context_DirtyRing* const ring =
+      Memory_allocate(sizeof(Context_DirtyRing) + noOfPages * sizeof(UINT64), FALSE);
+    if (ring == NULL)
+    {
+      DIRTY_LOG_destroy();
+      return STATUS_UNSUCCESSFUL;
+    }
+    ring->capacity = noOfPages;
+    context->logicalCores[logicalCoreIndex]->dirtyRing = ring;
+  }
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Starts dirty logging on all logical cores.
+ *
+ * Rings are emptied, page-modification logging is enabled, and dirty flags are cleared
+ * afterwards, so that no page written from now on is missed. Must be called at PASSIVE_LEVEL.
+ *
+ * @return STATUS_SUCCESS if successful, STATUS_NOT_SUPPORTED if dirty logging is disabled
+ * or not supported, STATUS_INVALID_DEVICE_STATE if it is already started.
+ */
+NTSTATUS DIRTY_LOG_start(VOID)
+{
+  const Context_Context* const context = Context_getContext();
+  if (context == NULL || !context->isPmlEnabled)
+  {
+    return STATUS_NOT_SUPPORTED;
+  }
+
+  ExAcquireFastMutex(&dirtyLogMutex);
+  if (isStarted)
+  {
+    ExReleaseFastMutex(&dirtyLogMutex);
+    return STATUS_INVALID_DEVICE_STATE;
+  }
+
+  // Logging is off on all cores, so nothing produces into the rings
+  for (UINT64 logicalCoreIndex = 0; logicalCoreIndex < context->noOfLogicalCores; logicalCoreIndex++)
+  {
+    Context_DirtyRing* const ring = context->logicalCores[logicalCoreIndex]->dirtyRing;
+    ring->head = 0;
+    ring->tail = 0;
+    ring->noOfDroppedPages = 0;
+  }
+
+  KeIpiGenericCall(DIRTY_LOG_vmCallIpi, VMEXIT_VMCALL_START_PML);
+  PAGE_SWAPPER_clearDirtyFlags();
+  isStarted = TRUE;
+  ExReleaseFastMutex(&dirtyLogMutex);
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Stops dirty logging on all logical cores.
+ *
+ * Entries left in the PML buffers are moved into the rings, which can still be read
+ * afterwards. Dirty flags are cleared in bulk again. Must be called at PASSIVE_LEVEL.
+ *
+ * @return STATUS_SUCCESS if successful, STATUS_NOT_SUPPORTED if dirty logging is disabled
+ * or not supported, STATUS_INVALID_DEVICE_STATE if it is not started.
+ */
+NTSTATUS DIRTY_LOG_stop(VOID)
+{
+  const Context_Context* const context = Context_getContext();
+  if (context == NULL || !context->isPmlEnabled)
+  {
+    return STATUS_NOT_SUPPORTED;
+  }
+
+  ExAcquireFastMutex(&dirtyLogMutex);
+  if (!isStarted)
+  {
+    ExReleaseFastMutex(&dirtyLogMutex);
+    return STATUS_INVALID_DEVICE_STATE;
+  }
+
+  KeIpiGenericCall(DIRTY_LOG_vmCallIpi, VMEXIT_VMCALL_STOP_PML);
+  PAGE_SWAPPER_clearDirtyFlags();
+  isStarted = FALSE;
+  ExReleaseFastMutex(&dirtyLogMutex);
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Reads logged pages of all logical cores.
+ *
+ * While logging is on, PML buffers of all cores are flushed into their rings first. As many
+ * pages as fit into the output are copied and removed from the rings, the rest is returned
+ * by the next call. Must be called at PASSIVE_LEVEL.
+ *
+ * @param outputSize Size of the output buffer in bytes.
+ * @param output Buffer receiving the pages.
+ * @param bytesWritten Number of bytes written to the output.
+ *
+ * @return STATUS_SUCCESS if successful, STATUS_NOT_SUPPORTED if dirty logging is disabled
+ * or not supported, STATUS_INVALID_PARAMETER if the output cannot hold the header.
+ */
+NTSTATUS DIRTY_LOG_read(
+  const UINT64 outputSize,
+  DIRTY_LOG_Pages* const output,
+  UINT64* const bytesWritten)
+{
+  *bytesWritten = 0;
+  const Context_Context* const context = Context_getContext();
+  if (context == NULL || !context->isPmlEnabled)
+  {
+    return STATUS_NOT_SUPPORTED;
+  }
+
+  if (outputSize < sizeof(DIRTY_LOG_Pages))
+  {
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  const UINT64 maxPages = (outputSize - sizeof(DIRTY_LOG_Pages)) / sizeof(UINT64);
+  UINT64 noOfPages = 0;
+  UINT64 noOfDroppedPages = 0;
+
+  ExAcquireFastMutex(&dirtyLogMutex);
+  if (isStarted)
+  {
+    KeIpiGenericCall(DIRTY_LOG_vmCallIpi, VMEXIT_VMCALL_FLUSH_PML);
+  }
+
+  for (UINT64 logicalCoreIndex = 0; logicalCoreIndex < context->noOfLogicalCores; logicalCoreIndex++)
+  {
+    Context_DirtyRing* const ring = context->logicalCores[logicalCoreIndex]->dirtyRing;
+    noOfDroppedPages += ring->noOfDroppedPages;
+
+    // Pages below the head are written before the head is advanced
+    const UINT64 head = ring->head;
+    KeMemoryBarrierWithoutFence();
+    UINT64 tail = ring->tail;
+    while (tail != head && noOfPages < maxPages)
+    {
+      output->pages[noOfPages++] = ring->pages[tail & (ring->capacity - 1)];
+      tail++;
+    }
+
+    // Reads must complete before the producer may reuse the entries
+    KeMemoryBarrierWithoutFence();
+    ring->tail = tail;
+  }
+  ExReleaseFastMutex(&dirtyLogMutex);
+
+  output->noOfPages = noOfPages;
+  output->noOfDroppedPages = noOfDroppedPages;
+  *bytesWritten = sizeof(DIRTY_LOG_Pages) + noOfPages * sizeof(UINT64);
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Moves entries of the current core's PML buffer into its dirty ring.
+ *
+ * Entries are logged from the last one down, the PML index points below the last written
+ * entry, or wraps to VMEXIT_PML_INDEX_FULL once the buffer is full. Each address is aligned
+ * to the size of its EPT page, the smallest one among the views, since a write to a large
+ * page is logged only once. The index is reset afterwards. Must be called in root mode.
+ *
+ * @return VOID
+ */
+VOID DIRTY_LOG_drainPml(VOID)
+{
+  Context_LogicalCore* const thisCore = Context_getLogicalCore();
+  Context_EptMappingsData* const mappingData = thisCore->eptMappingData;
+  const UINT64* const entries = (const UINT64*)thisCore->pmlBuffer;
+
+  UINT64 pmlIndex = 0;
+  __vmx_vmread(VMCS_PML_INDEX, &pmlIndex);
+  const UINT64 firstEntry = (UINT16)(pmlIndex + 1);
+
+  Context_lockEptMappings(mappingData);
+  for (UINT64 entryIndex = firstEntry; entryIndex < VMEXIT_PML_ENTRIES; entryIndex++)
+  {
+    push(thisCore->dirtyRing, getRingEntry(mappingData, entries[entryIndex]));
+  }
+  Context_unlockEptMappings(mappingData);
+
+  __vmx_vmwrite(VMCS_PML_INDEX, VMEXIT_PML_ENTRIES - 1);
+}
+
+
+/**
+ * @brief Frees dirty rings.
+ *
+ * Must be called at PASSIVE_LEVEL, after all logical cores are devirtualized.
+ *
+ * @return VOID
+ */
+VOID DIRTY_LOG_destroy(VOID)
+{
+  Context_Context* const context = Context_getContext();
+  for (UINT64 logicalCoreIndex = 0; logicalCoreIndex < context->noOfLogicalCores; logicalCoreIndex++)
+  {
+    Context_LogicalCore* const logicalCore = context->logicalCores[logicalCoreIndex];
+    if (logicalCore != NULL && logicalCore->dirtyRing != NULL)
+    {
+      Memory_free(logicalCore->dirtyRing);
+      logicalCore->dirtyRing = NULL;
+    }
+  }
+
+  isStarted = FALSE;
+}
+
+
+/**************************************************************************************************
+* Local function definitions
+**************************************************************************************************/
+/**
+ * @brief Sends a dirty logging VMCALL on the current logical core.
+ *
+ * @param argument VMCALL code.
+ *
+ * @return NTSTATUS returned by the VMCALL.
+ */
+_Use_decl_annotations_
+static ULONG_PTR DIRTY_LOG_vmCallIpi(ULONG_PTR argument)
+{
+  return VMX_vmcall(argument, 0, 0, 0);
+}
+
+
+/**
+ * @brief Returns a logged address aligned to its EPT page, with the page size in the low bits.
+ *
+ * The caller is responsible for holding the mappings data lock.
+ *
+ * @param mappingData Mappings data used by the current logical core.
+ * @param address Logged guest physical address.
+ *
+ * @return Dirty ring entry.
+ */
+static UINT64 getRingEntry(
+  const Context_EptMappingsData* const mappingData,
+  const UINT64 address)
+{
+  UINT64 pageSize = EPT_PAGE_SIZE_1GB;
+  for (UINT64 view = 0; view < EPT_getNoOfViews(mappingData); view++)
+  {
+    pageSize = min(pageSize, EPT_getPageSize(mappingData, view, address));
+  }
+
+  const UINT64 sizeCode = (pageSize == EPT_PAGE_SIZE_1GB) ? CONTEXT_DIRTY_PAGE_1GB :
+    (pageSize == EPT_PAGE_SIZE_2MB) ? CONTEXT_DIRTY_PAGE_2MB : CONTEXT_DIRTY_PAGE_4KB;
+
+  return (address & ~(pageSize - 1)) | sizeCode;
+}
+
+
+/**
+ * @brief Appends a page to a dirty ring.
+ *
+ * The page is written before the head is advanced, so the reader never sees a head covering
+ * a page that is not written yet. The page is dropped if the ring is full.
+ *
+ * @param ring Dirty ring of the current logical core.
+ * @param page Dirty ring entry.
+ *
+ * @return VOID
+ */
+static VOID push(Context_DirtyRing* const ring, const UINT64 page)
+{
+  const UINT64 head = ring->head;
+  if (head - ring->tail >= ring->capacity)
+  {
+    ring->noOfDroppedPages++;
+    return;
+  }
+
+  ring->pages[head & (ring->capacity - 1)] = page;
+  KeMemoryBarrierWithoutFence();
+  ring->head = head + 1;
+}
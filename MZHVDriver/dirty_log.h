@@ -0,0 +1,63 @@
+/**
+ * @file dirty_log.h
+ * @brief Dirty logging structures and function declarations.
+ *
+ * Pages written by the guest are logged with page-modification logging. Every logical core
+ * drains its PML buffer into its own dirty ring, once the buffer is full or when logging
+ * is flushed, and the rings are read with DRIVER_READ_DIRTY.
+ */
+
+
+#pragma once
+
+
+#include <ntddk.h>
+#include "context.h"
+
+
+/**************************************************************************************************
+* Type declarations
+**************************************************************************************************/
+/**
+ * @brief Structure returned by DRIVER_READ_DIRTY.
+ *
+ * Entries have the format of Context_DirtyRing entries. A page written more than once may
+ * be logged more than once.
+ *
+ * @param noOfPages Number of entries in pages.
+ * @param noOfDroppedPages Number of pages dropped by all cores since logging was started,
+ * nonzero means the log is incomplete.
+ * @param pages Logged pages.
+ */
+#pragma warning(disable:4200)
+typedef struct DIRTY_LOG_Pages
+{
+  UINT64 noOfPages;
+  UINT64 noOfDroppedPages;
+  UINT64 pages[];
+} DIRTY_LOG_Pages;
+#pragma warning(default:4200)
+
+
+/**************************************************************************************************
+* Global function declarations
+**************************************************************************************************/
+NTSTATUS DIRTY_LOG_init(VOID);
+
+
+NTSTATUS DIRTY_LOG_start(VOID);
+
+
+NTSTATUS DIRTY_LOG_stop(VOID);
+
+
+NTSTATUS DIRTY_LOG_read(
+  const UINT64 outputSize,
+  DIRTY_LOG_Pages* const output,
+  UINT64* const bytesWritten);
+
+
+VOID DIRTY_LOG_drainPml(VOID);
+
+
+VOID DIRTY_LOG_destroy(VOID);
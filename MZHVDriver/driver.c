@@ -6,10 +6,16 @@
  */
 
 
+#include "command_ring.h"
+#include "config.h"
 #include "context.h"
+#include "dirty_log.h"
 #include "driver.h"
 #include "page_swapper.h"
 #include "memory.h"
+#include "sampler.h"
+#include "stats.h"
+#include "trace.h"
 #include "vmm.h"
 
 
@@ -31,7 +37,8 @@ static NTSTATUS DeviceControl(PDEVICE_OBJECT deviceObject, PIRP irp);
 /**
  * @brief Driver entry point
  * 
- * Called when driver is loaded. It initializes driver, creates a device and boots VMM.
+ * Called when driver is loaded. It reads configuration, initializes driver, creates a device
+ * and boots VMM.
  * 
  * @param driverObject Driver object
  * @param registryPath Registry path
@@ -40,7 +47,6 @@ static NTSTATUS DeviceControl(PDEVICE_OBJECT deviceObject, PIRP irp);
  */
 NTSTATUS DriverEntry(PDRIVER_OBJECT driverObject, PUNICODE_STRING registryPath)
 {
-  UNREFERENCED_PARAMETER(registryPath);
   DbgPrint("DriverEntry\n");
 
   UNICODE_STRING ntDeviceName;
@@ -69,6 +75,10 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT driverObject, PUNICODE_STRING registryPath)
   driverObject->MajorFunction[IRP_MJ_CLOSE] = &DeviceClose;
   driverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = &DeviceControl;
 
+  Config_init(registryPath);
+  PAGE_SWAPPER_init();
+  COMMAND_RING_init();
+
   ntStatus = Context_init();
   if (!NT_SUCCESS(ntStatus))
   {
@@ -78,10 +88,21 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT driverObject, PUNICODE_STRING registryPath)
     return ntStatus;
   }
 
+  ntStatus = PAGE_SWAPPER_startRefill();
+  if (!NT_SUCCESS(ntStatus))
+  {
+    DbgPrint("DriverEntry: PAGE_SWAPPER_startRefill error=%ld\n", ntStatus);
+    Context_destroy();
+    IoDeleteSymbolicLink(&dosDeviceName);
+    IoDeleteDevice(driverObject->DeviceObject);
+    return ntStatus;
+  }
+
   ntStatus = VMM_enable();
   if (!NT_SUCCESS(ntStatus))
   {
     DbgPrint("DriverEntry: VMM_enable error=%ld\n", ntStatus);
+    PAGE_SWAPPER_stopRefill();
     Context_destroy();
     IoDeleteSymbolicLink(&dosDeviceName);
     IoDeleteDevice(driverObject->DeviceObject);
@@ -97,7 +118,8 @@ NTSTATUS DriverEntry(PDRIVER_OBJECT driverObject, PUNICODE_STRING registryPath)
 /**
  * @brief Driver unload function
  * 
- * Called when driver is unloaded. It disables VMM and destroys context.
+ * Called when driver is unloaded. It releases the command ring, stops refilling EPT pools,
+ * disables VMM and destroys context.
  * 
  * @param driverObject Driver object
  */
@@ -108,6 +130,8 @@ VOID DriverUnload(PDRIVER_OBJECT driverObject)
 
   if (Context_getContext() != NULL)
   {
+    COMMAND_RING_destroy();
+    PAGE_SWAPPER_stopRefill();
     VMM_disable();
     Context_destroy();
   }
@@ -150,7 +174,8 @@ static NTSTATUS DeviceCreate(PDEVICE_OBJECT deviceObject, PIRP irp)
 /**
  * @brief Device close function
  * 
- * Called when the device is closed, does nothing.
+ * Called when the device is closed. Releases the command ring registered with the closed
+ * handle, if any, and the regions it left prepared.
  * 
  * @param deviceObject Device object
  * @param irp I/O request packet
@@ -162,6 +187,10 @@ static NTSTATUS DeviceClose(PDEVICE_OBJECT deviceObject, PIRP irp)
   UNREFERENCED_PARAMETER(deviceObject);
   DbgPrint("DeviceClose\n");
 
+  const PFILE_OBJECT fileObject = IoGetCurrentIrpStackLocation(irp)->FileObject;
+  COMMAND_RING_unregister(fileObject);
+  PAGE_SWAPPER_releasePreparedRanges(fileObject);
+
   irp->IoStatus.Status = STATUS_SUCCESS;
   irp->IoStatus.Information = 0;
   IoCompleteRequest(irp, IO_NO_INCREMENT);
@@ -172,8 +201,21 @@ static NTSTATUS DeviceClose(PDEVICE_OBJECT deviceObject, PIRP irp)
 /**
  * @brief Device control function
  * 
- * Called when device's function is invoked. It handles DRIVER_MAP and DRIVER_UNMAP function
- * forwarding to the page swapper.
+ * Called when device's function is invoked. It handles DRIVER_MAP, DRIVER_UNMAP,
+ * DRIVER_MAP_BATCH and DRIVER_UNMAP_BATCH functions forwarding to the page swapper.
+ * Batch functions return a status for each entry in the output buffer. DRIVER_MAP_ASYNC
+ * and DRIVER_UNMAP_ASYNC pend the IRP, the page swapper completes it once all logical cores
+ * have applied the change. DRIVER_QUERY_STATS
+ * returns aggregated VM exit statistics, optionally resetting them. DRIVER_MAP_TRACE maps
+ * trace rings read-only into the calling process. DRIVER_START_DIRTY and
+ * DRIVER_STOP_DIRTY control page-modification logging, and DRIVER_READ_DIRTY returns
+ * the pages logged since the last read. DRIVER_START_SAMPLE and DRIVER_STOP_SAMPLE control
+ * guest RIP sampling into the trace rings. DRIVER_OPEN_RING maps a command ring into
+ * the calling process, and DRIVER_CLOSE_RING releases it. DRIVER_PREPARE splits a region
+ * into 4KB pages ahead of mapping changes, and DRIVER_UNPREPARE releases it.
+ * DRIVER_GROUP_BATCH moves mapping changes to mapping groups, returning a status for each
+ * entry like the other batch functions. DRIVER_BENCH_VMCALL measures VMCALL round trips
+ * from kernel mode, since user mode VMCALLs are rejected.
  * 
  * @param deviceObject Device object
  * @param irp I/O request packet
@@ -182,10 +224,10 @@ static NTSTATUS DeviceClose(PDEVICE_OBJECT deviceObject, PIRP irp)
  */
 static NTSTATUS DeviceControl(PDEVICE_OBJECT deviceObject, PIRP irp)
 {
-  UNREFERENCED_PARAMETER(deviceObject);
   DbgPrint("DeviceControl\n");
 
   NTSTATUS status = STATUS_SUCCESS;
+  ULONG_PTR information = 0;
 
   PIO_STACK_LOCATION  ioStackLocation = IoGetCurrentIrpStackLocation(irp);
   switch (ioStackLocation->Parameters.DeviceIoControl.IoControlCode)
@@ -216,6 +258,282 @@ static NTSTATUS DeviceControl(PDEVICE_OBJECT deviceObject, PIRP irp)
 
     break;
   }
+  case DRIVER_MAP_RANGE:
+  {
+    if (ioStackLocation->Parameters.DeviceIoControl.InputBufferLength <
+      sizeof(PAGE_SWAPPER_RangeRequest))
+    {
+      status = STATUS_INVALID_PARAMETER;
+      break;
+    }
+    PAGE_SWAPPER_RangeRequest request = { 0 };
+    Memory_copy(&request, irp->AssociatedIrp.SystemBuffer, sizeof(request));
+    status = PAGE_SWAPPER_mapRange(&request);
+
+    break;
+  }
+  case DRIVER_PREPARE:
+  {
+    if (ioStackLocation->Parameters.DeviceIoControl.InputBufferLength <
+      sizeof(PAGE_SWAPPER_PrepareRequest))
+    {
+      status = STATUS_INVALID_PARAMETER;
+      break;
+    }
+    PAGE_SWAPPER_PrepareRequest request = { 0 };
+    Memory_copy(&request, irp->AssociatedIrp.SystemBuffer, sizeof(request));
+    status = PAGE_SWAPPER_prepareRange(ioStackLocation->FileObject, &request);
+
+    break;
+  }
+  case DRIVER_UNPREPARE:
+  {
+    if (ioStackLocation->Parameters.DeviceIoControl.InputBufferLength <
+      sizeof(PAGE_SWAPPER_PrepareRequest))
+    {
+      status = STATUS_INVALID_PARAMETER;
+      break;
+    }
+    PAGE_SWAPPER_PrepareRequest request = { 0 };
+    Memory_copy(&request, irp->AssociatedIrp.SystemBuffer, sizeof(request));
+    status = PAGE_SWAPPER_unprepareRange(ioStackLocation->FileObject, &request);
+
+    break;
+  }
+  case DRIVER_MAP_ASYNC:
+  {
+    if (ioStackLocation->Parameters.DeviceIoControl.InputBufferLength < 3 * sizeof(PVOID))
+    {
+      status = STATUS_INVALID_PARAMETER;
+      break;
+    }
+    PVOID arguments[3] = { 0 };
+    Memory_copy(arguments, irp->AssociatedIrp.SystemBuffer, sizeof(arguments));
+    status =
+      PAGE_SWAPPER_mapAsync(deviceObject, irp, arguments[0], arguments[1], arguments[2]);
+
+    break;
+  }
+  case DRIVER_UNMAP_ASYNC:
+  {
+    if (ioStackLocation->Parameters.DeviceIoControl.InputBufferLength < sizeof(PVOID))
+    {
+      status = STATUS_INVALID_PARAMETER;
+      break;
+    }
+    PVOID argument = { 0 };
+    Memory_copy(&argument, irp->AssociatedIrp.SystemBuffer, sizeof(argument));
+    status = PAGE_SWAPPER_unmapAsync(deviceObject, irp, argument);
+
+    break;
+  }
+  case DRIVER_MAP_BATCH:
+  {
+    const ULONG inputLength = ioStackLocation->Parameters.DeviceIoControl.InputBufferLength;
+    const UINT64 noOfRequests = inputLength / sizeof(PAGE_SWAPPER_MapRequest);
+    if (noOfRequests == 0 ||
+      inputLength % sizeof(PAGE_SWAPPER_MapRequest) != 0 ||
+      ioStackLocation->Parameters.DeviceIoControl.OutputBufferLength < noOfRequests * sizeof(NTSTATUS))
+    {
+      status = STATUS_INVALID_PARAMETER;
+      break;
+    }
+    status = PAGE_SWAPPER_mapBatch(
+      noOfRequests,
+      irp->AssociatedIrp.SystemBuffer,
+      irp->AssociatedIrp.SystemBuffer);
+    if (NT_SUCCESS(status))
+    {
+      information = noOfRequests * sizeof(NTSTATUS);
+    }
+
+    break;
+  }
+  case DRIVER_UNMAP_BATCH:
+  {
+    const ULONG inputLength = ioStackLocation->Parameters.DeviceIoControl.InputBufferLength;
+    const UINT64 noOfRequests = inputLength / sizeof(PVOID);
+    if (noOfRequests == 0 ||
+      inputLength % sizeof(PVOID) != 0 ||
+      ioStackLocation->Parameters.DeviceIoControl.OutputBufferLength < noOfRequests * sizeof(NTSTATUS))
+    {
+      status = STATUS_INVALID_PARAMETER;
+      break;
+    }
+    status = PAGE_SWAPPER_unmapBatch(
+      noOfRequests,
+      irp->AssociatedIrp.SystemBuffer,
+      irp->AssociatedIrp.SystemBuffer);
+    if (NT_SUCCESS(status))
+    {
+      information = noOfRequests * sizeof(NTSTATUS);
+    }
+
+    break;
+  }
+  case DRIVER_GROUP_BATCH:
+  {
+    const ULONG inputLength = ioStackLocation->Parameters.DeviceIoControl.InputBufferLength;
+    const UINT64 noOfRequests = inputLength / sizeof(PAGE_SWAPPER_GroupRequest);
+    if (noOfRequests == 0 ||
+      inputLength % sizeof(PAGE_SWAPPER_GroupRequest) != 0 ||
+      ioStackLocation->Parameters.DeviceIoControl.OutputBufferLength < noOfRequests * sizeof(NTSTATUS))
+    {
+      status = STATUS_INVALID_PARAMETER;
+      break;
+    }
+    status = PAGE_SWAPPER_groupBatch(
+      noOfRequests,
+      irp->AssociatedIrp.SystemBuffer,
+      irp->AssociatedIrp.SystemBuffer);
+    if (NT_SUCCESS(status))
+    {
+      information = noOfRequests * sizeof(NTSTATUS);
+    }
+
+    break;
+  }
+  case DRIVER_QUERY_STATS:
+  {
+    // Input and output share the system buffer, so flags are read first
+    ULONG flags = 0;
+    if (ioStackLocation->Parameters.DeviceIoControl.InputBufferLength >= sizeof(flags))
+    {
+      Memory_copy(&flags, irp->AssociatedIrp.SystemBuffer, sizeof(flags));
+    }
+
+    UINT64 bytesWritten = 0;
+    status = STATS_query(
+      (flags & STATS_QUERY_RESET) != 0,
+      ioStackLocation->Parameters.DeviceIoControl.OutputBufferLength,
+      irp->AssociatedIrp.SystemBuffer,
+      &bytesWritten);
+    if (NT_SUCCESS(status))
+    {
+      information = bytesWritten;
+    }
+
+    break;
+  }
+  case DRIVER_MAP_TRACE:
+  {
+    if (ioStackLocation->Parameters.DeviceIoControl.OutputBufferLength < sizeof(TRACE_Mapping))
+    {
+      status = STATUS_INVALID_PARAMETER;
+      break;
+    }
+    status = TRACE_mapView(irp->AssociatedIrp.SystemBuffer);
+    if (NT_SUCCESS(status))
+    {
+      information = sizeof(TRACE_Mapping);
+    }
+
+    break;
+  }
+  case DRIVER_HARVEST_AD:
+  {
+    if (ioStackLocation->Parameters.DeviceIoControl.InputBufferLength <
+      sizeof(PAGE_SWAPPER_HarvestRequest))
+    {
+      status = STATUS_INVALID_PARAMETER;
+      break;
+    }
+    PAGE_SWAPPER_HarvestRequest request = { 0 };
+    Memory_copy(&request, irp->AssociatedIrp.SystemBuffer, sizeof(request));
+
+    UINT64 bytesWritten = 0;
+    status = PAGE_SWAPPER_harvestAccessedDirty(
+      &request,
+      ioStackLocation->Parameters.DeviceIoControl.OutputBufferLength,
+      irp->AssociatedIrp.SystemBuffer,
+      &bytesWritten);
+    if (NT_SUCCESS(status))
+    {
+      information = bytesWritten;
+    }
+
+    break;
+  }
+  case DRIVER_START_DIRTY:
+  {
+    status = DIRTY_LOG_start();
+    break;
+  }
+  case DRIVER_STOP_DIRTY:
+  {
+    status = DIRTY_LOG_stop();
+    break;
+  }
+  case DRIVER_READ_DIRTY:
+  {
+    UINT64 bytesWritten = 0;
+    status = DIRTY_LOG_read(
+      ioStackLocation->Parameters.DeviceIoControl.OutputBufferLength,
+      irp->AssociatedIrp.SystemBuffer,
+      &bytesWritten);
+    if (NT_SUCCESS(status))
+    {
+      information = bytesWritten;
+    }
+
+    break;
+  }
+  case DRIVER_START_SAMPLE:
+  {
+    UINT64 period = 0;
+    if (ioStackLocation->Parameters.DeviceIoControl.InputBufferLength >= sizeof(period))
+    {
+      Memory_copy(&period, irp->AssociatedIrp.SystemBuffer, sizeof(period));
+    }
+    status = SAMPLER_start(period);
+    break;
+  }
+  case DRIVER_STOP_SAMPLE:
+  {
+    status = SAMPLER_stop();
+    break;
+  }
+  case DRIVER_BENCH_VMCALL:
+  {
+    const UINT64 noOfSamples =
+      ioStackLocation->Parameters.DeviceIoControl.OutputBufferLength / sizeof(UINT64);
+    status = STATS_measureVmCall(noOfSamples, irp->AssociatedIrp.SystemBuffer);
+    if (NT_SUCCESS(status))
+    {
+      information = noOfSamples * sizeof(UINT64);
+    }
+
+    break;
+  }
+  case DRIVER_OPEN_RING:
+  {
+    if (ioStackLocation->Parameters.DeviceIoControl.InputBufferLength <
+      sizeof(COMMAND_RING_Registration) ||
+      ioStackLocation->Parameters.DeviceIoControl.OutputBufferLength <
+      sizeof(COMMAND_RING_Mapping))
+    {
+      status = STATUS_INVALID_PARAMETER;
+      break;
+    }
+    // Input and output share the system buffer
+    COMMAND_RING_Registration registration = { 0 };
+    Memory_copy(&registration, irp->AssociatedIrp.SystemBuffer, sizeof(registration));
+    status = COMMAND_RING_register(
+      ioStackLocation->FileObject,
+      &registration,
+      irp->AssociatedIrp.SystemBuffer);
+    if (NT_SUCCESS(status))
+    {
+      information = sizeof(COMMAND_RING_Mapping);
+    }
+
+    break;
+  }
+  case DRIVER_CLOSE_RING:
+  {
+    status = COMMAND_RING_unregister(ioStackLocation->FileObject);
+    break;
+  }
   default:
   {
     status = STATUS_INVALID_DEVICE_REQUEST;
@@ -223,7 +541,15 @@ static NTSTATUS DeviceControl(PDEVICE_OBJECT deviceObject, PIRP irp)
   }
   }
 
+  // Pended IRPs are completed by the page swapper and must not be touched anymore
+  if (status == STATUS_PENDING)
+  {
+    DbgPrint("DeviceControl: pending\n");
+    return status;
+  }
+
   irp->IoStatus.Status = status;
+  irp->IoStatus.Information = information;
   IoCompleteRequest(irp, IO_NO_INCREMENT);
 
   DbgPrint("DeviceControl: status=%ld\n", status);
@@ -27,8 +27,27 @@
  * @anchor DRIVERName
  */
  ///@{
-#define DRIVER_MAP       CTL_CODE(FILE_DEVICE_UNKNOWN, 0x1337, METHOD_BUFFERED, FILE_ANY_ACCESS)
-#define DRIVER_UNMAP     CTL_CODE(FILE_DEVICE_UNKNOWN, 0x2137, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_MAP          CTL_CODE(FILE_DEVICE_UNKNOWN, 0x1337, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_UNMAP        CTL_CODE(FILE_DEVICE_UNKNOWN, 0x2137, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_MAP_BATCH    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x1338, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_UNMAP_BATCH  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x2138, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_MAP_RANGE    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x1339, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_MAP_ASYNC    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x133A, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_UNMAP_ASYNC  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x213A, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_OPEN_RING    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x133B, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_CLOSE_RING   CTL_CODE(FILE_DEVICE_UNKNOWN, 0x213B, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_PREPARE      CTL_CODE(FILE_DEVICE_UNKNOWN, 0x133C, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_UNPREPARE    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x213C, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_GROUP_BATCH  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x133D, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_QUERY_STATS  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x4137, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_MAP_TRACE    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x4138, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_HARVEST_AD   CTL_CODE(FILE_DEVICE_UNKNOWN, 0x4139, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_START_DIRTY  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x413A, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_STOP_DIRTY   CTL_CODE(FILE_DEVICE_UNKNOWN, 0x413B, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_READ_DIRTY   CTL_CODE(FILE_DEVICE_UNKNOWN, 0x413C, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_START_SAMPLE CTL_CODE(FILE_DEVICE_UNKNOWN, 0x413D, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_STOP_SAMPLE  CTL_CODE(FILE_DEVICE_UNKNOWN, 0x413E, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define DRIVER_BENCH_VMCALL CTL_CODE(FILE_DEVICE_UNKNOWN, 0x413F, METHOD_BUFFERED, FILE_ANY_ACCESS)
 ///@}
 
 /**************************************************************************************************
@@ -11,6 +11,11 @@
 #include "ept.h"
 #include "ia32.h"
 #include "memory.h"
+#include "mtrr.h"
+#include "page_pool.h"
+#include "pfn_table.h"
+#include "vmcs.h"
+#include "vmx.h"
 
 
 /**************************************************************************************************
@@ -19,38 +24,153 @@
 static UINT64 getPml4Count(VOID);
 
 
-static NTSTATUS setupPml4Entry(const UINT64 pml4EntryIndex, EPT_Pml4E* const pml4e);
+static NTSTATUS setupHierarchy(Context_EptMappingsData* const mappingData, UINT64* const eptp);
 
 
-static VOID fillVariableMtrrsCache(
-  const UINT64 noOfVariableRangeRegisters,
-  EPT_VariableMtrr* const variableMtrrs);
+static NTSTATUS setupPml4Entry(
+  Context_EptMappingsData* const mappingData,
+  const MTRR_Map* const map,
+  const PHYSICAL_MEMORY_RANGE* const ranges,
+  const UINT64 pml4EntryIndex,
+  EPT_Pml4E* const pml4e);
+
+
+static NTSTATUS setupPdptEntry(
+  Context_EptMappingsData* const mappingData,
+  const MTRR_Map* const map,
+  const PHYSICAL_MEMORY_RANGE* const ranges,
+  const UINT64 address,
+  EPT_PdptE* const pdpte);
+
+
+static NTSTATUS setupPdEntry(
+  Context_EptMappingsData* const mappingData,
+  const MTRR_Map* const map,
+  const UINT64 address,
+  EPT_PdE* const pde);
+
+
+static NTSTATUS initPageTable(const MTRR_Map* const map, const UINT64 address, EPT_PtE* const pt);
+
+
+static BOOLEAN containsRam(
+  const PHYSICAL_MEMORY_RANGE* const ranges,
+  const UINT64 address,
+  const UINT64 size);
+
+
+static VOID* allocateTable(Context_EptMappingsData* const mappingData);
+
+
+static VOID* allocateUpperTable(const Context_EptMappingsData* const mappingData);
+
+
+static VOID freeUpperTable(VOID* const table);
+
 
+static VOID* getTable(const UINT64 pageFrameNumber);
 
-static NTSTATUS adjustPml4WithVariableMtrrs(
-  const UINT64 noOfVariableRangeRegisters,
-  const EPT_VariableMtrr* const variableMtrrs,
-  const UINT64 defaultMemoryType,
+
+static NTSTATUS reservePools(Context_EptMappingsData* const mappingData);
+
+
+static VOID* takePopulateTable(
+  Context_EptMappingsData* const mappingData,
+  Context_EptPagePool** const pool);
+
+
+static NTSTATUS populatePdpte(
+  Context_EptMappingsData* const mappingData,
+  const UINT64 address,
+  EPT_PdptE* const pdpte);
+
+
+static NTSTATUS populatePde(
+  Context_EptMappingsData* const mappingData,
+  const UINT64 address,
+  EPT_PdE* const pde);
+
+
+static NTSTATUS cloneHierarchy(
+  Context_EptMappingsData* const mappingData,
+  const UINT64 templateEptp,
+  UINT64* const eptp);
+
+
+static NTSTATUS clonePml4Entry(
+  Context_EptMappingsData* const mappingData,
+  const EPT_Pml4E* const templatePml4e,
   EPT_Pml4E* const pml4e);
 
 
-static UINT64 searchVariableMtrrs(
-  const UINT64 noOfVariableMtrrs,
-  const EPT_VariableMtrr variableMtrrs[],
-  const UINT64 defaultMemoryType,
-  const UINT64 physicalAddress);
+static NTSTATUS clonePdptEntry(
+  Context_EptMappingsData* const mappingData,
+  const EPT_PdptE* const templatePdpte,
+  EPT_PdptE* const pdpte);
+
+
+static UINT64 getEptp(EPT_Pml4E* const pml4);
+
+
+static UINT64 getViewEptp(const Context_EptMappingsData* const mappingData, const UINT64 view);
+
 
+static EPT_PdptE* getPdpte(
+  const Context_EptMappingsData* const mappingData,
+  const UINT64 view,
+  const UINT64 address);
 
-static NTSTATUS splitPage(EPT_PdE* const pde);
 
+static EPT_PdE* getPde(
+  const Context_EptMappingsData* const mappingData,
+  const UINT64 view,
+  const UINT64 address);
 
-static VOID fillFixedMtrr(
-  const UINT32 msrIndex,
-  const UINT64 sizeInKBytes,
-  EPT_PtE** const ptIteratorPointer);
 
+static EPT_PdE* getSplitPde(
+  const Context_EptMappingsData* const mappingData,
+  const UINT64 view,
+  const UINT64 address);
 
-static NTSTATUS overrideFirstPml4EntryWithFixedMtrrs(EPT_Pml4E* pml4);
+
+static UINT64 getRegionEnd(const UINT64 address, const UINT64 size, const UINT64 current);
+
+
+static BOOLEAN isChunkAligned(
+  const UINT64 sourceAddress,
+  const UINT64 targetAddress,
+  const UINT64 remainingSize,
+  const UINT64 pageSize);
+
+
+static UINT64 getNoOfRegions(const UINT64 address, const UINT64 size, const UINT64 regionSize);
+
+
+static UINT64 harvestRegion(
+  const Context_EptMappingsData* const mappingData,
+  const UINT64 view,
+  const UINT64 address,
+  const UINT64 size,
+  const UINT64 current,
+  RTL_BITMAP* const accessedPages,
+  RTL_BITMAP* const dirtyPages);
+
+
+static VOID harvestEntry(
+  volatile UINT64* const entry,
+  const UINT64 firstPageIndex,
+  const UINT64 noOfPages,
+  RTL_BITMAP* const accessedPages,
+  RTL_BITMAP* const dirtyPages);
+
+
+static NTSTATUS splitLargePdpte(Context_EptMappingsData* const mappingData, EPT_PdptE* const pdpte);
+
+
+static NTSTATUS splitPage(Context_EptMappingsData* const mappingData, EPT_PdE* const pde);
+
+
+static VOID coalescePage(Context_EptMappingsData* const mappingData, EPT_PdE* const pde);
 
 
 static VOID destroyPml4(const UINT64 noOfPml4Entries, EPT_Pml4E* const pml4);
@@ -62,444 +182,1917 @@ static VOID destroyPml4(const UINT64 noOfPml4Entries, EPT_Pml4E* const pml4);
 /**
  * @brief Creates Extended Page Table Pointer with default (1-1) mapping.
  * 
- * This function allocates and initializez EPT structures, sets their memory type and returns
- * Extended Page Table Pointer bits.
+ * This function allocates and initializez EPT structures, sets their memory type and stores
+ * Extended Page Table Pointer bits in the mappings data. Pages split during the setup are
+ * taken from the mappings data's split pool, which has to be reserved beforehand.
+ * If EPTP switching is enabled, a second hierarchy is created for the execute view, together
+ * with the EPTP list holding both views.
+ * 
+ * Memory types are computed from the MTRRs only if no template is given. Otherwise the
+ * read/write view is a copy of the template, which must be an unchanged hierarchy created
+ * by this function. The execute view is always a copy of the read/write view. Can be called
+ * for different mappings data in parallel, as long as the template is not destroyed.
  * 
- * @param eptpBits Pointer to variable where EPTP bits should be stored.
+ * Page directories and page tables are taken from the split pool, which is refilled as
+ * needed and left with CONTEXT_EPT_SPLIT_RESERVE free pages for later splits. The populate
+ * pool is filled with CONTEXT_EPT_POPULATE_RESERVE pages for regions populated on first access.
+ * 
+ * @param mappingData Mappings data the EPT hierarchy is created for.
+ * @param templateEptp Extended Page Table Pointer bits of the hierarchy to copy, or 0.
  * 
  * @return STATUS_SUCCESS on success, error code otherwise.
  */
-NTSTATUS EPT_setupDefaltStructures(UINT64* const eptpBits)
+NTSTATUS EPT_setupDefaltStructures(
+  Context_EptMappingsData* const mappingData,
+  const UINT64 templateEptp)
 {
-  EPT_Pml4E* const pml4 = Memory_allocate(sizeof(EPT_Pml4E[EPT_PML4_ENTRIES]), TRUE);
-  if (pml4 == NULL)
+  NTSTATUS ntStatus = (templateEptp != 0) ?
+    cloneHierarchy(mappingData, templateEptp, &mappingData->eptp) :
+    setupHierarchy(mappingData, &mappingData->eptp);
+  if (!NT_SUCCESS(ntStatus))
+  {
+    return ntStatus;
+  }
+
+  if (!Context_getContext()->isEptpSwitchingEnabled)
+  {
+    return reservePools(mappingData);
+  }
+
+  ntStatus = cloneHierarchy(mappingData, mappingData->eptp, &mappingData->fetchEptp);
+  if (!NT_SUCCESS(ntStatus))
+  {
+    return ntStatus;
+  }
+
+  mappingData->eptpList = Memory_allocateOnNode(PAGE_SIZE, TRUE, mappingData->numaNode);
+  if (mappingData->eptpList == NULL)
   {
     return STATUS_UNSUCCESSFUL;
   }
 
-  NTSTATUS ntStatus;
-  const UINT64 pml4Count = getPml4Count();
-  for (UINT64 pml4Index = 0; pml4Index < pml4Count; pml4Index++)
+  mappingData->eptpList[EPT_VIEW_READ] = mappingData->eptp;
+  mappingData->eptpList[EPT_VIEW_FETCH] = mappingData->fetchEptp;
+
+  return reservePools(mappingData);
+}
+
+
+/**
+ * @brief Returns size of EPT structures.
+ * 
+ * Calculates number of bytes allocated for PML4 and PDPTs of a single hierarchy. Page
+ * directories and page tables are not included, they are taken from the split pool.
+ * 
+ * @return Size of EPT structures in bytes.
+ */
+UINT64 EPT_getStructuresSize(VOID)
+{
+  return sizeof(EPT_Pml4E[EPT_PML4_ENTRIES]) + getPml4Count() * sizeof(EPT_PdptE[EPT_PDPT_ENTRIES]);
+}
+
+
+/**
+ * @brief Returns number of views of mappings data.
+ * 
+ * @param mappingData Mappings data to check.
+ * 
+ * @return EPT_NO_OF_VIEWS if EPTP switching is enabled, 1 otherwise.
+ */
+UINT64 EPT_getNoOfViews(const Context_EptMappingsData* const mappingData)
+{
+  return mappingData->fetchEptp != 0 ? EPT_NO_OF_VIEWS : 1;
+}
+
+
+/**
+ * @brief Returns number of tables needed to map an address by a 4KB page.
+ * 
+ * Used at PASSIVE_LEVEL to estimate how many tables the split pool needs before
+ * a mapping change is sent to root mode. Views are always split in the same places,
+ * so only the read/write view is checked.
+ * 
+ * @param mappingData Mappings data of the EPT hierarchy to check.
+ * @param address Guest physical address.
+ * 
+ * @return 2 if the address is mapped by a 1GB page or its PDPT entry is not populated,
+ * 1 if it is mapped by a 2MB page or its PD entry is not populated, 0 otherwise.
+ */
+UINT64 EPT_getNoOfSplitTables(
+  const Context_EptMappingsData* const mappingData,
+  const UINT64 address)
+{
+  const EPT_PdptE* const pdpte = getPdpte(mappingData, EPT_VIEW_READ, address);
+  if (pdpte->largePage.isLargePage || pdpte->bits == EPT_UNPOPULATED_ENTRY)
   {
-    ntStatus = setupPml4Entry(pml4Index, &pml4[pml4Index]);
-    if (!NT_SUCCESS(ntStatus))
+    return 2;
+  }
+
+  const EPT_PdE* const pde = getPde(mappingData, EPT_VIEW_READ, address);
+  return (pde->largePage.isLargePage || pde->bits == EPT_UNPOPULATED_ENTRY) ? 1 : 0;
+}
+
+
+/**
+ * @brief Checks if an address is mapped by the EPT hierarchy, in every view.
+ * 
+ * A population that ran out of tables may have populated only some of the views, so all
+ * of them are checked. The caller is responsible for holding the mappings data lock.
+ * 
+ * @param mappingData Mappings data of the EPT hierarchy to check.
+ * @param address Guest physical address.
+ * 
+ * @return FALSE if the PDPT or PD entry covering the address is not populated in any view,
+ * TRUE otherwise.
+ */
+BOOLEAN EPT_isPopulated(const Context_EptMappingsData* const mappingData, const UINT64 address)
+{
+  for (UINT64 view = 0; view < EPT_getNoOfViews(mappingData); view++)
+  {
+    const EPT_PdptE* const pdpte = getPdpte(mappingData, view, address);
+    if (pdpte->bits == EPT_UNPOPULATED_ENTRY)
     {
-      destroyPml4(pml4Index, pml4);
-      return ntStatus;
+      return FALSE;
+    }
+
+    if (!pdpte->largePage.isLargePage &&
+      getPde(mappingData, view, address)->bits == EPT_UNPOPULATED_ENTRY)
+    {
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+
+/**
+ * @brief Maps an address not populated yet one to one, in every view.
+ * 
+ * Populates the PDPT entry and then the PD entry covering the address, the same way
+ * EPT_setupDefaltStructures would have, with memory types taken from the memory type map
+ * kept in the context. Other 2MB regions of a new page directory with more than one memory
+ * type are left unpopulated, so at most 2 tables are taken per view. Tables are taken from
+ * the populate pool, and from the split pool once it is empty. Does nothing for populated
+ * addresses, and views populated before a failure stay populated, so calling it again
+ * completes the population. Fails if both pools are empty, it never allocates, so it can be
+ * called in root mode. The caller is responsible for holding the mappings data lock.
+ * 
+ * @param mappingData Mappings data of the EPT hierarchy to populate.
+ * @param address Guest physical address.
+ * 
+ * @return STATUS_SUCCESS on success, error code otherwise.
+ */
+NTSTATUS EPT_populate(Context_EptMappingsData* const mappingData, const UINT64 address)
+{
+  for (UINT64 view = 0; view < EPT_getNoOfViews(mappingData); view++)
+  {
+    EPT_PdptE* const pdpte = getPdpte(mappingData, view, address);
+    if (pdpte->bits == EPT_UNPOPULATED_ENTRY)
+    {
+      const NTSTATUS ntStatus = populatePdpte(mappingData, address, pdpte);
+      if (!NT_SUCCESS(ntStatus))
+      {
+        return ntStatus;
+      }
     }
+
+    if (pdpte->largePage.isLargePage)
+    {
+      continue;
+    }
+
+    EPT_PdE* const pde = getPde(mappingData, view, address);
+    if (pde->bits == EPT_UNPOPULATED_ENTRY)
+    {
+      const NTSTATUS ntStatus = populatePde(mappingData, address, pde);
+      if (!NT_SUCCESS(ntStatus))
+      {
+        return ntStatus;
+      }
+    }
+  }
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Splits large pages mapping an address into 4KB pages, in every view.
+ * 
+ * Used at PASSIVE_LEVEL before a mapping change is sent to root mode, so that applying it
+ * only writes the page table entry. Tables are built exactly as root mode would build them
+ * and published with a single 64-bit write each. The translations stay the same, but the
+ * page size of the mappings changes, so the caller must invalidate EPT caches of all
+ * logical cores using the hierarchy before relying on the split. Cores may meanwhile hold
+ * both the large and the 4KB translations, which the SDM does not allow to last. Regions
+ * not populated yet are left to root mode, since EPT violations may populate them
+ * concurrently, and so are large pages not mapping their own region with full access,
+ * whose changes are restored by rewriting the large entry. Pinned page tables are not
+ * coalesced until EPT_unpinSplit is called. The caller is responsible for serializing
+ * mapping changes of the hierarchy and for reserving the tables in the split pool.
+ * 
+ * @param mappingData Mappings data of the EPT hierarchy to split.
+ * @param address Guest physical address.
+ * @param pin TRUE if the page tables should be pinned.
+ * @param isSplit Receives TRUE if any large page was split, FALSE otherwise.
+ * 
+ * @return STATUS_SUCCESS on success, also if the address is not populated, error code
+ * otherwise.
+ */
+NTSTATUS EPT_prepareSplit(
+  Context_EptMappingsData* const mappingData,
+  const UINT64 address,
+  const BOOLEAN pin,
+  BOOLEAN* const isSplit)
+{
+  const EPT_Address eptAddress = { .address = address };
+  *isSplit = FALSE;
+  if (!EPT_isPopulated(mappingData, address))
+  {
+    return STATUS_SUCCESS;
   }
 
-  IA32_CpuidBasicInformation1 cpuid = { 0 };
-  __cpuid(cpuid.registers, IA32_CPUID_BASIC_INFORMATION_1);
-  if (cpuid.mtrr)
+  for (UINT64 view = 0; view < EPT_getNoOfViews(mappingData); view++)
   {
-    const IA32_MtrrDefType mtrrDefType = { .bits = __readmsr(IA32_MTRR_DEF_TYPE) };
-    if (mtrrDefType.mtrrEnable)
+    EPT_PdptE* const pdpte = getPdpte(mappingData, view, address);
+    if (pdpte->largePage.isLargePage)
     {
-      EPT_VariableMtrr variableMtrrs[IA32_MTRR_MAX_VMTRR_COUNT] = { 0 };
-      const IA32_Mtrrcap mtrrCap = { .bits = __readmsr(IA32_MTRRCAP) };
-      fillVariableMtrrsCache(mtrrCap.variableRangeRegistersCount, variableMtrrs);
+      if (pdpte->largePage.pageFrameNumber != eptAddress.pageFrameNumber1GB ||
+        !pdpte->largePage.readAccess ||
+        !pdpte->largePage.writeAccess ||
+        !pdpte->largePage.fetchAccess)
+      {
+        continue;
+      }
 
-      for (UINT64 pml4EntryIndex = 0; pml4EntryIndex < pml4Count; pml4EntryIndex++)
+      const NTSTATUS ntStatus = splitLargePdpte(mappingData, pdpte);
+      if (!NT_SUCCESS(ntStatus))
       {
-        ntStatus = adjustPml4WithVariableMtrrs(
-          mtrrCap.variableRangeRegistersCount,
-          variableMtrrs, 
-          mtrrDefType.defaultMemoryType,
-          &pml4[pml4EntryIndex]);
-        if (!NT_SUCCESS(ntStatus))
-        {
-          destroyPml4(pml4Count, pml4);
-          return ntStatus;
-        }
+        return ntStatus;
       }
+      *isSplit = TRUE;
+    }
 
-      if (mtrrCap.fixedRangeRegistersSupported && mtrrDefType.fixedRangeMtrrEnable)
+    EPT_PdE* const pde = getPde(mappingData, view, address);
+    if (pde->largePage.isLargePage)
+    {
+      if (pde->largePage.pageFrameNumber != eptAddress.pageFrameNumber2MB ||
+        !pde->largePage.readAccess ||
+        !pde->largePage.writeAccess ||
+        !pde->largePage.fetchAccess)
       {
-        ntStatus = overrideFirstPml4EntryWithFixedMtrrs(pml4);
-        if (!NT_SUCCESS(ntStatus))
+        continue;
+      }
+
+      const NTSTATUS ntStatus = splitPage(mappingData, pde);
+      if (!NT_SUCCESS(ntStatus))
+      {
+        return ntStatus;
+      }
+      *isSplit = TRUE;
+    }
+
+    if (pin)
+    {
+      // Interlocked, so a concurrent accessed flag update by the processor is not lost
+      InterlockedOr64((volatile LONG64*)&pde->bits, (LONG64)EPT_PDE_PINNED_FLAG);
+    }
+  }
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Unpins page tables pinned by EPT_prepareSplit, in every view.
+ * 
+ * A page table without changed mappings is coalesced back into a large page right away.
+ * The caller is responsible for serializing mapping changes of the hierarchy and for
+ * invalidating EPT caches of all logical cores using it.
+ * 
+ * @param mappingData Mappings data of the EPT hierarchy.
+ * @param address Guest physical address.
+ * 
+ * @return VOID
+ */
+VOID EPT_unpinSplit(Context_EptMappingsData* const mappingData, const UINT64 address)
+{
+  for (UINT64 view = 0; view < EPT_getNoOfViews(mappingData); view++)
+  {
+    EPT_PdE* const pde = getSplitPde(mappingData, view, address);
+    if (pde == NULL || !pde->isPinned)
+    {
+      continue;
+    }
+
+    InterlockedAnd64((volatile LONG64*)&pde->bits, ~(LONG64)EPT_PDE_PINNED_FLAG);
+    if (pde->noOfChangedMappings == 0)
+    {
+      coalescePage(mappingData, pde);
+    }
+  }
+}
+
+
+/**
+ * @brief Makes the current logical core use a given view.
+ * 
+ * Has the same effect as VMFUNC 0 executed by the guest, including the EPTP index update
+ * used for virtualization exceptions. Cached translations of both views are tagged with
+ * their EPTPs, so no invalidation is needed. Must be called in root mode,
+ * with EPTP switching enabled.
+ * 
+ * @param mappingData Mappings data used by the current logical core.
+ * @param view EPT_VIEW_READ or EPT_VIEW_FETCH.
+ * 
+ * @return VOID
+ */
+VOID EPT_switchView(const Context_EptMappingsData* const mappingData, const UINT64 view)
+{
+  __vmx_vmwrite(VMCS_EPT_POINTER_FULL, getViewEptp(mappingData, view));
+  if (Context_getContext()->isVeEnabled)
+  {
+    __vmx_vmwrite(VMCS_EPTP_INDEX, view);
+  }
+}
+
+
+/**
+ * @brief Invalidates cached translations of an EPT hierarchy on the current logical core.
+ * 
+ * Uses single-context INVEPT for every view, so translations derived from other EPTPs
+ * are kept. All-context INVEPT is used only if single-context invalidation is not supported.
+ * Must be called in root mode.
+ * 
+ * @param mappingData Mappings data of the EPT hierarchy.
+ * 
+ * @return VOID
+ */
+VOID EPT_invalidate(const Context_EptMappingsData* const mappingData)
+{
+  if (Context_getContext()->isInveptSingleContextSupported)
+  {
+    for (UINT64 view = 0; view < EPT_getNoOfViews(mappingData); view++)
+    {
+      VMX_invept(VMX_INVEPT_SINGLE_CONTEXT, getViewEptp(mappingData, view));
+    }
+  }
+  else
+  {
+    VMX_inveptAll();
+  }
+}
+
+
+/**
+ * @brief Marks changed mappings within split pages.
+ * 
+ * Increments the changed mappings counter of every PDE referencing a page table in the
+ * range, in every view, by the number of the range's pages it maps. Parts of the range
+ * mapped by large pages are not counted, they are restored by rewriting the large entry.
+ * EPT_changeRangeMapping must have succeeded for the range. The caller is responsible
+ * for holding the mappings data lock.
+ * 
+ * @param mappingData Mappings data of the EPT hierarchy.
+ * @param address Guest physical address of the changed range, page aligned.
+ * @param size Size of the range in bytes, multiple of PAGE_SIZE.
+ * 
+ * @return VOID
+ */
+VOID EPT_acquireSplitRange(
+  Context_EptMappingsData* const mappingData,
+  const UINT64 address,
+  const UINT64 size)
+{
+  for (UINT64 view = 0; view < EPT_getNoOfViews(mappingData); view++)
+  {
+    UINT64 current = address;
+    while (current < address + size)
+    {
+      const UINT64 regionEnd = getRegionEnd(address, size, current);
+      EPT_PdE* const pde = getSplitPde(mappingData, view, current);
+      if (pde != NULL)
+      {
+        const LONG64 noOfPages = (LONG64)((regionEnd - current) / PAGE_SIZE);
+
+        // Interlocked, so a concurrent accessed flag update by the processor is not lost
+        InterlockedAdd64((volatile LONG64*)&pde->bits, noOfPages << EPT_PDE_MAPPING_COUNT_SHIFT);
+      }
+
+      current = regionEnd;
+    }
+  }
+}
+
+
+/**
+ * @brief Unmarks changed mappings within split pages.
+ * 
+ * Decrements the changed mappings counters incremented by EPT_acquireSplitRange, the range
+ * must have been acquired before. When a counter drops to 0, the page is coalesced back into
+ * a large page, if its page table still contains the original mapping and is not pinned.
+ * The caller is responsible for holding the mappings data lock and for invalidating EPT
+ * caches of all logical cores using the hierarchy.
+ * 
+ * @param mappingData Mappings data of the EPT hierarchy.
+ * @param address Guest physical address of the restored range, page aligned.
+ * @param size Size of the range in bytes, multiple of PAGE_SIZE.
+ * 
+ * @return VOID
+ */
+VOID EPT_releaseSplitRange(
+  Context_EptMappingsData* const mappingData,
+  const UINT64 address,
+  const UINT64 size)
+{
+  for (UINT64 view = 0; view < EPT_getNoOfViews(mappingData); view++)
+  {
+    UINT64 current = address;
+    while (current < address + size)
+    {
+      const UINT64 regionEnd = getRegionEnd(address, size, current);
+      EPT_PdE* const pde = getSplitPde(mappingData, view, current);
+      if (pde != NULL)
+      {
+        const LONG64 noOfPages = (LONG64)((regionEnd - current) / PAGE_SIZE);
+        NT_ASSERT((UINT64)noOfPages <= pde->noOfChangedMappings);
+
+        InterlockedAdd64((volatile LONG64*)&pde->bits, -(noOfPages << EPT_PDE_MAPPING_COUNT_SHIFT));
+        if (pde->noOfChangedMappings == 0)
         {
-          destroyPml4(pml4Count, pml4);
-          return ntStatus;
+          coalescePage(mappingData, pde);
         }
       }
+
+      current = regionEnd;
     }
   }
+}
+
+
+/**
+ * @brief Coalesces split pages of a range that hold no changed mappings.
+ * 
+ * Used to roll back the splits of a mapping change that failed and was restored before
+ * EPT_acquireSplitRange, so its page tables are not left split without being counted.
+ * Pages are coalesced only if they still contain the original mapping and are not pinned.
+ * The caller is responsible for holding the mappings data lock and for invalidating EPT
+ * caches of all logical cores using the hierarchy.
+ * 
+ * @param mappingData Mappings data of the EPT hierarchy.
+ * @param address Guest physical address of the restored range, page aligned.
+ * @param size Size of the range in bytes, multiple of PAGE_SIZE.
+ * 
+ * @return VOID
+ */
+VOID EPT_coalesceRange(
+  Context_EptMappingsData* const mappingData,
+  const UINT64 address,
+  const UINT64 size)
+{
+  for (UINT64 view = 0; view < EPT_getNoOfViews(mappingData); view++)
+  {
+    UINT64 current = address;
+    while (current < address + size)
+    {
+      EPT_PdE* const pde = getSplitPde(mappingData, view, current);
+      if (pde != NULL && pde->noOfChangedMappings == 0)
+      {
+        coalescePage(mappingData, pde);
+      }
+
+      current = getRegionEnd(address, size, current);
+    }
+  }
+}
+
+
+/**
+ * @brief Changes mapping of a given address.
+ * 
+ * Changes mapping of a given source address to a given target address. It also
+ * sets read/write and fetch permissions. Entries are replaced with a single 64-bit
+ * write, so the hierarchy stays consistent for other logical cores walking it. A source
+ * address which is not populated yet is populated in every view first.
+ * The caller is responsible for holding the mappings data lock.
+ * 
+ * @param mappingData Mappings data of the EPT hierarchy to change.
+ * @param view View to change, EPT_VIEW_READ if EPTP switching is disabled.
+ * @param sourceAddress Source address.
+ * @param targetAddress Target address.
+ * @param rw Read/write permissions.
+ * @param fetch Fetch permissions.
+ * 
+ * @return STATUS_SUCCESS on success, error code otherwise.
+ */
+NTSTATUS EPT_changeMapping(
+  Context_EptMappingsData* const mappingData,
+  const UINT64 view,
+  const UINT64 sourceAddress,
+  const UINT64 targetAddress,
+  const BOOLEAN rw,
+  const BOOLEAN fetch)
+{
+  const EPT_Address eptAddress = { .address = sourceAddress };
+  NTSTATUS ntStatus = EPT_populate(mappingData, sourceAddress);
+  if (!NT_SUCCESS(ntStatus))
+  {
+    return ntStatus;
+  }
+
+  EPT_PdptE* const pdpte = getPdpte(mappingData, view, sourceAddress);
+  if (pdpte->largePage.isLargePage)
+  {
+    ntStatus = splitLargePdpte(mappingData, pdpte);
+    if (!NT_SUCCESS(ntStatus))
+    {
+      return ntStatus;
+    }
+  }
+
+  EPT_PdE* const pde = getPde(mappingData, view, sourceAddress);
+  if (pde->largePage.isLargePage)
+  {
+    ntStatus = splitPage(mappingData, pde);
+    if (!NT_SUCCESS(ntStatus))
+    {
+      return ntStatus;
+    }
+  }
+
+  EPT_PtE* const pt = getTable(pde->standard.pageFrameNumber);
+
+  EPT_PtE pte = { .bits = pt[eptAddress.ptEntry].bits };
+  pte.pageFrameNumber = (EPT_Address){ .address = targetAddress }.pageFrameNumber4KB;
+  pte.readAccess = rw;
+  pte.writeAccess = rw;
+  pte.fetchAccess = fetch;
+  InterlockedExchange64((volatile LONG64*)&pt[eptAddress.ptEntry].bits, (LONG64)pte.bits);
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Changes mapping of a given address range.
+ * 
+ * Parts of the range where both source and target are aligned to a large page which is
+ * still mapped by a large entry are changed by rewriting that entry, so a 1GB or 2MB
+ * aligned range costs no page tables. 1GB pages are split into 2MB pages if only those
+ * can be used, and only the unaligned edges are split into 4KB pages. Memory types of
+ * the source are kept, parts of the source not populated yet are populated first. On failure
+ * the range may be partially changed, it is up to the caller to restore it. The caller is
+ * responsible for holding the mappings data lock.
+ * 
+ * @param mappingData Mappings data of the EPT hierarchy to change.
+ * @param view View to change, EPT_VIEW_READ if EPTP switching is disabled.
+ * @param sourceAddress Source address, page aligned.
+ * @param targetAddress Target address, page aligned.
+ * @param size Size of the range in bytes, multiple of PAGE_SIZE.
+ * @param rw Read/write permissions.
+ * @param fetch Fetch permissions.
+ * 
+ * @return STATUS_SUCCESS on success, error code otherwise.
+ */
+NTSTATUS EPT_changeRangeMapping(
+  Context_EptMappingsData* const mappingData,
+  const UINT64 view,
+  const UINT64 sourceAddress,
+  const UINT64 targetAddress,
+  const UINT64 size,
+  const BOOLEAN rw,
+  const BOOLEAN fetch)
+{
+  UINT64 offset = 0;
+  while (offset < size)
+  {
+    const UINT64 source = sourceAddress + offset;
+    const UINT64 target = targetAddress + offset;
+    NTSTATUS ntStatus = EPT_populate(mappingData, source);
+    if (!NT_SUCCESS(ntStatus))
+    {
+      return ntStatus;
+    }
+
+    EPT_PdptE* const pdpte = getPdpte(mappingData, view, source);
+
+    if (pdpte->largePage.isLargePage &&
+      isChunkAligned(source, target, size - offset, EPT_PAGE_SIZE_1GB))
+    {
+      EPT_PdptE1GB entry = { .bits = pdpte->bits };
+      entry.pageFrameNumber = (EPT_Address){ .address = target }.pageFrameNumber1GB;
+      entry.readAccess = rw;
+      entry.writeAccess = rw;
+      entry.fetchAccess = fetch;
+      InterlockedExchange64((volatile LONG64*)&pdpte->bits, (LONG64)entry.bits);
+
+      offset += EPT_PAGE_SIZE_1GB;
+      continue;
+    }
+
+    if (isChunkAligned(source, target, size - offset, EPT_PAGE_SIZE_2MB))
+    {
+      if (pdpte->largePage.isLargePage)
+      {
+        ntStatus = splitLargePdpte(mappingData, pdpte);
+        if (!NT_SUCCESS(ntStatus))
+        {
+          return ntStatus;
+        }
+      }
+
+      EPT_PdE* const pde = getPde(mappingData, view, source);
+      if (pde->largePage.isLargePage)
+      {
+        EPT_PdE2MB entry = { .bits = pde->bits };
+        entry.pageFrameNumber = (EPT_Address){ .address = target }.pageFrameNumber2MB;
+        entry.readAccess = rw;
+        entry.writeAccess = rw;
+        entry.fetchAccess = fetch;
+        InterlockedExchange64((volatile LONG64*)&pde->bits, (LONG64)entry.bits);
+
+        offset += EPT_PAGE_SIZE_2MB;
+        continue;
+      }
+    }
+
+    ntStatus = EPT_changeMapping(mappingData, view, source, target, rw, fetch);
+    if (!NT_SUCCESS(ntStatus))
+    {
+      return ntStatus;
+    }
+
+    offset += PAGE_SIZE;
+  }
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Returns maximal number of tables needed to change mapping of an address range.
+ * 
+ * Used at PASSIVE_LEVEL to estimate how many tables the split pool needs for a single
+ * view. The estimate assumes the range is mapped by 1GB pages, and ignores tables that
+ * are already split. If source and target differ modulo 2MB, every 2MB region of the
+ * range needs a page table; if they differ modulo 1GB, every 1GB region needs a page
+ * directory; otherwise only the two edges can need them.
+ * 
+ * @param sourceAddress Source address, page aligned.
+ * @param targetAddress Target address, page aligned.
+ * @param size Size of the range in bytes, multiple of PAGE_SIZE.
+ * 
+ * @return Number of tables.
+ */
+UINT64 EPT_getNoOfRangeSplitTables(
+  const UINT64 sourceAddress,
+  const UINT64 targetAddress,
+  const UINT64 size)
+{
+  const UINT64 noOf2MBRegions =
+    getNoOfRegions(sourceAddress, size, EPT_PAGE_SIZE_2MB);
+  const UINT64 noOf1GBRegions =
+    getNoOfRegions(sourceAddress, size, EPT_PAGE_SIZE_1GB);
+  const UINT64 difference = sourceAddress ^ targetAddress;
+
+  const UINT64 noOfPts =
+    (difference & (EPT_PAGE_SIZE_2MB - 1)) != 0 ? noOf2MBRegions : min(2, noOf2MBRegions);
+  const UINT64 noOfPds =
+    (difference & (EPT_PAGE_SIZE_1GB - 1)) != 0 ? noOf1GBRegions : min(2, noOf1GBRegions);
+
+  return noOfPts + noOfPds;
+}
+
+
+/**
+ * @brief Collects and clears accessed and dirty flags of an address range.
+ * 
+ * Sets a bit for every page of the range whose leaf entry has the flag set in any view,
+ * and clears the flags. Pages mapped by a large page all take the flags of its entry, so
+ * nothing is split. Flags are only read and cleared with atomic operations, so the function
+ * can run at PASSIVE_LEVEL while the processor keeps setting them, but a flag set between
+ * the read and the clear of an entry is reported only by the next call. Bits are only set,
+ * the bitmaps must be cleared by the caller. The caller is responsible for invalidating
+ * EPT caches of all logical cores using the hierarchy afterwards, until then the processor
+ * may not set cleared flags again.
+ * 
+ * @param mappingData Mappings data of the EPT hierarchy to scan.
+ * @param address Guest physical address of the range, page aligned.
+ * @param size Size of the range in bytes, multiple of PAGE_SIZE.
+ * @param accessedPages Bitmap receiving accessed pages, one bit per page of the range.
+ * @param dirtyPages Bitmap receiving dirty pages, one bit per page of the range.
+ * 
+ * @return STATUS_SUCCESS on success, STATUS_INVALID_PARAMETER if the range is not covered
+ * by the hierarchy.
+ */
+NTSTATUS EPT_harvestAccessedDirty(
+  const Context_EptMappingsData* const mappingData,
+  const UINT64 address,
+  const UINT64 size,
+  RTL_BITMAP* const accessedPages,
+  RTL_BITMAP* const dirtyPages)
+{
+  const UINT64 addressLimit = getPml4Count() * EPT_PML4E_MAPPED_SIZE;
+  if (address >= addressLimit || size > addressLimit - address)
+  {
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  for (UINT64 view = 0; view < EPT_getNoOfViews(mappingData); view++)
+  {
+    UINT64 current = address;
+    while (current < address + size)
+    {
+      current =
+        harvestRegion(mappingData, view, address, size, current, accessedPages, dirtyPages);
+    }
+  }
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Clears dirty flags of the whole EPT hierarchy.
+ * 
+ * Used when page-modification logging is started or stopped, since the processor logs
+ * a page only when it sets the dirty flag of its leaf entry. Accessed flags are kept, and
+ * nothing is split. As with EPT_harvestAccessedDirty, the caller is responsible for
+ * invalidating EPT caches of all logical cores using the hierarchy afterwards.
+ * 
+ * @param mappingData Mappings data of the EPT hierarchy to clear.
+ * 
+ * @return VOID
+ */
+VOID EPT_clearDirtyFlags(const Context_EptMappingsData* const mappingData)
+{
+  const UINT64 addressLimit = getPml4Count() * EPT_PML4E_MAPPED_SIZE;
+  for (UINT64 view = 0; view < EPT_getNoOfViews(mappingData); view++)
+  {
+    UINT64 current = 0;
+    while (current < addressLimit)
+    {
+      current = harvestRegion(mappingData, view, 0, addressLimit, current, NULL, NULL);
+    }
+  }
+}
+
+
+/**
+ * @brief Returns size of the EPT page mapping a given address.
+ * 
+ * The caller is responsible for holding the mappings data lock.
+ * 
+ * @param mappingData Mappings data of the EPT hierarchy.
+ * @param view View to search.
+ * @param address Guest physical address, covered by the hierarchy.
+ * 
+ * @return EPT_PAGE_SIZE_1GB, EPT_PAGE_SIZE_2MB, or PAGE_SIZE. Unpopulated addresses are
+ * reported as PAGE_SIZE.
+ */
+UINT64 EPT_getPageSize(
+  const Context_EptMappingsData* const mappingData,
+  const UINT64 view,
+  const UINT64 address)
+{
+  const EPT_PdptE* const pdpte = getPdpte(mappingData, view, address);
+  if (pdpte->largePage.isLargePage)
+  {
+    return EPT_PAGE_SIZE_1GB;
+  }
+
+  if (pdpte->bits == EPT_UNPOPULATED_ENTRY)
+  {
+    return PAGE_SIZE;
+  }
+
+  const EPT_PdE* const pde = getPde(mappingData, view, address);
+  return pde->largePage.isLargePage ? EPT_PAGE_SIZE_2MB : PAGE_SIZE;
+}
+
+
+/**
+ * @brief Frees EPT structures.
+ * 
+ * Frees memory allocated for EPT structures allocated with EPT_setupDefaltStructures.
+ * This function is designed for external use.
+ * 
+ * @param eptpBits Extended Page Table Pointer bits.
+ * 
+ * @return VOID
+ */
+VOID EPT_destroyEPTStructure(const UINT64 eptpBits)
+{
+  const EPT_EptP eptp = (EPT_EptP){ .bits = eptpBits };
+  EPT_Pml4E* const pml4 = getTable(eptp.pageFrameNumber);
+  const UINT64 pml4Count = getPml4Count();
+  destroyPml4(pml4Count, pml4);
+}
+
+
+/**************************************************************************************************
+* Local function definitions
+**************************************************************************************************/
+/**
+ * @brief Returns number of PML4 entries.
+ * 
+ * Calculates required number of PML4 entries based on CPUID information.
+ * 
+ * @return Number of PML4 entries.
+ */
+static UINT64 getPml4Count(VOID)
+{
+  IA32_CpuidAddressBits cpuid = { 0 };
+  __cpuid(cpuid.registers, IA32_CPUID_ADDRESS_BITS);
+
+  // Memory range mapped by 1 PML4 entry = 512 GB (2^39)
+  const UINT64 shiftValue = max(cpuid.physicalAddressBits - 39, 0);
+  const UINT64 pml4Count = min((1U << shiftValue), EPT_WINDOWS_MAX_PML4_COUNT);
+
+  return pml4Count;
+}
+
+
+/**
+ * @brief Creates a single EPT hierarchy with default (1-1) mapping.
+ * 
+ * Memory types are taken from a memory type map built from the MTRRs of the current
+ * logical core. Every range with a single memory type is mapped by the largest pages
+ * possible, so the number of tables grows with the number of MTRR ranges rather than
+ * with the size of the address space.
+ * 
+ * Only regions containing RAM reported by MmGetPhysicalMemoryRanges are populated up front.
+ * Entries covering 1GB regions without RAM, and 2MB regions without RAM that would need
+ * a page table, are left unpopulated. MMIO in such regions is populated on first access
+ * by EPT_populate, which is why the memory type map is kept in the context.
+ * 
+ * @param mappingData Mappings data owning the split pool.
+ * @param eptp Pointer where Extended Page Table Pointer bits are stored.
+ * 
+ * @return STATUS_SUCCESS on success, error code otherwise.
+ */
+static NTSTATUS setupHierarchy(Context_EptMappingsData* const mappingData, UINT64* const eptp)
+{
+  Context_Context* const context = Context_getContext();
+  if (context->memoryTypeMap == NULL)
+  {
+    context->memoryTypeMap = Memory_allocate(sizeof(MTRR_Map), FALSE);
+    if (context->memoryTypeMap == NULL)
+    {
+      return STATUS_UNSUCCESSFUL;
+    }
+  }
+
+  const UINT64 pml4Count = getPml4Count();
+  NTSTATUS ntStatus = MTRR_buildMap(pml4Count * EPT_PML4E_MAPPED_SIZE, context->memoryTypeMap);
+  if (!NT_SUCCESS(ntStatus))
+  {
+    return ntStatus;
+  }
+
+  PHYSICAL_MEMORY_RANGE* const ranges = MmGetPhysicalMemoryRanges();
+  if (ranges == NULL)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  EPT_Pml4E* const pml4 = allocateUpperTable(mappingData);
+  if (pml4 == NULL)
+  {
+    ExFreePool(ranges);
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  for (UINT64 pml4Index = 0; pml4Index < pml4Count; pml4Index++)
+  {
+    ntStatus =
+      setupPml4Entry(mappingData, context->memoryTypeMap, ranges, pml4Index, &pml4[pml4Index]);
+    if (!NT_SUCCESS(ntStatus))
+    {
+      destroyPml4(pml4Index, pml4);
+      ExFreePool(ranges);
+      return ntStatus;
+    }
+  }
+
+  ExFreePool(ranges);
+  *eptp = getEptp(pml4);
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Initializes PML4 entry.
+ * 
+ * This function initializes PML4 entry, allocating memory for the PDPT. Every PDPT entry
+ * covering RAM maps a 1GB page if its whole range has a single memory type and 1GB pages
+ * are supported, otherwise it references a page directory. The PDPT is allocated even if
+ * none of its entries is populated, so populating an entry never needs a new PDPT.
+ * 
+ * @param mappingData Mappings data owning the split pool.
+ * @param map Memory type map.
+ * @param ranges Physical memory ranges returned by MmGetPhysicalMemoryRanges.
+ * @param pml4EntryIndex Index of PML4 entry to initialize.
+ * @param pml4e Pointer to PML4 entry to initialize.
+ * 
+ * @return STATUS_SUCCESS on success, error code otherwise.
+ */
+static NTSTATUS setupPml4Entry(
+  Context_EptMappingsData* const mappingData,
+  const MTRR_Map* const map,
+  const PHYSICAL_MEMORY_RANGE* const ranges,
+  const UINT64 pml4EntryIndex,
+  EPT_Pml4E* const pml4e)
+{
+  EPT_PdptE* const pdpt = allocateUpperTable(mappingData);
+  if (pdpt == NULL)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  for (UINT64 pdptEntryIndex = 0; pdptEntryIndex < EPT_PDPT_ENTRIES; pdptEntryIndex++)
+  {
+    const EPT_Address address = (EPT_Address)
+    {
+      .pml4Entry = pml4EntryIndex, .pdptEntry = pdptEntryIndex
+    };
+
+    const NTSTATUS ntStatus =
+      setupPdptEntry(mappingData, map, ranges, address.address, &pdpt[pdptEntryIndex]);
+    if (!NT_SUCCESS(ntStatus))
+    {
+      freeUpperTable(pdpt);
+      return ntStatus;
+    }
+  }
+
+  *pml4e = (EPT_Pml4E)
+  {
+    .readAccess = TRUE,
+    .writeAccess = TRUE,
+    .fetchAccess = TRUE,
+    .pageFrameNumber = (EPT_Address) {.address = Memory_getPhysicalAddress(pdpt) }.pageFrameNumber4KB
+  };
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Initializes PDPT entry.
+ * 
+ * Leaves the entry unpopulated if the 1GB range contains no RAM. Otherwise maps the range
+ * with a single large page if possible, or takes a page directory from the split pool,
+ * with 2MB pages wherever the memory type does not change within the page. The remaining
+ * 2MB regions get a page table if they contain RAM, and are left unpopulated otherwise.
+ * 
+ * @param mappingData Mappings data owning the split pool.
+ * @param map Memory type map.
+ * @param ranges Physical memory ranges returned by MmGetPhysicalMemoryRanges.
+ * @param address Guest physical address of the range mapped by the entry.
+ * @param pdpte Pointer to PDPT entry to initialize.
+ * 
+ * @return STATUS_SUCCESS on success, error code otherwise.
+ */
+static NTSTATUS setupPdptEntry(
+  Context_EptMappingsData* const mappingData,
+  const MTRR_Map* const map,
+  const PHYSICAL_MEMORY_RANGE* const ranges,
+  const UINT64 address,
+  EPT_PdptE* const pdpte)
+{
+  if (!containsRam(ranges, address, EPT_PAGE_SIZE_1GB))
+  {
+    pdpte->bits = EPT_UNPOPULATED_ENTRY;
+    return STATUS_SUCCESS;
+  }
+
+  const UINT64 memoryType = MTRR_getMemoryType(map, address, EPT_PAGE_SIZE_1GB);
+  if (memoryType != MTRR_MEMORY_TYPE_MIXED && Context_getContext()->isEpt1GBPageSupported)
+  {
+    pdpte->largePage = (EPT_PdptE1GB)
+    {
+      .readAccess = TRUE,
+      .writeAccess = TRUE,
+      .fetchAccess = TRUE,
+      .isLargePage = TRUE,
+      .memoryType = memoryType,
+      .pageFrameNumber = (EPT_Address){ .address = address }.pageFrameNumber1GB
+    };
+    return STATUS_SUCCESS;
+  }
+
+  EPT_PdE* const pd = allocateTable(mappingData);
+  if (pd == NULL)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  for (UINT64 pdEntryIndex = 0; pdEntryIndex < EPT_PD_ENTRIES; pdEntryIndex++)
+  {
+    const UINT64 pdeAddress = address + pdEntryIndex * EPT_PAGE_SIZE_2MB;
+    const UINT64 pdeMemoryType = MTRR_getMemoryType(map, pdeAddress, EPT_PAGE_SIZE_2MB);
+    if (pdeMemoryType == MTRR_MEMORY_TYPE_MIXED)
+    {
+      if (!containsRam(ranges, pdeAddress, EPT_PAGE_SIZE_2MB))
+      {
+        pd[pdEntryIndex].bits = EPT_UNPOPULATED_ENTRY;
+        continue;
+      }
+
+      const NTSTATUS ntStatus = setupPdEntry(mappingData, map, pdeAddress, &pd[pdEntryIndex]);
+      if (!NT_SUCCESS(ntStatus))
+      {
+        return ntStatus;
+      }
+      continue;
+    }
+
+    pd[pdEntryIndex].largePage = (EPT_PdE2MB)
+    {
+      .readAccess = TRUE,
+      .writeAccess = TRUE,
+      .fetchAccess = TRUE,
+      .isLargePage = TRUE,
+      .memoryType = pdeMemoryType,
+      .pageFrameNumber = (EPT_Address){ .address = pdeAddress }.pageFrameNumber2MB
+    };
+  }
+
+  *pdpte = (EPT_PdptE)
+  {
+    .readAccess = TRUE,
+    .writeAccess = TRUE,
+    .fetchAccess = TRUE,
+    .pageFrameNumber = (EPT_Address) {.address = Memory_getPhysicalAddress(pd) }.pageFrameNumber4KB
+  };
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Initializes PD entry with a page table.
+ * 
+ * The page table is taken from the split pool and maps every 4KB page with its own
+ * memory type.
+ * 
+ * @param mappingData Mappings data owning the split pool.
+ * @param map Memory type map.
+ * @param address Guest physical address of the range mapped by the entry.
+ * @param pde Pointer to PD entry to initialize.
+ * 
+ * @return STATUS_SUCCESS on success, error code otherwise.
+ */
+static NTSTATUS setupPdEntry(
+  Context_EptMappingsData* const mappingData,
+  const MTRR_Map* const map,
+  const UINT64 address,
+  EPT_PdE* const pde)
+{
+  EPT_PtE* const pt = allocateTable(mappingData);
+  if (pt == NULL)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  const NTSTATUS ntStatus = initPageTable(map, address, pt);
+  if (!NT_SUCCESS(ntStatus))
+  {
+    return ntStatus;
+  }
+
+  *pde = (EPT_PdE)
+  {
+    .standard =
+    {
+      .readAccess = TRUE,
+      .writeAccess = TRUE,
+      .fetchAccess = TRUE,
+      .pageFrameNumber = (EPT_Address)
+      {.address = Memory_getPhysicalAddress(pt) }.pageFrameNumber4KB
+    }
+  };
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Maps a 2MB region one to one by 4KB pages.
+ * 
+ * Every page gets its own memory type.
+ * 
+ * @param map Memory type map.
+ * @param address Guest physical address of the region.
+ * @param pt Page table to initialize.
+ * 
+ * @return STATUS_SUCCESS on success, error code otherwise.
+ */
+static NTSTATUS initPageTable(const MTRR_Map* const map, const UINT64 address, EPT_PtE* const pt)
+{
+  for (UINT64 ptEntryIndex = 0; ptEntryIndex < EPT_PT_ENTRIES; ptEntryIndex++)
+  {
+    const UINT64 pteAddress = address + ptEntryIndex * PAGE_SIZE;
+    const UINT64 memoryType = MTRR_getMemoryType(map, pteAddress, PAGE_SIZE);
+    if (memoryType == MTRR_MEMORY_TYPE_MIXED)
+    {
+      return STATUS_UNSUCCESSFUL;
+    }
+
+    pt[ptEntryIndex] = (EPT_PtE)
+    {
+      .readAccess = TRUE,
+      .writeAccess = TRUE,
+      .fetchAccess = TRUE,
+      .memoryType = memoryType,
+      .pageFrameNumber = (EPT_Address){ .address = pteAddress }.pageFrameNumber4KB
+    };
+  }
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Checks if a region overlaps physical memory.
+ * 
+ * @param ranges Physical memory ranges returned by MmGetPhysicalMemoryRanges, terminated
+ * by an empty range.
+ * @param address First address of the region.
+ * @param size Size of the region.
+ * 
+ * @return TRUE if any range overlaps the region, FALSE otherwise.
+ */
+static BOOLEAN containsRam(
+  const PHYSICAL_MEMORY_RANGE* const ranges,
+  const UINT64 address,
+  const UINT64 size)
+{
+  for (const PHYSICAL_MEMORY_RANGE* range = ranges; range->NumberOfBytes.QuadPart != 0; range++)
+  {
+    const UINT64 rangeBase = (UINT64)range->BaseAddress.QuadPart;
+    const UINT64 rangeEnd = rangeBase + (UINT64)range->NumberOfBytes.QuadPart;
+    if (rangeBase < address + size && address < rangeEnd)
+    {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+
+/**
+ * @brief Takes a page for a page directory or a page table from the split pool.
+ * 
+ * Refills the pool if it is empty, so it must be called at PASSIVE_LEVEL.
+ * 
+ * @param mappingData Mappings data owning the split pool.
+ * 
+ * @return Page, not zeroed, or NULL if the pool could not be refilled.
+ */
+static VOID* allocateTable(Context_EptMappingsData* const mappingData)
+{
+  VOID* const table = PAGE_POOL_pop(&mappingData->splitPool);
+  if (table != NULL)
+  {
+    return table;
+  }
+
+  const NTSTATUS ntStatus =
+    PAGE_POOL_reserve(&mappingData->splitPool, mappingData->splitPool.noOfPagesPerChunk);
+  return NT_SUCCESS(ntStatus) ? PAGE_POOL_pop(&mappingData->splitPool) : NULL;
+}
+
+
+/**
+ * @brief Allocates a zeroed page for a PML4 or a PDPT and registers it in the PFN table.
+ * 
+ * Must be called at PASSIVE_LEVEL.
+ * 
+ * @param mappingData Mappings data whose NUMA node the page is allocated on.
+ * 
+ * @return Page or NULL if it could not be allocated or registered.
+ */
+static VOID* allocateUpperTable(const Context_EptMappingsData* const mappingData)
+{
+  VOID* const table = Memory_allocateOnNode(PAGE_SIZE, TRUE, mappingData->numaNode);
+  if (table == NULL)
+  {
+    return NULL;
+  }
+
+  if (!NT_SUCCESS(PFN_TABLE_insert(table, PAGE_SIZE)))
+  {
+    Memory_free(table);
+    return NULL;
+  }
+
+  return table;
+}
+
+
+/**
+ * @brief Unregisters and frees a page allocated with allocateUpperTable.
+ * 
+ * @param table Page to free.
+ * 
+ * @return VOID
+ */
+static VOID freeUpperTable(VOID* const table)
+{
+  PFN_TABLE_remove(table, PAGE_SIZE);
+  Memory_free(table);
+}
+
+
+/**
+ * @brief Returns virtual address of an EPT table referenced by an entry.
+ * 
+ * Every table is registered in the PFN table, so the lookup is safe in VMX root mode.
+ * 
+ * @param pageFrameNumber 4KB page frame number stored in the entry.
+ * 
+ * @return Virtual address of the table.
+ */
+static VOID* getTable(const UINT64 pageFrameNumber)
+{
+  return PFN_TABLE_getVirtualAddress(
+    (EPT_Address){ .pageFrameNumber4KB = pageFrameNumber }.address);
+}
+
+
+/**
+ * @brief Fills the split and populate pools of a new hierarchy with their reserves.
+ * 
+ * @param mappingData Mappings data owning the pools.
+ * 
+ * @return STATUS_SUCCESS on success, error code otherwise.
+ */
+static NTSTATUS reservePools(Context_EptMappingsData* const mappingData)
+{
+  const NTSTATUS ntStatus =
+    PAGE_POOL_reserve(&mappingData->splitPool, CONTEXT_EPT_SPLIT_RESERVE);
+  if (!NT_SUCCESS(ntStatus))
+  {
+    return ntStatus;
+  }
+
+  return PAGE_POOL_reserve(&mappingData->populatePool, CONTEXT_EPT_POPULATE_RESERVE);
+}
+
+
+/**
+ * @brief Takes a table for populating a region on first access.
+ * 
+ * The populate pool is used first, and the split pool once it is empty. If the populate pool
+ * drops below its reserve, it is flagged for a refill at PASSIVE_LEVEL. Never allocates, so
+ * it can be called in root mode.
+ * 
+ * @param mappingData Mappings data owning the pools.
+ * @param pool Receives the pool the table was taken from.
+ * 
+ * @return Page, not zeroed, or NULL if both pools are empty.
+ */
+static VOID* takePopulateTable(
+  Context_EptMappingsData* const mappingData,
+  Context_EptPagePool** const pool)
+{
+  VOID* table = PAGE_POOL_pop(&mappingData->populatePool);
+  if (QueryDepthSList(&mappingData->populatePool.freePages) < CONTEXT_EPT_POPULATE_RESERVE)
+  {
+    InterlockedExchange(&mappingData->isPopulateRefillNeeded, TRUE);
+  }
+
+  *pool = &mappingData->populatePool;
+  if (table == NULL)
+  {
+    table = PAGE_POOL_pop(&mappingData->splitPool);
+    *pool = &mappingData->splitPool;
+  }
+
+  return table;
+}
+
+
+/**
+ * @brief Populates an unpopulated PDPT entry.
+ * 
+ * Maps the 1GB region with a single large page if possible. Otherwise a page directory
+ * is taken by takePopulateTable, with 2MB pages wherever the memory type does not change
+ * within the page, and the other PD entries unpopulated. The entry is replaced with
+ * a single 64-bit write.
+ * 
+ * @param mappingData Mappings data owning the pools.
+ * @param address Guest physical address within the region.
+ * @param pdpte Pointer to PDPT entry to populate.
+ * 
+ * @return STATUS_SUCCESS on success, error code otherwise.
+ */
+static NTSTATUS populatePdpte(
+  Context_EptMappingsData* const mappingData,
+  const UINT64 address,
+  EPT_PdptE* const pdpte)
+{
+  const MTRR_Map* const map = Context_getContext()->memoryTypeMap;
+  const UINT64 regionAddress = address & ~(EPT_PAGE_SIZE_1GB - 1);
+  const UINT64 memoryType = MTRR_getMemoryType(map, regionAddress, EPT_PAGE_SIZE_1GB);
+  if (memoryType != MTRR_MEMORY_TYPE_MIXED && Context_getContext()->isEpt1GBPageSupported)
+  {
+    const EPT_PdptE largePdpte = (EPT_PdptE)
+    {
+      .largePage =
+      {
+        .readAccess = TRUE,
+        .writeAccess = TRUE,
+        .fetchAccess = TRUE,
+        .isLargePage = TRUE,
+        .memoryType = memoryType,
+        .pageFrameNumber = (EPT_Address){ .address = regionAddress }.pageFrameNumber1GB
+      }
+    };
+    InterlockedExchange64((volatile LONG64*)&pdpte->bits, (LONG64)largePdpte.bits);
+    return STATUS_SUCCESS;
+  }
+
+  Context_EptPagePool* pool = NULL;
+  EPT_PdE* const pd = takePopulateTable(mappingData, &pool);
+  if (pd == NULL)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  for (UINT64 pdEntryIndex = 0; pdEntryIndex < EPT_PD_ENTRIES; pdEntryIndex++)
+  {
+    const UINT64 pdeAddress = regionAddress + pdEntryIndex * EPT_PAGE_SIZE_2MB;
+    const UINT64 pdeMemoryType = MTRR_getMemoryType(map, pdeAddress, EPT_PAGE_SIZE_2MB);
+    if (pdeMemoryType == MTRR_MEMORY_TYPE_MIXED)
+    {
+      pd[pdEntryIndex].bits = EPT_UNPOPULATED_ENTRY;
+      continue;
+    }
+
+    pd[pdEntryIndex].largePage = (EPT_PdE2MB)
+    {
+      .readAccess = TRUE,
+      .writeAccess = TRUE,
+      .fetchAccess = TRUE,
+      .isLargePage = TRUE,
+      .memoryType = pdeMemoryType,
+      .pageFrameNumber = (EPT_Address){ .address = pdeAddress }.pageFrameNumber2MB
+    };
+  }
+
+  const EPT_PdptE newPdpte = (EPT_PdptE)
+  {
+    .readAccess = TRUE,
+    .writeAccess = TRUE,
+    .fetchAccess = TRUE,
+    .pageFrameNumber = (EPT_Address) {.address = Memory_getPhysicalAddress(pd) }.pageFrameNumber4KB
+  };
+  InterlockedExchange64((volatile LONG64*)&pdpte->bits, (LONG64)newPdpte.bits);
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Populates an unpopulated PD entry with a page table.
+ * 
+ * The page table is taken by takePopulateTable and maps every 4KB page with its own
+ * memory type. The entry is replaced with a single 64-bit write.
+ * 
+ * @param mappingData Mappings data owning the pools.
+ * @param address Guest physical address within the region.
+ * @param pde Pointer to PD entry to populate.
+ * 
+ * @return STATUS_SUCCESS on success, error code otherwise.
+ */
+static NTSTATUS populatePde(
+  Context_EptMappingsData* const mappingData,
+  const UINT64 address,
+  EPT_PdE* const pde)
+{
+  Context_EptPagePool* pool = NULL;
+  EPT_PtE* const pt = takePopulateTable(mappingData, &pool);
+  if (pt == NULL)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  const NTSTATUS ntStatus = initPageTable(
+    Context_getContext()->memoryTypeMap,
+    address & ~(EPT_PAGE_SIZE_2MB - 1),
+    pt);
+  if (!NT_SUCCESS(ntStatus))
+  {
+    PAGE_POOL_push(pool, pt);
+    return ntStatus;
+  }
+
+  const EPT_PdE newPde = (EPT_PdE)
+  {
+    .standard =
+    {
+      .readAccess = TRUE,
+      .writeAccess = TRUE,
+      .fetchAccess = TRUE,
+      .pageFrameNumber = (EPT_Address)
+      {.address = Memory_getPhysicalAddress(pt) }.pageFrameNumber4KB
+    }
+  };
+  InterlockedExchange64((volatile LONG64*)&pde->bits, (LONG64)newPde.bits);
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Creates a single EPT hierarchy as a copy of another one.
+ * 
+ * Tables are copied in bulk, only the page frame numbers of the paging structures are
+ * fixed up to reference the new copies. Page directories and page tables are taken from
+ * the mappings data's split pool. No MTRRs are read.
+ * 
+ * @param mappingData Mappings data owning the split pool.
+ * @param templateEptp Extended Page Table Pointer bits of the hierarchy to copy.
+ * @param eptp Pointer where Extended Page Table Pointer bits are stored.
+ * 
+ * @return STATUS_SUCCESS on success, error code otherwise.
+ */
+static NTSTATUS cloneHierarchy(
+  Context_EptMappingsData* const mappingData,
+  const UINT64 templateEptp,
+  UINT64* const eptp)
+{
+  const EPT_Pml4E* const templatePml4 =
+    getTable(((EPT_EptP){ .bits = templateEptp }).pageFrameNumber);
+
+  EPT_Pml4E* const pml4 = allocateUpperTable(mappingData);
+  if (pml4 == NULL)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  const UINT64 pml4Count = getPml4Count();
+  for (UINT64 pml4Index = 0; pml4Index < pml4Count; pml4Index++)
+  {
+    const NTSTATUS ntStatus =
+      clonePml4Entry(mappingData, &templatePml4[pml4Index], &pml4[pml4Index]);
+    if (!NT_SUCCESS(ntStatus))
+    {
+      destroyPml4(pml4Index, pml4);
+      return ntStatus;
+    }
+  }
+
+  *eptp = getEptp(pml4);
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Initializes PML4 entry as a copy of another one.
+ * 
+ * Allocates the PDPT the same way setupPml4Entry does, and copies the template's entries
+ * together with the tables they reference.
+ * 
+ * @param mappingData Mappings data owning the split pool.
+ * @param templatePml4e Pointer to PML4 entry to copy.
+ * @param pml4e Pointer to PML4 entry to initialize.
+ * 
+ * @return STATUS_SUCCESS on success, error code otherwise.
+ */
+static NTSTATUS clonePml4Entry(
+  Context_EptMappingsData* const mappingData,
+  const EPT_Pml4E* const templatePml4e,
+  EPT_Pml4E* const pml4e)
+{
+  const EPT_PdptE* const templatePdpt = getTable(templatePml4e->pageFrameNumber);
+
+  EPT_PdptE* const pdpt = allocateUpperTable(mappingData);
+  if (pdpt == NULL)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
 
-  *eptpBits = (EPT_EptP)
+  for (UINT64 pdptEntryIndex = 0; pdptEntryIndex < EPT_PDPT_ENTRIES; pdptEntryIndex++)
   {
-    .memoryType = EPT_PAGING_STRUCTURE_MEMORY_TYPE_WB,
-    .oneLessPageWalkLen = EPT_PAGE_WALK_LEN - 1,
-    .pageFrameNumber = (EPT_Address) {.address = Memory_getPhysicalAddress(pml4) }.pageFrameNumber4KB
-  }.bits;
+    const NTSTATUS ntStatus =
+      clonePdptEntry(mappingData, &templatePdpt[pdptEntryIndex], &pdpt[pdptEntryIndex]);
+    if (!NT_SUCCESS(ntStatus))
+    {
+      freeUpperTable(pdpt);
+      return ntStatus;
+    }
+  }
+
+  *pml4e = *templatePml4e;
+  pml4e->pageFrameNumber =
+    (EPT_Address){ .address = Memory_getPhysicalAddress(pdpt) }.pageFrameNumber4KB;
 
   return STATUS_SUCCESS;
 }
 
 
 /**
- * @brief Changes mapping of a given address.
+ * @brief Initializes PDPT entry as a copy of another one.
  * 
- * Changes mapping of a given source address to a given target address. It also
- * sets read/write and fetch permissions.
+ * A 1GB page or an unpopulated entry is copied as is. Otherwise the page directory is
+ * copied in bulk, and so is every page table it references.
  * 
- * @param sourceAddress Source address.
- * @param targetAddress Target address.
- * @param rw Read/write permissions.
- * @param fetch Fetch permissions.
+ * @param mappingData Mappings data owning the split pool.
+ * @param templatePdpte Pointer to PDPT entry to copy.
+ * @param pdpte Pointer to PDPT entry to initialize.
  * 
  * @return STATUS_SUCCESS on success, error code otherwise.
  */
-NTSTATUS EPT_changeMapping(
-  const UINT64 sourceAddress,
-  const UINT64 targetAddress,
-  const BOOLEAN rw,
-  const BOOLEAN fetch)
+static NTSTATUS clonePdptEntry(
+  Context_EptMappingsData* const mappingData,
+  const EPT_PdptE* const templatePdpte,
+  EPT_PdptE* const pdpte)
 {
-  const EPT_EptP eptp = (EPT_EptP){ .bits = Context_getLogicalCore()->eptp };
+  *pdpte = *templatePdpte;
+  if (templatePdpte->largePage.isLargePage || templatePdpte->bits == EPT_UNPOPULATED_ENTRY)
+  {
+    return STATUS_SUCCESS;
+  }
 
-  const EPT_Address eptAddress = { .address = sourceAddress };
+  EPT_PdE* const pd = allocateTable(mappingData);
+  if (pd == NULL)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
 
-  const EPT_Pml4E* const pml4 = Memory_getVirtualAddress((EPT_Address) {
-    .pageFrameNumber4KB = eptp.pageFrameNumber
-  }.address);
-  const EPT_PdptE* const pdpt = Memory_getVirtualAddress((EPT_Address) {
-    .pageFrameNumber4KB = pml4[eptAddress.pml4Entry].pageFrameNumber
-  }.address);
-  EPT_PdE* const pd = Memory_getVirtualAddress((EPT_Address) {
-    .pageFrameNumber4KB = pdpt[eptAddress.pdptEntry].pageFrameNumber
-  }.address);
-  EPT_PdE* const pde = &pd[eptAddress.pdEntry];
+  Memory_copy(pd, getTable(templatePdpte->pageFrameNumber), sizeof(EPT_PdE[EPT_PD_ENTRIES]));
 
-  if (pde->largePage.isLargePage)
+  for (UINT64 pdEntryIndex = 0; pdEntryIndex < EPT_PD_ENTRIES; pdEntryIndex++)
   {
-    NTSTATUS ntStatus = splitPage(pde);
-    if (!NT_SUCCESS(ntStatus))
+    if (pd[pdEntryIndex].largePage.isLargePage || pd[pdEntryIndex].bits == EPT_UNPOPULATED_ENTRY)
     {
-      return ntStatus;
+      continue;
+    }
+
+    EPT_PtE* const pt = allocateTable(mappingData);
+    if (pt == NULL)
+    {
+      return STATUS_UNSUCCESSFUL;
     }
-  }
 
-  EPT_PtE* const pt = Memory_getVirtualAddress((EPT_Address) {
-    .pageFrameNumber4KB = pde->standard.pageFrameNumber
-  }.address);
+    Memory_copy(
+      pt, getTable(pd[pdEntryIndex].standard.pageFrameNumber), sizeof(EPT_PtE[EPT_PT_ENTRIES]));
+    pd[pdEntryIndex].standard.pageFrameNumber =
+      (EPT_Address){ .address = Memory_getPhysicalAddress(pt) }.pageFrameNumber4KB;
+  }
 
-  pt[eptAddress.ptEntry].pageFrameNumber = (EPT_Address){
-    .address = targetAddress
-  }.pageFrameNumber4KB;
-  pt[eptAddress.ptEntry].readAccess = rw;
-  pt[eptAddress.ptEntry].writeAccess = rw;
-  pt[eptAddress.ptEntry].fetchAccess = fetch;
+  pdpte->pageFrameNumber =
+    (EPT_Address){ .address = Memory_getPhysicalAddress(pd) }.pageFrameNumber4KB;
 
   return STATUS_SUCCESS;
 }
 
 
 /**
- * @brief Frees EPT structures.
+ * @brief Returns Extended Page Table Pointer of a hierarchy.
  * 
- * Frees memory allocated for EPT structures allocated with EPT_setupDefaltStructures.
- * This function is designed for external use.
+ * Accessed and dirty flags are enabled if supported.
  * 
- * @param eptpBits Extended Page Table Pointer bits.
+ * @param pml4 Pointer to PML4 of the hierarchy.
  * 
- * @return VOID
+ * @return Extended Page Table Pointer bits.
  */
-VOID EPT_destroyEPTStructure(const UINT64 eptpBits)
+static UINT64 getEptp(EPT_Pml4E* const pml4)
 {
-  const EPT_EptP eptp = (EPT_EptP){ .bits = eptpBits };
-  EPT_Pml4E* const pml4 = Memory_getVirtualAddress((EPT_Address) {
-    .pageFrameNumber4KB = eptp.pageFrameNumber
-  }.address);
-  const UINT64 pml4Count = getPml4Count();
-  destroyPml4(pml4Count, pml4);
+  return (EPT_EptP)
+  {
+    .memoryType = EPT_PAGING_STRUCTURE_MEMORY_TYPE_WB,
+    .oneLessPageWalkLen = EPT_PAGE_WALK_LEN - 1,
+    .accessedDirtyEnable = Context_getContext()->isEptAccessDirtySupported,
+    .pageFrameNumber = (EPT_Address) {.address = Memory_getPhysicalAddress(pml4) }.pageFrameNumber4KB
+  }.bits;
 }
 
 
-/**************************************************************************************************
-* Local function definitions
-**************************************************************************************************/
 /**
- * @brief Returns number of PML4 entries.
+ * @brief Returns EPTP of a view.
  * 
- * Calculates required number of PML4 entries based on CPUID information.
+ * @param mappingData Mappings data of the EPT hierarchy.
+ * @param view EPT_VIEW_READ or EPT_VIEW_FETCH.
  * 
- * @return Number of PML4 entries.
+ * @return Extended Page Table Pointer bits.
  */
-static UINT64 getPml4Count(VOID)
+static UINT64 getViewEptp(const Context_EptMappingsData* const mappingData, const UINT64 view)
 {
-  IA32_CpuidAddressBits cpuid = { 0 };
-  __cpuid(cpuid.registers, IA32_CPUID_ADDRESS_BITS);
+  return view == EPT_VIEW_FETCH ? mappingData->fetchEptp : mappingData->eptp;
+}
 
-  // Memory range mapped by 1 PML4 entry = 512 GB (2^39)
-  const UINT64 shiftValue = max(cpuid.physicalAddressBits - 39, 0);
-  const UINT64 pml4Count = min((1U << shiftValue), EPT_WINDOWS_MAX_PML4_COUNT);
 
-  return pml4Count;
+/**
+ * @brief Returns PDPTE mapping a given address.
+ * 
+ * @param mappingData Mappings data of the EPT hierarchy.
+ * @param view View to search.
+ * @param address Guest physical address.
+ * 
+ * @return Pointer to Page Directory Pointer Table Entry.
+ */
+static EPT_PdptE* getPdpte(
+  const Context_EptMappingsData* const mappingData,
+  const UINT64 view,
+  const UINT64 address)
+{
+  const EPT_EptP eptp = (EPT_EptP){ .bits = getViewEptp(mappingData, view) };
+  const EPT_Address eptAddress = { .address = address };
+
+  const EPT_Pml4E* const pml4 = getTable(eptp.pageFrameNumber);
+  EPT_PdptE* const pdpt = getTable(pml4[eptAddress.pml4Entry].pageFrameNumber);
+
+  return &pdpt[eptAddress.pdptEntry];
 }
 
 
 /**
- * @brief Initializes PML4 entry.
+ * @brief Returns PDE mapping a given address.
  * 
- * This function initializes PML4 entry, allocating memory for PDPT and PD structures.
- * The memory type is set to UC.
+ * The address must not be mapped by a 1GB page.
  * 
- * @param pml4EntryIndex Index of PML4 entry to initialize.
- * @param pml4e Pointer to PML4 entry to initialize.
+ * @param mappingData Mappings data of the EPT hierarchy.
+ * @param view View to search.
+ * @param address Guest physical address.
  * 
- * @return STATUS_SUCCESS on success, error code otherwise.
+ * @return Pointer to Page Directory Entry.
  */
-static NTSTATUS setupPml4Entry(const UINT64 pml4EntryIndex, EPT_Pml4E* const pml4e)
+static EPT_PdE* getPde(
+  const Context_EptMappingsData* const mappingData,
+  const UINT64 view,
+  const UINT64 address)
 {
-  EPT_PdptE* const pdpt = Memory_allocate(sizeof(EPT_PdptE[EPT_PDPT_ENTRIES]), TRUE);
-  if (pdpt == NULL)
-  {
-    return STATUS_UNSUCCESSFUL;
-  }
+  const EPT_Address eptAddress = { .address = address };
+  EPT_PdE* const pd = getTable(getPdpte(mappingData, view, address)->pageFrameNumber);
 
-  *pml4e = (EPT_Pml4E)
-  {
-    .readAccess = TRUE,
-    .writeAccess = TRUE,
-    .fetchAccess = TRUE,
-    .pageFrameNumber = (EPT_Address) {.address = Memory_getPhysicalAddress(pdpt) }.pageFrameNumber4KB
-  };
+  return &pd[eptAddress.pdEntry];
+}
 
-  // Allocate 512 Page Directories at once
-  EPT_PdE* const pdArray = Memory_allocate(EPT_PDPT_ENTRIES * sizeof(EPT_PdE[EPT_PD_ENTRIES]), TRUE);
-  if (pdArray == NULL)
-  {
-    Memory_free(pdpt);
-    return STATUS_UNSUCCESSFUL;
-  }
 
-  for (UINT64 pdptEntryIndex = 0; pdptEntryIndex < EPT_PDPT_ENTRIES; pdptEntryIndex++)
+/**
+ * @brief Returns PDE referencing a page table that maps a given address.
+ * 
+ * @param mappingData Mappings data of the EPT hierarchy.
+ * @param view View to search.
+ * @param address Guest physical address.
+ * 
+ * @return Pointer to Page Directory Entry, or NULL if the address is mapped by a large page
+ * or not populated.
+ */
+static EPT_PdE* getSplitPde(
+  const Context_EptMappingsData* const mappingData,
+  const UINT64 view,
+  const UINT64 address)
+{
+  const EPT_PdptE* const pdpte = getPdpte(mappingData, view, address);
+  if (pdpte->largePage.isLargePage || pdpte->bits == EPT_UNPOPULATED_ENTRY)
   {
-    EPT_PdE* const pd = &pdArray[pdptEntryIndex * EPT_PD_ENTRIES];
-    pdpt[pdptEntryIndex] = (EPT_PdptE)
-    {
-      .readAccess = TRUE,
-      .writeAccess = TRUE,
-      .fetchAccess = TRUE,
-      .pageFrameNumber = (EPT_Address)
-        {.address = Memory_getPhysicalAddress(pd) }.pageFrameNumber4KB
-    };
-
-    for (UINT64 pdEntryIndex = 0; pdEntryIndex < EPT_PD_ENTRIES; pdEntryIndex++)
-    {
-      const EPT_Address address = (EPT_Address)
-      {
-          .pml4Entry = pml4EntryIndex, .pdptEntry = pdptEntryIndex, .pdEntry = pdEntryIndex
-      };
-
-      pd[pdEntryIndex].largePage = (EPT_PdE2MB)
-      {
-        .readAccess = TRUE,
-        .writeAccess = TRUE,
-        .fetchAccess = TRUE,
-        .isLargePage = TRUE,
-        .memoryType = IA32_MTRR_DISABLED_DEFAULT_TYPE,
-        .pageFrameNumber = address.pageFrameNumber2MB
-      };
-    }
+    return NULL;
   }
 
-  return STATUS_SUCCESS;
+  EPT_PdE* const pde = getPde(mappingData, view, address);
+  return (pde->largePage.isLargePage || pde->bits == EPT_UNPOPULATED_ENTRY) ? NULL : pde;
 }
 
 
 /**
- * @brief Fills variable MTRRs cache.
+ * @brief Returns end of the part of a range that lies in the same 2MB region as a given address.
  * 
- * This function caches MTRR information in a local array.
+ * @param address First address of the range.
+ * @param size Size of the range.
+ * @param current Address within the range.
  * 
- * @param noOfVariableRangeRegisters Number of variable range registers.
- * @param variableMtrrs Array where MTRR information will be stored.
- * 
- * @return VOID
+ * @return First address after the part.
  */
-static VOID fillVariableMtrrsCache(
-  const UINT64 noOfVariableRangeRegisters,
-  EPT_VariableMtrr* const variableMtrrs)
+static UINT64 getRegionEnd(const UINT64 address, const UINT64 size, const UINT64 current)
 {
-  for (UINT32 mtrrIndex = 0; mtrrIndex < noOfVariableRangeRegisters; mtrrIndex++)
-  {
-    const IA32_MtrrPhysbase physbase =
-    { .bits = __readmsr(IA32_MTRR_PHYSBASE0 + IA32_MTRR_PHYSBASE0_INC * mtrrIndex) };
-    const IA32_MtrrPhysmask physmask =
-    { .bits = __readmsr(IA32_MTRR_PHYSMASK0 + IA32_MTRR_PHYSMASK0_INC * mtrrIndex) };
+  const UINT64 nextRegion = (current & ~(EPT_PAGE_SIZE_2MB - 1)) + EPT_PAGE_SIZE_2MB;
+  return min(nextRegion, address + size);
+}
 
-    if (!physmask.valid)
-    {
-      continue;
-    }
 
-    ULONG firstOneIndex = { 0 };
-    BOOLEAN isNonzero = _BitScanForward64(&firstOneIndex, (EPT_Address)
-    {
-      .pageFrameNumber4KB = physmask.physMask
-    }.address);
+/**
+ * @brief Checks if the rest of a range can be mapped by a large page.
+ * 
+ * @param sourceAddress Source address of the chunk.
+ * @param targetAddress Target address of the chunk.
+ * @param remainingSize Remaining size of the range.
+ * @param pageSize EPT_PAGE_SIZE_2MB or EPT_PAGE_SIZE_1GB.
+ * 
+ * @return TRUE if both addresses are aligned to the page size and the page fits
+ * in the range, FALSE otherwise.
+ */
+static BOOLEAN isChunkAligned(
+  const UINT64 sourceAddress,
+  const UINT64 targetAddress,
+  const UINT64 remainingSize,
+  const UINT64 pageSize)
+{
+  return ((sourceAddress | targetAddress) & (pageSize - 1)) == 0 && remainingSize >= pageSize;
+}
 
-    if (!isNonzero)
-    {
-      continue;
-    }
 
-    variableMtrrs[mtrrIndex] = (EPT_VariableMtrr)
-    {
-      .baseAddress = (EPT_Address) {.pageFrameNumber4KB = physbase.physBase }.address,
-      .length = 1LLU << firstOneIndex,
-      .memoryType = physbase.memoryType,
-      .valid = TRUE,
-    };
-  }
+/**
+ * @brief Returns number of aligned regions a range touches.
+ * 
+ * @param address First address of the range.
+ * @param size Size of the range, nonzero.
+ * @param regionSize Size of a region, power of 2.
+ * 
+ * @return Number of regions.
+ */
+static UINT64 getNoOfRegions(const UINT64 address, const UINT64 size, const UINT64 regionSize)
+{
+  const UINT64 firstRegion = address / regionSize;
+  const UINT64 lastRegion = (address + size - 1) / regionSize;
+  return lastRegion - firstRegion + 1;
 }
 
 
 /**
- * @brief Adjusts PML4 with variable MTRRs.
+ * @brief Collects accessed and dirty flags of the part of a range mapped by a single entry.
  * 
- * This function adjusts memory type of PML4 entry with variable MTRR values.
+ * Walks down to the entry mapping the current address. Unpopulated entries and large pages
+ * are handled as a whole, page tables entry by entry up to the end of their 2MB region.
+ * Without bitmaps, only dirty flags are cleared.
  * 
- * @param noOfVariableRangeRegisters Number of variable range registers.
- * @param variableMtrrs Array with MTRR information.
- * @param defaultMemoryType Default memory type.
- * @param pml4e Pointer to PML4 entry to adjust.
+ * @param mappingData Mappings data of the EPT hierarchy.
+ * @param view View to scan.
+ * @param address First address of the range.
+ * @param size Size of the range.
+ * @param current Address within the range.
+ * @param accessedPages Bitmap receiving accessed pages of the range, or NULL.
+ * @param dirtyPages Bitmap receiving dirty pages of the range, or NULL.
  * 
- * @return STATUS_SUCCESS on success, error code otherwise.
+ * @return First address after the scanned part.
  */
-static NTSTATUS adjustPml4WithVariableMtrrs(
-  const UINT64 noOfVariableRangeRegisters,
-  const EPT_VariableMtrr* const variableMtrrs,
-  const UINT64 defaultMemoryType,
-  EPT_Pml4E* const pml4e)
+static UINT64 harvestRegion(
+  const Context_EptMappingsData* const mappingData,
+  const UINT64 view,
+  const UINT64 address,
+  const UINT64 size,
+  const UINT64 current,
+  RTL_BITMAP* const accessedPages,
+  RTL_BITMAP* const dirtyPages)
 {
-  const EPT_PdptE* const pdpt = Memory_getVirtualAddress((EPT_Address) {
-    .pageFrameNumber4KB = pml4e->pageFrameNumber
-  }.address);
+  const UINT64 firstPageIndex = (current - address) / PAGE_SIZE;
+  EPT_PdptE* const pdpte = getPdpte(mappingData, view, current);
+  if (pdpte->largePage.isLargePage || pdpte->bits == EPT_UNPOPULATED_ENTRY)
+  {
+    const UINT64 nextRegion = (current & ~(EPT_PAGE_SIZE_1GB - 1)) + EPT_PAGE_SIZE_1GB;
+    const UINT64 regionEnd = min(nextRegion, address + size);
+    if (pdpte->largePage.isLargePage)
+    {
+      harvestEntry(
+        &pdpte->bits,
+        firstPageIndex,
+        (regionEnd - current) / PAGE_SIZE,
+        accessedPages,
+        dirtyPages);
+    }
 
-  for (UINT64 pdptEntryIndex = 0; pdptEntryIndex < EPT_PDPT_ENTRIES; pdptEntryIndex++)
+    return regionEnd;
+  }
+
+  const UINT64 regionEnd = getRegionEnd(address, size, current);
+  EPT_PdE* const pde = getPde(mappingData, view, current);
+  if (pde->bits == EPT_UNPOPULATED_ENTRY)
   {
-    EPT_PdE* const pd = Memory_getVirtualAddress((EPT_Address) {
-      .pageFrameNumber4KB = pdpt[pdptEntryIndex].pageFrameNumber
-    }.address);
+    return regionEnd;
+  }
 
-    for (UINT64 pdEntryIndex = 0; pdEntryIndex < EPT_PD_ENTRIES; pdEntryIndex++)
-    {
-      const UINT64 address = (EPT_Address){
-        .pageFrameNumber2MB = pd[pdEntryIndex].largePage.pageFrameNumber
-      }.address;
+  if (pde->largePage.isLargePage)
+  {
+    harvestEntry(
+      &pde->bits,
+      firstPageIndex,
+      (regionEnd - current) / PAGE_SIZE,
+      accessedPages,
+      dirtyPages);
+    return regionEnd;
+  }
 
-      pd[pdEntryIndex].largePage.memoryType =
-        searchVariableMtrrs(noOfVariableRangeRegisters, variableMtrrs, defaultMemoryType, address);
-      if (pd[pdEntryIndex].largePage.memoryType == IA32_MTRR_MEMORY_TYPE_ERR)
-      {
-        return STATUS_UNSUCCESSFUL;
-      }
-    }
+  EPT_PtE* const pt = getTable(pde->standard.pageFrameNumber);
+
+  const UINT64 firstPtEntryIndex = (EPT_Address){ .address = current }.ptEntry;
+  const UINT64 noOfPages = (regionEnd - current) / PAGE_SIZE;
+  for (UINT64 pageIndex = 0; pageIndex < noOfPages; pageIndex++)
+  {
+    harvestEntry(
+      &pt[firstPtEntryIndex + pageIndex].bits,
+      firstPageIndex + pageIndex,
+      1,
+      accessedPages,
+      dirtyPages);
   }
 
-  return STATUS_SUCCESS;
+  return regionEnd;
 }
 
 
 /**
- * @brief Searches MTRRs for given address' memory type.
+ * @brief Collects and clears accessed and dirty flags of a leaf entry.
  * 
- * @param noOfVariableMtrrs Number of variable MTRRs.
- * @param variableMtrrs Array with MTRR information.
- * @param defaultMemoryType Default memory type.
- * @param physicalAddress Physical address.
+ * The entry is only written if any of the flags is set, so scanning pages which were not
+ * accessed does not dirty the tables' cache lines. If no bitmaps are given, only the dirty
+ * flag is cleared and nothing is collected.
  * 
- * @return Memory type, or IA32_MTRR_MEMORY_TYPE_ERR on error.
+ * @param entry Pointer to the entry.
+ * @param firstPageIndex Index of the first page mapped by the entry within the bitmaps.
+ * @param noOfPages Number of pages of the range mapped by the entry.
+ * @param accessedPages Bitmap receiving accessed pages, or NULL.
+ * @param dirtyPages Bitmap receiving dirty pages, or NULL.
+ * 
+ * @return VOID
  */
-static UINT64 searchVariableMtrrs(
-  const UINT64 noOfVariableMtrrs,
-  const EPT_VariableMtrr variableMtrrs[],
-  const UINT64 defaultMemoryType,
-  const UINT64 physicalAddress)
+static VOID harvestEntry(
+  volatile UINT64* const entry,
+  const UINT64 firstPageIndex,
+  const UINT64 noOfPages,
+  RTL_BITMAP* const accessedPages,
+  RTL_BITMAP* const dirtyPages)
 {
-  EPT_FoundMemoryTypes foundTypes = { 0 };
-
-  for (UINT64 mtrrIndex = 0; mtrrIndex < noOfVariableMtrrs; mtrrIndex++)
+  const UINT64 flags =
+    (accessedPages != NULL) ? (EPT_ACCESSED_FLAG | EPT_DIRTY_FLAG) : EPT_DIRTY_FLAG;
+  if ((*entry & flags) == 0)
   {
-    const EPT_VariableMtrr* currentMtrr = &variableMtrrs[mtrrIndex];
-    if (!currentMtrr->valid)
-    {
-      continue;
-    }
-
-    if (!((currentMtrr->baseAddress <= physicalAddress) && (physicalAddress < (currentMtrr->baseAddress + currentMtrr->length))))
-    {
-      continue;
-    }
-
-    switch (currentMtrr->memoryType)
-    {
-    case IA32_MTRR_MEMORY_TYPE_UC:
-    {
-      foundTypes.uncacheable = 1;
-      break;
-    }
-    case IA32_MTRR_MEMORY_TYPE_WC:
-    {
-      foundTypes.writeCombining = 1;
-      break;
-    }
-    case IA32_MTRR_MEMORY_TYPE_WT:
-    {
-      foundTypes.writeThrough = 1;
-      break;
-    }
-    case IA32_MTRR_MEMORY_TYPE_WP:
-    {
-      foundTypes.writeProtected = 1;
-      break;
-    }
-    case IA32_MTRR_MEMORY_TYPE_WB:
-    {
-      foundTypes.writeback = 1;
-      break;
-    }
-    default:
-    {
-      return IA32_MTRR_MEMORY_TYPE_ERR;
-      break;
-    }
-    }
+    return;
   }
 
-  if ((foundTypes.uncacheable + foundTypes.writeCombining + foundTypes.writeThrough + foundTypes.writeProtected + foundTypes.writeback) == 1)
+  const UINT64 bits = (UINT64)InterlockedAnd64((volatile LONG64*)entry, ~(LONG64)flags);
+  if (accessedPages == NULL)
   {
-    if (foundTypes.uncacheable)
-      return IA32_MTRR_MEMORY_TYPE_UC;
-    if (foundTypes.writeCombining)
-      return IA32_MTRR_MEMORY_TYPE_WC;
-    if (foundTypes.writeThrough)
-      return IA32_MTRR_MEMORY_TYPE_WT;
-    if (foundTypes.writeProtected)
-      return IA32_MTRR_MEMORY_TYPE_WP;
-    if (foundTypes.writeback)
-      return IA32_MTRR_MEMORY_TYPE_WB;
+    return;
   }
 
-  if (foundTypes.uncacheable)
+  if ((bits & EPT_ACCESSED_FLAG) != 0)
+  {
+    RtlSetBits(accessedPages, (ULONG)firstPageIndex, (ULONG)noOfPages);
+  }
+  if ((bits & EPT_DIRTY_FLAG) != 0)
   {
-    return IA32_MTRR_MEMORY_TYPE_UC;
+    RtlSetBits(dirtyPages, (ULONG)firstPageIndex, (ULONG)noOfPages);
   }
+}
 
-  if (foundTypes.writeThrough == 1 && foundTypes.writeback == 1 && ((foundTypes.uncacheable + foundTypes.writeCombining + foundTypes.writeProtected) == 0))
+
+/**
+ * @brief Splits 1GB page into 2MB pages.
+ * 
+ * This function splits 1GB page mapped by this PDPTE into 512 2MB pages mapped by a single
+ * PD. The PD is taken from the mappings data's split pool and fully initialized before
+ * the PDPTE is replaced with a single 64-bit write. This function fails if the pool is
+ * empty, it never allocates. The PD is never coalesced back, it is kept until the hierarchy
+ * is destroyed.
+ * 
+ * @param mappingData Mappings data owning the split pool.
+ * @param pdpte Pointer to Page Directory Pointer Table Entry.
+ * 
+ * @return STATUS_SUCCESS on success, error code otherwise.
+ */
+static NTSTATUS splitLargePdpte(Context_EptMappingsData* const mappingData, EPT_PdptE* const pdpte)
+{
+  EPT_PdE* const pd = PAGE_POOL_pop(&mappingData->splitPool);
+  if (pd == NULL)
   {
-    return IA32_MTRR_MEMORY_TYPE_WT;
+    return STATUS_UNSUCCESSFUL;
   }
 
-  if ((foundTypes.uncacheable + foundTypes.writeCombining + foundTypes.writeThrough + foundTypes.writeProtected + foundTypes.writeback) != 0)
+  const UINT64 memoryType = pdpte->largePage.memoryType;
+  const UINT64 pageFrameNumber = pdpte->largePage.pageFrameNumber;
+
+  for (UINT64 pdEntryIndex = 0; pdEntryIndex < EPT_PD_ENTRIES; pdEntryIndex++)
   {
-    return IA32_MTRR_MEMORY_TYPE_ERR;
+    pd[pdEntryIndex].largePage = (EPT_PdE2MB)
+    {
+      .readAccess = TRUE,
+      .writeAccess = TRUE,
+      .fetchAccess = TRUE,
+      .isLargePage = TRUE,
+      .memoryType = memoryType,
+      .pageFrameNumber = EPT_PD_ENTRIES * pageFrameNumber + pdEntryIndex
+    };
   }
 
-  return defaultMemoryType;
+  const EPT_PdptE newPdpte = (EPT_PdptE)
+  {
+    .readAccess = TRUE,
+    .writeAccess = TRUE,
+    .fetchAccess = TRUE,
+    .pageFrameNumber = (EPT_Address) {.address = Memory_getPhysicalAddress(pd) }.pageFrameNumber4KB
+  };
+  InterlockedExchange64((volatile LONG64*)&pdpte->bits, (LONG64)newPdpte.bits);
+
+  return STATUS_SUCCESS;
 }
 
 
@@ -507,24 +2100,23 @@ static UINT64 searchVariableMtrrs(
  * @brief Splits large page into small pages.
  * 
  * This function splits large (2MB) mapped by this PDE into 512 small (4KB) pages
- * mapped by a single PT.
+ * mapped by a single PT. The PT is taken from the mappings data's split pool and fully
+ * initialized before the PDE is replaced with a single 64-bit write. This function
+ * fails if the pool is empty, it never allocates.
  * 
+ * @param mappingData Mappings data owning the split pool.
  * @param pde Pointer to Page Directory Entry.
  * 
  * @return STATUS_SUCCESS on success, error code otherwise.
  */
-static NTSTATUS splitPage(EPT_PdE* const pde)
+static NTSTATUS splitPage(Context_EptMappingsData* const mappingData, EPT_PdE* const pde)
 {
-  Context_EptMappingsData* const mappingData = &Context_getLogicalCore()->eptMappingData;
-  if (mappingData->noOfUsedSplits >= CONTEXT_EPT_NO_SPLITS)
+  EPT_PtE* const pte = PAGE_POOL_pop(&mappingData->splitPool);
+  if (pte == NULL)
   {
     return STATUS_UNSUCCESSFUL;
   }
 
-  EPT_PtE* const pte =
-    (EPT_PtE*)&mappingData->splitBuffer[CONTEXT_EPT_SPLIT_SIZE * mappingData->noOfUsedSplits];
-  mappingData->noOfUsedSplits++;
-
   const UINT64 memoryType = pde->largePage.memoryType;
   const UINT64 pageFrameNumber = pde->largePage.pageFrameNumber;
 
@@ -540,101 +2132,98 @@ static NTSTATUS splitPage(EPT_PdE* const pde)
     };
   }
 
-  pde->standard = (EPT_PagingStructure)
+  const EPT_PdE newPde = (EPT_PdE)
   {
-    .writeAccess = TRUE,
-    .readAccess = TRUE,
-    .fetchAccess = TRUE,
-    .pageFrameNumber = (EPT_Address)
-    {.address = Memory_getPhysicalAddress(pte) }.pageFrameNumber4KB
+    .standard =
+    {
+      .writeAccess = TRUE,
+      .readAccess = TRUE,
+      .fetchAccess = TRUE,
+      .pageFrameNumber = (EPT_Address)
+      {.address = Memory_getPhysicalAddress(pte) }.pageFrameNumber4KB
+    }
   };
+  InterlockedExchange64((volatile LONG64*)&pde->bits, (LONG64)newPde.bits);
 
   return STATUS_SUCCESS;
 }
 
 
 /**
- * @brief Fills PTE with fixed MTRRs.
+ * @brief Coalesces small pages back into a large page.
  * 
- * This function fills PTE memory types with fixed MTRR's values. Helper function used by
- * overrideFirstPml4EntryWithFixedMtrrs.
+ * The page table is replaced with a large page only if it maps the 2MB region one to one,
+ * with full access and a single memory type, which is the layout splitPage creates. Page
+ * tables with other content, e.g. the one describing fixed MTRRs, and pinned page tables
+ * are left in place. The page table is retired to the split pool, it can be reused once
+ * EPT caches of all logical cores have been invalidated.
  * 
- * @param msrIndex MSR index.
- * @param sizeInKBytes Size in KB.
- * @param ptIteratorPointer Pointer to PTE iterator.
+ * @param mappingData Mappings data owning the split pool.
+ * @param pde Pointer to Page Directory Entry referencing the page table.
  * 
  * @return VOID
  */
-static VOID fillFixedMtrr(
-  const UINT32 msrIndex,
-  const UINT64 sizeInKBytes,
-  EPT_PtE** const ptIteratorPointer)
+static VOID coalescePage(Context_EptMappingsData* const mappingData, EPT_PdE* const pde)
 {
-  const UINT64 msr = __readmsr(msrIndex);
-  for (UINT64 msrByteIndex = 0; msrByteIndex < 8; msrByteIndex++)
+  if (pde->isPinned)
   {
-    const UINT64 memoryType = (msr >> (msrByteIndex * 8)) & 0xFF;
-    for (UINT64 mappedPageCounter = 0; mappedPageCounter < (sizeInKBytes / 4); mappedPageCounter++)
-    {
-      (*ptIteratorPointer)->memoryType = memoryType;
-      *ptIteratorPointer = *ptIteratorPointer + 1;
-    }
+    return;
   }
-}
 
+  EPT_PtE* const pt = getTable(pde->standard.pageFrameNumber);
 
-/**
- * @brief Overrides first 1MB of memory with fixed MTRRs.
- * 
- * This function overrides first 1MB of memory' memory type with fixed MTRR's values.
- * 
- * @param pml4 Pointer to PML4.
- * 
- * @return STATUS_SUCCESS on success, error code otherwise.
- */
-static NTSTATUS overrideFirstPml4EntryWithFixedMtrrs(EPT_Pml4E* pml4)
-{
-  const EPT_PdptE* const pdpt = Memory_getVirtualAddress((EPT_Address) {
-    .pageFrameNumber4KB = pml4[0].pageFrameNumber
-  }.address);
-  EPT_PdE* const pd = Memory_getVirtualAddress((EPT_Address) {
-    .pageFrameNumber4KB = pdpt[0].pageFrameNumber
-  }.address);
-  EPT_PdE* const pde = &pd[0];
-
-  NTSTATUS ntStatus = splitPage(pde);
-  if (!NT_SUCCESS(ntStatus))
+  const UINT64 memoryType = pt[0].memoryType;
+  const UINT64 firstPageFrameNumber = pt[0].pageFrameNumber;
+  if (firstPageFrameNumber % EPT_PT_ENTRIES != 0)
   {
-    return ntStatus;
+    return;
   }
 
-  EPT_PtE* const pt = Memory_getVirtualAddress((EPT_Address) {
-    .pageFrameNumber4KB = pde->standard.pageFrameNumber
-  }.address);
-  EPT_PtE* ptIterator = &pt[0];
+  for (UINT64 ptEntryIndex = 0; ptEntryIndex < EPT_PT_ENTRIES; ptEntryIndex++)
+  {
+    EPT_PtE pte = { .bits = pt[ptEntryIndex].bits };
+    pte.accessed = FALSE;
+    pte.dirty = FALSE;
+
+    const EPT_PtE originalPte = (EPT_PtE)
+    {
+      .readAccess = TRUE,
+      .writeAccess = TRUE,
+      .fetchAccess = TRUE,
+      .memoryType = memoryType,
+      .pageFrameNumber = firstPageFrameNumber + ptEntryIndex
+    };
+    if (pte.bits != originalPte.bits)
+    {
+      return;
+    }
+  }
 
-  fillFixedMtrr(IA32_MTRR_FIX64K_00000, 64, &ptIterator);
-  fillFixedMtrr(IA32_MTRR_FIX16K_80000, 16, &ptIterator);
-  fillFixedMtrr(IA32_MTRR_FIX16K_A0000, 16, &ptIterator);
-  fillFixedMtrr(IA32_MTRR_FIX4K_C0000, 4, &ptIterator);
-  fillFixedMtrr(IA32_MTRR_FIX4K_C8000, 4, &ptIterator);
-  fillFixedMtrr(IA32_MTRR_FIX4K_D0000, 4, &ptIterator);
-  fillFixedMtrr(IA32_MTRR_FIX4K_D8000, 4, &ptIterator);
-  fillFixedMtrr(IA32_MTRR_FIX4K_E0000, 4, &ptIterator);
-  fillFixedMtrr(IA32_MTRR_FIX4K_E8000, 4, &ptIterator);
-  fillFixedMtrr(IA32_MTRR_FIX4K_F0000, 4, &ptIterator);
-  fillFixedMtrr(IA32_MTRR_FIX4K_F8000, 4, &ptIterator);
+  const EPT_PdE largePde = (EPT_PdE)
+  {
+    .largePage =
+    {
+      .readAccess = TRUE,
+      .writeAccess = TRUE,
+      .fetchAccess = TRUE,
+      .isLargePage = TRUE,
+      .memoryType = memoryType,
+      .pageFrameNumber = firstPageFrameNumber / EPT_PT_ENTRIES
+    }
+  };
+  InterlockedExchange64((volatile LONG64*)&pde->bits, (LONG64)largePde.bits);
 
-  return STATUS_SUCCESS;
+  PAGE_POOL_retire(&mappingData->splitPool, pt);
 }
 
 
 /**
  * @brief Destroys PML4 for internal use.
  * 
- * Internal function that frees memory allocated for PML4 and all underlying structures.
- * The noOfPml4Entries parameter limits number of PML4 entries to destroy (since not all
- * of them may have been allocated).
+ * Internal function that frees memory allocated for PML4 and its PDPTs. Page directories
+ * and page tables belong to the split pool and are freed with it. The noOfPml4Entries
+ * parameter limits number of PML4 entries to destroy (since not all of them may have been
+ * allocated).
  * 
  * @param noOfPml4Entries Number of PML4 entries.
  * @param pml4 Pointer to PML4.
@@ -645,18 +2234,10 @@ static VOID destroyPml4(const UINT64 noOfPml4Entries, EPT_Pml4E* const pml4)
 {
   for (UINT64 pml4EntryIndex = 0; pml4EntryIndex < noOfPml4Entries; pml4EntryIndex++)
   {
-    EPT_PdptE* const pdpt = Memory_getVirtualAddress(
-      (EPT_Address) {
-      .pageFrameNumber4KB = pml4[pml4EntryIndex].pageFrameNumber
-    }.address);
-    EPT_PdE* const pdArray = Memory_getVirtualAddress(
-      (EPT_Address) {
-      .pageFrameNumber4KB = pdpt[0].pageFrameNumber
-    }.address);
+    EPT_PdptE* const pdpt = getTable(pml4[pml4EntryIndex].pageFrameNumber);
 
-    Memory_free(pdArray);
-    Memory_free(pdpt);
+    freeUpperTable(pdpt);
   }
 
-  Memory_free(pml4);
+  freeUpperTable(pml4);
 }
@@ -10,6 +10,7 @@
 
 
 #include <ntddk.h>
+#include "context.h"
 
 
 /**************************************************************************************************
@@ -39,6 +40,70 @@
 #define EPT_PT_ENTRIES                        512
 ///@}
 
+/**
+ * @name Split page mapping counter
+ * @brief Position of the changed mappings counter, kept in ignored bits of a PDE that
+ * references a page table.
+ * @anchor EPTSplitCounter
+ */
+///@{
+#define EPT_PDE_MAPPING_COUNT_SHIFT           52
+///@}
+
+/**
+ * @name Pinned split page
+ * @brief Ignored bit of a PDE referencing a page table, set for regions prepared for
+ * mapping changes. Such a page table is not coalesced when its counter drops to 0.
+ * @anchor EPTPinnedSplit
+ */
+///@{
+#define EPT_PDE_PINNED_FLAG                   0x4000000000000000ULL
+///@}
+
+/**
+ * @name Accessed and dirty flags
+ * @brief Flags set by the processor in leaf entries of every level, if enabled in the EPTP.
+ * @anchor EPTAccessedDirtyFlags
+ */
+///@{
+#define EPT_ACCESSED_FLAG                     0x100ULL
+#define EPT_DIRTY_FLAG                        0x200ULL
+///@}
+
+/**
+ * @name Unpopulated entry
+ * @brief Value of PDPT and PD entries which are not populated yet. Such an entry is not
+ * present and only suppresses virtualization exceptions, so every access to the region
+ * it covers causes an EPT violation VM exit.
+ * @anchor EPTUnpopulatedEntry
+ */
+///@{
+#define EPT_UNPOPULATED_ENTRY                 0x8000000000000000ULL
+///@}
+
+/**
+ * @name EPT views
+ * @brief Indices of the read/write and the execute view in the EPTP list. Views are
+ * separate EPT hierarchies only if EPTP switching is enabled.
+ * @anchor EPTViews
+ */
+///@{
+#define EPT_VIEW_READ                         0
+#define EPT_VIEW_FETCH                        1
+#define EPT_NO_OF_VIEWS                       2
+///@}
+
+/**
+ * @name EPT page sizes
+ * @brief Sizes of memory mapped by a PDE large page, a PDPTE large page and a PML4 entry.
+ * @anchor EPTPageSizes
+ */
+///@{
+#define EPT_PAGE_SIZE_2MB                     0x200000ULL
+#define EPT_PAGE_SIZE_1GB                     0x40000000ULL
+#define EPT_PML4E_MAPPED_SIZE                 0x8000000000ULL
+///@}
+
 /**
  * @name EPT-Windows constant
  * @brief The upper limit for PML4 entries, because Windows can manage up to 2TB of memory.
@@ -52,45 +117,8 @@
 /**************************************************************************************************
 * Type declarations
 **************************************************************************************************/
-/**
- * @brief Variable MTRR cache helper structure.
- * 
- * @param baseAddress Base address
- * @param length Length
- * @param memoryType Memory type
- * @param valid TRUE if valid
- */
 #pragma warning(disable:4201)
 #pragma pack(push, 1)
-typedef struct EPT_VariableMtrr
-{
-  UINT64 baseAddress;
-  UINT64 length;
-  UINT64 memoryType;
-  BOOLEAN valid;
-} EPT_VariableMtrr;
-
-
-/**
- * @brief Helper structure for found memory types.
- * 
- * @param uncacheable TRUE if uncacheable
- * @param writeCombining TRUE if write combining
- * @param writeThrough TRUE if write through
- * @param writeProtected TRUE if write protected
- * @param writeback TRUE if writeback
- */
-typedef struct EPT_FoundMemoryTypes
-{
-  UINT8 uncacheable : 1;
-  UINT8 writeCombining : 1;
-  UINT8 writeThrough : 1;
-  UINT8 writeProtected : 1;
-  UINT8 writeback : 1;
-  UINT8 _pad1 : 3;
-} EPT_FoundMemoryTypes;
-
-
 /**
  * @brief Common EPT paging structure.
  * @see [Intel SDM, Vol. 3C, Chapter 29 VMX Support for Address Translation](https://software.intel.com/en-us/articles/intel-sdm)
@@ -121,6 +149,37 @@ typedef union EPT_Pml4E
 } EPT_Pml4E;
 
 
+/**
+ * @brief EPT PDPT entry for 1GB pages.
+ * @see [Intel SDM, Vol. 3C, Chapter 29 VMX Support for Address Translation](https://software.intel.com/en-us/articles/intel-sdm)
+ */
+typedef union EPT_PdptE1GB
+{
+  UINT64 bits;
+  struct
+  {
+    UINT64 readAccess : 1;
+    UINT64 writeAccess : 1;
+    UINT64 fetchAccess : 1;
+    UINT64 memoryType : 3;
+    UINT64 ignorePATMemoryType : 1;
+    UINT64 isLargePage : 1;
+    UINT64 accessed : 1;
+    UINT64 dirty : 1;
+    UINT64 fetchAccessUserMode : 1;
+    UINT64 _pad1 : 19;
+    UINT64 pageFrameNumber : 22;
+    UINT64 _pad2 : 5;
+    UINT64 verifyGuestPaging : 1;
+    UINT64 pagingWriteAccess : 1;
+    UINT64 _pad3 : 1;
+    UINT64 supervisorShadowStack : 1;
+    UINT64 _pad4 : 2;
+    UINT64 supressVE : 1;
+  };
+} EPT_PdptE1GB;
+
+
 /**
  * @brief Union for PDPT entry.
  * @see [Intel SDM, Vol. 3C, Chapter 29 VMX Support for Address Translation](https://software.intel.com/en-us/articles/intel-sdm)
@@ -129,6 +188,7 @@ typedef union EPT_PdptE
 {
   UINT64 bits;
   EPT_PagingStructure;
+  EPT_PdptE1GB largePage;
 } EPT_PdptE;
 
 
@@ -165,6 +225,11 @@ typedef union EPT_PdE2MB
 
 /**
  * @brief Union for PD entry.
+ * 
+ * For a PDE referencing a page table, noOfChangedMappings counts changed mappings within
+ * the 2MB region, and isPinned keeps the page table after the last one is removed. The bits
+ * are ignored by the processor.
+ * 
  * @see [Intel SDM, Vol. 3C, Chapter 29 VMX Support for Address Translation](https://software.intel.com/en-us/articles/intel-sdm)
  */
 typedef union EPT_PdE
@@ -172,6 +237,13 @@ typedef union EPT_PdE
   UINT64 bits;
   EPT_PagingStructure standard;
   EPT_PdE2MB largePage;
+  struct
+  {
+    UINT64 _pad1 : EPT_PDE_MAPPING_COUNT_SHIFT;
+    UINT64 noOfChangedMappings : 10;
+    UINT64 isPinned : 1;
+    UINT64 _pad2 : 1;
+  };
 } EPT_PdE;
 
 
@@ -239,6 +311,7 @@ typedef union EPT_EptP
  * 
  * @param pageFrameNumber4KB Page frame number for 4KB page
  * @param pageFrameNumber2MB Page frame number for 2MB page
+ * @param pageFrameNumber1GB Page frame number for 1GB page
  */
 typedef union EPT_Address
 {
@@ -262,6 +335,11 @@ typedef union EPT_Address
     UINT64 _pad3 : 21;
     UINT64 pageFrameNumber2MB : 43;
   };
+  struct
+  {
+    UINT64 _pad4 : 30;
+    UINT64 pageFrameNumber1GB : 34;
+  };
 } EPT_Address;
 #pragma pack(pop)
 #pragma warning(default:4201)
@@ -270,14 +348,102 @@ typedef union EPT_Address
 /**************************************************************************************************
 * Global function declarations
 **************************************************************************************************/
-NTSTATUS EPT_setupDefaltStructures(UINT64* const eptpBits);
+NTSTATUS EPT_setupDefaltStructures(
+  Context_EptMappingsData* const mappingData,
+  const UINT64 templateEptp);
+
+
+UINT64 EPT_getStructuresSize(VOID);
+
+
+UINT64 EPT_getNoOfViews(const Context_EptMappingsData* const mappingData);
+
+
+UINT64 EPT_getNoOfSplitTables(
+  const Context_EptMappingsData* const mappingData,
+  const UINT64 address);
+
+
+BOOLEAN EPT_isPopulated(const Context_EptMappingsData* const mappingData, const UINT64 address);
+
+
+NTSTATUS EPT_populate(Context_EptMappingsData* const mappingData, const UINT64 address);
+
+
+NTSTATUS EPT_prepareSplit(
+  Context_EptMappingsData* const mappingData,
+  const UINT64 address,
+  const BOOLEAN pin,
+  BOOLEAN* const isSplit);
+
+
+VOID EPT_unpinSplit(Context_EptMappingsData* const mappingData, const UINT64 address);
+
+
+VOID EPT_switchView(const Context_EptMappingsData* const mappingData, const UINT64 view);
+
+
+VOID EPT_invalidate(const Context_EptMappingsData* const mappingData);
+
+
+VOID EPT_acquireSplitRange(
+  Context_EptMappingsData* const mappingData,
+  const UINT64 address,
+  const UINT64 size);
+
+
+VOID EPT_releaseSplitRange(
+  Context_EptMappingsData* const mappingData,
+  const UINT64 address,
+  const UINT64 size);
+
+
+VOID EPT_coalesceRange(
+  Context_EptMappingsData* const mappingData,
+  const UINT64 address,
+  const UINT64 size);
 
 
 NTSTATUS EPT_changeMapping(
+  Context_EptMappingsData* const mappingData,
+  const UINT64 view,
   const UINT64 sourceAddress,
   const UINT64 targetAddress,
   const BOOLEAN rw,
   const BOOLEAN fetch);
 
 
+NTSTATUS EPT_changeRangeMapping(
+  Context_EptMappingsData* const mappingData,
+  const UINT64 view,
+  const UINT64 sourceAddress,
+  const UINT64 targetAddress,
+  const UINT64 size,
+  const BOOLEAN rw,
+  const BOOLEAN fetch);
+
+
+UINT64 EPT_getNoOfRangeSplitTables(
+  const UINT64 sourceAddress,
+  const UINT64 targetAddress,
+  const UINT64 size);
+
+
+NTSTATUS EPT_harvestAccessedDirty(
+  const Context_EptMappingsData* const mappingData,
+  const UINT64 address,
+  const UINT64 size,
+  RTL_BITMAP* const accessedPages,
+  RTL_BITMAP* const dirtyPages);
+
+
+VOID EPT_clearDirtyFlags(const Context_EptMappingsData* const mappingData);
+
+
+UINT64 EPT_getPageSize(
+  const Context_EptMappingsData* const mappingData,
+  const UINT64 view,
+  const UINT64 address);
+
+
 VOID EPT_destroyEPTStructure(const UINT64 eptpBits);
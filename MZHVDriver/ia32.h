@@ -43,15 +43,18 @@
 #define IA32_MTRR_FIX4K_F8000            0x26F
 #define IA32_MTRR_DEF_TYPE               0x2FF
 #define IA32_VMX_BASIC                   0x480
+#define IA32_VMX_MISC                    0x485
 #define IA32_VMX_CR0_FIXED0              0x486
 #define IA32_VMX_CR0_FIXED1              0x487
 #define IA32_VMX_CR4_FIXED0              0x488
 #define IA32_VMX_CR4_FIXED1              0x489
 #define IA32_VMX_PROCBASED_CTLS2         0x48B
+#define IA32_VMX_EPT_VPID_CAP            0x48C
 #define IA32_VMX_TRUE_PINBASED_CTLS      0x48D
 #define IA32_VMX_TRUE_PROCBASED_CTLS     0x48E
 #define IA32_VMX_TRUE_EXIT_CTLS          0x48F
 #define IA32_VMX_TRUE_ENTRY_CTLS         0x490
+#define IA32_VMX_VMFUNC                  0x491
 #define IA32_FS_BASE                     0xC0000100
 #define IA32_GS_BASE                     0xC0000101
 ///@}
@@ -65,6 +68,7 @@
 ///@{
 #define IA32_CPUID_BASIC_INFORMATION_0   0x0
 #define IA32_CPUID_BASIC_INFORMATION_1   0x1
+#define IA32_CPUID_EXTENDED_LEAVES_BASE  0x80000000
 #define IA32_CPUID_ADDRESS_BITS          0x80000008
  ///@}
 
@@ -116,6 +120,75 @@ typedef union IA32_VmxBasic
 } IA32_VmxBasic;
 
 
+/**
+ * @brief Structure for IA32_VMX_MISC MSR
+ * @see [Intel SDM, Vol. 3D, Appendix A.6](https://software.intel.com/en-us/articles/intel-sdm)
+ */
+typedef union IA32_VmxMisc
+{
+  UINT64 bits;
+  struct
+  {
+    UINT64 preemptionTimerTscShift : 5;
+    UINT64 _pad1 : 59;
+  };
+} IA32_VmxMisc;
+
+
+/**
+ * @brief Structure for IA32_VMX_EPT_VPID_CAP MSR
+ * @see [Intel SDM, Vol. 3D, Appendix A.10](https://software.intel.com/en-us/articles/intel-sdm)
+ */
+typedef union IA32_VmxEptVpidCap
+{
+  UINT64 bits;
+  struct
+  {
+    UINT64 executeOnlyPages : 1;
+    UINT64 _pad1 : 5;
+    UINT64 pageWalkLength4 : 1;
+    UINT64 pageWalkLength5 : 1;
+    UINT64 memoryTypeUncacheable : 1;
+    UINT64 _pad2 : 5;
+    UINT64 memoryTypeWriteback : 1;
+    UINT64 _pad3 : 1;
+    UINT64 pde2MBPages : 1;
+    UINT64 pdpte1GBPages : 1;
+    UINT64 _pad4 : 2;
+    UINT64 invept : 1;
+    UINT64 accessedDirtyFlags : 1;
+    UINT64 advancedExitInformation : 1;
+    UINT64 supervisorShadowStack : 1;
+    UINT64 _pad5 : 1;
+    UINT64 inveptSingleContext : 1;
+    UINT64 inveptAllContext : 1;
+    UINT64 _pad6 : 5;
+    UINT64 invvpid : 1;
+    UINT64 _pad7 : 7;
+    UINT64 invvpidIndividualAddress : 1;
+    UINT64 invvpidSingleContext : 1;
+    UINT64 invvpidAllContext : 1;
+    UINT64 invvpidSingleContextRetainGlobals : 1;
+    UINT64 _pad8 : 20;
+  };
+} IA32_VmxEptVpidCap;
+
+
+/**
+ * @brief Structure for IA32_VMX_VMFUNC MSR
+ * @see [Intel SDM, Vol. 3D, Appendix A.11](https://software.intel.com/en-us/articles/intel-sdm)
+ */
+typedef union IA32_VmxVmfunc
+{
+  UINT64 bits;
+  struct
+  {
+    UINT64 eptpSwitching : 1;
+    UINT64 _pad1 : 63;
+  };
+} IA32_VmxVmfunc;
+
+
 /**
  * @brief Structure for IA32_MTRRCAP MSR
  * @see [Intel SDM, Vol. 3A, Memory Cache Control](https://software.intel.com/en-us/articles/intel-sdm)
@@ -310,12 +383,14 @@ typedef union IA32_CpuidBasicInformation1 {
     // There is a lot of features, see Intel SDM
     INT32 _otherFeatures1 : 5;
     INT32 vmx : 1;
-    INT32 _otherFeatures2 : 25;
+    INT32 _otherFeatures2 : 21;
+    INT32 osxsave : 1;
+    INT32 _otherFeatures3 : 3;
     INT32 hypervisorPresentBit : 1;
 
-    INT32 _otherFeatures3 : 12;
+    INT32 _otherFeatures4 : 12;
     INT32 mtrr : 1;
-    INT32 _otherFeatures4 : 19;
+    INT32 _otherFeatures5 : 19;
   };
 } IA32_CpuidBasicInformation1;
 
@@ -0,0 +1,852 @@
+/**
+ * @file mapping_table.c
+ * @brief Implements changed mappings table.
+ *
+ * The table is an open addressing hash table with linear probing, keyed by guest page
+ * frame number. A second table counts references to host page frames, so that the
+ * conflict checks done when a mapping is added do not need to scan all mappings.
+ * Both tables are kept at most half full, and removal uses backward shift deletion,
+ * so no tombstones are needed. Memory is allocated once, which makes all operations
+ * except init and destroy safe in VMX root mode.
+ *
+ * Range mappings, spanning more than one page, are kept apart in a small array sorted by
+ * guest address, so that lookups of any page inside a range do not need one slot per page.
+ *
+ * Mappings of a group are linked into a cycle by guest address rather than by slot, so
+ * the cycle survives entries being shifted by removals, and members are found by lookups.
+ */
+
+
+#include "ept.h"
+#include "mapping_table.h"
+#include "memory.h"
+
+
+/**************************************************************************************************
+* Local function declarations
+**************************************************************************************************/
+static UINT64 roundUpToPowerOf2(const UINT64 value);
+
+
+static UINT64 getHomeSlot(const UINT64 pageFrameNumber, const UINT64 capacity);
+
+
+static UINT64 findMappingSlot(const Context_EptMappingTable* const table, const UINT64 guestAddress);
+
+
+static UINT64 findHostReferenceSlot(
+  const Context_EptMappingTable* const table,
+  const UINT64 hostAddress);
+
+
+static VOID addHostReference(Context_EptMappingTable* const table, const UINT64 hostAddress);
+
+
+static VOID removeHostReference(Context_EptMappingTable* const table, const UINT64 hostAddress);
+
+
+static UINT64 findRangeIndex(const Context_EptMappingTable* const table, const UINT64 guestAddress);
+
+
+static NTSTATUS insertRange(
+  Context_EptMappingTable* const table,
+  const Context_EptChangedMapping* const mapping);
+
+
+static NTSTATUS removeRange(Context_EptMappingTable* const table, const UINT64 guestAddress);
+
+
+static BOOLEAN isOverlapping(
+  const UINT64 firstAddress,
+  const UINT64 firstSize,
+  const UINT64 secondAddress,
+  const UINT64 secondSize);
+
+
+static Context_EptChangedMapping* findGroupMember(
+  const Context_EptMappingTable* const table,
+  const UINT64 groupId);
+
+
+static UINT64 getGroupSize(
+  const Context_EptMappingTable* const table,
+  const Context_EptChangedMapping* const member);
+
+
+static VOID leaveGroup(
+  const Context_EptMappingTable* const table,
+  Context_EptChangedMapping* const mapping);
+
+
+/**************************************************************************************************
+* Global function definitions
+**************************************************************************************************/
+/**
+ * @brief Initializes the table.
+ *
+ * Allocates slots for the given number of mappings. Must be called at PASSIVE_LEVEL.
+ *
+ * @param table Table to initialize.
+ * @param maxEntries Maximal number of mappings.
+ *
+ * @return STATUS_SUCCESS on success, STATUS_UNSUCCESSFUL otherwise.
+ */
+NTSTATUS MAPPING_TABLE_init(Context_EptMappingTable* const table, const UINT64 maxEntries)
+{
+  // Every mapping references at most 2 host pages
+  *table = (Context_EptMappingTable)
+  {
+    .maxEntries = maxEntries,
+    .noOfEntries = 0,
+    .mappingsCapacity = roundUpToPowerOf2(2 * maxEntries),
+    .hostReferencesCapacity = roundUpToPowerOf2(4 * maxEntries),
+    .noOfRanges = 0
+  };
+
+  table->mappings =
+    Memory_allocate(table->mappingsCapacity * sizeof(Context_EptChangedMapping), FALSE);
+  if (table->mappings == NULL)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  table->hostReferences =
+    Memory_allocate(table->hostReferencesCapacity * sizeof(Context_EptHostReference), FALSE);
+  if (table->hostReferences == NULL)
+  {
+    Memory_free(table->mappings);
+    table->mappings = NULL;
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Finds mapping of a guest page.
+ *
+ * Page mappings are looked up first, then the range mappings.
+ *
+ * @param table Table to search.
+ * @param guestAddress Guest physical address of the page.
+ *
+ * @return Pointer to the page or range mapping covering the page, or NULL if the page's
+ * mapping is not changed.
+ */
+Context_EptChangedMapping* MAPPING_TABLE_find(
+  const Context_EptMappingTable* const table,
+  const UINT64 guestAddress)
+{
+  Context_EptChangedMapping* const mapping =
+    &table->mappings[findMappingSlot(table, guestAddress)];
+  if (mapping->valid)
+  {
+    return mapping;
+  }
+
+  const UINT64 index = findRangeIndex(table, guestAddress);
+  if (index == 0)
+  {
+    return NULL;
+  }
+
+  Context_EptChangedMapping* const range = (Context_EptChangedMapping*)&table->ranges[index - 1];
+  return guestAddress < range->guestAddress + range->size ? range : NULL;
+}
+
+
+/**
+ * @brief Checks if a host page is a target of any mapping.
+ *
+ * @param table Table to search.
+ * @param hostAddress Physical address of the page.
+ *
+ * @return TRUE if the page is used by read/write or fetch part of any mapping, FALSE otherwise.
+ */
+BOOLEAN MAPPING_TABLE_isHostAddressUsed(
+  const Context_EptMappingTable* const table,
+  const UINT64 hostAddress)
+{
+  return MAPPING_TABLE_isHostRangeUsed(table, hostAddress, PAGE_SIZE);
+}
+
+
+/**
+ * @brief Checks if any page of a guest range has its mapping changed.
+ *
+ * Pages of short ranges are looked up one by one, for long ranges all slots are scanned
+ * instead, whichever is fewer.
+ *
+ * @param table Table to search.
+ * @param guestAddress Guest physical address of the range, page aligned.
+ * @param size Size of the range in bytes, multiple of PAGE_SIZE.
+ *
+ * @return TRUE if any page of the range is a guest page of a mapping, FALSE otherwise.
+ */
+BOOLEAN MAPPING_TABLE_isGuestRangeChanged(
+  const Context_EptMappingTable* const table,
+  const UINT64 guestAddress,
+  const UINT64 size)
+{
+  for (UINT64 i = 0; i < table->noOfRanges; i++)
+  {
+    if (isOverlapping(table->ranges[i].guestAddress, table->ranges[i].size, guestAddress, size))
+    {
+      return TRUE;
+    }
+  }
+
+  if (size / PAGE_SIZE <= table->mappingsCapacity)
+  {
+    for (UINT64 offset = 0; offset < size; offset += PAGE_SIZE)
+    {
+      if (table->mappings[findMappingSlot(table, guestAddress + offset)].valid)
+      {
+        return TRUE;
+      }
+    }
+
+    return FALSE;
+  }
+
+  for (UINT64 slot = 0; slot < table->mappingsCapacity; slot++)
+  {
+    if (table->mappings[slot].valid &&
+      isOverlapping(table->mappings[slot].guestAddress, PAGE_SIZE, guestAddress, size))
+    {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+
+/**
+ * @brief Checks if any page of a host range is a target of any mapping.
+ *
+ * Pages of short ranges are looked up one by one, for long ranges all slots are scanned
+ * instead, whichever is fewer.
+ *
+ * @param table Table to search.
+ * @param hostAddress Physical address of the range, page aligned.
+ * @param size Size of the range in bytes, multiple of PAGE_SIZE.
+ *
+ * @return TRUE if any page of the range is used by read/write or fetch part of any mapping,
+ * FALSE otherwise.
+ */
+BOOLEAN MAPPING_TABLE_isHostRangeUsed(
+  const Context_EptMappingTable* const table,
+  const UINT64 hostAddress,
+  const UINT64 size)
+{
+  for (UINT64 i = 0; i < table->noOfRanges; i++)
+  {
+    const Context_EptChangedMapping* const range = &table->ranges[i];
+    if (isOverlapping(range->hostRwAddress, range->size, hostAddress, size) ||
+      isOverlapping(range->hostFetchAddress, range->size, hostAddress, size))
+    {
+      return TRUE;
+    }
+  }
+
+  if (size / PAGE_SIZE <= table->hostReferencesCapacity)
+  {
+    for (UINT64 offset = 0; offset < size; offset += PAGE_SIZE)
+    {
+      const UINT64 slot = findHostReferenceSlot(table, hostAddress + offset);
+      if (table->hostReferences[slot].referenceCount != 0)
+      {
+        return TRUE;
+      }
+    }
+
+    return FALSE;
+  }
+
+  for (UINT64 slot = 0; slot < table->hostReferencesCapacity; slot++)
+  {
+    const Context_EptHostReference* const reference = &table->hostReferences[slot];
+    if (reference->referenceCount != 0 &&
+      isOverlapping(reference->pageFrameNumber * PAGE_SIZE, PAGE_SIZE, hostAddress, size))
+    {
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+
+/**
+ * @brief Checks if the table is full.
+ *
+ * @param table Table to check.
+ *
+ * @return TRUE if no more mappings can be inserted, FALSE otherwise.
+ */
+BOOLEAN MAPPING_TABLE_isFull(const Context_EptMappingTable* const table)
+{
+  return table->noOfEntries >= table->maxEntries;
+}
+
+
+/**
+ * @brief Checks if the range array is full.
+ *
+ * @param table Table to check.
+ *
+ * @return TRUE if no more range mappings can be inserted, FALSE otherwise.
+ */
+BOOLEAN MAPPING_TABLE_isRangeTableFull(const Context_EptMappingTable* const table)
+{
+  return table->noOfRanges >= CONTEXT_EPT_MAX_RANGES;
+}
+
+
+/**
+ * @brief Inserts a mapping.
+ *
+ * Conflict checks are left to the caller, this function only refuses duplicates.
+ * Mappings larger than a page are stored as ranges.
+ *
+ * @param table Table to insert to.
+ * @param mapping Mapping to insert.
+ *
+ * @return STATUS_SUCCESS on success, STATUS_UNSUCCESSFUL if the table is full or the
+ * guest page is already present.
+ */
+NTSTATUS MAPPING_TABLE_insert(
+  Context_EptMappingTable* const table,
+  const Context_EptChangedMapping* const mapping)
+{
+  if (mapping->size > PAGE_SIZE)
+  {
+    return insertRange(table, mapping);
+  }
+
+  if (MAPPING_TABLE_isFull(table))
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  Context_EptChangedMapping* const slot =
+    &table->mappings[findMappingSlot(table, mapping->guestAddress)];
+  if (slot->valid)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  *slot = *mapping;
+  slot->valid = TRUE;
+  table->noOfEntries++;
+
+  addHostReference(table, mapping->hostRwAddress);
+  addHostReference(table, mapping->hostFetchAddress);
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Removes mapping of a guest page.
+ *
+ * The mapping leaves its group first. The following entries of the probe sequence are
+ * shifted back, so that lookups never stop at the freed slot. Range mappings are removed
+ * by their first page.
+ *
+ * @param table Table to remove from.
+ * @param guestAddress Guest physical address of the page.
+ *
+ * @return STATUS_SUCCESS on success, STATUS_UNSUCCESSFUL if the mapping is not found.
+ */
+NTSTATUS MAPPING_TABLE_remove(Context_EptMappingTable* const table, const UINT64 guestAddress)
+{
+  Context_EptChangedMapping* const mapping = MAPPING_TABLE_find(table, guestAddress);
+  if (mapping != NULL && mapping->guestAddress == guestAddress)
+  {
+    leaveGroup(table, mapping);
+  }
+
+  const UINT64 mask = table->mappingsCapacity - 1;
+  UINT64 freeSlot = findMappingSlot(table, guestAddress);
+  if (!table->mappings[freeSlot].valid)
+  {
+    return removeRange(table, guestAddress);
+  }
+
+  removeHostReference(table, table->mappings[freeSlot].hostRwAddress);
+  removeHostReference(table, table->mappings[freeSlot].hostFetchAddress);
+
+  for (UINT64 slot = (freeSlot + 1) & mask; table->mappings[slot].valid; slot = (slot + 1) & mask)
+  {
+    const UINT64 homeSlot = getHomeSlot(
+      (EPT_Address){ .address = table->mappings[slot].guestAddress }.pageFrameNumber4KB,
+      table->mappingsCapacity);
+
+    // Entry can be moved only if the free slot lies between its home slot and its slot
+    if (((slot - homeSlot) & mask) >= ((slot - freeSlot) & mask))
+    {
+      table->mappings[freeSlot] = table->mappings[slot];
+      freeSlot = slot;
+    }
+  }
+
+  table->mappings[freeSlot] = (Context_EptChangedMapping){ 0 };
+  table->noOfEntries--;
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Moves a mapping to a mapping group.
+ *
+ * The mapping leaves its current group first. Finding a member of the group to join scans
+ * all slots, which is acceptable when groups are configured, but not when they are used.
+ *
+ * @param table Table holding the mapping.
+ * @param guestAddress Guest physical address of the mapping, first page of a range mapping.
+ * @param groupId Group to join, 0 to only leave the current group.
+ *
+ * @return STATUS_SUCCESS on success, STATUS_UNSUCCESSFUL if the mapping is not found or the
+ * group already has CONTEXT_EPT_MAX_GROUP_SIZE members.
+ */
+NTSTATUS MAPPING_TABLE_setGroup(
+  Context_EptMappingTable* const table,
+  const UINT64 guestAddress,
+  const UINT64 groupId)
+{
+  Context_EptChangedMapping* const mapping = MAPPING_TABLE_find(table, guestAddress);
+  if (mapping == NULL || mapping->guestAddress != guestAddress)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  if (mapping->groupId == groupId)
+  {
+    return STATUS_SUCCESS;
+  }
+
+  Context_EptChangedMapping* const member = findGroupMember(table, groupId);
+  if (member != NULL && getGroupSize(table, member) >= CONTEXT_EPT_MAX_GROUP_SIZE)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  leaveGroup(table, mapping);
+  if (groupId == 0)
+  {
+    return STATUS_SUCCESS;
+  }
+
+  mapping->groupId = groupId;
+  if (member == NULL)
+  {
+    mapping->nextGroupAddress = mapping->guestAddress;
+  }
+  else
+  {
+    mapping->nextGroupAddress = member->nextGroupAddress;
+    member->nextGroupAddress = mapping->guestAddress;
+  }
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Returns the next mapping of a mapping's group.
+ *
+ * @param table Table holding the mapping.
+ * @param mapping Mapping whose group is walked.
+ *
+ * @return Next member, the mapping itself if it is alone in its group, or NULL if it is not
+ * in any group.
+ */
+Context_EptChangedMapping* MAPPING_TABLE_getNextGroupMember(
+  const Context_EptMappingTable* const table,
+  const Context_EptChangedMapping* const mapping)
+{
+  return mapping->groupId != 0 ? MAPPING_TABLE_find(table, mapping->nextGroupAddress) : NULL;
+}
+
+
+/**
+ * @brief Frees memory allocated for the table.
+ *
+ * @param table Table to destroy.
+ *
+ * @return VOID
+ */
+VOID MAPPING_TABLE_destroy(Context_EptMappingTable* const table)
+{
+  if (table->hostReferences != NULL)
+  {
+    Memory_free(table->hostReferences);
+  }
+
+  if (table->mappings != NULL)
+  {
+    Memory_free(table->mappings);
+  }
+
+  *table = (Context_EptMappingTable){ 0 };
+}
+
+
+/**************************************************************************************************
+* Local function definitions
+**************************************************************************************************/
+/**
+ * @brief Rounds a value up to the nearest power of 2.
+ *
+ * @param value Value to round, must be nonzero.
+ *
+ * @return Smallest power of 2 greater or equal to value.
+ */
+static UINT64 roundUpToPowerOf2(const UINT64 value)
+{
+  UINT64 powerOf2 = 1;
+  while (powerOf2 < value)
+  {
+    powerOf2 <<= 1;
+  }
+
+  return powerOf2;
+}
+
+
+/**
+ * @brief Returns the slot where the probe sequence for a page frame starts.
+ *
+ * @param pageFrameNumber Page frame number.
+ * @param capacity Number of slots, power of 2.
+ *
+ * @return Slot index.
+ */
+static UINT64 getHomeSlot(const UINT64 pageFrameNumber, const UINT64 capacity)
+{
+  return ((pageFrameNumber * MAPPING_TABLE_HASH_MULTIPLIER) >> 32) & (capacity - 1);
+}
+
+
+/**
+ * @brief Finds slot of a guest page's mapping.
+ *
+ * @param table Table to search.
+ * @param guestAddress Guest physical address of the page.
+ *
+ * @return Index of the slot holding the mapping, or of the free slot ending the probe sequence.
+ */
+static UINT64 findMappingSlot(const Context_EptMappingTable* const table, const UINT64 guestAddress)
+{
+  const UINT64 pageFrameNumber = (EPT_Address){ .address = guestAddress }.pageFrameNumber4KB;
+  const UINT64 mask = table->mappingsCapacity - 1;
+
+  UINT64 slot = getHomeSlot(pageFrameNumber, table->mappingsCapacity);
+  while (table->mappings[slot].valid &&
+    (EPT_Address){ .address = table->mappings[slot].guestAddress }.pageFrameNumber4KB != pageFrameNumber)
+  {
+    slot = (slot + 1) & mask;
+  }
+
+  return slot;
+}
+
+
+/**
+ * @brief Finds slot of a host page's reference counter.
+ *
+ * @param table Table to search.
+ * @param hostAddress Physical address of the page.
+ *
+ * @return Index of the slot holding the counter, or of the free slot ending the probe sequence.
+ */
+static UINT64 findHostReferenceSlot(
+  const Context_EptMappingTable* const table,
+  const UINT64 hostAddress)
+{
+  const UINT64 pageFrameNumber = (EPT_Address){ .address = hostAddress }.pageFrameNumber4KB;
+  const UINT64 mask = table->hostReferencesCapacity - 1;
+
+  UINT64 slot = getHomeSlot(pageFrameNumber, table->hostReferencesCapacity);
+  while (table->hostReferences[slot].referenceCount != 0 &&
+    table->hostReferences[slot].pageFrameNumber != pageFrameNumber)
+  {
+    slot = (slot + 1) & mask;
+  }
+
+  return slot;
+}
+
+
+/**
+ * @brief Increments reference counter of a host page.
+ *
+ * @param table Table to change.
+ * @param hostAddress Physical address of the page.
+ *
+ * @return VOID
+ */
+static VOID addHostReference(Context_EptMappingTable* const table, const UINT64 hostAddress)
+{
+  Context_EptHostReference* const reference =
+    &table->hostReferences[findHostReferenceSlot(table, hostAddress)];
+
+  reference->pageFrameNumber = (EPT_Address){ .address = hostAddress }.pageFrameNumber4KB;
+  reference->referenceCount++;
+}
+
+
+/**
+ * @brief Decrements reference counter of a host page.
+ *
+ * The slot is freed with backward shift deletion once the counter reaches 0.
+ *
+ * @param table Table to change.
+ * @param hostAddress Physical address of the page.
+ *
+ * @return VOID
+ */
+static VOID removeHostReference(Context_EptMappingTable* const table, const UINT64 hostAddress)
+{
+  const UINT64 mask = table->hostReferencesCapacity - 1;
+  UINT64 freeSlot = findHostReferenceSlot(table, hostAddress);
+  if (table->hostReferences[freeSlot].referenceCount == 0)
+  {
+    return;
+  }
+
+  table->hostReferences[freeSlot].referenceCount--;
+  if (table->hostReferences[freeSlot].referenceCount != 0)
+  {
+    return;
+  }
+
+  for (UINT64 slot = (freeSlot + 1) & mask;
+    table->hostReferences[slot].referenceCount != 0;
+    slot = (slot + 1) & mask)
+  {
+    const UINT64 homeSlot =
+      getHomeSlot(table->hostReferences[slot].pageFrameNumber, table->hostReferencesCapacity);
+
+    if (((slot - homeSlot) & mask) >= ((slot - freeSlot) & mask))
+    {
+      table->hostReferences[freeSlot] = table->hostReferences[slot];
+      freeSlot = slot;
+    }
+  }
+
+  table->hostReferences[freeSlot] = (Context_EptHostReference){ 0 };
+}
+
+
+/**
+ * @brief Finds position of a guest address in the range array.
+ *
+ * @param table Table to search.
+ * @param guestAddress Guest physical address.
+ *
+ * @return Number of ranges starting at or below the address, the range that may contain
+ * the address is the one before the returned index.
+ */
+static UINT64 findRangeIndex(const Context_EptMappingTable* const table, const UINT64 guestAddress)
+{
+  UINT64 low = 0;
+  UINT64 high = table->noOfRanges;
+  while (low < high)
+  {
+    const UINT64 middle = low + (high - low) / 2;
+    if (table->ranges[middle].guestAddress <= guestAddress)
+    {
+      low = middle + 1;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+
+  return low;
+}
+
+
+/**
+ * @brief Inserts a range mapping, keeping the array sorted.
+ *
+ * @param table Table to insert to.
+ * @param mapping Range mapping to insert.
+ *
+ * @return STATUS_SUCCESS on success, STATUS_UNSUCCESSFUL if the array is full or a range
+ * with the same guest address is already present.
+ */
+static NTSTATUS insertRange(
+  Context_EptMappingTable* const table,
+  const Context_EptChangedMapping* const mapping)
+{
+  if (MAPPING_TABLE_isRangeTableFull(table))
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  const UINT64 index = findRangeIndex(table, mapping->guestAddress);
+  if (index != 0 && table->ranges[index - 1].guestAddress == mapping->guestAddress)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  for (UINT64 i = table->noOfRanges; i > index; i--)
+  {
+    table->ranges[i] = table->ranges[i - 1];
+  }
+
+  table->ranges[index] = *mapping;
+  table->ranges[index].valid = TRUE;
+  table->noOfRanges++;
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Removes a range mapping.
+ *
+ * @param table Table to remove from.
+ * @param guestAddress Guest physical address of the range's first page.
+ *
+ * @return STATUS_SUCCESS on success, STATUS_UNSUCCESSFUL if no range starts at the address.
+ */
+static NTSTATUS removeRange(Context_EptMappingTable* const table, const UINT64 guestAddress)
+{
+  const UINT64 index = findRangeIndex(table, guestAddress);
+  if (index == 0 || table->ranges[index - 1].guestAddress != guestAddress)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  for (UINT64 i = index; i < table->noOfRanges; i++)
+  {
+    table->ranges[i - 1] = table->ranges[i];
+  }
+
+  table->noOfRanges--;
+  table->ranges[table->noOfRanges] = (Context_EptChangedMapping){ 0 };
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Checks if two address ranges overlap.
+ *
+ * @param firstAddress First address of the first range.
+ * @param firstSize Size of the first range.
+ * @param secondAddress First address of the second range.
+ * @param secondSize Size of the second range.
+ *
+ * @return TRUE if the ranges share at least one byte, FALSE otherwise.
+ */
+static BOOLEAN isOverlapping(
+  const UINT64 firstAddress,
+  const UINT64 firstSize,
+  const UINT64 secondAddress,
+  const UINT64 secondSize)
+{
+  return firstAddress < secondAddress + secondSize && secondAddress < firstAddress + firstSize;
+}
+
+
+/**
+ * @brief Finds any mapping of a group.
+ *
+ * @param table Table to search.
+ * @param groupId Group to find, nonzero.
+ *
+ * @return Pointer to a member, or NULL if the group has no members or groupId is 0.
+ */
+static Context_EptChangedMapping* findGroupMember(
+  const Context_EptMappingTable* const table,
+  const UINT64 groupId)
+{
+  if (groupId == 0)
+  {
+    return NULL;
+  }
+
+  for (UINT64 slot = 0; slot < table->mappingsCapacity; slot++)
+  {
+    if (table->mappings[slot].valid && table->mappings[slot].groupId == groupId)
+    {
+      return &table->mappings[slot];
+    }
+  }
+
+  for (UINT64 i = 0; i < table->noOfRanges; i++)
+  {
+    if (table->ranges[i].groupId == groupId)
+    {
+      return (Context_EptChangedMapping*)&table->ranges[i];
+    }
+  }
+
+  return NULL;
+}
+
+
+/**
+ * @brief Counts mappings of a member's group.
+ *
+ * @param table Table holding the group.
+ * @param member Any mapping of the group.
+ *
+ * @return Number of members, including the given one.
+ */
+static UINT64 getGroupSize(
+  const Context_EptMappingTable* const table,
+  const Context_EptChangedMapping* const member)
+{
+  UINT64 groupSize = 1;
+  const Context_EptChangedMapping* next = MAPPING_TABLE_getNextGroupMember(table, member);
+  while (next != NULL && next != member)
+  {
+    groupSize++;
+    next = MAPPING_TABLE_getNextGroupMember(table, next);
+  }
+
+  return groupSize;
+}
+
+
+/**
+ * @brief Unlinks a mapping from its group.
+ *
+ * The member preceding the mapping in the cycle is linked to the one following it. Does
+ * nothing if the mapping is not in any group.
+ *
+ * @param table Table holding the mapping.
+ * @param mapping Mapping to unlink.
+ *
+ * @return VOID
+ */
+static VOID leaveGroup(
+  const Context_EptMappingTable* const table,
+  Context_EptChangedMapping* const mapping)
+{
+  if (mapping->groupId == 0)
+  {
+    return;
+  }
+
+  Context_EptChangedMapping* previous = mapping;
+  Context_EptChangedMapping* next = MAPPING_TABLE_getNextGroupMember(table, mapping);
+  while (next != NULL && next != mapping)
+  {
+    previous = next;
+    next = MAPPING_TABLE_getNextGroupMember(table, next);
+  }
+
+  previous->nextGroupAddress = mapping->nextGroupAddress;
+  mapping->groupId = 0;
+}
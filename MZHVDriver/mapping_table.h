@@ -0,0 +1,83 @@
+/**
+ * @file mapping_table.h
+ * @brief Changed mappings table function declarations.
+ *
+ * The table is an open addressing hash table with linear probing, with range mappings
+ * kept in a sorted array next to it. It is allocated once, so it can be used in VMX root mode.
+ */
+
+
+#pragma once
+
+
+#include <ntddk.h>
+#include "context.h"
+
+
+/**************************************************************************************************
+* Defines
+**************************************************************************************************/
+/**
+ * @name Hashing constants
+ * @brief Fibonacci hashing multiplier (2^64 divided by the golden ratio).
+ * @anchor MAPPINGTABLEHashing
+ */
+///@{
+#define MAPPING_TABLE_HASH_MULTIPLIER  0x9E3779B97F4A7C15ULL
+///@}
+
+
+/**************************************************************************************************
+* Global function declarations
+**************************************************************************************************/
+NTSTATUS MAPPING_TABLE_init(Context_EptMappingTable* const table, const UINT64 maxEntries);
+
+
+Context_EptChangedMapping* MAPPING_TABLE_find(
+  const Context_EptMappingTable* const table,
+  const UINT64 guestAddress);
+
+
+BOOLEAN MAPPING_TABLE_isHostAddressUsed(
+  const Context_EptMappingTable* const table,
+  const UINT64 hostAddress);
+
+
+BOOLEAN MAPPING_TABLE_isGuestRangeChanged(
+  const Context_EptMappingTable* const table,
+  const UINT64 guestAddress,
+  const UINT64 size);
+
+
+BOOLEAN MAPPING_TABLE_isHostRangeUsed(
+  const Context_EptMappingTable* const table,
+  const UINT64 hostAddress,
+  const UINT64 size);
+
+
+BOOLEAN MAPPING_TABLE_isFull(const Context_EptMappingTable* const table);
+
+
+BOOLEAN MAPPING_TABLE_isRangeTableFull(const Context_EptMappingTable* const table);
+
+
+NTSTATUS MAPPING_TABLE_insert(
+  Context_EptMappingTable* const table,
+  const Context_EptChangedMapping* const mapping);
+
+
+NTSTATUS MAPPING_TABLE_remove(Context_EptMappingTable* const table, const UINT64 guestAddress);
+
+
+NTSTATUS MAPPING_TABLE_setGroup(
+  Context_EptMappingTable* const table,
+  const UINT64 guestAddress,
+  const UINT64 groupId);
+
+
+Context_EptChangedMapping* MAPPING_TABLE_getNextGroupMember(
+  const Context_EptMappingTable* const table,
+  const Context_EptChangedMapping* const mapping);
+
+
+VOID MAPPING_TABLE_destroy(Context_EptMappingTable* const table);
@@ -8,7 +8,6 @@
  */
 
 
-#include "bsod.h"
 #include "memory.h"
 
 
@@ -17,6 +16,12 @@
 #endif
 
 
+/**************************************************************************************************
+* Local function declarations
+**************************************************************************************************/
+static VOID* checkAlignment(VOID* const allocatedMemory, const BOOLEAN aligned);
+
+
 /**************************************************************************************************
 * Global function definitions
 **************************************************************************************************/
@@ -35,28 +40,66 @@ VOID* Memory_allocate(const SIZE_T noOfBytes, const BOOLEAN aligned)
 {
   const SIZE_T noOfBytesToAllocate = (noOfBytes < PAGE_SIZE && aligned) ? PAGE_SIZE : noOfBytes;
 
-  // Must be POOL_FLAG_NON_PAGED_EXECUTE so MmGetVirtualForPhysical works
   VOID* const allocatedMemory =
     ExAllocatePool2(POOL_FLAG_NON_PAGED_EXECUTE, noOfBytesToAllocate, MEMORY_POOL_TAG);
-  if (allocatedMemory == NULL)
-  {
-    return NULL;
-  }
 
-  if (aligned)
+  return checkAlignment(allocatedMemory, aligned);
+}
+
+
+/**
+ * @brief Allocates memory on a NUMA node.
+ * 
+ * Same as Memory_allocate, but the memory is preferably taken from the given node, so that
+ * structures used by a single logical core are local to it.
+ * 
+ * @param noOfBytes Number of bytes to allocate.
+ * @param aligned   Whether memory should be aligned to PAGE_SIZE.
+ * @param numaNode  Preferred NUMA node.
+ * 
+ * @return Allocated memory or NULL if the allocation failed.
+ */
+VOID* Memory_allocateOnNode(const SIZE_T noOfBytes, const BOOLEAN aligned, const ULONG numaNode)
+{
+  const SIZE_T noOfBytesToAllocate = (noOfBytes < PAGE_SIZE && aligned) ? PAGE_SIZE : noOfBytes;
+
+  const POOL_EXTENDED_PARAMETER parameter =
   {
-    const BOOLEAN virtualAddressAligned = (allocatedMemory == PAGE_ALIGN(allocatedMemory));
-    const BOOLEAN physicalAddressAligned =
-      ((Memory_getPhysicalAddress(allocatedMemory) & (PAGE_SIZE - 1)) == 0);
+    .Type = PoolExtendedParameterNumaNode,
+    .PreferredNode = numaNode
+  };
+  VOID* const allocatedMemory = ExAllocatePool3(
+    POOL_FLAG_NON_PAGED_EXECUTE,
+    noOfBytesToAllocate,
+    MEMORY_POOL_TAG,
+    &parameter,
+    1);
+
+  return checkAlignment(allocatedMemory, aligned);
+}
 
-    if (!virtualAddressAligned || !physicalAddressAligned)
-    {
-      ExFreePoolWithTag(allocatedMemory, MEMORY_POOL_TAG);
-      return NULL;
-    }
-  }
 
-  return allocatedMemory;
+/**
+ * @brief Allocates physically contiguous memory on a NUMA node.
+ * 
+ * The allocation may not cross a multiple of its own size, so a power of two sized block
+ * is physically aligned to its size. The memory is not zeroed and must be freed with
+ * Memory_freeContiguous. Must be called at PASSIVE_LEVEL.
+ * 
+ * @param noOfBytes Number of bytes to allocate, power of two multiple of PAGE_SIZE.
+ * @param numaNode  Preferred NUMA node.
+ * 
+ * @return Allocated memory or NULL if the allocation failed.
+ */
+VOID* Memory_allocateContiguousOnNode(const SIZE_T noOfBytes, const ULONG numaNode)
+{
+  return MmAllocateContiguousNodeMemory(
+    noOfBytes,
+    (PHYSICAL_ADDRESS) { .QuadPart = 0 },
+    (PHYSICAL_ADDRESS) { .QuadPart = MAXLONGLONG },
+    (PHYSICAL_ADDRESS) { .QuadPart = noOfBytes },
+    PAGE_READWRITE,
+    numaNode);
 }
 
 
@@ -109,28 +152,6 @@ UINT64 Memory_getPhysicalAddress(VOID* const virtualAddress)
 }
 
 
-/**
-* @brief Returns virtual address.
-  * 
-  * Returns virtual address of a physical address.
-  * 
-  * @param physicalAddress Physical address.
-  * 
-  * @return Virtual address.
-  */
-VOID* Memory_getVirtualAddress(const UINT64 physicalAddress)
-{
-  VOID* const virtualAddress =
-    MmGetVirtualForPhysical((PHYSICAL_ADDRESS) { .QuadPart = physicalAddress });
-  if (virtualAddress == NULL)
-  {
-    KeBugCheck(BSOD_MEMORY_VA_CONVERSION);
-  }
-
-  return virtualAddress;
-}
-
-
 /**
  * @brief Frees memory.
  * 
@@ -144,3 +165,54 @@ VOID Memory_free(VOID* const address)
 {
   ExFreePoolWithTag(address, MEMORY_POOL_TAG);
 }
+
+
+/**
+ * @brief Frees memory allocated with Memory_allocateContiguousOnNode.
+ * 
+ * @param address Address to deallocate.
+ * 
+ * @return VOID
+ */
+VOID Memory_freeContiguous(VOID* const address)
+{
+  MmFreeContiguousMemory(address);
+}
+
+
+/**************************************************************************************************
+* Local function definitions
+**************************************************************************************************/
+/**
+ * @brief Checks alignment of an allocation.
+ * 
+ * Frees the memory if the aligned flag is set but the memory is not aligned to PAGE_SIZE,
+ * both virtually and physically.
+ * 
+ * @param allocatedMemory Allocated memory, can be NULL.
+ * @param aligned         Whether memory should be aligned to PAGE_SIZE.
+ * 
+ * @return The memory, or NULL if it was NULL or not aligned.
+ */
+static VOID* checkAlignment(VOID* const allocatedMemory, const BOOLEAN aligned)
+{
+  if (allocatedMemory == NULL)
+  {
+    return NULL;
+  }
+
+  if (aligned)
+  {
+    const BOOLEAN virtualAddressAligned = (allocatedMemory == PAGE_ALIGN(allocatedMemory));
+    const BOOLEAN physicalAddressAligned =
+      ((Memory_getPhysicalAddress(allocatedMemory) & (PAGE_SIZE - 1)) == 0);
+
+    if (!virtualAddressAligned || !physicalAddressAligned)
+    {
+      ExFreePoolWithTag(allocatedMemory, MEMORY_POOL_TAG);
+      return NULL;
+    }
+  }
+
+  return allocatedMemory;
+}
@@ -24,6 +24,12 @@
 VOID* Memory_allocate(const SIZE_T noOfBytes, const BOOLEAN aligned);
 
 
+VOID* Memory_allocateOnNode(const SIZE_T noOfBytes, const BOOLEAN aligned, const ULONG numaNode);
+
+
+VOID* Memory_allocateContiguousOnNode(const SIZE_T noOfBytes, const ULONG numaNode);
+
+
 VOID Memory_copy(VOID* const destination, const VOID* const source, const SIZE_T length);
 
 
@@ -33,7 +39,7 @@ BOOLEAN Memory_compare(const VOID* const source1, const VOID* const source2, con
 UINT64 Memory_getPhysicalAddress(VOID* const virtualAddress);
 
 
-VOID* Memory_getVirtualAddress(const UINT64 physicalAddress);
+VOID Memory_free(VOID* const address);
 
 
-VOID Memory_free(VOID* const address);
+VOID Memory_freeContiguous(VOID* const address);
@@ -0,0 +1,483 @@
+/**
+ * @file mtrr.c
+ * @brief Implements MTRR memory type map.
+ *
+ * Fixed MTRRs describe the first 1MB of memory and take precedence over variable MTRRs there.
+ * Above, the address space is cut at every base and end address of a variable MTRR, so that
+ * every resulting interval is covered by the same set of variable MTRRs and has one memory
+ * type. Adjacent intervals of the same type are merged.
+ */
+
+
+#include <intrin.h>
+#include "ept.h"
+#include "ia32.h"
+#include "memory.h"
+#include "mtrr.h"
+
+
+/**************************************************************************************************
+* Local type declarations
+**************************************************************************************************/
+/**
+ * @brief Fixed MTRR register description.
+ *
+ * @param msrIndex MSR index.
+ * @param rangeSize Size of the range described by each byte of the MSR.
+ */
+typedef struct MTRR_FixedMtrr
+{
+  UINT32 msrIndex;
+  UINT64 rangeSize;
+} MTRR_FixedMtrr;
+
+
+/**
+ * @brief Memory used while the variable MTRRs are turned into ranges.
+ *
+ * @param variableMtrrs Cached variable MTRRs.
+ * @param boundaries Base and end addresses of the variable MTRRs, and of the address space.
+ */
+typedef struct MTRR_VariableRangesData
+{
+  MTRR_VariableMtrr variableMtrrs[IA32_MTRR_MAX_VMTRR_COUNT];
+  UINT64 boundaries[2 * IA32_MTRR_MAX_VMTRR_COUNT + 2];
+} MTRR_VariableRangesData;
+
+
+/**************************************************************************************************
+* Local globals definitions
+**************************************************************************************************/
+/**
+ * @brief Fixed MTRRs, in order of the described addresses.
+ */
+static const MTRR_FixedMtrr fixedMtrrs[] =
+{
+  { IA32_MTRR_FIX64K_00000, 0x10000 },
+  { IA32_MTRR_FIX16K_80000, 0x4000 },
+  { IA32_MTRR_FIX16K_A0000, 0x4000 },
+  { IA32_MTRR_FIX4K_C0000, 0x1000 },
+  { IA32_MTRR_FIX4K_C8000, 0x1000 },
+  { IA32_MTRR_FIX4K_D0000, 0x1000 },
+  { IA32_MTRR_FIX4K_D8000, 0x1000 },
+  { IA32_MTRR_FIX4K_E0000, 0x1000 },
+  { IA32_MTRR_FIX4K_E8000, 0x1000 },
+  { IA32_MTRR_FIX4K_F0000, 0x1000 },
+  { IA32_MTRR_FIX4K_F8000, 0x1000 }
+};
+
+
+/**************************************************************************************************
+* Local function declarations
+**************************************************************************************************/
+static VOID appendRange(
+  MTRR_Map* const map,
+  const UINT64 baseAddress,
+  const UINT64 endAddress,
+  const UINT64 memoryType);
+
+
+static VOID appendFixedRanges(MTRR_Map* const map);
+
+
+static NTSTATUS appendVariableRanges(
+  MTRR_Map* const map,
+  const UINT64 noOfVariableRangeRegisters,
+  const UINT64 defaultMemoryType,
+  const UINT64 baseAddress,
+  const UINT64 endAddress);
+
+
+static VOID fillVariableMtrrsCache(
+  const UINT64 noOfVariableRangeRegisters,
+  MTRR_VariableMtrr* const variableMtrrs);
+
+
+static UINT64 searchVariableMtrrs(
+  const UINT64 noOfVariableMtrrs,
+  const MTRR_VariableMtrr variableMtrrs[],
+  const UINT64 defaultMemoryType,
+  const UINT64 physicalAddress);
+
+
+/**************************************************************************************************
+* Global function definitions
+**************************************************************************************************/
+/**
+ * @brief Builds the memory type map.
+ *
+ * Reads the MTRRs of the current logical core. If MTRRs are not supported or disabled,
+ * the whole address space gets IA32_MTRR_DISABLED_DEFAULT_TYPE. Must be called at
+ * PASSIVE_LEVEL.
+ *
+ * @param addressLimit First address after the address space to describe.
+ * @param map Map to build.
+ *
+ * @return STATUS_SUCCESS on success, STATUS_UNSUCCESSFUL if the memory type of some range
+ * cannot be determined or memory allocation failed.
+ */
+NTSTATUS MTRR_buildMap(const UINT64 addressLimit, MTRR_Map* const map)
+{
+  map->noOfRanges = 0;
+
+  IA32_CpuidBasicInformation1 cpuid = { 0 };
+  __cpuid(cpuid.registers, IA32_CPUID_BASIC_INFORMATION_1);
+  const IA32_MtrrDefType mtrrDefType = { .bits = cpuid.mtrr ? __readmsr(IA32_MTRR_DEF_TYPE) : 0 };
+  if (!mtrrDefType.mtrrEnable)
+  {
+    appendRange(map, 0, addressLimit, IA32_MTRR_DISABLED_DEFAULT_TYPE);
+    return STATUS_SUCCESS;
+  }
+
+  UINT64 variableRangesBase = 0;
+  const IA32_Mtrrcap mtrrCap = { .bits = __readmsr(IA32_MTRRCAP) };
+  if (mtrrCap.fixedRangeRegistersSupported && mtrrDefType.fixedRangeMtrrEnable)
+  {
+    appendFixedRanges(map);
+    variableRangesBase = MTRR_FIXED_RANGES_END;
+  }
+
+  return appendVariableRanges(
+    map,
+    mtrrCap.variableRangeRegistersCount,
+    mtrrDefType.defaultMemoryType,
+    variableRangesBase,
+    addressLimit);
+}
+
+
+/**
+ * @brief Returns memory type of an address range.
+ *
+ * Finds the map range containing the address with a binary search.
+ *
+ * @param map Memory type map.
+ * @param address First address of the range, must be below the map's address limit.
+ * @param size Size of the range.
+ *
+ * @return Memory type of the range, or MTRR_MEMORY_TYPE_MIXED if parts of the range have
+ * different memory types.
+ */
+UINT64 MTRR_getMemoryType(const MTRR_Map* const map, const UINT64 address, const UINT64 size)
+{
+  UINT64 firstIndex = 0;
+  UINT64 lastIndex = map->noOfRanges - 1;
+  while (firstIndex < lastIndex)
+  {
+    const UINT64 middleIndex = (firstIndex + lastIndex + 1) / 2;
+    if (map->ranges[middleIndex].baseAddress <= address)
+    {
+      firstIndex = middleIndex;
+    }
+    else
+    {
+      lastIndex = middleIndex - 1;
+    }
+  }
+
+  const MTRR_Range* const range = &map->ranges[firstIndex];
+  return (address + size <= range->endAddress) ? range->memoryType : MTRR_MEMORY_TYPE_MIXED;
+}
+
+
+/**************************************************************************************************
+* Local function definitions
+**************************************************************************************************/
+/**
+ * @brief Appends a range to the map.
+ *
+ * The range is merged with the last range of the map if both have the same memory type.
+ *
+ * @param map Map to append to.
+ * @param baseAddress First address of the range, equal to the end of the last range.
+ * @param endAddress First address after the range.
+ * @param memoryType Memory type of the range.
+ *
+ * @return VOID
+ */
+static VOID appendRange(
+  MTRR_Map* const map,
+  const UINT64 baseAddress,
+  const UINT64 endAddress,
+  const UINT64 memoryType)
+{
+  if (map->noOfRanges != 0 && map->ranges[map->noOfRanges - 1].memoryType == memoryType)
+  {
+    map->ranges[map->noOfRanges - 1].endAddress = endAddress;
+    return;
+  }
+
+  map->ranges[map->noOfRanges] = (MTRR_Range)
+  {
+    .baseAddress = baseAddress,
+    .endAddress = endAddress,
+    .memoryType = memoryType
+  };
+  map->noOfRanges++;
+}
+
+
+/**
+ * @brief Appends ranges described by fixed MTRRs to the map.
+ *
+ * Must be called on an empty map. Every byte of a fixed MTRR describes one range.
+ *
+ * @param map Map to append to.
+ *
+ * @return VOID
+ */
+static VOID appendFixedRanges(MTRR_Map* const map)
+{
+  UINT64 address = 0;
+  for (UINT64 fixedMtrrIndex = 0; fixedMtrrIndex < ARRAYSIZE(fixedMtrrs); fixedMtrrIndex++)
+  {
+    const UINT64 msr = __readmsr(fixedMtrrs[fixedMtrrIndex].msrIndex);
+    const UINT64 rangeSize = fixedMtrrs[fixedMtrrIndex].rangeSize;
+    for (UINT64 msrByteIndex = 0; msrByteIndex < 8; msrByteIndex++)
+    {
+      const UINT64 memoryType = (msr >> (msrByteIndex * 8)) & 0xFF;
+      appendRange(map, address, address + rangeSize, memoryType);
+      address += rangeSize;
+    }
+  }
+}
+
+
+/**
+ * @brief Appends ranges described by variable MTRRs to the map.
+ *
+ * The given address range is cut at every base and end address of a valid variable MTRR,
+ * the boundaries are sorted with an insertion sort, since there are only a few of them.
+ *
+ * @param map Map to append to.
+ * @param noOfVariableRangeRegisters Number of variable range registers.
+ * @param defaultMemoryType Default memory type.
+ * @param baseAddress First address of the range to describe, equal to the end of the map.
+ * @param endAddress First address after the range to describe.
+ *
+ * @return STATUS_SUCCESS on success, error code otherwise.
+ */
+static NTSTATUS appendVariableRanges(
+  MTRR_Map* const map,
+  const UINT64 noOfVariableRangeRegisters,
+  const UINT64 defaultMemoryType,
+  const UINT64 baseAddress,
+  const UINT64 endAddress)
+{
+  MTRR_VariableRangesData* const data = Memory_allocate(sizeof(MTRR_VariableRangesData), FALSE);
+  if (data == NULL)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  fillVariableMtrrsCache(noOfVariableRangeRegisters, data->variableMtrrs);
+
+  UINT64 noOfBoundaries = 0;
+  data->boundaries[noOfBoundaries++] = baseAddress;
+  data->boundaries[noOfBoundaries++] = endAddress;
+  for (UINT64 mtrrIndex = 0; mtrrIndex < noOfVariableRangeRegisters; mtrrIndex++)
+  {
+    const MTRR_VariableMtrr* const variableMtrr = &data->variableMtrrs[mtrrIndex];
+    if (!variableMtrr->valid)
+    {
+      continue;
+    }
+
+    const UINT64 mtrrBoundaries[] =
+    {
+      variableMtrr->baseAddress,
+      variableMtrr->baseAddress + variableMtrr->length
+    };
+    for (UINT64 boundaryIndex = 0; boundaryIndex < ARRAYSIZE(mtrrBoundaries); boundaryIndex++)
+    {
+      if (baseAddress < mtrrBoundaries[boundaryIndex] && mtrrBoundaries[boundaryIndex] < endAddress)
+      {
+        data->boundaries[noOfBoundaries++] = mtrrBoundaries[boundaryIndex];
+      }
+    }
+  }
+
+  for (UINT64 boundaryIndex = 1; boundaryIndex < noOfBoundaries; boundaryIndex++)
+  {
+    const UINT64 boundary = data->boundaries[boundaryIndex];
+    UINT64 insertIndex = boundaryIndex;
+    for (; insertIndex > 0 && data->boundaries[insertIndex - 1] > boundary; insertIndex--)
+    {
+      data->boundaries[insertIndex] = data->boundaries[insertIndex - 1];
+    }
+    data->boundaries[insertIndex] = boundary;
+  }
+
+  NTSTATUS ntStatus = STATUS_SUCCESS;
+  for (UINT64 boundaryIndex = 0; boundaryIndex + 1 < noOfBoundaries; boundaryIndex++)
+  {
+    if (data->boundaries[boundaryIndex] == data->boundaries[boundaryIndex + 1])
+    {
+      continue;
+    }
+
+    // The interval is covered by the same variable MTRRs as its first address
+    const UINT64 memoryType = searchVariableMtrrs(
+      noOfVariableRangeRegisters,
+      data->variableMtrrs,
+      defaultMemoryType,
+      data->boundaries[boundaryIndex]);
+    if (memoryType == IA32_MTRR_MEMORY_TYPE_ERR)
+    {
+      ntStatus = STATUS_UNSUCCESSFUL;
+      break;
+    }
+
+    appendRange(map, data->boundaries[boundaryIndex], data->boundaries[boundaryIndex + 1], memoryType);
+  }
+
+  Memory_free(data);
+  return ntStatus;
+}
+
+
+/**
+ * @brief Fills variable MTRRs cache.
+ *
+ * This function caches MTRR information in a local array.
+ *
+ * @param noOfVariableRangeRegisters Number of variable range registers.
+ * @param variableMtrrs Array where MTRR information will be stored.
+ *
+ * @return VOID
+ */
+static VOID fillVariableMtrrsCache(
+  const UINT64 noOfVariableRangeRegisters,
+  MTRR_VariableMtrr* const variableMtrrs)
+{
+  for (UINT32 mtrrIndex = 0; mtrrIndex < noOfVariableRangeRegisters; mtrrIndex++)
+  {
+    const IA32_MtrrPhysbase physbase =
+    { .bits = __readmsr(IA32_MTRR_PHYSBASE0 + IA32_MTRR_PHYSBASE0_INC * mtrrIndex) };
+    const IA32_MtrrPhysmask physmask =
+    { .bits = __readmsr(IA32_MTRR_PHYSMASK0 + IA32_MTRR_PHYSMASK0_INC * mtrrIndex) };
+
+    if (!physmask.valid)
+    {
+      continue;
+    }
+
+    ULONG firstOneIndex = { 0 };
+    BOOLEAN isNonzero = _BitScanForward64(&firstOneIndex, (EPT_Address)
+    {
+      .pageFrameNumber4KB = physmask.physMask
+    }.address);
+
+    if (!isNonzero)
+    {
+      continue;
+    }
+
+    variableMtrrs[mtrrIndex] = (MTRR_VariableMtrr)
+    {
+      .baseAddress = (EPT_Address) {.pageFrameNumber4KB = physbase.physBase }.address,
+      .length = 1LLU << firstOneIndex,
+      .memoryType = physbase.memoryType,
+      .valid = TRUE,
+    };
+  }
+}
+
+
+/**
+ * @brief Searches MTRRs for given address' memory type.
+ *
+ * @param noOfVariableMtrrs Number of variable MTRRs.
+ * @param variableMtrrs Array with MTRR information.
+ * @param defaultMemoryType Default memory type.
+ * @param physicalAddress Physical address.
+ *
+ * @return Memory type, or IA32_MTRR_MEMORY_TYPE_ERR on error.
+ */
+static UINT64 searchVariableMtrrs(
+  const UINT64 noOfVariableMtrrs,
+  const MTRR_VariableMtrr variableMtrrs[],
+  const UINT64 defaultMemoryType,
+  const UINT64 physicalAddress)
+{
+  MTRR_FoundMemoryTypes foundTypes = { 0 };
+
+  for (UINT64 mtrrIndex = 0; mtrrIndex < noOfVariableMtrrs; mtrrIndex++)
+  {
+    const MTRR_VariableMtrr* currentMtrr = &variableMtrrs[mtrrIndex];
+    if (!currentMtrr->valid)
+    {
+      continue;
+    }
+
+    if (!((currentMtrr->baseAddress <= physicalAddress) && (physicalAddress < (currentMtrr->baseAddress + currentMtrr->length))))
+    {
+      continue;
+    }
+
+    switch (currentMtrr->memoryType)
+    {
+    case IA32_MTRR_MEMORY_TYPE_UC:
+    {
+      foundTypes.uncacheable = 1;
+      break;
+    }
+    case IA32_MTRR_MEMORY_TYPE_WC:
+    {
+      foundTypes.writeCombining = 1;
+      break;
+    }
+    case IA32_MTRR_MEMORY_TYPE_WT:
+    {
+      foundTypes.writeThrough = 1;
+      break;
+    }
+    case IA32_MTRR_MEMORY_TYPE_WP:
+    {
+      foundTypes.writeProtected = 1;
+      break;
+    }
+    case IA32_MTRR_MEMORY_TYPE_WB:
+    {
+      foundTypes.writeback = 1;
+      break;
+    }
+    default:
+    {
+      return IA32_MTRR_MEMORY_TYPE_ERR;
+      break;
+    }
+    }
+  }
+
+  if ((foundTypes.uncacheable + foundTypes.writeCombining + foundTypes.writeThrough + foundTypes.writeProtected + foundTypes.writeback) == 1)
+  {
+    if (foundTypes.uncacheable)
+      return IA32_MTRR_MEMORY_TYPE_UC;
+    if (foundTypes.writeCombining)
+      return IA32_MTRR_MEMORY_TYPE_WC;
+    if (foundTypes.writeThrough)
+      return IA32_MTRR_MEMORY_TYPE_WT;
+    if (foundTypes.writeProtected)
+      return IA32_MTRR_MEMORY_TYPE_WP;
+    if (foundTypes.writeback)
+      return IA32_MTRR_MEMORY_TYPE_WB;
+  }
+
+  if (foundTypes.uncacheable)
+  {
+    return IA32_MTRR_MEMORY_TYPE_UC;
+  }
+
+  if (foundTypes.writeThrough == 1 && foundTypes.writeback == 1 && ((foundTypes.uncacheable + foundTypes.writeCombining + foundTypes.writeProtected) == 0))
+  {
+    return IA32_MTRR_MEMORY_TYPE_WT;
+  }
+
+  if ((foundTypes.uncacheable + foundTypes.writeCombining + foundTypes.writeThrough + foundTypes.writeProtected + foundTypes.writeback) != 0)
+  {
+    return IA32_MTRR_MEMORY_TYPE_ERR;
+  }
+
+  return defaultMemoryType;
+}
@@ -0,0 +1,112 @@
+/**
+ * @file mtrr.h
+ * @brief MTRR memory type map data types and function declarations.
+ *
+ * The map describes memory types of the physical address space as sorted, non-overlapping
+ * ranges. It is computed once from the fixed and variable MTRRs, so that memory types of
+ * whole EPT pages can be looked up without reading the MTRRs again.
+ */
+
+
+#pragma once
+
+
+#include <ntddk.h>
+#include "ia32.h"
+
+
+/**************************************************************************************************
+* Defines
+**************************************************************************************************/
+/**
+ * @name MTRR map constants
+ * @brief Number of fixed ranges, end of the fixed ranges, maximal number of map ranges, and
+ * the memory type returned for address ranges with more than one memory type.
+ * @anchor MTRRMapConstants
+ */
+///@{
+#define MTRR_NO_OF_FIXED_RANGES   88
+#define MTRR_FIXED_RANGES_END     0x100000
+#define MTRR_MAX_RANGES           (MTRR_NO_OF_FIXED_RANGES + 2 * IA32_MTRR_MAX_VMTRR_COUNT + 1)
+#define MTRR_MEMORY_TYPE_MIXED    0xFFFE
+///@}
+
+
+/**************************************************************************************************
+* Type declarations
+**************************************************************************************************/
+/**
+ * @brief Variable MTRR cache helper structure.
+ *
+ * @param baseAddress Base address
+ * @param length Length
+ * @param memoryType Memory type
+ * @param valid TRUE if valid
+ */
+typedef struct MTRR_VariableMtrr
+{
+  UINT64 baseAddress;
+  UINT64 length;
+  UINT64 memoryType;
+  BOOLEAN valid;
+} MTRR_VariableMtrr;
+
+
+/**
+ * @brief Helper structure for found memory types.
+ *
+ * @param uncacheable TRUE if uncacheable
+ * @param writeCombining TRUE if write combining
+ * @param writeThrough TRUE if write through
+ * @param writeProtected TRUE if write protected
+ * @param writeback TRUE if writeback
+ */
+typedef struct MTRR_FoundMemoryTypes
+{
+  UINT8 uncacheable : 1;
+  UINT8 writeCombining : 1;
+  UINT8 writeThrough : 1;
+  UINT8 writeProtected : 1;
+  UINT8 writeback : 1;
+  UINT8 _pad1 : 3;
+} MTRR_FoundMemoryTypes;
+
+
+/**
+ * @brief Range of physical memory with a single memory type.
+ *
+ * @param baseAddress First address of the range.
+ * @param endAddress First address after the range.
+ * @param memoryType Memory type of the range.
+ */
+typedef struct MTRR_Range
+{
+  UINT64 baseAddress;
+  UINT64 endAddress;
+  UINT64 memoryType;
+} MTRR_Range;
+
+
+/**
+ * @brief Memory type map.
+ *
+ * Ranges are sorted by address and cover the mapped address space without gaps.
+ * Adjacent ranges always have different memory types.
+ *
+ * @param noOfRanges Number of ranges.
+ * @param ranges Array of ranges.
+ */
+typedef struct MTRR_Map
+{
+  UINT64 noOfRanges;
+  MTRR_Range ranges[MTRR_MAX_RANGES];
+} MTRR_Map;
+
+
+/**************************************************************************************************
+* Global function declarations
+**************************************************************************************************/
+NTSTATUS MTRR_buildMap(const UINT64 addressLimit, MTRR_Map* const map);
+
+
+UINT64 MTRR_getMemoryType(const MTRR_Map* const map, const UINT64 address, const UINT64 size);
@@ -0,0 +1,240 @@
+/**
+ * @file page_pool.c
+ * @brief Implements page pool.
+ *
+ * Free pages are kept on an interlocked singly linked list, with the list entry stored
+ * in the free page itself. Taking and returning pages never allocates, so it is safe in
+ * VMX root mode. The pool is refilled at PASSIVE_LEVEL in chunks of pages, which are only
+ * freed when the pool is destroyed. Chunk pages are registered in the PFN table, so tables
+ * taken from the pool can be found by their physical address in VMX root mode.
+ *
+ * A chunk is physically contiguous and aligned to its size, a power of two number of pages,
+ * so tables taken from it are dense in physical memory. A 2MB arena fills exactly one PFN
+ * table leaf. If physical memory is too fragmented for a chunk, it falls back to a pool
+ * allocation.
+ */
+
+
+#include "memory.h"
+#include "page_pool.h"
+#include "pfn_table.h"
+
+
+/**************************************************************************************************
+* Local function declarations
+**************************************************************************************************/
+static VOID freeChunkPages(Context_EptPagePoolChunk* const chunk);
+
+
+/**************************************************************************************************
+* Global function definitions
+**************************************************************************************************/
+/**
+ * @brief Initializes an empty pool.
+ *
+ * @param pool Pool to initialize.
+ * @param numaNode NUMA node chunks are allocated on.
+ * @param noOfPagesPerChunk Number of pages allocated at once, a power of two.
+ *
+ * @return VOID
+ */
+VOID PAGE_POOL_init(
+  Context_EptPagePool* const pool,
+  const ULONG numaNode,
+  const UINT64 noOfPagesPerChunk)
+{
+  InitializeSListHead(&pool->freePages);
+  InitializeSListHead(&pool->retiredPages);
+  ExInitializeFastMutex(&pool->chunksMutex);
+  pool->chunks = NULL;
+  pool->noOfPages = 0;
+  pool->numaNode = numaNode;
+  pool->noOfPagesPerChunk = noOfPagesPerChunk;
+}
+
+
+/**
+ * @brief Makes sure the pool has at least the given number of free pages.
+ *
+ * Allocates new chunks until the number of free pages is sufficient. Pages of a chunk are
+ * pushed in reverse, so they are taken in ascending address order. Must be called at
+ * PASSIVE_LEVEL.
+ *
+ * @param pool Pool to refill.
+ * @param noOfFreePages Required number of free pages.
+ *
+ * @return STATUS_SUCCESS on success, STATUS_UNSUCCESSFUL otherwise.
+ */
+NTSTATUS PAGE_POOL_reserve(Context_EptPagePool* const pool, const UINT64 noOfFreePages)
+{
+  NTSTATUS ntStatus = STATUS_SUCCESS;
+
+  ExAcquireFastMutex(&pool->chunksMutex);
+  while (QueryDepthSList(&pool->freePages) < noOfFreePages)
+  {
+    Context_EptPagePoolChunk* const chunk =
+      Memory_allocateOnNode(sizeof(Context_EptPagePoolChunk), FALSE, pool->numaNode);
+    if (chunk == NULL)
+    {
+      ntStatus = STATUS_UNSUCCESSFUL;
+      break;
+    }
+
+    const SIZE_T chunkSize = pool->noOfPagesPerChunk * PAGE_SIZE;
+    chunk->pages = Memory_allocateContiguousOnNode(chunkSize, pool->numaNode);
+    chunk->isContiguous = chunk->pages != NULL;
+    if (!chunk->isContiguous)
+    {
+      chunk->pages = Memory_allocateOnNode(chunkSize, TRUE, pool->numaNode);
+    }
+    if (chunk->pages == NULL)
+    {
+      Memory_free(chunk);
+      ntStatus = STATUS_UNSUCCESSFUL;
+      break;
+    }
+
+    ntStatus = PFN_TABLE_insert(chunk->pages, chunkSize);
+    if (!NT_SUCCESS(ntStatus))
+    {
+      freeChunkPages(chunk);
+      Memory_free(chunk);
+      break;
+    }
+
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+    pool->noOfPages += pool->noOfPagesPerChunk;
+
+    for (UINT64 pageIndex = pool->noOfPagesPerChunk; pageIndex > 0; pageIndex--)
+    {
+      PAGE_POOL_push(pool, (CHAR*)chunk->pages + (pageIndex - 1) * PAGE_SIZE);
+    }
+  }
+  ExReleaseFastMutex(&pool->chunksMutex);
+
+  return ntStatus;
+}
+
+
+/**
+ * @brief Takes a free page from the pool.
+ *
+ * Can be called at any IRQL and in VMX root mode.
+ *
+ * @param pool Pool to take the page from.
+ *
+ * @return Page aligned page, not zeroed, or NULL if the pool is empty.
+ */
+VOID* PAGE_POOL_pop(Context_EptPagePool* const pool)
+{
+  return InterlockedPopEntrySList(&pool->freePages);
+}
+
+
+/**
+ * @brief Returns a page to the pool.
+ *
+ * Can be called at any IRQL and in VMX root mode.
+ *
+ * @param pool Pool the page was taken from.
+ * @param page Page to return.
+ *
+ * @return VOID
+ */
+VOID PAGE_POOL_push(Context_EptPagePool* const pool, VOID* const page)
+{
+  InterlockedPushEntrySList(&pool->freePages, (PSLIST_ENTRY)page);
+}
+
+
+/**
+ * @brief Retires a page that may still be cached by a logical core.
+ *
+ * The page becomes free after a call to PAGE_POOL_recycleRetired. Can be called at any
+ * IRQL and in VMX root mode.
+ *
+ * @param pool Pool the page was taken from.
+ * @param page Page to retire.
+ *
+ * @return VOID
+ */
+VOID PAGE_POOL_retire(Context_EptPagePool* const pool, VOID* const page)
+{
+  InterlockedPushEntrySList(&pool->retiredPages, (PSLIST_ENTRY)page);
+}
+
+
+/**
+ * @brief Moves all retired pages to the free list.
+ *
+ * Must only be called once EPT caches of all logical cores have been invalidated since
+ * the pages were retired.
+ *
+ * @param pool Pool to recycle pages of.
+ *
+ * @return VOID
+ */
+VOID PAGE_POOL_recycleRetired(Context_EptPagePool* const pool)
+{
+  PSLIST_ENTRY page = InterlockedFlushSList(&pool->retiredPages);
+  while (page != NULL)
+  {
+    PSLIST_ENTRY const nextPage = page->Next;
+    PAGE_POOL_push(pool, page);
+    page = nextPage;
+  }
+}
+
+
+/**
+ * @brief Frees all pages of the pool.
+ *
+ * Pages still in use are freed as well, so the pool may only be destroyed when its pages
+ * are no longer referenced by any EPT hierarchy in use.
+ *
+ * @param pool Pool to destroy.
+ *
+ * @return VOID
+ */
+VOID PAGE_POOL_destroy(Context_EptPagePool* const pool)
+{
+  InterlockedFlushSList(&pool->freePages);
+  InterlockedFlushSList(&pool->retiredPages);
+
+  Context_EptPagePoolChunk* chunk = pool->chunks;
+  while (chunk != NULL)
+  {
+    Context_EptPagePoolChunk* const nextChunk = chunk->next;
+    PFN_TABLE_remove(chunk->pages, pool->noOfPagesPerChunk * PAGE_SIZE);
+    freeChunkPages(chunk);
+    Memory_free(chunk);
+    chunk = nextChunk;
+  }
+
+  pool->chunks = NULL;
+  pool->noOfPages = 0;
+}
+
+
+/**************************************************************************************************
+* Local function definitions
+**************************************************************************************************/
+/**
+ * @brief Frees pages of a chunk with the allocator they were taken from.
+ *
+ * @param chunk Chunk to free pages of.
+ *
+ * @return VOID
+ */
+static VOID freeChunkPages(Context_EptPagePoolChunk* const chunk)
+{
+  if (chunk->isContiguous)
+  {
+    Memory_freeContiguous(chunk->pages);
+  }
+  else
+  {
+    Memory_free(chunk->pages);
+  }
+}
@@ -0,0 +1,61 @@
+/**
+ * @file page_pool.h
+ * @brief Page pool constants and function declarations.
+ *
+ * The pool provides 4KB pages used as EPT page tables. Pages can be taken and returned
+ * in VMX root mode, but the pool can only grow at PASSIVE_LEVEL. The pool grows by physically
+ * contiguous chunks, so that tables of a hierarchy are dense in physical memory. The shared
+ * hierarchy grows by 2MB arenas, while per-core hierarchies, which only need a few dozen
+ * tables each once regions without RAM are populated on first access, grow by smaller chunks.
+ */
+
+
+#pragma once
+
+
+#include <ntddk.h>
+#include "context.h"
+
+
+/**************************************************************************************************
+* Defines
+**************************************************************************************************/
+/**
+ * @name Pool sizes
+ * @brief Number of pages allocated at once by the split pool of the shared hierarchy and by
+ * those of per-core hierarchies, and number of free pages the driver keeps in reserve on
+ * top of what a request needs.
+ * @anchor PAGEPOOLSizes
+ */
+///@{
+#define PAGE_POOL_PAGES_PER_ARENA  512
+#define PAGE_POOL_PAGES_PER_CHUNK  64
+#define PAGE_POOL_LOW_WATERMARK    16
+///@}
+
+
+/**************************************************************************************************
+* Global function declarations
+**************************************************************************************************/
+VOID PAGE_POOL_init(
+  Context_EptPagePool* const pool,
+  const ULONG numaNode,
+  const UINT64 noOfPagesPerChunk);
+
+
+NTSTATUS PAGE_POOL_reserve(Context_EptPagePool* const pool, const UINT64 noOfFreePages);
+
+
+VOID* PAGE_POOL_pop(Context_EptPagePool* const pool);
+
+
+VOID PAGE_POOL_push(Context_EptPagePool* const pool, VOID* const page);
+
+
+VOID PAGE_POOL_retire(Context_EptPagePool* const pool, VOID* const page);
+
+
+VOID PAGE_POOL_recycleRetired(Context_EptPagePool* const pool);
+
+
+VOID PAGE_POOL_destroy(Context_EptPagePool* const pool);
@@ -3,17 +3,198 @@
  * @brief Implements driver page swapper.
  * 
  * Provides delegation mechanism for mapping and unmapping pages. It allows the driver
- * to communicate with all logical cores to perform EPT structure changes.
+ * to communicate with all logical cores to perform EPT structure changes. In the shared
+ * EPT mode the change is performed once, on the current core, and the other cores are
+ * only asked to invalidate their EPT caches. Page tables needed to split large pages are
+ * reserved here, at PASSIVE_LEVEL, since root mode cannot allocate memory. Large pages
+ * mapping single pages are also split here before synchronous changes, so the VMCALL run
+ * while the other cores spin in the IPI only writes page table entries and invalidates.
+ * Regions can be prepared ahead of time, their page tables are then kept until they are
+ * unprepared. Physically contiguous ranges can be remapped as a single mapping, keeping
+ * their large pages.
+ *
+ * Asynchronous requests pend their IRP instead of spinning all cores in an IPI. The change
+ * is queued to every logical core as a targeted DPC, and the IRP is completed from a work
+ * item once the last core has applied it. DPCs are queued under the mutex and each core
+ * runs its DPCs in order, so all cores see the changes in the same order. Synchronous
+ * changes wait for queued DPCs first, so an IPI never overtakes them.
+ *
+ * EPT accessed and dirty flags are harvested, and dirty flags cleared for dirty logging,
+ * under the same mutex, so page tables being scanned are never recycled in the meantime.
  */
 
 
 #include "context.h"
+#include "ept.h"
+#include "mapping_table.h"
 #include "memory.h"
+#include "page_pool.h"
 #include "page_swapper.h"
 #include "vmexit.h"
 #include "vmx.h"
 
 
+/**************************************************************************************************
+* Local type declarations
+**************************************************************************************************/
+/**
+ * @brief Batch of mapping changes broadcast to all logical cores.
+ *
+ * @param vmCallCode VMCALL code used to apply the batch.
+ * @param noOfMappings Number of mapping changes in the batch.
+ * @param mappings Array of mapping changes.
+ * @param coreStatuses Per-core status arrays, noOfMappings entries for each logical core.
+ */
+typedef struct PAGE_SWAPPER_Batch
+{
+  UINT64 vmCallCode;
+  UINT64 noOfMappings;
+  const Context_EptChangedMapping* mappings;
+  NTSTATUS* coreStatuses;
+} PAGE_SWAPPER_Batch;
+
+
+/**
+ * @brief Single mapping change broadcast to all logical cores.
+ *
+ * @param ipiWorker Worker applying the change on the current logical core.
+ * @param mapping Mapping to apply.
+ * @param coreStatuses Status of every logical core.
+ */
+typedef struct PAGE_SWAPPER_Change
+{
+  PKIPI_BROADCAST_WORKER ipiWorker;
+  const Context_EptChangedMapping* mapping;
+  NTSTATUS* coreStatuses;
+} PAGE_SWAPPER_Change;
+
+
+/**
+ * @brief Change undoing a mapping change on the logical cores where it succeeded.
+ *
+ * @param mappingIndex Index of the undone mapping in the original change.
+ * @param ipiWorker Worker applying the undo on the current logical core.
+ * @param mapping Mapping restoring the original state.
+ */
+typedef struct PAGE_SWAPPER_Undo
+{
+  UINT64 mappingIndex;
+  PKIPI_BROADCAST_WORKER ipiWorker;
+  Context_EptChangedMapping mapping;
+} PAGE_SWAPPER_Undo;
+
+
+/**
+ * @brief Rollback of mapping changes which succeeded on some logical cores only.
+ *
+ * @param noOfMappings Number of mappings in the original change.
+ * @param coreStatuses Per-core status arrays of the original change, noOfMappings entries for
+ * each logical core.
+ * @param noOfUndos Number of undo changes.
+ * @param undos Array of undo changes, in the order they are applied.
+ * @param status STATUS_SUCCESS, or the first error reported by any core.
+ */
+typedef struct PAGE_SWAPPER_Rollback
+{
+  UINT64 noOfMappings;
+  const NTSTATUS* coreStatuses;
+  UINT64 noOfUndos;
+  const PAGE_SWAPPER_Undo* undos;
+  volatile LONG status;
+} PAGE_SWAPPER_Rollback;
+
+
+#pragma warning(disable:4200)
+/**
+ * @brief Mapping change propagated to all logical cores by DPCs.
+ *
+ * @param irp Pended IRP completed once all cores applied the change.
+ * @param workItem Work item completing the IRP at PASSIVE_LEVEL.
+ * @param dpcWorker Worker run by the DPC of every core.
+ * @param mapping Mapping to apply.
+ * @param noOfPendingCores Number of cores which have not applied the change yet.
+ * @param status STATUS_SUCCESS, or the first error reported by any core.
+ * @param coreStatuses Status of every logical core, stored after the DPCs.
+ * @param dpcs DPC of every logical core.
+ */
+typedef struct PAGE_SWAPPER_AsyncRequest
+{
+  PIRP irp;
+  PIO_WORKITEM workItem;
+  PKIPI_BROADCAST_WORKER dpcWorker;
+  Context_EptChangedMapping mapping;
+  volatile LONG noOfPendingCores;
+  volatile LONG status;
+  NTSTATUS* coreStatuses;
+  KDPC dpcs[];
+} PAGE_SWAPPER_AsyncRequest;
+#pragma warning(default:4200)
+
+
+/**
+ * @brief 2MB region prepared by a handle.
+ *
+ * Physical addresses are kept, since the virtual region may be gone when the handle is
+ * closed.
+ *
+ * @param owner File object of the handle which prepared the region, NULL if the entry is free.
+ * @param largePage 2MB page frame number of the region.
+ */
+typedef struct PAGE_SWAPPER_PreparedRegion
+{
+  PFILE_OBJECT owner;
+  UINT64 largePage;
+} PAGE_SWAPPER_PreparedRegion;
+
+
+/**************************************************************************************************
+* Local globals definitions
+**************************************************************************************************/
+/**
+ * @brief Mutex serializing mapping changes.
+ *
+ * Split tables retired by one change must not be recycled after an invalidation
+ * broadcast of another change that started before they were retired.
+ */
+static FAST_MUTEX swapperMutex;
+
+
+/**
+ * @brief Number of asynchronous requests not applied by all cores yet.
+ *
+ * Split tables are not recycled while any is in flight, since some cores may not have
+ * invalidated their EPT caches after the tables were retired.
+ */
+static volatile LONG noOfAsyncRequests;
+
+
+/**
+ * @brief Notification event set when the last asynchronous request in flight was applied.
+ */
+static KEVENT asyncIdleEvent;
+
+
+/**
+ * @brief Regions prepared by all handles, guarded by the mutex.
+ *
+ * A region prepared by several handles has an entry for each of them, and stays pinned
+ * until the last one releases it.
+ */
+static PAGE_SWAPPER_PreparedRegion preparedRegions[PAGE_SWAPPER_MAX_PREPARED_REGIONS];
+
+
+/**
+ * @brief Notification event set to stop the refill worker.
+ */
+static KEVENT refillStopEvent;
+
+
+/**
+ * @brief Refill worker thread, NULL if it is not running.
+ */
+static PKTHREAD refillThread;
+
+
 /**************************************************************************************************
 * Local function declarations
 **************************************************************************************************/
@@ -23,9 +204,196 @@ static KIPI_BROADCAST_WORKER PAGE_SWAPPER_mapIpi;
 static KIPI_BROADCAST_WORKER PAGE_SWAPPER_unmapIpi;
 
 
+static KIPI_BROADCAST_WORKER PAGE_SWAPPER_mapRangeIpi;
+
+
+static KIPI_BROADCAST_WORKER PAGE_SWAPPER_groupIpi;
+
+
+static KIPI_BROADCAST_WORKER PAGE_SWAPPER_batchIpi;
+
+
+static KIPI_BROADCAST_WORKER PAGE_SWAPPER_changeIpi;
+
+
+static KIPI_BROADCAST_WORKER PAGE_SWAPPER_rollbackIpi;
+
+
+static KIPI_BROADCAST_WORKER PAGE_SWAPPER_invalidateIpi;
+
+
+static KDEFERRED_ROUTINE PAGE_SWAPPER_asyncDpc;
+
+
+static IO_WORKITEM_ROUTINE PAGE_SWAPPER_completeAsync;
+
+
+static KSTART_ROUTINE PAGE_SWAPPER_refillWorker;
+
+
+static NTSTATUS submitAsync(
+  PDEVICE_OBJECT deviceObject,
+  PIRP irp,
+  PKIPI_BROADCAST_WORKER ipiWorker,
+  const Context_EptChangedMapping* const mapping);
+
+
+static VOID finishAsync(PAGE_SWAPPER_AsyncRequest* const request);
+
+
+static VOID acquireForSyncChange(VOID);
+
+
+static NTSTATUS applyMapping(
+  PKIPI_BROADCAST_WORKER ipiWorker,
+  const Context_EptChangedMapping* const mapping);
+
+
+static VOID recycleSplitTables(VOID);
+
+
+static NTSTATUS getRangePhysicalAddress(
+  VOID* const virtualAddress,
+  const UINT64 size,
+  UINT64* const physicalAddress);
+
+
+static UINT64 collectViolations(const UINT64 guestAddress, const BOOLEAN reset);
+
+
+static NTSTATUS reserveSplitTables(
+  const UINT64 noOfMappings,
+  const Context_EptChangedMapping* const mappings);
+
+
+static NTSTATUS splitLargePages(
+  const UINT64 noOfMappings,
+  const Context_EptChangedMapping* const mappings);
+
+
+static NTSTATUS changePreparedRegions(
+  const PFILE_OBJECT owner,
+  const PAGE_SWAPPER_PrepareRequest* const request,
+  const BOOLEAN prepare);
+
+
+static VOID releasePreparedRegion(const UINT64 regionIndex);
+
+
+static NTSTATUS broadcastBatch(
+  const UINT64 vmCallCode,
+  const UINT64 noOfMappings,
+  const Context_EptChangedMapping* const mappings,
+  NTSTATUS* const statuses);
+
+
+static NTSTATUS collectStatus(
+  const UINT64 noOfMappings,
+  const NTSTATUS* const coreStatuses,
+  const UINT64 mappingIndex);
+
+
+static BOOLEAN isPartialChange(
+  const UINT64 noOfMappings,
+  const NTSTATUS* const coreStatuses,
+  const UINT64 mappingIndex,
+  UINT64* const failedCoreIndex);
+
+
+static NTSTATUS rollbackPartialChanges(
+  const UINT64 vmCallCode,
+  const UINT64 noOfMappings,
+  const Context_EptChangedMapping* const mappings,
+  const NTSTATUS* const coreStatuses);
+
+
 /**************************************************************************************************
 * Global function definitions
 **************************************************************************************************/
+/**
+ * @brief Initializes the page swapper.
+ * 
+ * @return VOID
+ */
+VOID PAGE_SWAPPER_init(VOID)
+{
+  ExInitializeFastMutex(&swapperMutex);
+  noOfAsyncRequests = 0;
+  KeInitializeEvent(&asyncIdleEvent, NotificationEvent, TRUE);
+  RtlZeroMemory(preparedRegions, sizeof(preparedRegions));
+  KeInitializeEvent(&refillStopEvent, NotificationEvent, FALSE);
+  refillThread = NULL;
+}
+
+
+/**
+ * @brief Starts the worker refilling populate pools.
+ *
+ * Root mode populates regions on first access with tables from the populate pools, but it
+ * can neither allocate memory nor wake up a thread, so it only flags pools running low. The
+ * worker checks the flags every PAGE_SWAPPER_REFILL_PERIOD_MS milliseconds. Must be called
+ * at PASSIVE_LEVEL, after the context is initialized.
+ *
+ * @return STATUS_SUCCESS if successful, error code otherwise.
+ */
+NTSTATUS PAGE_SWAPPER_startRefill(VOID)
+{
+  OBJECT_ATTRIBUTES attributes = { 0 };
+  InitializeObjectAttributes(&attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+  HANDLE thread = NULL;
+  NTSTATUS ntStatus = PsCreateSystemThread(
+    &thread,
+    THREAD_ALL_ACCESS,
+    &attributes,
+    NULL,
+    NULL,
+    PAGE_SWAPPER_refillWorker,
+    NULL);
+  if (!NT_SUCCESS(ntStatus))
+  {
+    return ntStatus;
+  }
+
+  ntStatus = ObReferenceObjectByHandle(
+    thread,
+    SYNCHRONIZE,
+    *PsThreadType,
+    KernelMode,
+    &refillThread,
+    NULL);
+  if (!NT_SUCCESS(ntStatus))
+  {
+    refillThread = NULL;
+    KeSetEvent(&refillStopEvent, IO_NO_INCREMENT, FALSE);
+    ZwWaitForSingleObject(thread, FALSE, NULL);
+  }
+  ZwClose(thread);
+
+  return ntStatus;
+}
+
+
+/**
+ * @brief Stops the worker refilling populate pools, if it is running.
+ *
+ * Must be called at PASSIVE_LEVEL, before the context is destroyed.
+ *
+ * @return VOID
+ */
+VOID PAGE_SWAPPER_stopRefill(VOID)
+{
+  if (refillThread == NULL)
+  {
+    return;
+  }
+
+  KeSetEvent(&refillStopEvent, IO_NO_INCREMENT, FALSE);
+  KeWaitForSingleObject(refillThread, Executive, KernelMode, FALSE, NULL);
+  ObDereferenceObject(refillThread);
+  refillThread = NULL;
+}
+
+
 /**
  * @brief Changes page mapping in EPT.
  * 
@@ -45,16 +413,83 @@ NTSTATUS PAGE_SWAPPER_map(
     .guestAddress = Memory_getPhysicalAddress(pageToMapVirtualAddress),
     .hostRwAddress = Memory_getPhysicalAddress(rwPageVirtualAddress),
     .hostFetchAddress = Memory_getPhysicalAddress(fPageVirtualAddress),
+    .size = PAGE_SIZE,
+    .valid = TRUE
+  };
+
+  acquireForSyncChange();
+  NTSTATUS ntStatus = reserveSplitTables(1, &mapping);
+  if (NT_SUCCESS(ntStatus))
+  {
+    ntStatus = splitLargePages(1, &mapping);
+  }
+  if (NT_SUCCESS(ntStatus))
+  {
+    ntStatus = applyMapping(PAGE_SWAPPER_mapIpi, &mapping);
+  }
+  ExReleaseFastMutex(&swapperMutex);
+
+  return ntStatus;
+}
+
+
+/**
+ * @brief Changes mapping of a physically contiguous range in EPT.
+ *
+ * Every range must be page aligned and physically contiguous. Parts of the range aligned
+ * to 2MB or 1GB in both the source and the target are remapped by large pages, only the
+ * unaligned edges are split. The range is removed with PAGE_SWAPPER_unmap of its first page.
+ *
+ * @param request Range map request.
+ *
+ * @return STATUS_SUCCESS if successful, STATUS_INVALID_PARAMETER if any range is not
+ * page aligned or contiguous, error code otherwise.
+ */
+NTSTATUS PAGE_SWAPPER_mapRange(const PAGE_SWAPPER_RangeRequest* const request)
+{
+  const UINT64 size = request->size;
+  if (size == 0 || size % PAGE_SIZE != 0)
+  {
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  Context_EptChangedMapping mapping = (Context_EptChangedMapping)
+  {
+    .size = size,
     .valid = TRUE
   };
 
-  return (NTSTATUS)KeIpiGenericCall(PAGE_SWAPPER_mapIpi, (ULONG_PTR)&mapping);
+  if (!NT_SUCCESS(getRangePhysicalAddress(request->originalAddress, size, &mapping.guestAddress)) ||
+    !NT_SUCCESS(getRangePhysicalAddress(request->rwAddress, size, &mapping.hostRwAddress)) ||
+    !NT_SUCCESS(getRangePhysicalAddress(request->fetchAddress, size, &mapping.hostFetchAddress)))
+  {
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  acquireForSyncChange();
+  NTSTATUS ntStatus = reserveSplitTables(1, &mapping);
+  if (NT_SUCCESS(ntStatus))
+  {
+    ntStatus = applyMapping(PAGE_SWAPPER_mapRangeIpi, &mapping);
+
+    // Rolled back splits of a failed change are recycled once all cores have invalidated
+    if (!NT_SUCCESS(ntStatus) && Context_getContext()->isEptShared)
+    {
+      KeIpiGenericCall(PAGE_SWAPPER_invalidateIpi, 0);
+    }
+    recycleSplitTables();
+  }
+  ExReleaseFastMutex(&swapperMutex);
+
+  return ntStatus;
 }
 
 
 /**
  * @brief Removes page mapping change in EPT.
  * 
+ * Ranges mapped by PAGE_SWAPPER_mapRange are removed as a whole, by their first page.
+ *
  * @param pageToUnmapVirtualAddress Source page virtual address.
  * 
  * @return STATUS_SUCCESS if successful, error code otherwise.
@@ -69,42 +504,1677 @@ NTSTATUS PAGE_SWAPPER_unmap(VOID* const pageToUnmapVirtualAddress)
     .valid = TRUE
   };
 
-  return (NTSTATUS)KeIpiGenericCall(PAGE_SWAPPER_unmapIpi, (ULONG_PTR)&mapping);
+  acquireForSyncChange();
+  const NTSTATUS ntStatus = applyMapping(PAGE_SWAPPER_unmapIpi, &mapping);
+  recycleSplitTables();
+  ExReleaseFastMutex(&swapperMutex);
+
+  return ntStatus;
 }
 
 
-/**************************************************************************************************
-* Local function definitions
-**************************************************************************************************/
 /**
- * @brief Changes the page's mapping on all logical cores.
- * 
- * @param argument Context_EptChangedMapping structure.
- * 
- * @return STATUS_SUCCESS if successful, error code otherwise.
+ * @brief Changes page mapping in EPT without blocking the caller.
+ *
+ * The IRP is pended and completed once every logical core has applied the change. Its
+ * status is STATUS_SUCCESS only if the change succeeded on all cores, otherwise it is
+ * the first error reported by any core, and the change is rolled back on the other cores.
+ *
+ * @param deviceObject Device object the IRP was sent to.
+ * @param irp IRP to pend.
+ * @param pageToMapVirtualAddress Source page virtual address.
+ * @param rwPageVirtualAddress Target read-write page virtual address.
+ * @param fPageVirtualAddress Target fetch page virtual address.
+ *
+ * @return STATUS_PENDING if the IRP was pended, error code otherwise, in which case
+ * the IRP is left to the caller.
  */
-_Use_decl_annotations_
-static ULONG_PTR PAGE_SWAPPER_mapIpi(ULONG_PTR argument)
+NTSTATUS PAGE_SWAPPER_mapAsync(
+  PDEVICE_OBJECT deviceObject,
+  PIRP irp,
+  VOID* const pageToMapVirtualAddress,
+  VOID* const rwPageVirtualAddress,
+  VOID* const fPageVirtualAddress)
 {
-  const Context_EptChangedMapping* const mapping = (const Context_EptChangedMapping*)argument;
-  return VMX_vmcall(
-    VMEXIT_VMCALL_MAP_PAGE,
-    mapping->guestAddress,
-    mapping->hostRwAddress,
-    mapping->hostFetchAddress);
+  const Context_EptChangedMapping mapping = (Context_EptChangedMapping)
+  {
+    .guestAddress = Memory_getPhysicalAddress(pageToMapVirtualAddress),
+    .hostRwAddress = Memory_getPhysicalAddress(rwPageVirtualAddress),
+    .hostFetchAddress = Memory_getPhysicalAddress(fPageVirtualAddress),
+    .size = PAGE_SIZE,
+    .valid = TRUE
+  };
+
+  return submitAsync(deviceObject, irp, PAGE_SWAPPER_mapIpi, &mapping);
 }
 
 
 /**
- * @brief Removes the page mapping change.
+ * @brief Removes page mapping change in EPT without blocking the caller.
  *
- * @param argument Context_EptChangedMapping structure.
+ * Counterpart of PAGE_SWAPPER_mapAsync.
  *
- * @return STATUS_SUCCESS if successful, error code otherwise.
+ * @param deviceObject Device object the IRP was sent to.
+ * @param irp IRP to pend.
+ * @param pageToUnmapVirtualAddress Source page virtual address.
+ *
+ * @return STATUS_PENDING if the IRP was pended, error code otherwise, in which case
+ * the IRP is left to the caller.
  */
-_Use_decl_annotations_
-static ULONG_PTR PAGE_SWAPPER_unmapIpi(ULONG_PTR argument)
+NTSTATUS PAGE_SWAPPER_unmapAsync(
+  PDEVICE_OBJECT deviceObject,
+  PIRP irp,
+  VOID* const pageToUnmapVirtualAddress)
 {
-  const Context_EptChangedMapping* const mapping = (const Context_EptChangedMapping*)argument;
-  return VMX_vmcall(VMEXIT_VMCALL_UNMAP_PAGE, mapping->guestAddress, 0, 0);
+  const Context_EptChangedMapping mapping = (Context_EptChangedMapping)
+  {
+    .guestAddress = Memory_getPhysicalAddress(pageToUnmapVirtualAddress),
+    .hostRwAddress = 0,
+    .hostFetchAddress = 0,
+    .valid = TRUE
+  };
+
+  return submitAsync(deviceObject, irp, PAGE_SWAPPER_unmapIpi, &mapping);
+}
+
+
+/**
+ * @brief Changes multiple page mappings in EPT at once.
+ *
+ * All requests are delivered to every logical core with a single IPI and a single VMCALL,
+ * and each core invalidates its EPT caches once for the whole batch. The statuses array may
+ * alias the requests array, since all requests are consumed before any status is written.
+ *
+ * @param noOfRequests Number of requests.
+ * @param requests Array of map requests.
+ * @param statuses Array receiving a status for each request.
+ *
+ * @return STATUS_SUCCESS if the batch was processed, error code otherwise.
+ */
+NTSTATUS PAGE_SWAPPER_mapBatch(
+  const UINT64 noOfRequests,
+  const PAGE_SWAPPER_MapRequest* const requests,
+  NTSTATUS* const statuses)
+{
+  if (noOfRequests == 0 || noOfRequests > PAGE_SWAPPER_MAX_BATCH_SIZE)
+  {
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  Context_EptChangedMapping* const mappings =
+    Memory_allocate(noOfRequests * sizeof(Context_EptChangedMapping), FALSE);
+  if (mappings == NULL)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  for (UINT64 requestIndex = 0; requestIndex < noOfRequests; requestIndex++)
+  {
+    mappings[requestIndex] = (Context_EptChangedMapping)
+    {
+      .guestAddress = Memory_getPhysicalAddress(requests[requestIndex].originalAddress),
+      .hostRwAddress = Memory_getPhysicalAddress(requests[requestIndex].rwAddress),
+      .hostFetchAddress = Memory_getPhysicalAddress(requests[requestIndex].fetchAddress),
+      .size = PAGE_SIZE,
+      .valid = TRUE
+    };
+  }
+
+  acquireForSyncChange();
+  NTSTATUS ntStatus = reserveSplitTables(noOfRequests, mappings);
+  if (NT_SUCCESS(ntStatus))
+  {
+    ntStatus = splitLargePages(noOfRequests, mappings);
+  }
+  if (NT_SUCCESS(ntStatus))
+  {
+    ntStatus = broadcastBatch(VMEXIT_VMCALL_MAP_BATCH, noOfRequests, mappings, statuses);
+  }
+  ExReleaseFastMutex(&swapperMutex);
+  Memory_free(mappings);
+
+  return ntStatus;
+}
+
+
+/**
+ * @brief Removes multiple page mapping changes in EPT at once.
+ *
+ * Counterpart of PAGE_SWAPPER_mapBatch. The statuses array may alias the pagesToUnmap array.
+ *
+ * @param noOfRequests Number of requests.
+ * @param pagesToUnmap Array of source page virtual addresses.
+ * @param statuses Array receiving a status for each request.
+ *
+ * @return STATUS_SUCCESS if the batch was processed, error code otherwise.
+ */
+NTSTATUS PAGE_SWAPPER_unmapBatch(
+  const UINT64 noOfRequests,
+  VOID* const* const pagesToUnmap,
+  NTSTATUS* const statuses)
+{
+  if (noOfRequests == 0 || noOfRequests > PAGE_SWAPPER_MAX_BATCH_SIZE)
+  {
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  Context_EptChangedMapping* const mappings =
+    Memory_allocate(noOfRequests * sizeof(Context_EptChangedMapping), FALSE);
+  if (mappings == NULL)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  for (UINT64 requestIndex = 0; requestIndex < noOfRequests; requestIndex++)
+  {
+    mappings[requestIndex] = (Context_EptChangedMapping)
+    {
+      .guestAddress = Memory_getPhysicalAddress(pagesToUnmap[requestIndex]),
+      .hostRwAddress = 0,
+      .hostFetchAddress = 0,
+      .valid = TRUE
+    };
+  }
+
+  acquireForSyncChange();
+  const NTSTATUS ntStatus =
+    broadcastBatch(VMEXIT_VMCALL_UNMAP_BATCH, noOfRequests, mappings, statuses);
+  recycleSplitTables();
+  ExReleaseFastMutex(&swapperMutex);
+  Memory_free(mappings);
+
+  return ntStatus;
+}
+
+
+/**
+ * @brief Changes and removes multiple page mappings in EPT at once, in order.
+ *
+ * Requests with NULL read/write and fetch addresses remove the mapping change of their
+ * page, the others change it. Like PAGE_SWAPPER_mapBatch, the whole batch is delivered with
+ * a single IPI and a single VMCALL, so a mix of maps and unmaps costs one broadcast. The
+ * statuses array may alias the requests array.
+ *
+ * @param noOfRequests Number of requests.
+ * @param requests Array of map and unmap requests.
+ * @param statuses Array receiving a status for each request.
+ *
+ * @return STATUS_SUCCESS if the batch was processed, error code otherwise.
+ */
+NTSTATUS PAGE_SWAPPER_applyBatch(
+  const UINT64 noOfRequests,
+  const PAGE_SWAPPER_MapRequest* const requests,
+  NTSTATUS* const statuses)
+{
+  if (noOfRequests == 0 || noOfRequests > PAGE_SWAPPER_MAX_BATCH_SIZE)
+  {
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  Context_EptChangedMapping* const mappings =
+    Memory_allocate(noOfRequests * sizeof(Context_EptChangedMapping), FALSE);
+  if (mappings == NULL)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  BOOLEAN hasUnmaps = FALSE;
+  for (UINT64 requestIndex = 0; requestIndex < noOfRequests; requestIndex++)
+  {
+    const PAGE_SWAPPER_MapRequest* const request = &requests[requestIndex];
+    const BOOLEAN isUnmap = request->rwAddress == NULL && request->fetchAddress == NULL;
+    mappings[requestIndex] = (Context_EptChangedMapping)
+    {
+      .guestAddress = Memory_getPhysicalAddress(request->originalAddress),
+      .hostRwAddress = isUnmap ? 0 : Memory_getPhysicalAddress(request->rwAddress),
+      .hostFetchAddress = isUnmap ? 0 : Memory_getPhysicalAddress(request->fetchAddress),
+      .size = isUnmap ? 0 : PAGE_SIZE,
+      .valid = TRUE
+    };
+    hasUnmaps |= isUnmap;
+  }
+
+  acquireForSyncChange();
+  NTSTATUS ntStatus = reserveSplitTables(noOfRequests, mappings);
+  if (NT_SUCCESS(ntStatus))
+  {
+    ntStatus = splitLargePages(noOfRequests, mappings);
+  }
+  if (NT_SUCCESS(ntStatus))
+  {
+    ntStatus = broadcastBatch(VMEXIT_VMCALL_APPLY_BATCH, noOfRequests, mappings, statuses);
+  }
+  if (hasUnmaps)
+  {
+    recycleSplitTables();
+  }
+  ExReleaseFastMutex(&swapperMutex);
+  Memory_free(mappings);
+
+  return ntStatus;
+}
+
+
+/**
+ * @brief Moves multiple page mapping changes to mapping groups at once.
+ *
+ * Mappings of a group are switched to the same view by a single EPT violation of any of
+ * them. Groups are set in every EPT hierarchy with a single IPI and a single VMCALL, no EPT
+ * entry is changed. A group holds at most CONTEXT_EPT_MAX_GROUP_SIZE mappings. The statuses
+ * array may alias the requests array.
+ *
+ * @param noOfRequests Number of requests.
+ * @param requests Array of group requests.
+ * @param statuses Array receiving a status for each request.
+ *
+ * @return STATUS_SUCCESS if the batch was processed, error code otherwise.
+ */
+NTSTATUS PAGE_SWAPPER_groupBatch(
+  const UINT64 noOfRequests,
+  const PAGE_SWAPPER_GroupRequest* const requests,
+  NTSTATUS* const statuses)
+{
+  if (noOfRequests == 0 || noOfRequests > PAGE_SWAPPER_MAX_BATCH_SIZE)
+  {
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  Context_EptChangedMapping* const mappings =
+    Memory_allocate(noOfRequests * sizeof(Context_EptChangedMapping), FALSE);
+  if (mappings == NULL)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  for (UINT64 requestIndex = 0; requestIndex < noOfRequests; requestIndex++)
+  {
+    mappings[requestIndex] = (Context_EptChangedMapping)
+    {
+      .guestAddress = Memory_getPhysicalAddress(requests[requestIndex].originalAddress),
+      .groupId = requests[requestIndex].groupId,
+      .valid = TRUE
+    };
+  }
+
+  acquireForSyncChange();
+  const NTSTATUS ntStatus =
+    broadcastBatch(VMEXIT_VMCALL_GROUP_BATCH, noOfRequests, mappings, statuses);
+  ExReleaseFastMutex(&swapperMutex);
+  Memory_free(mappings);
+
+  return ntStatus;
+}
+
+
+/**
+ * @brief Splits a region into 4KB pages ahead of mapping changes.
+ *
+ * Every 2MB region holding a page of the region is split in every EPT hierarchy and pinned,
+ * so later changes of its pages only write page table entries, and removing them does not
+ * coalesce the region. The page size of the split mappings changes, so all cores invalidate
+ * their EPT caches once afterwards, also on failure. Parts of physical memory not populated
+ * in the EPT are skipped. At most PAGE_SWAPPER_MAX_PREPARED_REGIONS 2MB regions are kept
+ * prepared at a time. On failure, regions prepared so far stay prepared, until
+ * PAGE_SWAPPER_unprepareRange is called or the handle is closed.
+ *
+ * @param owner File object of the handle preparing the region.
+ * @param request Region to prepare.
+ *
+ * @return STATUS_SUCCESS if successful, STATUS_INVALID_PARAMETER if the region is not page
+ * aligned or any of its pages is not resident, STATUS_INSUFFICIENT_RESOURCES if too many
+ * regions are prepared, error code otherwise.
+ */
+NTSTATUS PAGE_SWAPPER_prepareRange(
+  const PFILE_OBJECT owner,
+  const PAGE_SWAPPER_PrepareRequest* const request)
+{
+  acquireForSyncChange();
+  const NTSTATUS ntStatus = changePreparedRegions(owner, request, TRUE);
+  KeIpiGenericCall(PAGE_SWAPPER_invalidateIpi, 0);
+  ExReleaseFastMutex(&swapperMutex);
+
+  return ntStatus;
+}
+
+
+/**
+ * @brief Releases a region prepared by PAGE_SWAPPER_prepareRange.
+ *
+ * Page tables of 2MB regions no other handle keeps prepared are unpinned, and those without
+ * changed mappings are coalesced back into large pages. All cores invalidate their EPT
+ * caches once afterwards.
+ *
+ * @param owner File object of the handle which prepared the region.
+ * @param request Region to release, the same as the one prepared.
+ *
+ * @return STATUS_SUCCESS if successful, STATUS_INVALID_PARAMETER if the region is not page
+ * aligned or any of its pages is not resident. Regions before the first such page are
+ * released then.
+ */
+NTSTATUS PAGE_SWAPPER_unprepareRange(
+  const PFILE_OBJECT owner,
+  const PAGE_SWAPPER_PrepareRequest* const request)
+{
+  acquireForSyncChange();
+  const NTSTATUS ntStatus = changePreparedRegions(owner, request, FALSE);
+  KeIpiGenericCall(PAGE_SWAPPER_invalidateIpi, 0);
+  recycleSplitTables();
+  ExReleaseFastMutex(&swapperMutex);
+
+  return ntStatus;
+}
+
+
+/**
+ * @brief Releases all regions prepared by a handle.
+ *
+ * Called when the handle is closed, so regions its process did not unprepare do not stay
+ * pinned. Must be called at PASSIVE_LEVEL.
+ *
+ * @param owner File object of the closed handle.
+ *
+ * @return VOID
+ */
+VOID PAGE_SWAPPER_releasePreparedRanges(const PFILE_OBJECT owner)
+{
+  acquireForSyncChange();
+  BOOLEAN isReleased = FALSE;
+  for (UINT64 regionIndex = 0; regionIndex < PAGE_SWAPPER_MAX_PREPARED_REGIONS; regionIndex++)
+  {
+    if (preparedRegions[regionIndex].owner == owner)
+    {
+      releasePreparedRegion(regionIndex);
+      isReleased = TRUE;
+    }
+  }
+  if (isReleased)
+  {
+    KeIpiGenericCall(PAGE_SWAPPER_invalidateIpi, 0);
+    recycleSplitTables();
+  }
+  ExReleaseFastMutex(&swapperMutex);
+}
+
+
+/**
+ * @brief Collects EPT violation counters of changed mappings.
+ *
+ * Mappings are enumerated in the first EPT hierarchy, and the counters of the same
+ * mapping in the other hierarchies are added to it. Page mappings are returned first,
+ * range mappings follow. Holding the mutex keeps the set of mappings stable, counters
+ * themselves may still change while they are read.
+ *
+ * @param reset TRUE if counters should be reset after they are read.
+ * @param maxMappings Number of entries the mappings array can hold.
+ * @param mappings Array receiving per mapping statistics.
+ * @param noOfMappings Number of changed mappings.
+ * @param noOfReturnedMappings Number of entries written to the mappings array.
+ *
+ * @return VOID
+ */
+VOID PAGE_SWAPPER_queryMappingStats(
+  const BOOLEAN reset,
+  const UINT64 maxMappings,
+  STATS_MappingStats* const mappings,
+  UINT64* const noOfMappings,
+  UINT64* const noOfReturnedMappings)
+{
+  Context_Context* const context = Context_getContext();
+  *noOfMappings = 0;
+  *noOfReturnedMappings = 0;
+
+  ExAcquireFastMutex(&swapperMutex);
+  const Context_EptMappingTable* const firstTable = &context->eptMappingsData[0]->changedMappings;
+  *noOfMappings = firstTable->noOfEntries + firstTable->noOfRanges;
+  const UINT64 noOfSlots = firstTable->mappingsCapacity + firstTable->noOfRanges;
+  for (UINT64 slot = 0; slot < noOfSlots; slot++)
+  {
+    const Context_EptChangedMapping* const mapping = slot < firstTable->mappingsCapacity ?
+      &firstTable->mappings[slot] : &firstTable->ranges[slot - firstTable->mappingsCapacity];
+    if (!mapping->valid)
+    {
+      continue;
+    }
+
+    const UINT64 guestAddress = mapping->guestAddress;
+    const UINT64 noOfViolations = collectViolations(guestAddress, reset);
+    if (*noOfReturnedMappings < maxMappings)
+    {
+      mappings[*noOfReturnedMappings] = (STATS_MappingStats)
+      {
+        .guestAddress = guestAddress,
+        .noOfViolations = noOfViolations
+      };
+      (*noOfReturnedMappings)++;
+    }
+  }
+  ExReleaseFastMutex(&swapperMutex);
+}
+
+
+/**
+ * @brief Collects and clears EPT accessed and dirty flags of a physical range.
+ *
+ * Scans every EPT hierarchy, so a page is reported if it was accessed by any logical core.
+ * Pages mapped by large pages are reported as a whole. All cores invalidate their EPT
+ * caches once afterwards, so the processor sets the flags again on the next access.
+ * The output holds the accessed bitmap followed by the dirty bitmap, with one bit per page
+ * of the range, each rounded up to a multiple of 64 bits.
+ *
+ * @param request Range to scan.
+ * @param outputSize Size of the output buffer in bytes.
+ * @param bitmaps Output buffer, which may overlap the request.
+ * @param bytesWritten Pointer receiving number of bytes written to the output buffer.
+ *
+ * @return STATUS_SUCCESS if successful, STATUS_NOT_SUPPORTED if the processor does not
+ * support EPT accessed and dirty flags, STATUS_INVALID_PARAMETER if the range is invalid
+ * or the output buffer is too small.
+ */
+NTSTATUS PAGE_SWAPPER_harvestAccessedDirty(
+  const PAGE_SWAPPER_HarvestRequest* const request,
+  const UINT64 outputSize,
+  UINT64* const bitmaps,
+  UINT64* const bytesWritten)
+{
+  Context_Context* const context = Context_getContext();
+  *bytesWritten = 0;
+  if (!context->isEptAccessDirtySupported)
+  {
+    return STATUS_NOT_SUPPORTED;
+  }
+
+  // Input and output may share the system buffer, so the request is read first
+  const UINT64 address = request->address;
+  const UINT64 size = request->size;
+  const UINT64 noOfPages = size / PAGE_SIZE;
+  if (size == 0 || size % PAGE_SIZE != 0 || address % PAGE_SIZE != 0 || noOfPages > MAXULONG)
+  {
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  const UINT64 bitmapSize = (noOfPages + 63) / 64 * sizeof(UINT64);
+  if (outputSize < 2 * bitmapSize)
+  {
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  RTL_BITMAP accessedPages = { 0 };
+  RTL_BITMAP dirtyPages = { 0 };
+  RtlInitializeBitMap(&accessedPages, (PULONG)bitmaps, (ULONG)noOfPages);
+  RtlInitializeBitMap(&dirtyPages, (PULONG)((UINT8*)bitmaps + bitmapSize), (ULONG)noOfPages);
+  RtlClearAllBits(&accessedPages);
+  RtlClearAllBits(&dirtyPages);
+
+  NTSTATUS ntStatus = STATUS_SUCCESS;
+  ExAcquireFastMutex(&swapperMutex);
+  for (UINT64 mappingsDataIndex = 0;
+    mappingsDataIndex < context->noOfEptMappingsData && NT_SUCCESS(ntStatus);
+    mappingsDataIndex++)
+  {
+    ntStatus = EPT_harvestAccessedDirty(
+      context->eptMappingsData[mappingsDataIndex],
+      address,
+      size,
+      &accessedPages,
+      &dirtyPages);
+  }
+  KeIpiGenericCall(PAGE_SWAPPER_invalidateIpi, 0);
+  ExReleaseFastMutex(&swapperMutex);
+
+  if (NT_SUCCESS(ntStatus))
+  {
+    *bytesWritten = 2 * bitmapSize;
+  }
+
+  return ntStatus;
+}
+
+
+/**
+ * @brief Clears EPT dirty flags of all EPT hierarchies.
+ *
+ * Used by dirty logging, accessed flags are kept. All cores invalidate their EPT caches
+ * once afterwards, so the next write to any page sets its dirty flag again. Must be called
+ * at PASSIVE_LEVEL.
+ *
+ * @return VOID
+ */
+VOID PAGE_SWAPPER_clearDirtyFlags(VOID)
+{
+  const Context_Context* const context = Context_getContext();
+
+  ExAcquireFastMutex(&swapperMutex);
+  for (UINT64 mappingsDataIndex = 0;
+    mappingsDataIndex < context->noOfEptMappingsData;
+    mappingsDataIndex++)
+  {
+    EPT_clearDirtyFlags(context->eptMappingsData[mappingsDataIndex]);
+  }
+  KeIpiGenericCall(PAGE_SWAPPER_invalidateIpi, 0);
+  ExReleaseFastMutex(&swapperMutex);
+}
+
+
+/**************************************************************************************************
+* Local function definitions
+**************************************************************************************************/
+/**
+ * @brief Changes the page's mapping on all logical cores.
+ * 
+ * @param argument Context_EptChangedMapping structure.
+ * 
+ * @return STATUS_SUCCESS if successful, error code otherwise.
+ */
+_Use_decl_annotations_
+static ULONG_PTR PAGE_SWAPPER_mapIpi(ULONG_PTR argument)
+{
+  const Context_EptChangedMapping* const mapping = (const Context_EptChangedMapping*)argument;
+  return VMX_vmcall(
+    VMEXIT_VMCALL_MAP_PAGE,
+    mapping->guestAddress,
+    mapping->hostRwAddress,
+    mapping->hostFetchAddress);
+}
+
+
+/**
+ * @brief Removes the page mapping change.
+ *
+ * @param argument Context_EptChangedMapping structure.
+ *
+ * @return STATUS_SUCCESS if successful, error code otherwise.
+ */
+_Use_decl_annotations_
+static ULONG_PTR PAGE_SWAPPER_unmapIpi(ULONG_PTR argument)
+{
+  const Context_EptChangedMapping* const mapping = (const Context_EptChangedMapping*)argument;
+  return VMX_vmcall(VMEXIT_VMCALL_UNMAP_PAGE, mapping->guestAddress, 0, 0);
+}
+
+
+/**
+ * @brief Changes the range's mapping on the current logical core.
+ *
+ * @param argument Context_EptChangedMapping structure describing the range.
+ *
+ * @return STATUS_SUCCESS if successful, error code otherwise.
+ */
+_Use_decl_annotations_
+static ULONG_PTR PAGE_SWAPPER_mapRangeIpi(ULONG_PTR argument)
+{
+  return VMX_vmcall(VMEXIT_VMCALL_MAP_RANGE, (UINT64)argument, 0, 0);
+}
+
+
+/**
+ * @brief Moves the mapping change to its group on the current logical core.
+ *
+ * @param argument Context_EptChangedMapping structure with the group ID.
+ *
+ * @return STATUS_SUCCESS if successful, error code otherwise.
+ */
+_Use_decl_annotations_
+static ULONG_PTR PAGE_SWAPPER_groupIpi(ULONG_PTR argument)
+{
+  NTSTATUS ntStatus = STATUS_SUCCESS;
+  VMX_vmcall(VMEXIT_VMCALL_GROUP_BATCH, (UINT64)argument, 1, (UINT64)&ntStatus);
+  return (ULONG_PTR)ntStatus;
+}
+
+
+/**
+ * @brief Applies a batch of mapping changes on the current logical core.
+ *
+ * @param argument PAGE_SWAPPER_Batch structure.
+ *
+ * @return VMCALL result.
+ */
+_Use_decl_annotations_
+static ULONG_PTR PAGE_SWAPPER_batchIpi(ULONG_PTR argument)
+{
+  const PAGE_SWAPPER_Batch* const batch = (const PAGE_SWAPPER_Batch*)argument;
+  const UINT64 logicalCoreIndex = KeGetCurrentProcessorNumberEx(NULL);
+  return VMX_vmcall(
+    batch->vmCallCode,
+    (UINT64)batch->mappings,
+    batch->noOfMappings,
+    (UINT64)&batch->coreStatuses[logicalCoreIndex * batch->noOfMappings]);
+}
+
+
+/**
+ * @brief Applies a single mapping change on the current logical core.
+ *
+ * @param argument PAGE_SWAPPER_Change structure.
+ *
+ * @return Status of the change.
+ */
+_Use_decl_annotations_
+static ULONG_PTR PAGE_SWAPPER_changeIpi(ULONG_PTR argument)
+{
+  const PAGE_SWAPPER_Change* const change = (const PAGE_SWAPPER_Change*)argument;
+  const NTSTATUS ntStatus = (NTSTATUS)change->ipiWorker((ULONG_PTR)change->mapping);
+  change->coreStatuses[KeGetCurrentProcessorNumberEx(NULL)] = ntStatus;
+  return (ULONG_PTR)ntStatus;
+}
+
+
+/**
+ * @brief Undoes mapping changes which succeeded on the current logical core.
+ *
+ * Undo changes of mappings which failed on the current core are skipped, the first error of
+ * an undo change is merged into the rollback.
+ *
+ * @param argument PAGE_SWAPPER_Rollback structure.
+ *
+ * @return STATUS_SUCCESS.
+ */
+_Use_decl_annotations_
+static ULONG_PTR PAGE_SWAPPER_rollbackIpi(ULONG_PTR argument)
+{
+  PAGE_SWAPPER_Rollback* const rollback = (PAGE_SWAPPER_Rollback*)argument;
+  const NTSTATUS* const coreStatuses =
+    &rollback->coreStatuses[KeGetCurrentProcessorNumberEx(NULL) * rollback->noOfMappings];
+
+  for (UINT64 undoIndex = 0; undoIndex < rollback->noOfUndos; undoIndex++)
+  {
+    const PAGE_SWAPPER_Undo* const undo = &rollback->undos[undoIndex];
+    if (!NT_SUCCESS(coreStatuses[undo->mappingIndex]))
+    {
+      continue;
+    }
+
+    const NTSTATUS ntStatus = (NTSTATUS)undo->ipiWorker((ULONG_PTR)&undo->mapping);
+    if (!NT_SUCCESS(ntStatus))
+    {
+      InterlockedCompareExchange(&rollback->status, ntStatus, STATUS_SUCCESS);
+    }
+  }
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Invalidates EPT caches of the current logical core.
+ *
+ * @param argument Unused.
+ *
+ * @return STATUS_SUCCESS.
+ */
+_Use_decl_annotations_
+static ULONG_PTR PAGE_SWAPPER_invalidateIpi(ULONG_PTR argument)
+{
+  UNREFERENCED_PARAMETER(argument);
+  return VMX_vmcall(VMEXIT_VMCALL_INVALIDATE_EPT, 0, 0, 0);
+}
+
+
+/**
+ * @brief Applies an asynchronous request on the current logical core.
+ *
+ * The status is merged into the request, and the last core to finish queues the work item
+ * completing the IRP.
+ *
+ * @param dpc DPC of the current core.
+ * @param deferredContext PAGE_SWAPPER_AsyncRequest structure.
+ * @param systemArgument1 Unused.
+ * @param systemArgument2 Unused.
+ *
+ * @return VOID
+ */
+_Use_decl_annotations_
+static VOID PAGE_SWAPPER_asyncDpc(
+  PKDPC dpc,
+  PVOID deferredContext,
+  PVOID systemArgument1,
+  PVOID systemArgument2)
+{
+  UNREFERENCED_PARAMETER(dpc);
+  UNREFERENCED_PARAMETER(systemArgument1);
+  UNREFERENCED_PARAMETER(systemArgument2);
+
+  PAGE_SWAPPER_AsyncRequest* const request = deferredContext;
+  const NTSTATUS ntStatus = (NTSTATUS)request->dpcWorker((ULONG_PTR)&request->mapping);
+  request->coreStatuses[KeGetCurrentProcessorNumberEx(NULL)] = ntStatus;
+  if (!NT_SUCCESS(ntStatus))
+  {
+    InterlockedCompareExchange(&request->status, ntStatus, STATUS_SUCCESS);
+  }
+
+  if (InterlockedDecrement(&request->noOfPendingCores) == 0)
+  {
+    finishAsync(request);
+  }
+}
+
+
+/**
+ * @brief Completes an asynchronous request.
+ *
+ * Runs at PASSIVE_LEVEL after all cores have applied the change, so split tables retired
+ * by it can be recycled, unless other requests are still in flight. A change which failed
+ * on some cores only is rolled back on the others before the IRP is completed with the first
+ * error. The rollback waits for requests submitted later like a synchronous change, and is
+ * derived from the state they left on the failed core.
+ *
+ * @param deviceObject Unused.
+ * @param context PAGE_SWAPPER_AsyncRequest structure.
+ *
+ * @return VOID
+ */
+_Use_decl_annotations_
+static VOID PAGE_SWAPPER_completeAsync(PDEVICE_OBJECT deviceObject, PVOID context)
+{
+  UNREFERENCED_PARAMETER(deviceObject);
+
+  PAGE_SWAPPER_AsyncRequest* const request = context;
+  if (!NT_SUCCESS(request->status) && !Context_getContext()->isEptShared)
+  {
+    // The request is no longer counted as in flight, so waiting for the others cannot block
+    acquireForSyncChange();
+    rollbackPartialChanges(
+      request->dpcWorker == PAGE_SWAPPER_unmapIpi ?
+        VMEXIT_VMCALL_UNMAP_BATCH :
+        VMEXIT_VMCALL_MAP_BATCH,
+      1,
+      &request->mapping,
+      request->coreStatuses);
+  }
+  else
+  {
+    ExAcquireFastMutex(&swapperMutex);
+  }
+  recycleSplitTables();
+  ExReleaseFastMutex(&swapperMutex);
+
+  PIRP irp = request->irp;
+  irp->IoStatus.Status = request->status;
+  irp->IoStatus.Information = 0;
+  IoFreeWorkItem(request->workItem);
+  Memory_free(request);
+
+  IoCompleteRequest(irp, IO_NO_INCREMENT);
+}
+
+
+/**
+ * @brief Worker thread refilling populate pools flagged by root mode.
+ *
+ * A pool which cannot be refilled stays flagged and is retried after the next period.
+ *
+ * @param context Unused.
+ *
+ * @return VOID
+ */
+_Use_decl_annotations_
+static VOID PAGE_SWAPPER_refillWorker(PVOID context)
+{
+  UNREFERENCED_PARAMETER(context);
+
+  LARGE_INTEGER period = { .QuadPart = -(LONGLONG)PAGE_SWAPPER_REFILL_PERIOD_MS * 10000 };
+  while (KeWaitForSingleObject(&refillStopEvent, Executive, KernelMode, FALSE, &period) ==
+    STATUS_TIMEOUT)
+  {
+    const Context_Context* const swapperContext = Context_getContext();
+    for (UINT64 mappingsDataIndex = 0;
+      mappingsDataIndex < swapperContext->noOfEptMappingsData;
+      mappingsDataIndex++)
+    {
+      Context_EptMappingsData* const mappingData =
+        swapperContext->eptMappingsData[mappingsDataIndex];
+      if (InterlockedExchange(&mappingData->isPopulateRefillNeeded, FALSE) &&
+        !NT_SUCCESS(PAGE_POOL_reserve(&mappingData->populatePool, CONTEXT_EPT_POPULATE_RESERVE)))
+      {
+        InterlockedExchange(&mappingData->isPopulateRefillNeeded, TRUE);
+      }
+    }
+  }
+
+  PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+
+/**
+ * @brief Pends an IRP and queues a mapping change to all logical cores.
+ *
+ * Every core gets a targeted DPC applying the change. In the shared EPT mode, the change
+ * is applied on the current core right away, and the DPCs only invalidate EPT caches.
+ *
+ * @param deviceObject Device object the IRP was sent to.
+ * @param irp IRP to pend.
+ * @param ipiWorker PAGE_SWAPPER_mapIpi or PAGE_SWAPPER_unmapIpi.
+ * @param mapping Mapping to apply, copied into the request.
+ *
+ * @return STATUS_PENDING if the IRP was pended, error code otherwise.
+ */
+static NTSTATUS submitAsync(
+  PDEVICE_OBJECT deviceObject,
+  PIRP irp,
+  PKIPI_BROADCAST_WORKER ipiWorker,
+  const Context_EptChangedMapping* const mapping)
+{
+  const Context_Context* const context = Context_getContext();
+  const UINT64 noOfLogicalCores = context->noOfLogicalCores;
+
+  PAGE_SWAPPER_AsyncRequest* const request = Memory_allocate(
+    sizeof(PAGE_SWAPPER_AsyncRequest) + noOfLogicalCores * (sizeof(KDPC) + sizeof(NTSTATUS)),
+    FALSE);
+  if (request == NULL)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  request->workItem = IoAllocateWorkItem(deviceObject);
+  if (request->workItem == NULL)
+  {
+    Memory_free(request);
+    return STATUS_UNSUCCESSFUL;
+  }
+  request->irp = irp;
+  request->dpcWorker = ipiWorker;
+  request->mapping = *mapping;
+  request->noOfPendingCores = (LONG)noOfLogicalCores;
+  request->status = STATUS_SUCCESS;
+  request->coreStatuses = (NTSTATUS*)&request->dpcs[noOfLogicalCores];
+
+  ExAcquireFastMutex(&swapperMutex);
+  if (ipiWorker == PAGE_SWAPPER_mapIpi)
+  {
+    const NTSTATUS ntStatus = reserveSplitTables(1, mapping);
+    if (!NT_SUCCESS(ntStatus))
+    {
+      ExReleaseFastMutex(&swapperMutex);
+      IoFreeWorkItem(request->workItem);
+      Memory_free(request);
+      return ntStatus;
+    }
+  }
+
+  InterlockedIncrement(&noOfAsyncRequests);
+  IoMarkIrpPending(irp);
+
+  if (context->isEptShared)
+  {
+    request->status = (LONG)ipiWorker((ULONG_PTR)&request->mapping);
+    if (!NT_SUCCESS(request->status))
+    {
+      finishAsync(request);
+      ExReleaseFastMutex(&swapperMutex);
+      return STATUS_PENDING;
+    }
+    request->dpcWorker = PAGE_SWAPPER_invalidateIpi;
+  }
+
+  for (UINT64 logicalCoreIndex = 0; logicalCoreIndex < noOfLogicalCores; logicalCoreIndex++)
+  {
+    PROCESSOR_NUMBER processorNumber = { 0 };
+    KeGetProcessorNumberFromIndex((ULONG)logicalCoreIndex, &processorNumber);
+
+    KDPC* const dpc = &request->dpcs[logicalCoreIndex];
+    KeInitializeDpc(dpc, PAGE_SWAPPER_asyncDpc, request);
+    KeSetTargetProcessorDpcEx(dpc, &processorNumber);
+    KeSetImportanceDpc(dpc, MediumHighImportance);
+  }
+
+  // All DPCs are initialized before the first one can complete the request
+  for (UINT64 logicalCoreIndex = 0; logicalCoreIndex < noOfLogicalCores; logicalCoreIndex++)
+  {
+    KeInsertQueueDpc(&request->dpcs[logicalCoreIndex], NULL, NULL);
+  }
+  ExReleaseFastMutex(&swapperMutex);
+
+  return STATUS_PENDING;
+}
+
+
+/**
+ * @brief Marks an asynchronous request as applied by all cores.
+ *
+ * Wakes up synchronous changes waiting for the last request in flight, and queues the work
+ * item completing the IRP. Can be called at DISPATCH_LEVEL. The request may be freed as soon
+ * as this function returns.
+ *
+ * @param request Request applied by all cores.
+ *
+ * @return VOID
+ */
+static VOID finishAsync(PAGE_SWAPPER_AsyncRequest* const request)
+{
+  if (InterlockedDecrement(&noOfAsyncRequests) == 0)
+  {
+    KeSetEvent(&asyncIdleEvent, IO_NO_INCREMENT, FALSE);
+  }
+
+  IoQueueWorkItem(request->workItem, PAGE_SWAPPER_completeAsync, DelayedWorkQueue, request);
+}
+
+
+/**
+ * @brief Acquires the mutex for a synchronous mapping change.
+ *
+ * Waits until all asynchronous requests in flight have been applied, so the change is not
+ * applied by an IPI ahead of DPCs still queued on some cores. No request can be submitted
+ * while the mutex is held, so the counter only decreases during the wait.
+ *
+ * @return VOID
+ */
+static VOID acquireForSyncChange(VOID)
+{
+  ExAcquireFastMutex(&swapperMutex);
+  while (noOfAsyncRequests != 0)
+  {
+    KeClearEvent(&asyncIdleEvent);
+    if (noOfAsyncRequests == 0)
+    {
+      break;
+    }
+
+    KeWaitForSingleObject(&asyncIdleEvent, Executive, KernelMode, FALSE, NULL);
+  }
+}
+
+
+/**
+ * @brief Applies a single mapping change on all logical cores.
+ *
+ * In the shared EPT mode, the change is applied on the current core only, and all cores
+ * are then asked to invalidate their EPT caches. Otherwise, a change which failed on some
+ * cores only is rolled back on the others before the first error is returned.
+ *
+ * @param ipiWorker PAGE_SWAPPER_mapIpi, PAGE_SWAPPER_mapRangeIpi or PAGE_SWAPPER_unmapIpi.
+ * @param mapping Mapping to apply.
+ *
+ * @return STATUS_SUCCESS if successful, error code otherwise.
+ */
+static NTSTATUS applyMapping(
+  PKIPI_BROADCAST_WORKER ipiWorker,
+  const Context_EptChangedMapping* const mapping)
+{
+  if (Context_getContext()->isEptShared)
+  {
+    const NTSTATUS ntStatus = (NTSTATUS)ipiWorker((ULONG_PTR)mapping);
+    if (NT_SUCCESS(ntStatus))
+    {
+      KeIpiGenericCall(PAGE_SWAPPER_invalidateIpi, 0);
+    }
+
+    return ntStatus;
+  }
+
+  const UINT64 noOfLogicalCores = Context_getContext()->noOfLogicalCores;
+  NTSTATUS* const coreStatuses = Memory_allocate(noOfLogicalCores * sizeof(NTSTATUS), FALSE);
+  if (coreStatuses == NULL)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  PAGE_SWAPPER_Change change = (PAGE_SWAPPER_Change)
+  {
+    .ipiWorker = ipiWorker,
+    .mapping = mapping,
+    .coreStatuses = coreStatuses
+  };
+  KeIpiGenericCall(PAGE_SWAPPER_changeIpi, (ULONG_PTR)&change);
+
+  const NTSTATUS ntStatus = collectStatus(1, coreStatuses, 0);
+  const NTSTATUS rollbackStatus = rollbackPartialChanges(
+    ipiWorker == PAGE_SWAPPER_unmapIpi ? VMEXIT_VMCALL_UNMAP_BATCH : VMEXIT_VMCALL_MAP_BATCH,
+    1,
+    mapping,
+    coreStatuses);
+  Memory_free(coreStatuses);
+
+  return NT_SUCCESS(ntStatus) ? rollbackStatus : ntStatus;
+}
+
+
+/**
+ * @brief Makes split tables released by coalescing available again.
+ *
+ * Must be called after EPT caches of all logical cores have been invalidated. Nothing
+ * is recycled while asynchronous requests are in flight, the last one to complete does it.
+ *
+ * @return VOID
+ */
+static VOID recycleSplitTables(VOID)
+{
+  if (noOfAsyncRequests != 0)
+  {
+    return;
+  }
+
+  Context_Context* const context = Context_getContext();
+  for (UINT64 mappingsDataIndex = 0;
+    mappingsDataIndex < context->noOfEptMappingsData;
+    mappingsDataIndex++)
+  {
+    PAGE_POOL_recycleRetired(&context->eptMappingsData[mappingsDataIndex]->splitPool);
+  }
+}
+
+
+/**
+ * @brief Returns physical address of a physically contiguous, page aligned range.
+ *
+ * @param virtualAddress Virtual address of the range.
+ * @param size Size of the range in bytes, multiple of PAGE_SIZE.
+ * @param physicalAddress Pointer receiving physical address of the range.
+ *
+ * @return STATUS_SUCCESS if successful, STATUS_INVALID_PARAMETER otherwise.
+ */
+static NTSTATUS getRangePhysicalAddress(
+  VOID* const virtualAddress,
+  const UINT64 size,
+  UINT64* const physicalAddress)
+{
+  const UINT64 baseAddress = Memory_getPhysicalAddress(virtualAddress);
+  if (baseAddress == 0 || baseAddress % PAGE_SIZE != 0)
+  {
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  for (UINT64 offset = PAGE_SIZE; offset < size; offset += PAGE_SIZE)
+  {
+    if (Memory_getPhysicalAddress((UINT8*)virtualAddress + offset) != baseAddress + offset)
+    {
+      return STATUS_INVALID_PARAMETER;
+    }
+  }
+
+  *physicalAddress = baseAddress;
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Sums EPT violation counters of a mapping over all EPT hierarchies.
+ *
+ * @param guestAddress Guest physical address of the mapping.
+ * @param reset TRUE if counters should be reset after they are read.
+ *
+ * @return Number of EPT violations.
+ */
+static UINT64 collectViolations(const UINT64 guestAddress, const BOOLEAN reset)
+{
+  Context_Context* const context = Context_getContext();
+  UINT64 noOfViolations = 0;
+  for (UINT64 mappingsDataIndex = 0;
+    mappingsDataIndex < context->noOfEptMappingsData;
+    mappingsDataIndex++)
+  {
+    Context_EptChangedMapping* const mapping = MAPPING_TABLE_find(
+      &context->eptMappingsData[mappingsDataIndex]->changedMappings,
+      guestAddress);
+    if (mapping != NULL)
+    {
+      noOfViolations += mapping->noOfViolations;
+      if (reset)
+      {
+        mapping->noOfViolations = 0;
+      }
+    }
+  }
+
+  return noOfViolations;
+}
+
+
+/**
+ * @brief Reserves page tables needed to apply mappings.
+ *
+ * For every EPT hierarchy, counts the tables needed to split the large pages still mapping
+ * the mappings' guest addresses and makes sure the split pool has that many free pages for
+ * every view, on top of PAGE_POOL_LOW_WATERMARK. Consecutive mappings in the same 2MB region
+ * are counted once. Range mappings are estimated for both their targets, which covers
+ * both views, and also the pre-split done without EPTP switching. Mappings of zero size
+ * are removals and need no tables.
+ *
+ * @param noOfMappings Number of mappings.
+ * @param mappings Array of mappings.
+ *
+ * @return STATUS_SUCCESS if successful, error code otherwise.
+ */
+static NTSTATUS reserveSplitTables(
+  const UINT64 noOfMappings,
+  const Context_EptChangedMapping* const mappings)
+{
+  Context_Context* const context = Context_getContext();
+  for (UINT64 mappingsDataIndex = 0;
+    mappingsDataIndex < context->noOfEptMappingsData;
+    mappingsDataIndex++)
+  {
+    Context_EptMappingsData* const mappingData = context->eptMappingsData[mappingsDataIndex];
+
+    UINT64 noOfSplits = 0;
+    UINT64 noOfRangeSplits = 0;
+    UINT64 previousLargePage = MAXUINT64;
+    for (UINT64 mappingIndex = 0; mappingIndex < noOfMappings; mappingIndex++)
+    {
+      const Context_EptChangedMapping* const mapping = &mappings[mappingIndex];
+      if (mapping->size == 0)
+      {
+        continue;
+      }
+
+      if (mapping->size > PAGE_SIZE)
+      {
+        const UINT64 guestAddress = mapping->guestAddress;
+        noOfRangeSplits +=
+          EPT_getNoOfRangeSplitTables(guestAddress, mapping->hostRwAddress, mapping->size) +
+          EPT_getNoOfRangeSplitTables(guestAddress, mapping->hostFetchAddress, mapping->size);
+        continue;
+      }
+
+      const UINT64 largePage =
+        (EPT_Address){ .address = mapping->guestAddress }.pageFrameNumber2MB;
+      if (largePage != previousLargePage)
+      {
+        noOfSplits += EPT_getNoOfSplitTables(mappingData, mapping->guestAddress);
+      }
+      previousLargePage = largePage;
+    }
+
+    const NTSTATUS ntStatus = PAGE_POOL_reserve(
+      &mappingData->splitPool,
+      noOfSplits * EPT_getNoOfViews(mappingData) + noOfRangeSplits + PAGE_POOL_LOW_WATERMARK);
+    if (!NT_SUCCESS(ntStatus))
+    {
+      return ntStatus;
+    }
+  }
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Splits large pages mapping page mappings' guest addresses.
+ *
+ * Called at PASSIVE_LEVEL after reserveSplitTables, so that root mode finds the page tables
+ * in place. Every 2MB region is split once for each EPT hierarchy, which is a single one in
+ * the shared EPT mode. Removals are skipped, and so are range mappings, which are split by
+ * root mode only where their alignment requires it. Must not be called while asynchronous
+ * requests are in flight, since their DPCs may be changing the same hierarchies. If any
+ * large page was split, all cores invalidate their EPT caches before the change is sent,
+ * since the page size of its mappings changed, also when a later split fails.
+ *
+ * @param noOfMappings Number of mappings.
+ * @param mappings Array of mappings.
+ *
+ * @return STATUS_SUCCESS if successful, error code otherwise.
+ */
+static NTSTATUS splitLargePages(
+  const UINT64 noOfMappings,
+  const Context_EptChangedMapping* const mappings)
+{
+  Context_Context* const context = Context_getContext();
+  NTSTATUS ntStatus = STATUS_SUCCESS;
+  BOOLEAN isSplit = FALSE;
+  for (UINT64 mappingsDataIndex = 0;
+    mappingsDataIndex < context->noOfEptMappingsData && NT_SUCCESS(ntStatus);
+    mappingsDataIndex++)
+  {
+    Context_EptMappingsData* const mappingData = context->eptMappingsData[mappingsDataIndex];
+
+    UINT64 previousLargePage = MAXUINT64;
+    for (UINT64 mappingIndex = 0;
+      mappingIndex < noOfMappings && NT_SUCCESS(ntStatus);
+      mappingIndex++)
+    {
+      const Context_EptChangedMapping* const mapping = &mappings[mappingIndex];
+      const UINT64 largePage =
+        (EPT_Address){ .address = mapping->guestAddress }.pageFrameNumber2MB;
+      if (mapping->size != PAGE_SIZE || largePage == previousLargePage)
+      {
+        continue;
+      }
+      previousLargePage = largePage;
+
+      BOOLEAN isPageSplit = FALSE;
+      ntStatus = EPT_prepareSplit(mappingData, mapping->guestAddress, FALSE, &isPageSplit);
+      isSplit |= isPageSplit;
+    }
+  }
+
+  if (isSplit)
+  {
+    KeIpiGenericCall(PAGE_SWAPPER_invalidateIpi, 0);
+  }
+
+  return ntStatus;
+}
+
+
+/**
+ * @brief Prepares or releases 2MB regions holding pages of a virtual region.
+ *
+ * Each 2MB region is recorded once for the owner, and handled in every EPT hierarchy. A
+ * region is split and pinned when it is recorded, even if another handle prepared it too,
+ * and it is released once no handle keeps it prepared. Tables needed to prepare it are
+ * reserved right before, so the pool grows only by what the region needs. The caller is
+ * responsible for holding the mutex and for invalidating EPT caches of all cores afterwards.
+ *
+ * @param owner File object of the handle preparing or releasing the region.
+ * @param request Virtual region.
+ * @param prepare TRUE to split and pin the regions, FALSE to release them.
+ *
+ * @return STATUS_SUCCESS if successful, STATUS_INVALID_PARAMETER if the region is not page
+ * aligned or any of its pages is not resident, STATUS_INSUFFICIENT_RESOURCES if too many
+ * regions are prepared, error code otherwise.
+ */
+static NTSTATUS changePreparedRegions(
+  const PFILE_OBJECT owner,
+  const PAGE_SWAPPER_PrepareRequest* const request,
+  const BOOLEAN prepare)
+{
+  const UINT64 size = request->size;
+  if (size == 0 || size % PAGE_SIZE != 0 || (UINT64)request->address % PAGE_SIZE != 0 ||
+    size > PAGE_SWAPPER_MAX_PREPARED_REGIONS * EPT_PAGE_SIZE_2MB)
+  {
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  Context_Context* const context = Context_getContext();
+  UINT64 previousLargePage = MAXUINT64;
+  for (UINT64 offset = 0; offset < size; offset += PAGE_SIZE)
+  {
+    const UINT64 guestAddress = Memory_getPhysicalAddress((UINT8*)request->address + offset);
+    if (guestAddress == 0)
+    {
+      return STATUS_INVALID_PARAMETER;
+    }
+
+    const UINT64 largePage = (EPT_Address){ .address = guestAddress }.pageFrameNumber2MB;
+    if (largePage == previousLargePage)
+    {
+      continue;
+    }
+    previousLargePage = largePage;
+
+    UINT64 regionIndex = PAGE_SWAPPER_MAX_PREPARED_REGIONS;
+    UINT64 freeIndex = PAGE_SWAPPER_MAX_PREPARED_REGIONS;
+    for (UINT64 index = 0; index < PAGE_SWAPPER_MAX_PREPARED_REGIONS; index++)
+    {
+      if (preparedRegions[index].owner == owner && preparedRegions[index].largePage == largePage)
+      {
+        regionIndex = index;
+      }
+      else if (preparedRegions[index].owner == NULL &&
+        freeIndex == PAGE_SWAPPER_MAX_PREPARED_REGIONS)
+      {
+        freeIndex = index;
+      }
+    }
+
+    if (!prepare)
+    {
+      if (regionIndex != PAGE_SWAPPER_MAX_PREPARED_REGIONS)
+      {
+        releasePreparedRegion(regionIndex);
+      }
+      continue;
+    }
+    if (regionIndex != PAGE_SWAPPER_MAX_PREPARED_REGIONS)
+    {
+      continue;
+    }
+    if (freeIndex == PAGE_SWAPPER_MAX_PREPARED_REGIONS)
+    {
+      return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    // Recorded first, so a region split only in some hierarchies is still released
+    preparedRegions[freeIndex] = (PAGE_SWAPPER_PreparedRegion)
+    {
+      .owner = owner,
+      .largePage = largePage
+    };
+
+    for (UINT64 mappingsDataIndex = 0;
+      mappingsDataIndex < context->noOfEptMappingsData;
+      mappingsDataIndex++)
+    {
+      Context_EptMappingsData* const mappingData = context->eptMappingsData[mappingsDataIndex];
+      NTSTATUS ntStatus = PAGE_POOL_reserve(
+        &mappingData->splitPool,
+        EPT_getNoOfSplitTables(mappingData, guestAddress) * EPT_getNoOfViews(mappingData) +
+        PAGE_POOL_LOW_WATERMARK);
+      if (NT_SUCCESS(ntStatus))
+      {
+        BOOLEAN isSplit = FALSE;
+        ntStatus = EPT_prepareSplit(mappingData, guestAddress, TRUE, &isSplit);
+      }
+      if (!NT_SUCCESS(ntStatus))
+      {
+        return ntStatus;
+      }
+    }
+  }
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Removes an entry of a prepared region.
+ *
+ * The region is unpinned in every EPT hierarchy, unless another handle keeps it prepared.
+ * The caller is responsible for holding the mutex and for invalidating EPT caches of all
+ * cores afterwards.
+ *
+ * @param regionIndex Index of the entry in preparedRegions.
+ *
+ * @return VOID
+ */
+static VOID releasePreparedRegion(const UINT64 regionIndex)
+{
+  const UINT64 largePage = preparedRegions[regionIndex].largePage;
+  preparedRegions[regionIndex] = (PAGE_SWAPPER_PreparedRegion){ 0 };
+
+  for (UINT64 index = 0; index < PAGE_SWAPPER_MAX_PREPARED_REGIONS; index++)
+  {
+    if (preparedRegions[index].owner != NULL && preparedRegions[index].largePage == largePage)
+    {
+      return;
+    }
+  }
+
+  Context_Context* const context = Context_getContext();
+  for (UINT64 mappingsDataIndex = 0;
+    mappingsDataIndex < context->noOfEptMappingsData;
+    mappingsDataIndex++)
+  {
+    EPT_unpinSplit(context->eptMappingsData[mappingsDataIndex], largePage * EPT_PAGE_SIZE_2MB);
+  }
+}
+
+
+/**
+ * @brief Broadcasts a batch of mapping changes to all logical cores.
+ *
+ * Every core receives the whole batch in one VMCALL and reports a status for each mapping.
+ * The status of a mapping is STATUS_SUCCESS only if it succeeded on all cores, otherwise it
+ * is the first error reported by any core, and the mapping is rolled back on the cores where
+ * it succeeded. In the shared EPT mode, the batch is applied on the current core only, and
+ * all cores are then asked to invalidate their EPT caches.
+ *
+ * @param vmCallCode VMEXIT_VMCALL_MAP_BATCH, VMEXIT_VMCALL_UNMAP_BATCH,
+ * VMEXIT_VMCALL_APPLY_BATCH or VMEXIT_VMCALL_GROUP_BATCH.
+ * @param noOfMappings Number of mappings.
+ * @param mappings Array of mappings.
+ * @param statuses Array receiving aggregated status for each mapping.
+ *
+ * @return STATUS_SUCCESS if the batch was broadcast and all cores agree on every mapping,
+ * error code otherwise.
+ */
+static NTSTATUS broadcastBatch(
+  const UINT64 vmCallCode,
+  const UINT64 noOfMappings,
+  const Context_EptChangedMapping* const mappings,
+  NTSTATUS* const statuses)
+{
+  if (Context_getContext()->isEptShared)
+  {
+    VMX_vmcall(vmCallCode, (UINT64)mappings, noOfMappings, (UINT64)statuses);
+
+    for (UINT64 mappingIndex = 0; mappingIndex < noOfMappings; mappingIndex++)
+    {
+      if (NT_SUCCESS(statuses[mappingIndex]))
+      {
+        KeIpiGenericCall(PAGE_SWAPPER_invalidateIpi, 0);
+        break;
+      }
+    }
+
+    return STATUS_SUCCESS;
+  }
+
+  const UINT64 noOfLogicalCores = Context_getContext()->noOfLogicalCores;
+  NTSTATUS* const coreStatuses =
+    Memory_allocate(noOfLogicalCores * noOfMappings * sizeof(NTSTATUS), FALSE);
+  if (coreStatuses == NULL)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  PAGE_SWAPPER_Batch batch = (PAGE_SWAPPER_Batch)
+  {
+    .vmCallCode = vmCallCode,
+    .noOfMappings = noOfMappings,
+    .mappings = mappings,
+    .coreStatuses = coreStatuses
+  };
+  KeIpiGenericCall(PAGE_SWAPPER_batchIpi, (ULONG_PTR)&batch);
+
+  for (UINT64 mappingIndex = 0; mappingIndex < noOfMappings; mappingIndex++)
+  {
+    statuses[mappingIndex] = collectStatus(noOfMappings, coreStatuses, mappingIndex);
+  }
+
+  const NTSTATUS ntStatus =
+    rollbackPartialChanges(vmCallCode, noOfMappings, mappings, coreStatuses);
+  Memory_free(coreStatuses);
+
+  return ntStatus;
+}
+
+
+/**
+ * @brief Merges the statuses reported by all logical cores for a mapping.
+ *
+ * @param noOfMappings Number of mappings.
+ * @param coreStatuses Per-core status arrays, noOfMappings entries for each logical core.
+ * @param mappingIndex Index of the mapping.
+ *
+ * @return STATUS_SUCCESS if the mapping succeeded on all cores, the first error reported
+ * by any core otherwise.
+ */
+static NTSTATUS collectStatus(
+  const UINT64 noOfMappings,
+  const NTSTATUS* const coreStatuses,
+  const UINT64 mappingIndex)
+{
+  const UINT64 noOfLogicalCores = Context_getContext()->noOfLogicalCores;
+  for (UINT64 logicalCoreIndex = 0; logicalCoreIndex < noOfLogicalCores; logicalCoreIndex++)
+  {
+    const NTSTATUS coreStatus = coreStatuses[logicalCoreIndex * noOfMappings + mappingIndex];
+    if (!NT_SUCCESS(coreStatus))
+    {
+      return coreStatus;
+    }
+  }
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Checks if a mapping succeeded on some logical cores and failed on the others.
+ *
+ * @param noOfMappings Number of mappings.
+ * @param coreStatuses Per-core status arrays, noOfMappings entries for each logical core.
+ * @param mappingIndex Index of the mapping.
+ * @param failedCoreIndex Receives the index of the first core where the mapping failed.
+ *
+ * @return TRUE if the cores disagree on the mapping, FALSE otherwise.
+ */
+static BOOLEAN isPartialChange(
+  const UINT64 noOfMappings,
+  const NTSTATUS* const coreStatuses,
+  const UINT64 mappingIndex,
+  UINT64* const failedCoreIndex)
+{
+  const UINT64 noOfLogicalCores = Context_getContext()->noOfLogicalCores;
+  BOOLEAN isFailed = FALSE;
+  BOOLEAN isApplied = FALSE;
+  for (UINT64 logicalCoreIndex = 0; logicalCoreIndex < noOfLogicalCores; logicalCoreIndex++)
+  {
+    if (NT_SUCCESS(coreStatuses[logicalCoreIndex * noOfMappings + mappingIndex]))
+    {
+      isApplied = TRUE;
+    }
+    else if (!isFailed)
+    {
+      isFailed = TRUE;
+      *failedCoreIndex = logicalCoreIndex;
+    }
+  }
+
+  return isFailed && isApplied;
+}
+
+
+/**
+ * @brief Rolls back mapping changes which succeeded on some logical cores only.
+ *
+ * Used when every core applies changes to its own EPT, and so may fail on its own. A mapping
+ * which failed on some cores is undone on the cores where it succeeded, using the state of
+ * the first core where it failed: a map is undone by unmapping the page, an unmap by mapping
+ * that core's change again, including its group, and a group change by moving the change back
+ * to that core's group. Mappings are undone in reverse order, so all cores agree again once
+ * every undo succeeded. The mutex must be held with no asynchronous request in flight, since
+ * mapping tables of other cores are read.
+ *
+ * @param vmCallCode VMCALL code the mappings were applied with, VMEXIT_VMCALL_MAP_BATCH,
+ * VMEXIT_VMCALL_UNMAP_BATCH, VMEXIT_VMCALL_APPLY_BATCH or VMEXIT_VMCALL_GROUP_BATCH.
+ * @param noOfMappings Number of mappings.
+ * @param mappings Array of applied mappings.
+ * @param coreStatuses Per-core status arrays, noOfMappings entries for each logical core.
+ *
+ * @return STATUS_SUCCESS if all cores agree on every mapping, error code otherwise.
+ */
+static NTSTATUS rollbackPartialChanges(
+  const UINT64 vmCallCode,
+  const UINT64 noOfMappings,
+  const Context_EptChangedMapping* const mappings,
+  const NTSTATUS* const coreStatuses)
+{
+  const Context_Context* const context = Context_getContext();
+
+  UINT64 failedCoreIndex = 0;
+  UINT64 noOfPartialChanges = 0;
+  for (UINT64 mappingIndex = 0; mappingIndex < noOfMappings; mappingIndex++)
+  {
+    noOfPartialChanges +=
+      isPartialChange(noOfMappings, coreStatuses, mappingIndex, &failedCoreIndex);
+  }
+  if (noOfPartialChanges == 0)
+  {
+    return STATUS_SUCCESS;
+  }
+
+  // An undone unmap may also restore the group of the change
+  PAGE_SWAPPER_Undo* const undos =
+    Memory_allocate(2 * noOfPartialChanges * sizeof(PAGE_SWAPPER_Undo), FALSE);
+  if (undos == NULL)
+  {
+    DbgPrint("rollbackPartialChanges: error=%ld\n", STATUS_UNSUCCESSFUL);
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  NTSTATUS ntStatus = STATUS_SUCCESS;
+  UINT64 noOfUndos = 0;
+  for (UINT64 reverseIndex = noOfMappings; reverseIndex > 0; reverseIndex--)
+  {
+    const UINT64 mappingIndex = reverseIndex - 1;
+    if (!isPartialChange(noOfMappings, coreStatuses, mappingIndex, &failedCoreIndex))
+    {
+      continue;
+    }
+
+    const Context_EptChangedMapping* const mapping = &mappings[mappingIndex];
+    const Context_EptChangedMapping* const original = MAPPING_TABLE_find(
+      &context->logicalCores[failedCoreIndex]->eptMappingData->changedMappings,
+      mapping->guestAddress);
+    const BOOLEAN isChanged = original != NULL && original->guestAddress == mapping->guestAddress;
+    const BOOLEAN isUnmap = vmCallCode == VMEXIT_VMCALL_UNMAP_BATCH ||
+      (vmCallCode == VMEXIT_VMCALL_APPLY_BATCH && mapping->size == 0);
+
+    PAGE_SWAPPER_Undo* const undo = &undos[noOfUndos];
+    *undo = (PAGE_SWAPPER_Undo)
+    {
+      .mappingIndex = mappingIndex,
+      .ipiWorker = PAGE_SWAPPER_unmapIpi,
+      .mapping = { .guestAddress = mapping->guestAddress, .valid = TRUE }
+    };
+
+    // Without a change on the failed core, there is nothing to restore an unmap or group from
+    if (vmCallCode == VMEXIT_VMCALL_GROUP_BATCH)
+    {
+      if (isChanged)
+      {
+        undo->ipiWorker = PAGE_SWAPPER_groupIpi;
+        undo->mapping.groupId = original->groupId;
+        noOfUndos++;
+      }
+    }
+    else if (isUnmap)
+    {
+      if (isChanged)
+      {
+        undo->ipiWorker =
+          original->size > PAGE_SIZE ? PAGE_SWAPPER_mapRangeIpi : PAGE_SWAPPER_mapIpi;
+        undo->mapping.hostRwAddress = original->hostRwAddress;
+        undo->mapping.hostFetchAddress = original->hostFetchAddress;
+        undo->mapping.size = original->size;
+
+        const NTSTATUS reserveStatus = reserveSplitTables(1, &undo->mapping);
+        if (!NT_SUCCESS(reserveStatus))
+        {
+          ntStatus = reserveStatus;
+          continue;
+        }
+        noOfUndos++;
+
+        if (original->groupId != 0)
+        {
+          undos[noOfUndos] = (PAGE_SWAPPER_Undo)
+          {
+            .mappingIndex = mappingIndex,
+            .ipiWorker = PAGE_SWAPPER_groupIpi,
+            .mapping =
+            {
+              .guestAddress = mapping->guestAddress,
+              .groupId = original->groupId,
+              .valid = TRUE
+            }
+          };
+          noOfUndos++;
+        }
+      }
+    }
+    else
+    {
+      noOfUndos++;
+    }
+  }
+
+  PAGE_SWAPPER_Rollback rollback = (PAGE_SWAPPER_Rollback)
+  {
+    .noOfMappings = noOfMappings,
+    .coreStatuses = coreStatuses,
+    .noOfUndos = noOfUndos,
+    .undos = undos,
+    .status = STATUS_SUCCESS
+  };
+  if (noOfUndos != 0)
+  {
+    KeIpiGenericCall(PAGE_SWAPPER_rollbackIpi, (ULONG_PTR)&rollback);
+
+    // Split tables retired by undone maps
+    recycleSplitTables();
+  }
+  Memory_free(undos);
+
+  if (NT_SUCCESS(ntStatus))
+  {
+    ntStatus = rollback.status;
+  }
+  if (!NT_SUCCESS(ntStatus))
+  {
+    DbgPrint("rollbackPartialChanges: error=%ld\n", ntStatus);
+  }
+
+  return ntStatus;
 }
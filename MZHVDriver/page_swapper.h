@@ -7,15 +7,214 @@
 
 
 #include <ntddk.h>
+#include "stats.h"
+
+
+/**************************************************************************************************
+* Defines
+**************************************************************************************************/
+/**
+ * @name Batch limits
+ * @brief Maximum number of pages that can be changed with a single batch request.
+ * @anchor PAGE_SWAPPERBatchLimits
+ */
+///@{
+#define PAGE_SWAPPER_MAX_BATCH_SIZE  4096
+///@}
+
+
+/**
+ * @name Prepared regions limit
+ * @brief Maximum number of 2MB regions kept prepared, 128MB in total.
+ * @anchor PAGE_SWAPPERPreparedRegionsLimit
+ */
+///@{
+#define PAGE_SWAPPER_MAX_PREPARED_REGIONS  64
+///@}
+
+
+/**
+ * @name Refill period
+ * @brief Interval in milliseconds at which populate pools flagged by root mode are refilled.
+ * @anchor PAGE_SWAPPERRefillPeriod
+ */
+///@{
+#define PAGE_SWAPPER_REFILL_PERIOD_MS  100
+///@}
+
+
+/**************************************************************************************************
+* Type declarations
+**************************************************************************************************/
+/**
+ * @brief Single entry of a batched map request.
+ *
+ * Layout matches the VOID*[3] argument of DRIVER_MAP, so batches are plain arrays of triples.
+ *
+ * @param originalAddress Virtual address of the page to be changed.
+ * @param rwAddress Virtual address of the page mapped for read/write access.
+ * @param fetchAddress Virtual address of the page mapped for code execution.
+ */
+typedef struct PAGE_SWAPPER_MapRequest
+{
+  VOID* originalAddress;
+  VOID* rwAddress;
+  VOID* fetchAddress;
+} PAGE_SWAPPER_MapRequest;
+
+
+/**
+ * @brief Single entry of a batched group request.
+ *
+ * Layout matches the input buffer entries of DRIVER_GROUP_BATCH.
+ *
+ * @param originalAddress Virtual address of a changed page, first page of a range mapping.
+ * @param groupId Group to move the mapping to, 0 to remove it from its group.
+ */
+typedef struct PAGE_SWAPPER_GroupRequest
+{
+  VOID* originalAddress;
+  UINT64 groupId;
+} PAGE_SWAPPER_GroupRequest;
+
+
+/**
+ * @brief Range map request.
+ *
+ * Layout matches the input buffer of DRIVER_MAP_RANGE.
+ *
+ * @param originalAddress Virtual address of the range to be changed.
+ * @param rwAddress Virtual address of the range mapped for read/write access.
+ * @param fetchAddress Virtual address of the range mapped for code execution.
+ * @param size Size of the ranges in bytes, multiple of PAGE_SIZE.
+ */
+typedef struct PAGE_SWAPPER_RangeRequest
+{
+  VOID* originalAddress;
+  VOID* rwAddress;
+  VOID* fetchAddress;
+  UINT64 size;
+} PAGE_SWAPPER_RangeRequest;
+
+
+/**
+ * @brief Accessed and dirty flags harvest request.
+ *
+ * Layout matches the input buffer of DRIVER_HARVEST_AD.
+ *
+ * @param address Guest physical address of the range to scan, page aligned.
+ * @param size Size of the range in bytes, multiple of PAGE_SIZE.
+ */
+typedef struct PAGE_SWAPPER_HarvestRequest
+{
+  UINT64 address;
+  UINT64 size;
+} PAGE_SWAPPER_HarvestRequest;
+
+
+/**
+ * @brief Prepare request.
+ *
+ * Layout matches the input buffer of DRIVER_PREPARE and DRIVER_UNPREPARE.
+ *
+ * @param address Virtual address of the region to be changed later, page aligned.
+ * @param size Size of the region in bytes, multiple of PAGE_SIZE.
+ */
+typedef struct PAGE_SWAPPER_PrepareRequest
+{
+  VOID* address;
+  UINT64 size;
+} PAGE_SWAPPER_PrepareRequest;
 
 
 /**************************************************************************************************
 * Global function declarations
 **************************************************************************************************/
+VOID PAGE_SWAPPER_init(VOID);
+
+
+NTSTATUS PAGE_SWAPPER_startRefill(VOID);
+
+
+VOID PAGE_SWAPPER_stopRefill(VOID);
+
+
 NTSTATUS PAGE_SWAPPER_map(
   VOID* const pageToMapVirtualAddress,
   VOID* const rwPageVirtualAddress,
   VOID* const fPageVirtualAddress);
 
 
+NTSTATUS PAGE_SWAPPER_mapRange(const PAGE_SWAPPER_RangeRequest* const request);
+
+
 NTSTATUS PAGE_SWAPPER_unmap(VOID* const pageToUnmapVirtualAddress);
+
+
+NTSTATUS PAGE_SWAPPER_mapAsync(
+  PDEVICE_OBJECT deviceObject,
+  PIRP irp,
+  VOID* const pageToMapVirtualAddress,
+  VOID* const rwPageVirtualAddress,
+  VOID* const fPageVirtualAddress);
+
+
+NTSTATUS PAGE_SWAPPER_unmapAsync(
+  PDEVICE_OBJECT deviceObject,
+  PIRP irp,
+  VOID* const pageToUnmapVirtualAddress);
+
+
+NTSTATUS PAGE_SWAPPER_mapBatch(
+  const UINT64 noOfRequests,
+  const PAGE_SWAPPER_MapRequest* const requests,
+  NTSTATUS* const statuses);
+
+
+NTSTATUS PAGE_SWAPPER_unmapBatch(
+  const UINT64 noOfRequests,
+  VOID* const* const pagesToUnmap,
+  NTSTATUS* const statuses);
+
+
+NTSTATUS PAGE_SWAPPER_applyBatch(
+  const UINT64 noOfRequests,
+  const PAGE_SWAPPER_MapRequest* const requests,
+  NTSTATUS* const statuses);
+
+
+NTSTATUS PAGE_SWAPPER_groupBatch(
+  const UINT64 noOfRequests,
+  const PAGE_SWAPPER_GroupRequest* const requests,
+  NTSTATUS* const statuses);
+
+
+NTSTATUS PAGE_SWAPPER_prepareRange(
+  const PFILE_OBJECT owner,
+  const PAGE_SWAPPER_PrepareRequest* const request);
+
+
+NTSTATUS PAGE_SWAPPER_unprepareRange(
+  const PFILE_OBJECT owner,
+  const PAGE_SWAPPER_PrepareRequest* const request);
+
+
+VOID PAGE_SWAPPER_releasePreparedRanges(const PFILE_OBJECT owner);
+
+
+NTSTATUS PAGE_SWAPPER_harvestAccessedDirty(
+  const PAGE_SWAPPER_HarvestRequest* const request,
+  const UINT64 outputSize,
+  UINT64* const bitmaps,
+  UINT64* const bytesWritten);
+
+
+VOID PAGE_SWAPPER_clearDirtyFlags(VOID);
+
+
+VOID PAGE_SWAPPER_queryMappingStats(
+  const BOOLEAN reset,
+  const UINT64 maxMappings,
+  STATS_MappingStats* const mappings,
+  UINT64* const noOfMappings,
+  UINT64* const noOfReturnedMappings);
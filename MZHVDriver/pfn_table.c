@@ -0,0 +1,255 @@
+/**
+ * @file pfn_table.c
+ * @brief Implements PFN table.
+ *
+ * The table is a radix tree indexed by the physical address, with a fixed array of 1GB
+ * directories in the context, 2MB leaves below them, and a virtual address for every page.
+ * Pages are registered at PASSIVE_LEVEL when they are allocated, and unregistered before
+ * they are freed. A directory or leaf is published only after it is zeroed and is never
+ * freed before the table is destroyed, so root mode can look pages up without a lock.
+ */
+
+
+#include "bsod.h"
+#include "context.h"
+#include "memory.h"
+#include "pfn_table.h"
+
+
+/**************************************************************************************************
+* Local function declarations
+**************************************************************************************************/
+static NTSTATUS insertPage(Context_PfnTable* const table, VOID* const page);
+
+
+static UINT64 getDirectoryIndex(const UINT64 pageFrameNumber);
+
+
+static UINT64 getLeafIndex(const UINT64 pageFrameNumber);
+
+
+/**************************************************************************************************
+* Global function definitions
+**************************************************************************************************/
+/**
+ * @brief Initializes an empty PFN table.
+ *
+ * Must be called after the context is allocated, before any EPT table is allocated.
+ *
+ * @return VOID
+ */
+VOID PFN_TABLE_init(VOID)
+{
+  ExInitializeFastMutex(&Context_getContext()->pfnTable.mutex);
+}
+
+
+/**
+ * @brief Registers pages of a page aligned allocation.
+ *
+ * Each page is registered by its own physical address, so the allocation does not have to
+ * be physically contiguous. Must be called at PASSIVE_LEVEL.
+ *
+ * @param virtualAddress Virtual address of the first page.
+ * @param size Size of the allocation in bytes, multiple of PAGE_SIZE.
+ *
+ * @return STATUS_SUCCESS on success, STATUS_UNSUCCESSFUL if a page lies above the mapped
+ * address space or memory for the table could not be allocated. No page is registered then.
+ */
+NTSTATUS PFN_TABLE_insert(VOID* const virtualAddress, const UINT64 size)
+{
+  Context_PfnTable* const table = &Context_getContext()->pfnTable;
+  NTSTATUS ntStatus = STATUS_SUCCESS;
+
+  ExAcquireFastMutex(&table->mutex);
+  UINT64 noOfInsertedBytes = 0;
+  while (noOfInsertedBytes < size)
+  {
+    ntStatus = insertPage(table, (CHAR*)virtualAddress + noOfInsertedBytes);
+    if (!NT_SUCCESS(ntStatus))
+    {
+      break;
+    }
+    noOfInsertedBytes += PAGE_SIZE;
+  }
+  ExReleaseFastMutex(&table->mutex);
+
+  if (!NT_SUCCESS(ntStatus))
+  {
+    PFN_TABLE_remove(virtualAddress, noOfInsertedBytes);
+  }
+
+  return ntStatus;
+}
+
+
+/**
+ * @brief Unregisters pages of an allocation.
+ *
+ * Directories and leaves are kept until the table is destroyed. Must be called at
+ * PASSIVE_LEVEL, once no EPT hierarchy in use references the pages.
+ *
+ * @param virtualAddress Virtual address of the first page.
+ * @param size Size of the allocation in bytes, multiple of PAGE_SIZE.
+ *
+ * @return VOID
+ */
+VOID PFN_TABLE_remove(VOID* const virtualAddress, const UINT64 size)
+{
+  Context_PfnTable* const table = &Context_getContext()->pfnTable;
+
+  ExAcquireFastMutex(&table->mutex);
+  for (UINT64 offset = 0; offset < size; offset += PAGE_SIZE)
+  {
+    const UINT64 pageFrameNumber =
+      Memory_getPhysicalAddress((CHAR*)virtualAddress + offset) / PAGE_SIZE;
+    Context_PfnTableDirectory* const directory =
+      table->directories[getDirectoryIndex(pageFrameNumber)];
+    Context_PfnTableLeaf* const leaf = directory->leaves[getLeafIndex(pageFrameNumber)];
+    leaf->pages[pageFrameNumber % CONTEXT_PFN_TABLE_ENTRIES] = NULL;
+  }
+  ExReleaseFastMutex(&table->mutex);
+}
+
+
+/**
+ * @brief Returns virtual address of a registered page.
+ *
+ * Only reads the table, so it can be called at any IRQL and in VMX root mode. Function will
+ * bugcheck if the page is not registered.
+ *
+ * @param physicalAddress Physical address within a registered page.
+ *
+ * @return Virtual address.
+ */
+VOID* PFN_TABLE_getVirtualAddress(const UINT64 physicalAddress)
+{
+  const Context_PfnTable* const table = &Context_getContext()->pfnTable;
+  const UINT64 pageFrameNumber = physicalAddress / PAGE_SIZE;
+  const UINT64 directoryIndex = getDirectoryIndex(pageFrameNumber);
+
+  const Context_PfnTableDirectory* const directory =
+    (directoryIndex < CONTEXT_PFN_TABLE_DIRECTORIES) ? table->directories[directoryIndex] : NULL;
+  const Context_PfnTableLeaf* const leaf =
+    (directory != NULL) ? directory->leaves[getLeafIndex(pageFrameNumber)] : NULL;
+  CHAR* const page =
+    (leaf != NULL) ? leaf->pages[pageFrameNumber % CONTEXT_PFN_TABLE_ENTRIES] : NULL;
+  if (page == NULL)
+  {
+    KeBugCheck(BSOD_MEMORY_VA_CONVERSION);
+  }
+
+  return page + physicalAddress % PAGE_SIZE;
+}
+
+
+/**
+ * @brief Frees all directories and leaves of the PFN table.
+ *
+ * Must be called at PASSIVE_LEVEL, after all logical cores are devirtualized.
+ *
+ * @return VOID
+ */
+VOID PFN_TABLE_destroy(VOID)
+{
+  Context_PfnTable* const table = &Context_getContext()->pfnTable;
+  for (UINT64 directoryIndex = 0; directoryIndex < CONTEXT_PFN_TABLE_DIRECTORIES; directoryIndex++)
+  {
+    Context_PfnTableDirectory* const directory = table->directories[directoryIndex];
+    if (directory == NULL)
+    {
+      continue;
+    }
+
+    for (UINT64 leafIndex = 0; leafIndex < CONTEXT_PFN_TABLE_ENTRIES; leafIndex++)
+    {
+      if (directory->leaves[leafIndex] != NULL)
+      {
+        Memory_free(directory->leaves[leafIndex]);
+      }
+    }
+
+    Memory_free(directory);
+    table->directories[directoryIndex] = NULL;
+  }
+}
+
+
+/**************************************************************************************************
+* Local function definitions
+**************************************************************************************************/
+/**
+ * @brief Registers a single page, adding its directory and leaf if needed.
+ *
+ * Allocations are zeroed, and x64 does not reorder stores, so a directory or leaf is never
+ * seen before it is zeroed. The caller is responsible for holding the mutex.
+ *
+ * @param table PFN table.
+ * @param page Virtual address of the page.
+ *
+ * @return STATUS_SUCCESS on success, STATUS_UNSUCCESSFUL otherwise.
+ */
+static NTSTATUS insertPage(Context_PfnTable* const table, VOID* const page)
+{
+  const UINT64 pageFrameNumber = Memory_getPhysicalAddress(page) / PAGE_SIZE;
+  const UINT64 directoryIndex = getDirectoryIndex(pageFrameNumber);
+  if (directoryIndex >= CONTEXT_PFN_TABLE_DIRECTORIES)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  if (table->directories[directoryIndex] == NULL)
+  {
+    Context_PfnTableDirectory* const directory =
+      Memory_allocate(sizeof(Context_PfnTableDirectory), TRUE);
+    if (directory == NULL)
+    {
+      return STATUS_UNSUCCESSFUL;
+    }
+    KeMemoryBarrierWithoutFence();
+    table->directories[directoryIndex] = directory;
+  }
+
+  Context_PfnTableDirectory* const directory = table->directories[directoryIndex];
+  const UINT64 leafIndex = getLeafIndex(pageFrameNumber);
+  if (directory->leaves[leafIndex] == NULL)
+  {
+    Context_PfnTableLeaf* const leaf = Memory_allocate(sizeof(Context_PfnTableLeaf), TRUE);
+    if (leaf == NULL)
+    {
+      return STATUS_UNSUCCESSFUL;
+    }
+    KeMemoryBarrierWithoutFence();
+    directory->leaves[leafIndex] = leaf;
+  }
+
+  directory->leaves[leafIndex]->pages[pageFrameNumber % CONTEXT_PFN_TABLE_ENTRIES] = page;
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Returns index of the directory covering a page.
+ *
+ * @param pageFrameNumber Page frame number.
+ *
+ * @return Directory index, not checked against CONTEXT_PFN_TABLE_DIRECTORIES.
+ */
+static UINT64 getDirectoryIndex(const UINT64 pageFrameNumber)
+{
+  return pageFrameNumber / (CONTEXT_PFN_TABLE_ENTRIES * CONTEXT_PFN_TABLE_ENTRIES);
+}
+
+
+/**
+ * @brief Returns index of the leaf covering a page within its directory.
+ *
+ * @param pageFrameNumber Page frame number.
+ *
+ * @return Leaf index.
+ */
+static UINT64 getLeafIndex(const UINT64 pageFrameNumber)
+{
+  return pageFrameNumber / CONTEXT_PFN_TABLE_ENTRIES % CONTEXT_PFN_TABLE_ENTRIES;
+}
@@ -0,0 +1,32 @@
+/**
+ * @file pfn_table.h
+ * @brief PFN table function declarations.
+ *
+ * The table maps physical addresses of EPT tables back to their virtual addresses, so that
+ * hierarchies are walked by pointer arithmetic instead of asking the memory manager, which
+ * is not meant to be called in VMX root mode.
+ */
+
+
+#pragma once
+
+
+#include <ntddk.h>
+
+
+/**************************************************************************************************
+* Global function declarations
+**************************************************************************************************/
+VOID PFN_TABLE_init(VOID);
+
+
+NTSTATUS PFN_TABLE_insert(VOID* const virtualAddress, const UINT64 size);
+
+
+VOID PFN_TABLE_remove(VOID* const virtualAddress, const UINT64 size);
+
+
+VOID* PFN_TABLE_getVirtualAddress(const UINT64 physicalAddress);
+
+
+VOID PFN_TABLE_destroy(VOID);
@@ -0,0 +1,146 @@
+/**
+ * @file sampler.c
+ * @brief Implements the sampling profiler.
+ *
+ * The VMX-preemption timer counts down at the TSC rate divided by a power of 2 reported in
+ * IA32_VMX_MISC, only while the guest runs. Its value is saved on every VM exit, so samples
+ * are spread over guest time regardless of other VM exits, and the profiler costs a single
+ * VM exit per sample.
+ *
+ * Starting and stopping are serialized by a mutex.
+ */
+
+
+#include <intrin.h>
+#include "context.h"
+#include "ia32.h"
+#include "sampler.h"
+#include "vmexit.h"
+#include "vmx.h"
+
+
+/**************************************************************************************************
+* Local globals definitions
+**************************************************************************************************/
+/**
+ * @brief Mutex serializing starting and stopping of sampling.
+ */
+static FAST_MUTEX samplerMutex;
+
+
+/**
+ * @brief TRUE if sampling was started and not stopped yet.
+ */
+static BOOLEAN isStarted;
+
+
+/**************************************************************************************************
+* Local function declarations
+**************************************************************************************************/
+static KIPI_BROADCAST_WORKER SAMPLER_vmCallIpi;
+
+
+/**************************************************************************************************
+* Global function definitions
+**************************************************************************************************/
+/**
+ * @brief Initializes the sampler.
+ *
+ * Must be called at PASSIVE_LEVEL.
+ *
+ * @return VOID
+ */
+VOID SAMPLER_init(VOID)
+{
+  ExInitializeFastMutex(&samplerMutex);
+  isStarted = FALSE;
+}
+
+
+/**
+ * @brief Starts sampling on all logical cores.
+ *
+ * The period is converted to VMX-preemption timer ticks once, every core arms its timer
+ * with the same value. Must be called at PASSIVE_LEVEL.
+ *
+ * @param period Number of TSC ticks of guest time between two samples of a core,
+ * 0 for CONTEXT_SAMPLE_PERIOD. Shorter periods than CONTEXT_SAMPLE_PERIOD_MIN are raised.
+ *
+ * @return STATUS_SUCCESS if successful, STATUS_NOT_SUPPORTED if tracing is disabled
+ * or the timer is not supported, STATUS_INVALID_DEVICE_STATE if sampling is already started.
+ */
+NTSTATUS SAMPLER_start(const UINT64 period)
+{
+  Context_Context* const context = Context_getContext();
+  if (context == NULL || !context->isSamplingEnabled)
+  {
+    return STATUS_NOT_SUPPORTED;
+  }
+
+  ExAcquireFastMutex(&samplerMutex);
+  if (isStarted)
+  {
+    ExReleaseFastMutex(&samplerMutex);
+    return STATUS_INVALID_DEVICE_STATE;
+  }
+
+  const UINT64 tscPeriod =
+    (period == 0) ? CONTEXT_SAMPLE_PERIOD : max(period, CONTEXT_SAMPLE_PERIOD_MIN);
+  const IA32_VmxMisc vmxMisc = { .bits = __readmsr(IA32_VMX_MISC) };
+  context->samplingPeriod =
+    (UINT32)max(1, min(tscPeriod >> vmxMisc.preemptionTimerTscShift, MAXUINT32));
+
+  KeIpiGenericCall(SAMPLER_vmCallIpi, VMEXIT_VMCALL_START_SAMPLING);
+  isStarted = TRUE;
+  ExReleaseFastMutex(&samplerMutex);
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Stops sampling on all logical cores.
+ *
+ * Samples already recorded stay in the trace rings. Must be called at PASSIVE_LEVEL.
+ *
+ * @return STATUS_SUCCESS if successful, STATUS_NOT_SUPPORTED if tracing is disabled
+ * or the timer is not supported, STATUS_INVALID_DEVICE_STATE if sampling is not started.
+ */
+NTSTATUS SAMPLER_stop(VOID)
+{
+  const Context_Context* const context = Context_getContext();
+  if (context == NULL || !context->isSamplingEnabled)
+  {
+    return STATUS_NOT_SUPPORTED;
+  }
+
+  ExAcquireFastMutex(&samplerMutex);
+  if (!isStarted)
+  {
+    ExReleaseFastMutex(&samplerMutex);
+    return STATUS_INVALID_DEVICE_STATE;
+  }
+
+  KeIpiGenericCall(SAMPLER_vmCallIpi, VMEXIT_VMCALL_STOP_SAMPLING);
+  isStarted = FALSE;
+  ExReleaseFastMutex(&samplerMutex);
+
+  return STATUS_SUCCESS;
+}
+
+
+/**************************************************************************************************
+* Local function definitions
+**************************************************************************************************/
+/**
+ * @brief Sends a sampling VMCALL on the current logical core.
+ *
+ * @param argument VMCALL code.
+ *
+ * @return NTSTATUS returned by the VMCALL.
+ */
+_Use_decl_annotations_
+static ULONG_PTR SAMPLER_vmCallIpi(ULONG_PTR argument)
+{
+  return VMX_vmcall(argument, 0, 0, 0);
+}
@@ -0,0 +1,26 @@
+/**
+ * @file sampler.h
+ * @brief Sampling profiler function declarations.
+ *
+ * While sampling is on, every logical core arms its VMX-preemption timer, and records guest
+ * RIP, CR3 and TSC into its trace ring each time the timer expires. Samples are read from
+ * the rings mapped with DRIVER_MAP_TRACE.
+ */
+
+
+#pragma once
+
+
+#include <ntddk.h>
+
+
+/**************************************************************************************************
+* Global function declarations
+**************************************************************************************************/
+VOID SAMPLER_init(VOID);
+
+
+NTSTATUS SAMPLER_start(const UINT64 period);
+
+
+NTSTATUS SAMPLER_stop(VOID);
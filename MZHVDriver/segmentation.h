@@ -14,6 +14,20 @@
 #include <ntddk.h>
 
 
+/**************************************************************************************************
+* Defines
+**************************************************************************************************/
+/**
+ * @name Interrupt gate constants
+ * @brief Gate type of a 64-bit interrupt gate and vector of the virtualization exception.
+ * @anchor SEGMENTATIONInterruptGate
+ */
+///@{
+#define SEGMENTATION_INTERRUPT_GATE_TYPE  0xE
+#define SEGMENTATION_VE_VECTOR            20
+///@}
+
+
 /**************************************************************************************************
 * Type declarations
 **************************************************************************************************/
@@ -129,6 +143,33 @@ typedef union SEGMENTATION_SegmentBase
     UINT32 address4;
   };
 } SEGMENTATION_SegmentBase;
+
+
+/**
+ * @brief Structure for 64-bit interrupt gate descriptor
+ */
+typedef union SEGMENTATION_InterruptGate
+{
+  struct
+  {
+    UINT64 lowerBits;
+    UINT64 upperBits;
+  };
+  struct
+  {
+    UINT64 offset1 : 16;
+    UINT64 segmentSelector : 16;
+    UINT64 interruptStackTable : 3;
+    UINT64 _pad1 : 5;
+    UINT64 gateType : 4;
+    UINT64 _pad2 : 1;
+    UINT64 descriptorPrivilegeLevel : 2;
+    UINT64 present : 1;
+    UINT64 offset2 : 16;
+    UINT64 offset3 : 32;
+    UINT64 _pad3 : 32;
+  };
+} SEGMENTATION_InterruptGate;
 #pragma pack(pop)
 #pragma warning(default:4201)
 
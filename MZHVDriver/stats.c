@@ -0,0 +1,352 @@
+/**
+ * @file stats.c
+ * @brief Implements VM exit statistics.
+ *
+ * Recording functions are called in root mode and only touch the current core's counters.
+ * Queries run at PASSIVE_LEVEL. Every core adds its counters to the result and resets them
+ * itself in an IPI, so a reset never races with the core's own updates.
+ */
+
+
+#include <intrin.h>
+#include "context.h"
+#include "ept.h"
+#include "page_swapper.h"
+#include "stats.h"
+#include "vmexit.h"
+#include "vmx.h"
+
+
+/**************************************************************************************************
+* Local type declarations
+**************************************************************************************************/
+/**
+ * @brief Arguments of the collection IPI.
+ *
+ * @param reset TRUE if counters should be reset after they are collected.
+ * @param total Statistics summed over all logical cores.
+ */
+typedef struct STATS_Collection
+{
+  BOOLEAN reset;
+  Context_CoreStats* total;
+} STATS_Collection;
+
+
+/**************************************************************************************************
+* Local function declarations
+**************************************************************************************************/
+static KIPI_BROADCAST_WORKER STATS_collectIpi;
+
+
+static UINT64 getVmCallIndex(const UINT64 vmCallCode);
+
+
+static UINT64 getEptBytes(const Context_Context* const context);
+
+
+/**************************************************************************************************
+* Global function definitions
+**************************************************************************************************/
+/**
+ * @brief Counts a VM exit.
+ *
+ * @param stats Statistics of the current logical core.
+ * @param basicExitReason Basic exit reason.
+ *
+ * @return VOID
+ */
+VOID STATS_recordExit(Context_CoreStats* const stats, const UINT64 basicExitReason)
+{
+  stats->exitReasons[min(basicExitReason, CONTEXT_STATS_EXIT_REASONS - 1)]++;
+}
+
+
+/**
+ * @brief Counts a CPUID VM exit.
+ *
+ * @param stats Statistics of the current logical core.
+ * @param leaf CPUID leaf requested by the guest.
+ *
+ * @return VOID
+ */
+VOID STATS_recordCpuid(Context_CoreStats* const stats, const UINT32 leaf)
+{
+  if (leaf < CONTEXT_STATS_CPUID_LEAVES)
+  {
+    stats->cpuidBasicLeaves[leaf]++;
+  }
+  else if (leaf - IA32_CPUID_EXTENDED_LEAVES_BASE < CONTEXT_STATS_CPUID_LEAVES)
+  {
+    stats->cpuidExtendedLeaves[leaf - IA32_CPUID_EXTENDED_LEAVES_BASE]++;
+  }
+  else
+  {
+    stats->cpuidOtherLeaves++;
+  }
+}
+
+
+/**
+ * @brief Counts a VMCALL.
+ *
+ * @param stats Statistics of the current logical core.
+ * @param vmCallCode VMCALL code passed in RCX.
+ *
+ * @return VOID
+ */
+VOID STATS_recordVmCall(Context_CoreStats* const stats, const UINT64 vmCallCode)
+{
+  stats->vmCalls[getVmCallIndex(vmCallCode)]++;
+}
+
+
+/**
+ * @brief Records time spent handling a single VM exit.
+ *
+ * @param stats Statistics of the current logical core.
+ * @param cycles Number of TSC ticks.
+ *
+ * @return VOID
+ */
+VOID STATS_recordRootCycles(Context_CoreStats* const stats, const UINT64 cycles)
+{
+  ULONG bucket = 0;
+  _BitScanReverse64(&bucket, cycles | 1);
+
+  stats->rootCycles += cycles;
+  stats->rootCyclesHistogram[min(bucket, CONTEXT_STATS_HISTOGRAM_BUCKETS - 1)]++;
+}
+
+
+/**
+ * @brief Aggregates statistics of all logical cores.
+ *
+ * Must be called at PASSIVE_LEVEL. Mapping entries are written as long as they fit in
+ * the output buffer. Per mapping counters are reset without synchronization with root mode,
+ * so a violation handled at the same time may be lost.
+ *
+ * @param reset TRUE if all counters should be reset.
+ * @param outputLength Size of the output buffer in bytes.
+ * @param output Output buffer.
+ * @param bytesWritten Number of bytes written to the output buffer.
+ *
+ * @return STATUS_SUCCESS if successful, error code otherwise.
+ */
+NTSTATUS STATS_query(
+  const BOOLEAN reset,
+  const UINT64 outputLength,
+  STATS_Stats* const output,
+  UINT64* const bytesWritten)
+{
+  if (outputLength < sizeof(STATS_Stats) || Context_getContext() == NULL)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  const Context_Context* const context = Context_getContext();
+  *output = (STATS_Stats)
+  {
+    .noOfLogicalCores = context->noOfLogicalCores,
+    .noOfEptHierarchies = context->noOfEptMappingsData,
+    .eptBytes = getEptBytes(context),
+    .eptSetupMicroseconds = context->eptSetupMicroseconds
+  };
+  STATS_Collection collection = (STATS_Collection)
+  {
+    .reset = reset,
+    .total = &output->total
+  };
+  KeIpiGenericCall(STATS_collectIpi, (ULONG_PTR)&collection);
+
+  PAGE_SWAPPER_queryMappingStats(
+    reset,
+    (outputLength - sizeof(STATS_Stats)) / sizeof(STATS_MappingStats),
+    output->mappings,
+    &output->noOfMappings,
+    &output->noOfReturnedMappings);
+
+  *bytesWritten = sizeof(STATS_Stats) + output->noOfReturnedMappings * sizeof(STATS_MappingStats);
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Measures round trips of VMEXIT_VMCALL_NOP from kernel mode.
+ *
+ * VMCALLs are only accepted from CPL 0, so the round trip can not be measured by user mode.
+ * The loop runs at DISPATCH_LEVEL, so all samples are taken on the same logical core and
+ * are not interrupted by the scheduler. Must be called at PASSIVE_LEVEL.
+ *
+ * @param noOfSamples Number of samples, at most STATS_MAX_VMCALL_SAMPLES.
+ * @param samples Array receiving TSC ticks of each round trip.
+ *
+ * @return STATUS_SUCCESS if all VMCALLs succeeded, error code otherwise.
+ */
+NTSTATUS STATS_measureVmCall(const UINT64 noOfSamples, UINT64* const samples)
+{
+  if (noOfSamples == 0 || noOfSamples > STATS_MAX_VMCALL_SAMPLES || Context_getContext() == NULL)
+  {
+    return STATUS_INVALID_PARAMETER;
+  }
+
+  NTSTATUS ntStatus = STATUS_SUCCESS;
+  KIRQL oldIrql = PASSIVE_LEVEL;
+  KeRaiseIrql(DISPATCH_LEVEL, &oldIrql);
+  UINT32 processor = 0;
+  for (UINT64 sampleIndex = 0; sampleIndex < noOfSamples; sampleIndex++)
+  {
+    const UINT64 start = __rdtscp(&processor);
+    const NTSTATUS vmCallStatus = VMX_vmcall(VMEXIT_VMCALL_NOP, 0, 0, 0);
+    const UINT64 end = __rdtscp(&processor);
+    samples[sampleIndex] = end - start;
+    if (!NT_SUCCESS(vmCallStatus))
+    {
+      ntStatus = vmCallStatus;
+    }
+  }
+  KeLowerIrql(oldIrql);
+
+  return ntStatus;
+}
+
+
+/**************************************************************************************************
+* Local function definitions
+**************************************************************************************************/
+/**
+ * @brief Adds statistics of the current logical core to the total.
+ *
+ * @param argument STATS_Collection structure.
+ *
+ * @return STATUS_SUCCESS
+ */
+_Use_decl_annotations_
+static ULONG_PTR STATS_collectIpi(ULONG_PTR argument)
+{
+  const STATS_Collection* const collection = (const STATS_Collection*)argument;
+  Context_CoreStats* const stats = &Context_getLogicalCore()->stats;
+
+  // Counters are laid out as an array of UINT64
+  const UINT64 noOfCounters = sizeof(Context_CoreStats) / sizeof(UINT64);
+  const UINT64* const counters = (const UINT64*)stats;
+  UINT64* const totalCounters = (UINT64*)collection->total;
+  for (UINT64 counterIndex = 0; counterIndex < noOfCounters; counterIndex++)
+  {
+    InterlockedAdd64((volatile LONG64*)&totalCounters[counterIndex], (LONG64)counters[counterIndex]);
+  }
+
+  if (collection->reset)
+  {
+    *stats = (Context_CoreStats){ 0 };
+  }
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Returns the vmCalls counter index of a VMCALL code.
+ *
+ * @param vmCallCode VMCALL code.
+ *
+ * @return Counter index, the last one for unknown codes.
+ */
+static UINT64 getVmCallIndex(const UINT64 vmCallCode)
+{
+  switch (vmCallCode)
+  {
+  case VMEXIT_VMCALL_INITIATE_SHUTDOWN:
+  {
+    return 0;
+  }
+  case VMEXIT_VMCALL_MAP_PAGE:
+  {
+    return 1;
+  }
+  case VMEXIT_VMCALL_UNMAP_PAGE:
+  {
+    return 2;
+  }
+  case VMEXIT_VMCALL_MAP_BATCH:
+  {
+    return 3;
+  }
+  case VMEXIT_VMCALL_UNMAP_BATCH:
+  {
+    return 4;
+  }
+  case VMEXIT_VMCALL_INVALIDATE_EPT:
+  {
+    return 5;
+  }
+  case VMEXIT_VMCALL_MAP_RANGE:
+  {
+    return 6;
+  }
+  case VMEXIT_VMCALL_NOP:
+  {
+    return 7;
+  }
+  case VMEXIT_VMCALL_START_PML:
+  {
+    return 8;
+  }
+  case VMEXIT_VMCALL_STOP_PML:
+  {
+    return 9;
+  }
+  case VMEXIT_VMCALL_FLUSH_PML:
+  {
+    return 10;
+  }
+  case VMEXIT_VMCALL_START_SAMPLING:
+  {
+    return 11;
+  }
+  case VMEXIT_VMCALL_STOP_SAMPLING:
+  {
+    return 12;
+  }
+  case VMEXIT_VMCALL_APPLY_BATCH:
+  {
+    return 13;
+  }
+  case VMEXIT_VMCALL_GROUP_BATCH:
+  {
+    return 14;
+  }
+  default:
+  {
+    return CONTEXT_STATS_VMCALLS - 1;
+  }
+  }
+}
+
+
+/**
+ * @brief Returns memory used by all EPT hierarchies.
+ *
+ * Split and populate pools keep growing while mappings are changed and regions populated,
+ * so the result is a snapshot.
+ *
+ * @param context Context of the processor.
+ *
+ * @return Number of bytes.
+ */
+static UINT64 getEptBytes(const Context_Context* const context)
+{
+  UINT64 noOfBytes = 0;
+  for (UINT64 mappingsDataIndex = 0;
+    mappingsDataIndex < context->noOfEptMappingsData;
+    mappingsDataIndex++)
+  {
+    const Context_EptMappingsData* const mappingData = context->eptMappingsData[mappingsDataIndex];
+    noOfBytes += EPT_getNoOfViews(mappingData) * EPT_getStructuresSize() +
+      sizeof(Context_EptMappingsData) +
+      (mappingData->splitPool.noOfPages + mappingData->populatePool.noOfPages) * PAGE_SIZE;
+  }
+
+  return noOfBytes;
+}
@@ -0,0 +1,107 @@
+/**
+ * @file stats.h
+ * @brief VM exit statistics structures and function declarations.
+ *
+ * Statistics are counted per logical core in root mode and aggregated across all cores
+ * on request. The aggregated structure is returned by DRIVER_QUERY_STATS.
+ */
+
+
+#pragma once
+
+
+#include <ntddk.h>
+#include "context.h"
+
+
+/**************************************************************************************************
+* Defines
+**************************************************************************************************/
+/**
+ * @name Query flags
+ * @brief Flags passed in the input buffer of DRIVER_QUERY_STATS.
+ * @anchor STATSQueryFlags
+ */
+///@{
+#define STATS_QUERY_RESET  0x1
+///@}
+
+/**
+ * @name Measurement limits
+ * @brief Maximal number of samples returned by a single DRIVER_BENCH_VMCALL.
+ * @anchor STATSMeasurementLimits
+ */
+///@{
+#define STATS_MAX_VMCALL_SAMPLES  4096
+///@}
+
+
+/**************************************************************************************************
+* Type declarations
+**************************************************************************************************/
+/**
+ * @brief Structure holding EPT violation statistics of a single changed mapping.
+ *
+ * @param guestAddress Guest physical address of the mapping.
+ * @param noOfViolations Number of EPT violations handled in root mode, summed over all
+ * EPT hierarchies.
+ */
+typedef struct STATS_MappingStats
+{
+  UINT64 guestAddress;
+  UINT64 noOfViolations;
+} STATS_MappingStats;
+
+
+/**
+ * @brief Structure returned by DRIVER_QUERY_STATS.
+ *
+ * The output buffer holds as many mapping entries as fit after the fixed part.
+ *
+ * @param noOfLogicalCores Number of logical cores the statistics are aggregated over.
+ * @param noOfEptHierarchies Number of EPT mappings data structures, 1 if shared.
+ * @param eptBytes Memory used by EPT hierarchies, including their split pools.
+ * @param eptSetupMicroseconds Time it took to set up all EPT hierarchies.
+ * @param total Statistics summed over all logical cores.
+ * @param noOfMappings Number of changed mappings.
+ * @param noOfReturnedMappings Number of entries in the mappings array.
+ * @param mappings Per mapping statistics.
+ */
+#pragma warning(disable:4200)
+typedef struct STATS_Stats
+{
+  UINT64 noOfLogicalCores;
+  UINT64 noOfEptHierarchies;
+  UINT64 eptBytes;
+  UINT64 eptSetupMicroseconds;
+  Context_CoreStats total;
+  UINT64 noOfMappings;
+  UINT64 noOfReturnedMappings;
+  STATS_MappingStats mappings[];
+} STATS_Stats;
+#pragma warning(default:4200)
+
+
+/**************************************************************************************************
+* Global function declarations
+**************************************************************************************************/
+VOID STATS_recordExit(Context_CoreStats* const stats, const UINT64 basicExitReason);
+
+
+VOID STATS_recordCpuid(Context_CoreStats* const stats, const UINT32 leaf);
+
+
+VOID STATS_recordVmCall(Context_CoreStats* const stats, const UINT64 vmCallCode);
+
+
+VOID STATS_recordRootCycles(Context_CoreStats* const stats, const UINT64 cycles);
+
+
+NTSTATUS STATS_query(
+  const BOOLEAN reset,
+  const UINT64 outputLength,
+  STATS_Stats* const output,
+  UINT64* const bytesWritten);
+
+
+NTSTATUS STATS_measureVmCall(const UINT64 noOfSamples, UINT64* const samples);
@@ -0,0 +1,356 @@
+/**
+ * @file trace.c
+ * @brief Implements trace rings.
+ *
+ * Rings live in a single pagefile backed section. The driver locks the section's pages with
+ * an MDL and writes through its nonpaged system mapping, so recording is safe in root mode.
+ * User processes get their own read-only views of the same section. Each ring has a single
+ * producer, which publishes an event by advancing the head after the event is written.
+ * Readers keep their own position and detect overwritten events by comparing it with the head.
+ * The producer never reads the ring header, which user processes may overwrite.
+ */
+
+
+#include <intrin.h>
+#include "config.h"
+#include "context.h"
+#include "trace.h"
+#include "vmexit.h"
+
+
+/**************************************************************************************************
+* Local function declarations
+**************************************************************************************************/
+static VOID record(const Context_TraceEvent* const event);
+
+
+/**************************************************************************************************
+* Global function definitions
+**************************************************************************************************/
+/**
+ * @brief Allocates trace rings of all logical cores.
+ *
+ * The number of events per ring is taken from the configuration and rounded down to a power
+ * of 2. Does nothing if tracing is disabled. Must be called at PASSIVE_LEVEL, after the
+ * context is allocated.
+ *
+ * @return STATUS_SUCCESS if successful, error code otherwise.
+ */
+NTSTATUS TRACE_init(VOID)
+{
+  Context_Context* const context = Context_getContext();
+  Context_Trace* const trace = &context->trace;
+  *trace = (Context_Trace){ 0 };
+
+  const UINT64 configuredEvents = Config_getConfig()->traceRingEvents;
+  if (configuredEvents == 0)
+  {
+    return STATUS_SUCCESS;
+  }
+
+  ULONG highestBit = 0;
+  _BitScanReverse64(&highestBit, configuredEvents);
+  const UINT64 noOfEvents = 1ULL << highestBit;
+
+  trace->ringSize =
+    ROUND_TO_PAGES(sizeof(Context_TraceRing) + noOfEvents * sizeof(Context_TraceEvent));
+  trace->size = trace->ringSize * context->noOfLogicalCores;
+  if (trace->size > MAXULONG - PAGE_SIZE)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  OBJECT_ATTRIBUTES attributes = { 0 };
+  InitializeObjectAttributes(&attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+  LARGE_INTEGER maximumSize = { .QuadPart = (LONGLONG)trace->size };
+  NTSTATUS ntStatus = ZwCreateSection(
+    &trace->section,
+    SECTION_ALL_ACCESS,
+    &attributes,
+    &maximumSize,
+    PAGE_READWRITE,
+    SEC_COMMIT,
+    NULL);
+  if (!NT_SUCCESS(ntStatus))
+  {
+    trace->section = NULL;
+    TRACE_destroy();
+    return ntStatus;
+  }
+
+  ntStatus = ObReferenceObjectByHandle(
+    trace->section,
+    SECTION_ALL_ACCESS,
+    NULL,
+    KernelMode,
+    &trace->sectionObject,
+    NULL);
+  if (!NT_SUCCESS(ntStatus))
+  {
+    trace->sectionObject = NULL;
+    TRACE_destroy();
+    return ntStatus;
+  }
+
+  SIZE_T viewSize = trace->size;
+  ntStatus = MmMapViewInSystemSpace(trace->sectionObject, &trace->systemView, &viewSize);
+  if (!NT_SUCCESS(ntStatus))
+  {
+    trace->systemView = NULL;
+    TRACE_destroy();
+    return ntStatus;
+  }
+
+  trace->mdl = IoAllocateMdl(trace->systemView, (ULONG)trace->size, FALSE, FALSE, NULL);
+  if (trace->mdl == NULL)
+  {
+    TRACE_destroy();
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  __try
+  {
+    MmProbeAndLockPages(trace->mdl, KernelMode, IoWriteAccess);
+  }
+  __except (EXCEPTION_EXECUTE_HANDLER)
+  {
+    IoFreeMdl(trace->mdl);
+    trace->mdl = NULL;
+    TRACE_destroy();
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  // The system view itself is pageable, root mode only uses the MDL mapping
+  trace->rings =
+    MmGetSystemAddressForMdlSafe(trace->mdl, NormalPagePriority | MdlMappingNoExecute);
+  if (trace->rings == NULL)
+  {
+    TRACE_destroy();
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  // Committed section pages are zeroed, only capacities need to be set
+  for (UINT64 logicalCoreIndex = 0; logicalCoreIndex < context->noOfLogicalCores; logicalCoreIndex++)
+  {
+    Context_TraceRing* const ring =
+      (Context_TraceRing*)(trace->rings + logicalCoreIndex * trace->ringSize);
+    ring->capacity = noOfEvents;
+    Context_LogicalCore* const logicalCore = context->logicalCores[logicalCoreIndex];
+    logicalCore->traceHead = 0;
+    logicalCore->traceMask = noOfEvents - 1;
+    logicalCore->traceRing = ring;
+  }
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Maps all trace rings read-only into the current process.
+ *
+ * Must be called at PASSIVE_LEVEL in the context of the requesting process. The view is
+ * owned by the process, which unmaps it with UnmapViewOfFile, or when it exits. It stays
+ * valid after the driver is unloaded, but is no longer written to.
+ *
+ * @param mapping Structure receiving the view's address and layout.
+ *
+ * @return STATUS_SUCCESS if successful, error code otherwise.
+ */
+NTSTATUS TRACE_mapView(TRACE_Mapping* const mapping)
+{
+  const Context_Context* const context = Context_getContext();
+  if (context == NULL || context->trace.rings == NULL)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  VOID* address = NULL;
+  SIZE_T viewSize = 0;
+  const NTSTATUS ntStatus = ZwMapViewOfSection(
+    context->trace.section,
+    ZwCurrentProcess(),
+    &address,
+    0,
+    0,
+    NULL,
+    &viewSize,
+    ViewUnmap,
+    0,
+    PAGE_READONLY);
+  if (!NT_SUCCESS(ntStatus))
+  {
+    return ntStatus;
+  }
+
+  *mapping = (TRACE_Mapping)
+  {
+    .address = address,
+    .size = context->trace.size,
+    .ringSize = context->trace.ringSize,
+    .noOfRings = context->noOfLogicalCores
+  };
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Records an EPT violation in the current core's trace ring.
+ *
+ * Must be called in root mode.
+ *
+ * @param guestPhysicalAddress Guest physical address of the violation.
+ * @param exitQualification Exit qualification of the violation.
+ * @param guestRip Guest RIP of the faulting instruction.
+ * @param view EPT view granted by the handler.
+ *
+ * @return VOID
+ */
+VOID TRACE_recordEptViolation(
+  const UINT64 guestPhysicalAddress,
+  const UINT64 exitQualification,
+  const UINT64 guestRip,
+  const UINT8 view)
+{
+  const VMEXIT_EptViolation eptViolation = { .bits = exitQualification };
+
+  const Context_TraceEvent event =
+  {
+    .timestamp = __rdtsc(),
+    .guestRip = guestRip,
+    .address = guestPhysicalAddress,
+    .vmCallCode = 0,
+    .type = CONTEXT_TRACE_EVENT_EPT_VIOLATION,
+    .accessType = (UINT8)(eptViolation.dataRead |
+      eptViolation.dataWrite << 1 |
+      eptViolation.instructionFetch << 2),
+    .view = view
+  };
+  record(&event);
+}
+
+
+/**
+ * @brief Records a VMCALL in the current core's trace ring.
+ *
+ * Must be called in root mode.
+ *
+ * @param vmCallCode VMCALL code.
+ * @param argument First VMCALL argument.
+ * @param guestRip Guest RIP of the VMCALL instruction.
+ *
+ * @return VOID
+ */
+VOID TRACE_recordVmCall(const UINT64 vmCallCode, const UINT64 argument, const UINT64 guestRip)
+{
+  const Context_TraceEvent event =
+  {
+    .timestamp = __rdtsc(),
+    .guestRip = guestRip,
+    .address = argument,
+    .vmCallCode = (UINT32)vmCallCode,
+    .type = CONTEXT_TRACE_EVENT_VMCALL
+  };
+  record(&event);
+}
+
+
+/**
+ * @brief Records a guest RIP sample in the current core's trace ring.
+ *
+ * Must be called in root mode.
+ *
+ * @param guestRip Guest RIP when the VMX-preemption timer expired.
+ * @param guestCr3 Guest CR3 when the VMX-preemption timer expired.
+ *
+ * @return VOID
+ */
+VOID TRACE_recordSample(const UINT64 guestRip, const UINT64 guestCr3)
+{
+  const Context_TraceEvent event =
+  {
+    .timestamp = __rdtsc(),
+    .guestRip = guestRip,
+    .address = guestCr3,
+    .type = CONTEXT_TRACE_EVENT_SAMPLE
+  };
+  record(&event);
+}
+
+
+/**
+ * @brief Frees trace rings.
+ *
+ * Views mapped into user processes keep the section alive until they are unmapped. Must be
+ * called at PASSIVE_LEVEL, after all logical cores are devirtualized.
+ *
+ * @return VOID
+ */
+VOID TRACE_destroy(VOID)
+{
+  Context_Context* const context = Context_getContext();
+  Context_Trace* const trace = &context->trace;
+
+  for (UINT64 logicalCoreIndex = 0; logicalCoreIndex < context->noOfLogicalCores; logicalCoreIndex++)
+  {
+    if (context->logicalCores[logicalCoreIndex] != NULL)
+    {
+      context->logicalCores[logicalCoreIndex]->traceRing = NULL;
+    }
+  }
+
+  // Unlocking the pages also releases the MDL mapping
+  if (trace->mdl != NULL)
+  {
+    MmUnlockPages(trace->mdl);
+    IoFreeMdl(trace->mdl);
+  }
+
+  if (trace->systemView != NULL)
+  {
+    MmUnmapViewInSystemSpace(trace->systemView);
+  }
+
+  if (trace->sectionObject != NULL)
+  {
+    ObDereferenceObject(trace->sectionObject);
+  }
+
+  if (trace->section != NULL)
+  {
+    ZwClose(trace->section);
+  }
+
+  *trace = (Context_Trace){ 0 };
+}
+
+
+/**************************************************************************************************
+* Local function definitions
+**************************************************************************************************/
+/**
+ * @brief Appends an event to the current core's trace ring.
+ *
+ * The event is written before the head is advanced, so readers never see a head covering
+ * an event that is not written yet. The index is taken from the core's own copy of the head
+ * and the mask, so a corrupted header cannot move the write outside of the ring.
+ *
+ * @param event Event to append.
+ *
+ * @return VOID
+ */
+static VOID record(const Context_TraceEvent* const event)
+{
+  Context_LogicalCore* const logicalCore = Context_getLogicalCore();
+  Context_TraceRing* const ring = logicalCore->traceRing;
+  if (ring == NULL)
+  {
+    return;
+  }
+
+  const UINT64 head = logicalCore->traceHead;
+  ring->events[head & logicalCore->traceMask] = *event;
+  KeMemoryBarrierWithoutFence();
+  logicalCore->traceHead = head + 1;
+  ring->head = head + 1;
+}
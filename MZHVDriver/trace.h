@@ -0,0 +1,63 @@
+/**
+ * @file trace.h
+ * @brief Trace ring structures and function declarations.
+ *
+ * Every logical core records EPT violations, VMCALLs and guest RIP samples into its own ring.
+ * All rings can be mapped read-only into a user process with DRIVER_MAP_TRACE and drained
+ * without syscalls.
+ */
+
+
+#pragma once
+
+
+#include <ntddk.h>
+#include "context.h"
+
+
+/**************************************************************************************************
+* Type declarations
+**************************************************************************************************/
+/**
+ * @brief Structure returned by DRIVER_MAP_TRACE.
+ *
+ * Ring of logical core n starts at address + n * ringSize and begins with a Context_TraceRing
+ * header.
+ *
+ * @param address Address of the read-only view in the calling process.
+ * @param size Size of the view in bytes.
+ * @param ringSize Size of a single ring in bytes.
+ * @param noOfRings Number of rings, one per logical core.
+ */
+typedef struct TRACE_Mapping
+{
+  VOID* address;
+  UINT64 size;
+  UINT64 ringSize;
+  UINT64 noOfRings;
+} TRACE_Mapping;
+
+
+/**************************************************************************************************
+* Global function declarations
+**************************************************************************************************/
+NTSTATUS TRACE_init(VOID);
+
+
+NTSTATUS TRACE_mapView(TRACE_Mapping* const mapping);
+
+
+VOID TRACE_recordEptViolation(
+  const UINT64 guestPhysicalAddress,
+  const UINT64 exitQualification,
+  const UINT64 guestRip,
+  const UINT8 view);
+
+
+VOID TRACE_recordVmCall(const UINT64 vmCallCode, const UINT64 argument, const UINT64 guestRip);
+
+
+VOID TRACE_recordSample(const UINT64 guestRip, const UINT64 guestCr3);
+
+
+VOID TRACE_destroy(VOID);
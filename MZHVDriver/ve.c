@@ -0,0 +1,172 @@
+/**
+ * @file ve.c
+ * @brief Implements virtualization exception handling.
+ *
+ * The #VE gate of every logical core's IDT is replaced with ASMPROC_veHandler, which calls
+ * VE_handler in the guest. Changed mappings have full access in one of the views, so the
+ * handler only switches to the view matching the access. An instruction that needs both
+ * views faults again at the same RIP right after the switch. Such an exception is left
+ * unacknowledged, so the next EPT violation causes a VM exit and is handled in root mode.
+ * So are exceptions on pages without a changed mapping, which root mode populates or retries.
+ *
+ * Replacing the IDT gate is reported by PatchGuard, so this is meant for test systems,
+ * with a kernel debugger attached.
+ */
+
+
+#include <intrin.h>
+#include "asmproc.h"
+#include "context.h"
+#include "ept.h"
+#include "mapping_table.h"
+#include "segmentation.h"
+#include "ve.h"
+#include "vmexit.h"
+#include "vmx.h"
+
+
+/**************************************************************************************************
+* Local function declarations
+**************************************************************************************************/
+static VOID writeVeGate(const SEGMENTATION_InterruptGate* const gate);
+
+
+/**************************************************************************************************
+* Global function definitions
+**************************************************************************************************/
+/**
+ * @brief Installs the #VE handler on the current logical core.
+ *
+ * The original gate is stored in the logical core's context. Must be called with
+ * interrupts disabled.
+ *
+ * @return VOID
+ */
+VOID VE_installHandler(VOID)
+{
+  Context_LogicalCore* const thisCore = Context_getLogicalCore();
+
+  SEGMENTATION_IDTR idtr = { 0 };
+  __sidt(&idtr);
+  thisCore->originalVeGate = ((SEGMENTATION_InterruptGate*)idtr.base)[SEGMENTATION_VE_VECTOR];
+
+  const UINT64 handlerAddress = (UINT64)ASMPROC_veHandler;
+  const SEGMENTATION_InterruptGate gate =
+  {
+    .offset1 = handlerAddress & 0xFFFF,
+    .segmentSelector = SEGMENTATION_readCs().bits,
+    .gateType = SEGMENTATION_INTERRUPT_GATE_TYPE,
+    .present = TRUE,
+    .offset2 = (handlerAddress >> 16) & 0xFFFF,
+    .offset3 = handlerAddress >> 32
+  };
+  writeVeGate(&gate);
+  thisCore->isVeHandlerInstalled = TRUE;
+}
+
+
+/**
+ * @brief Restores the original #VE gate on the current logical core.
+ *
+ * Must be called with interrupts disabled, once EPT-violation #VE can no longer occur.
+ *
+ * @return VOID
+ */
+VOID VE_uninstallHandler(VOID)
+{
+  Context_LogicalCore* const thisCore = Context_getLogicalCore();
+  if (!thisCore->isVeHandlerInstalled)
+  {
+    return;
+  }
+
+  writeVeGate(&thisCore->originalVeGate);
+  thisCore->isVeHandlerInstalled = FALSE;
+}
+
+
+/**
+ * @brief Allows delivery of the next virtualization exception on the current logical core.
+ *
+ * Called in root mode after an EPT violation left to root mode by VE_handler is resolved.
+ *
+ * @return VOID
+ */
+VOID VE_rearm(VOID)
+{
+  Context_LogicalCore* const thisCore = Context_getLogicalCore();
+  ((VE_Information*)thisCore->veInformation)->busy = 0;
+  thisCore->veLastRip = 0;
+}
+
+
+/**
+ * @brief Handles a virtualization exception.
+ *
+ * Called by ASMPROC_veHandler in the guest, with interrupts disabled. Only volatile general
+ * purpose registers are preserved by the caller, so this function must stay simple. Views are
+ * switched only for pages of changed mappings. The mapping table is read without the lock.
+ * Only root mode of this core changes its table, so it cannot change during the lookup, except
+ * in the shared EPT mode, where a stale result is harmless: a removed mapping has the same
+ * page in both views, and a missed one is handled in root mode.
+ *
+ * @param rip Guest RIP of the faulting instruction.
+ *
+ * @return VOID
+ */
+VOID VE_handler(const UINT64 rip)
+{
+  Context_LogicalCore* const thisCore = Context_getLogicalCore();
+  VE_Information* const information = (VE_Information*)thisCore->veInformation;
+  if (MAPPING_TABLE_find(
+    &thisCore->eptMappingData->changedMappings,
+    information->guestPhysicalAddress) == NULL)
+  {
+    // Leave the exception unacknowledged, root mode rearms it
+    return;
+  }
+  thisCore->stats.noOfVirtualizationExceptions++;
+
+  const VMEXIT_EptViolation eptViolation = { .bits = information->exitQualification };
+  VMX_vmfunc(
+    VMX_VMFUNC_EPTP_SWITCHING,
+    eptViolation.instructionFetch ? EPT_VIEW_FETCH : EPT_VIEW_READ);
+
+  if (rip == thisCore->veLastRip)
+  {
+    // Leave the exception unacknowledged, root mode rearms it
+    return;
+  }
+
+  thisCore->veLastRip = rip;
+  information->busy = 0;
+}
+
+
+/**************************************************************************************************
+* Local function definitions
+**************************************************************************************************/
+/**
+ * @brief Writes the #VE gate of the current logical core's IDT.
+ *
+ * The IDT is mapped read-only, so write protection is disabled for the duration of the
+ * write. Interrupts must be disabled.
+ *
+ * @param gate Gate to write.
+ *
+ * @return VOID
+ */
+static VOID writeVeGate(const SEGMENTATION_InterruptGate* const gate)
+{
+  SEGMENTATION_IDTR idtr = { 0 };
+  __sidt(&idtr);
+
+  const IA32_Cr0 cr0 = { .bits = __readcr0() };
+  IA32_Cr0 writableCr0 = cr0;
+  writableCr0.writeProtect = FALSE;
+  __writecr0(writableCr0.bits);
+
+  ((SEGMENTATION_InterruptGate*)idtr.base)[SEGMENTATION_VE_VECTOR] = *gate;
+
+  __writecr0(cr0.bits);
+}
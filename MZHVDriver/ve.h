@@ -0,0 +1,54 @@
+/**
+ * @file ve.h
+ * @brief Virtualization exception structures and function declarations.
+ *
+ * With EPT-violation #VE enabled, EPT violations on changed mappings are delivered to the
+ * guest as virtualization exceptions, which are resolved by switching views with VMFUNC.
+ */
+
+
+#pragma once
+
+
+#include <ntddk.h>
+
+
+/**************************************************************************************************
+* Type declarations
+**************************************************************************************************/
+#pragma warning(disable:4201)
+#pragma pack(push, 1)
+/**
+ * @brief Structure for virtualization exception information area
+ *
+ * The processor delivers a #VE only if busy is 0, and sets it to VE_INFORMATION_BUSY
+ * when it does. Until it is cleared again, EPT violations cause VM exits.
+ *
+ * @see [Intel SDM, Vol. 3C, Chapter 26.5.7 Virtualization Exceptions](https://software.intel.com/en-us/articles/intel-sdm)
+ */
+typedef struct VE_Information
+{
+  UINT32 exitReason;
+  volatile UINT32 busy;
+  UINT64 exitQualification;
+  UINT64 guestLinearAddress;
+  UINT64 guestPhysicalAddress;
+  UINT16 eptpIndex;
+} VE_Information;
+#pragma pack(pop)
+#pragma warning(default:4201)
+
+
+/**************************************************************************************************
+* Global function declarations
+**************************************************************************************************/
+VOID VE_installHandler(VOID);
+
+
+VOID VE_uninstallHandler(VOID);
+
+
+VOID VE_rearm(VOID);
+
+
+VOID VE_handler(const UINT64 rip);
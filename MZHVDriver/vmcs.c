@@ -8,9 +8,13 @@
 
 #include <intrin.h>
 #include "context.h"
+#include "cpuid.h"
+#include "ept.h"
 #include "ia32.h"
 #include "memory.h"
 #include "vmcs.h"
+#include "vmexit.h"
+#include "vmx.h"
 #include "asmproc.h"
 #include "segmentation.h"
 
@@ -68,11 +72,14 @@ static VOID adjustAndApplyControls(
 /**
  * @brief Prepares VMCS for VM entry.
  *
+ * The core's CPUID cache is filled here as well, while CPUID still executes natively.
+ *
  * @return STATUS_SUCCESS on success, error code otherwise.
  */
 NTSTATUS VMCS_setup(VOID)
 {
   Context_LogicalCore* const thisCore = Context_getLogicalCore();
+  CPUID_setupCache(&thisCore->cpuidCache);
 
   NTSTATUS ntStatus = setupMemoryRegion(thisCore);
   if (!NT_SUCCESS(ntStatus))
@@ -94,7 +101,9 @@ NTSTATUS VMCS_setup(VOID)
  * @brief Restores host state from VMCS.
  *
  * Restores host state from VMCS. It is called before returning to the host
- * in devirtualized state.
+ * in devirtualized state. With VPID enabled, translations tagged with VPID 0 were cached
+ * before virtualization or by root mode, and the guest never invalidated them, so they
+ * are invalidated before the host continues with VPID 0.
  *
  * @return VOID
  */
@@ -103,6 +112,7 @@ VOID VMCS_restore(VOID)
   IA32_Cr3 cr3 = { 0 };
   __vmx_vmread(VMCS_GUEST_CR3, &cr3.bits);
   __writecr3(cr3.bits);
+  VMCS_invalidateHostTlb();
 
   UINT64 base = { 0 };
   UINT64 limit = { 0 };
@@ -116,6 +126,106 @@ VOID VMCS_restore(VOID)
 }
 
 
+/**
+ * @brief Enables or disables the Monitor Trap Flag of the current VMCS.
+ *
+ * MTF makes a VM exit occur after the next guest instruction. It must be called in VMX root
+ * mode, and only if the flag is allowed by IA32_VMX_TRUE_PROCBASED_CTLS.
+ *
+ * @param enable TRUE to enable the flag, FALSE to disable it.
+ *
+ * @return VOID
+ */
+VOID VMCS_setMonitorTrapFlag(const BOOLEAN enable)
+{
+  UINT64 controlsBits = { 0 };
+  __vmx_vmread(VMCS_PRIMARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, &controlsBits);
+
+  VMCS_PrimaryProcessorBasedVmExecutionControls primaryControls = { .bits = (UINT32)controlsBits };
+  primaryControls.monitorTrapFlag = enable;
+  __vmx_vmwrite(VMCS_PRIMARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, primaryControls.bits);
+}
+
+
+/**
+ * @brief Enables or disables page-modification logging of the current VMCS.
+ *
+ * While enabled, the processor logs the guest physical address of every write that sets
+ * a dirty flag in the EPT into the PML buffer. It must be called in VMX root mode, and only
+ * if Context_Context::isPmlEnabled is set.
+ *
+ * @param enable TRUE to enable logging, FALSE to disable it.
+ *
+ * @return VOID
+ */
+VOID VMCS_setPageModificationLogging(const BOOLEAN enable)
+{
+  UINT64 controlsBits = { 0 };
+  __vmx_vmread(VMCS_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, &controlsBits);
+
+  VMCS_SecondaryProcessorBasedVmExecutionControls secondaryControls =
+  {
+    .bits = (UINT32)controlsBits
+  };
+  secondaryControls.enablePML = enable;
+  __vmx_vmwrite(VMCS_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS, secondaryControls.bits);
+}
+
+
+/**
+ * @brief Enables or disables the VMX-preemption timer of the current VMCS.
+ *
+ * The timer counts down only in VMX non-root mode, and its value is saved on every VM exit,
+ * so a timer armed with VMCS_GUEST_VMX_PREEMPTION_TIMER_VALUE expires after that much guest
+ * time regardless of other VM exits. It must be called in VMX root mode, and only
+ * if Context_Context::isSamplingEnabled is set.
+ *
+ * @param enable TRUE to enable the timer, FALSE to disable it.
+ *
+ * @return VOID
+ */
+VOID VMCS_setPreemptionTimer(const BOOLEAN enable)
+{
+  UINT64 controlsBits = { 0 };
+  __vmx_vmread(VMCS_PIN_BASED_VM_EXECUTION_CONTROLS, &controlsBits);
+  VMCS_PinBasedVmExecutionControls pinControls = { .bits = (UINT32)controlsBits };
+  pinControls.activateVmxPreemptionTimer = enable;
+  __vmx_vmwrite(VMCS_PIN_BASED_VM_EXECUTION_CONTROLS, pinControls.bits);
+
+  __vmx_vmread(VMCS_PRIMARY_VM_EXIT_CONTROLS, &controlsBits);
+  VMCS_PrimaryVmExitControls exitControls = { .bits = (UINT32)controlsBits };
+  exitControls.saveVmxPreemptionTimerValue = enable;
+  __vmx_vmwrite(VMCS_PRIMARY_VM_EXIT_CONTROLS, exitControls.bits);
+}
+
+
+/**
+ * @brief Invalidates all translations of the current VPID, including global ones.
+ *
+ * In VMX root mode the current VPID is 0. With VPID enabled, VM entries and exits no longer
+ * flush its translations, while the guest changes kernel page tables and invalidates only
+ * its own VPID. Root mode must call this before it dereferences guest linear addresses
+ * that may have been remapped since root mode last used them. Without VPID, VM exits
+ * already flushed them and this function does nothing. Toggling CR4.PGE invalidates every
+ * PCID, and works whether or not INVPCID is supported.
+ *
+ * @return VOID
+ */
+VOID VMCS_invalidateHostTlb(VOID)
+{
+  if (!Context_getContext()->isVpidEnabled)
+  {
+    return;
+  }
+
+  const IA32_Cr4 cr4 = (IA32_Cr4){ .bits = __readcr4() };
+  IA32_Cr4 toggledCr4 = cr4;
+  toggledCr4.pageGlobalEnable = !cr4.pageGlobalEnable;
+  __writecr4(toggledCr4.bits);
+  __writecr4(cr4.bits);
+}
+
+
 /**************************************************************************************************
 * Local function definitions
 **************************************************************************************************/
@@ -428,6 +538,14 @@ static VOID setupHostSegmentSelector(
 /**
  * @brief Sets up VM execution control fields.
  *
+ * Page-modification logging starts disabled, only its buffer is set up, so that
+ * VMEXIT_VMCALL_START_PML can enable it later.
+ *
+ * With VPID enabled, every logical core tags guest translations with its processor index
+ * plus one, so they survive VM exits. Translations left with the same VPID by an earlier
+ * virtualization are invalidated before the first VM entry. Changes of EPT entries need no
+ * INVVPID, since INVEPT invalidates combined mappings of all VPIDs.
+ *
  * @param thisCore Pointer to logical core's context.
  *
  * @return VOID
@@ -455,7 +573,10 @@ static VOID setupVMExecutionControlFields(Context_LogicalCore* const thisCore)
     .enableRdtscp = TRUE,
     .enableInvpcid = TRUE,
     .enableXsavesXrstors = TRUE,
-    .enableEpt = TRUE
+    .enableEpt = TRUE,
+    .enableVpid = Context_getContext()->isVpidEnabled,
+    .enableVmFunctions = thisCore->eptMappingData->eptpList != NULL,
+    .eptViolationVe = Context_getContext()->isVeEnabled
   };
   adjustAndApplyControls(
     VMCS_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS,
@@ -463,7 +584,38 @@ static VOID setupVMExecutionControlFields(Context_LogicalCore* const thisCore)
     &secondaryControls.bits);
 
   __vmx_vmwrite(VMCS_ADDRESS_OF_MSR_BITMAPS_FULL, Memory_getPhysicalAddress(thisCore->msrBitmap));
-  __vmx_vmwrite(VMCS_EPT_POINTER_FULL, thisCore->eptp);
+  __vmx_vmwrite(VMCS_EPT_POINTER_FULL, thisCore->eptMappingData->eptp);
+
+  if (Context_getContext()->isVpidEnabled)
+  {
+    const UINT64 vpid = KeGetCurrentProcessorNumberEx(NULL) + 1;
+    __vmx_vmwrite(VMCS_VIRTUAL_PROCESSOR_IDENTIFIER, vpid);
+    VMX_invvpid(VMX_INVVPID_SINGLE_CONTEXT, vpid, 0);
+  }
+
+  if (thisCore->eptMappingData->eptpList != NULL)
+  {
+    __vmx_vmwrite(
+      VMCS_VM_FUNCTION_CONTROLS_FULL,
+      (VMCS_VmFunctionControls){ .eptpSwitching = TRUE }.bits);
+    __vmx_vmwrite(
+      VMCS_EPTP_LIST_ADDRESS_FULL,
+      Memory_getPhysicalAddress(thisCore->eptMappingData->eptpList));
+  }
+
+  if (Context_getContext()->isVeEnabled)
+  {
+    __vmx_vmwrite(
+      VMCS_VE_INFORMATION_ADDRESS_FULL,
+      Memory_getPhysicalAddress(thisCore->veInformation));
+    __vmx_vmwrite(VMCS_EPTP_INDEX, EPT_VIEW_READ);
+  }
+
+  if (Context_getContext()->isPmlEnabled)
+  {
+    __vmx_vmwrite(VMCS_PML_ADDRESS_FULL, Memory_getPhysicalAddress(thisCore->pmlBuffer));
+    __vmx_vmwrite(VMCS_PML_INDEX, VMEXIT_PML_ENTRIES - 1);
+  }
 }
 
 
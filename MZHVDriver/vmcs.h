@@ -13,6 +13,16 @@
 /**************************************************************************************************
 * Defines
 **************************************************************************************************/
+/**
+ * @name 16-Bit Control Fields
+ * @anchor VMCS16BitControlFields
+ * @see [Intel SDM, Vol. 3C, Appendix B.1.1](https://software.intel.com/en-us/articles/intel-sdm)
+ */
+///@{
+#define VMCS_VIRTUAL_PROCESSOR_IDENTIFIER                     0x00000000
+#define VMCS_EPTP_INDEX                                       0x00000004
+///@}
+
 /**
  * @name 16-Bit Guest-State Fields
  * @anchor VMCS16BitGuestStateFields
@@ -27,6 +37,7 @@
 #define VMCS_GUEST_GS_SELECTOR                                0x0000080A
 #define VMCS_GUEST_LDTR_SELECTOR                              0x0000080C
 #define VMCS_GUEST_TR_SELECTOR                                0x0000080E
+#define VMCS_PML_INDEX                                        0x00000812
 ///@}
 
 /**
@@ -51,7 +62,22 @@
  */
 ///@{
 #define VMCS_ADDRESS_OF_MSR_BITMAPS_FULL                      0x00002004
+#define VMCS_PML_ADDRESS_FULL                                 0x0000200E
+#define VMCS_VM_FUNCTION_CONTROLS_FULL                        0x00002018
 #define VMCS_EPT_POINTER_FULL                                 0x0000201A
+#define VMCS_EPTP_LIST_ADDRESS_FULL                           0x00002024
+#define VMCS_VE_INFORMATION_ADDRESS_FULL                      0x0000202A
+///@}
+
+/**
+ * @name Event injection
+ * @brief Interruption type and vector used to inject an invalid opcode exception.
+ * @anchor VMCSEventInjection
+ * @see [Intel SDM, Vol. 3C, Chapter 25 Virtual Machine Control Structures](https://software.intel.com/en-us/articles/intel-sdm)
+ */
+///@{
+#define VMCS_INTERRUPTION_TYPE_HARDWARE_EXCEPTION             3
+#define VMCS_EXCEPTION_VECTOR_UD                              6
 ///@}
 
 /**
@@ -83,6 +109,7 @@
 #define VMCS_PRIMARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS    0x00004002
 #define VMCS_PRIMARY_VM_EXIT_CONTROLS                         0x0000400C
 #define VMCS_VM_ENTRY_CONTROLS                                0x00004012
+#define VMCS_VM_ENTRY_INTERRUPTION_INFORMATION                0x00004016
 #define VMCS_SECONDARY_PROCESSOR_BASED_VM_EXECUTION_CONTROLS  0x0000401E
 ///@}
 
@@ -121,6 +148,7 @@
 #define VMCS_GUEST_LDTR_ACCESS_RIGHTS                         0x00004820
 #define VMCS_GUEST_TR_ACCESS_RIGHTS                           0x00004822
 #define VMCS_GUEST_IA32_SYSENTER_CS                           0x0000482A
+#define VMCS_GUEST_VMX_PREEMPTION_TIMER_VALUE                 0x0000482E
 ///@}
 
 /**
@@ -139,6 +167,7 @@
  */
 ///@{
 #define VMCS_EXIT_QUALIFICATION                               0x00006400
+#define VMCS_GUEST_LINEAR_ADDRESS                             0x0000640A
 ///@}
 
 /**
@@ -365,6 +394,39 @@ typedef union VMCS_VmEntryControls
     UINT32 loadPkrs : 1;
   };
 } VMCS_VmEntryControls;
+
+
+/**
+ * @brief Union for VM-Function Controls
+ * @see [Intel SDM, Vol. 3C, Chapter 25 Virtual Machine Control Structures](https://software.intel.com/en-us/articles/intel-sdm)
+ */
+typedef union VMCS_VmFunctionControls
+{
+  UINT64 bits;
+  struct
+  {
+    UINT64 eptpSwitching : 1;
+    UINT64 _pad1 : 63;
+  };
+} VMCS_VmFunctionControls;
+
+
+/**
+ * @brief Union for VM-Entry Interruption-Information Field
+ * @see [Intel SDM, Vol. 3C, Chapter 25 Virtual Machine Control Structures](https://software.intel.com/en-us/articles/intel-sdm)
+ */
+typedef union VMCS_InterruptionInformation
+{
+  UINT32 bits;
+  struct
+  {
+    UINT32 vector : 8;
+    UINT32 interruptionType : 3;
+    UINT32 deliverErrorCode : 1;
+    UINT32 _pad1 : 19;
+    UINT32 valid : 1;
+  };
+} VMCS_InterruptionInformation;
 #pragma pack(pop)
 #pragma warning(default:4201)
 
@@ -376,3 +438,15 @@ NTSTATUS VMCS_setup(VOID);
 
 
 VOID VMCS_restore(VOID);
+
+
+VOID VMCS_setMonitorTrapFlag(const BOOLEAN enable);
+
+
+VOID VMCS_setPageModificationLogging(const BOOLEAN enable);
+
+
+VOID VMCS_invalidateHostTlb(VOID);
+
+
+VOID VMCS_setPreemptionTimer(const BOOLEAN enable);
@@ -2,28 +2,99 @@
  * @file vmexit.c
  * @brief VM exit handlers
  *
- * This file contains VM exit handlers for CPUID, VMCALL, and EPT violations.
+ * This file contains VM exit handlers for CPUID, VMCALL, EPT violations, and full PML buffers.
  */
 
 
+#include <intrin.h>
 #include "bsod.h"
 #include "context.h"
+#include "cpuid.h"
+#include "dirty_log.h"
 #include "ept.h"
+#include "mapping_table.h"
+#include "stats.h"
+#include "trace.h"
+#include "ve.h"
 #include "vmx.h"
 #include "vmcs.h"
 #include "vmexit.h"
 
 
+/**************************************************************************************************
+* Local type declarations
+**************************************************************************************************/
+/**
+ * @brief VMCS fields describing the current VM exit, read once per exit.
+ *
+ * @param exitReason Exit reason.
+ * @param exitQualification Exit qualification.
+ * @param guestRip Guest RIP of the instruction that caused the exit.
+ * @param instructionLength Length of that instruction.
+ */
+typedef struct VMEXIT_ExitInformation
+{
+  VMEXIT_ExitReason exitReason;
+  UINT64 exitQualification;
+  UINT64 guestRip;
+  UINT64 instructionLength;
+} VMEXIT_ExitInformation;
+
+
 /**************************************************************************************************
 * Local function declarations
 **************************************************************************************************/
 static VOID cpuidHandler(VMEXIT_Registers* const registers);
 
 
-static VOID vmCallHandler(VMEXIT_Registers* const registers, BOOLEAN* const initiateShutdown);
+static BOOLEAN vmCallHandler(
+  VMEXIT_Registers* const registers,
+  const VMEXIT_ExitInformation* const exitInformation,
+  BOOLEAN* const initiateShutdown);
+
+
+static VOID eptViolationHandler(const VMEXIT_ExitInformation* const exitInformation);
+
+
+static VOID resolveEptViolation(const VMEXIT_ExitInformation* const exitInformation);
+
+
+static VOID monitorTrapHandler(VOID);
+
+
+static VOID vmFuncHandler(VOID);
 
 
-static VOID eptViolationHandler(VOID);
+static VOID pmlFullHandler(VOID);
+
+
+static VOID injectInvalidOpcode(VOID);
+
+
+static VOID preemptionTimerHandler(const VMEXIT_ExitInformation* const exitInformation);
+
+
+static BOOLEAN isInstructionOnMapping(
+  const VMEXIT_ExitInformation* const exitInformation,
+  const VMEXIT_EptViolation eptViolation,
+  const UINT64 guestAddress,
+  const Context_EptChangedMapping* const mapping);
+
+
+static BOOLEAN grantView(
+  Context_EptMappingsData* const mappingData,
+  const Context_EptChangedMapping* const mapping,
+  const UINT64 view,
+  const BOOLEAN singleStep);
+
+
+static VOID grantGroupView(
+  Context_EptMappingsData* const mappingData,
+  const Context_EptChangedMapping* const mapping,
+  const UINT64 view);
+
+
+static VOID updateThrashCounter(Context_EptChangedMapping* const mapping, const BOOLEAN isFetch);
 
 
 static VOID vmCallMapPage(VMEXIT_Registers* const registers);
@@ -32,6 +103,60 @@ static VOID vmCallMapPage(VMEXIT_Registers* const registers);
 static VOID vmCallUnmapPage(VMEXIT_Registers* const registers);
 
 
+static VOID vmCallMapBatch(VMEXIT_Registers* const registers);
+
+
+static VOID vmCallUnmapBatch(VMEXIT_Registers* const registers);
+
+
+static VOID vmCallApplyBatch(VMEXIT_Registers* const registers);
+
+
+static VOID vmCallGroupBatch(VMEXIT_Registers* const registers);
+
+
+static VOID vmCallMapRange(VMEXIT_Registers* const registers);
+
+
+static VOID vmCallInvalidateEpt(VMEXIT_Registers* const registers);
+
+
+static VOID vmCallStartPml(VMEXIT_Registers* const registers);
+
+
+static VOID vmCallStopPml(VMEXIT_Registers* const registers);
+
+
+static VOID vmCallFlushPml(VMEXIT_Registers* const registers);
+
+
+static VOID vmCallStartSampling(VMEXIT_Registers* const registers);
+
+
+static VOID vmCallStopSampling(VMEXIT_Registers* const registers);
+
+
+static NTSTATUS mapPage(
+  Context_EptMappingsData* const mappingData,
+  const UINT64 guestAddress,
+  const UINT64 hostRwAddress,
+  const UINT64 hostFetchAddress);
+
+
+static NTSTATUS mapRange(
+  Context_EptMappingsData* const mappingData,
+  const Context_EptChangedMapping* const range);
+
+
+static NTSTATUS restoreRange(
+  Context_EptMappingsData* const mappingData,
+  const UINT64 guestAddress,
+  const UINT64 size);
+
+
+static NTSTATUS unmapPage(Context_EptMappingsData* const mappingData, const UINT64 guestAddress);
+
+
 /**************************************************************************************************
 * Global function definitions
 **************************************************************************************************/
@@ -39,38 +164,72 @@ static VOID vmCallUnmapPage(VMEXIT_Registers* const registers);
  * @brief Handles a single VM exit
  *
  * Delegates VM exits to appropriate handlers. It also handles incrementing
- * guest RIP and loading guest RSP into registers structure. It is called from assembly.
- * This function will bugcheck if exit reason is not CPUID, VMCALL, or EPT violation.
+ * guest RIP. It is called from assembly, which already read the exit reason to choose
+ * how much guest state to save, the other VMCS fields used by the handlers are read once here.
+ * This function will bugcheck if exit reason is not CPUID, VMCALL, EPT violation, MTF,
+ * VMFUNC, PML full, or VMX-preemption timer. Exits are counted in the current core's
+ * statistics, together with the time spent in this function.
  *
  * @param registers Guest general purpose registers, provided by assembly
+ * @param exitReason Exit reason, provided by assembly
  *
  * @return TRUE if VM should be shutdown, FALSE otherwise
  */
-BOOLEAN VMEXIT_handler(VMEXIT_Registers* const registers)
+BOOLEAN VMEXIT_handler(VMEXIT_Registers* const registers, const UINT64 exitReason)
 {
-  __vmx_vmread(VMCS_GUEST_RSP, &registers->RSP);
+  const UINT64 entryTimestamp = __rdtsc();
+  Context_CoreStats* const stats = &Context_getLogicalCore()->stats;
 
   BOOLEAN initiateShutdown = FALSE;
   BOOLEAN incrementRIP = TRUE;
 
-  VMEXIT_ExitReason exitReason = { 0 };
-  __vmx_vmread(VMCS_EXIT_REASON, &exitReason.bits);
+  VMEXIT_ExitInformation exitInformation = { .exitReason = { .bits = (UINT32)exitReason } };
+  __vmx_vmread(VMCS_EXIT_QUALIFICATION, &exitInformation.exitQualification);
+  __vmx_vmread(VMCS_GUEST_RIP, &exitInformation.guestRip);
+  __vmx_vmread(VMCS_VM_EXIT_INSTRUCTION_LENGTH, &exitInformation.instructionLength);
+  STATS_recordExit(stats, exitInformation.exitReason.basicExitReason);
 
-  switch (exitReason.basicExitReason)
+  switch (exitInformation.exitReason.basicExitReason)
   {
   case VMEXIT_CPUID:
   {
+    STATS_recordCpuid(stats, (UINT32)registers->RAX);
     cpuidHandler(registers);
     break;
   }
   case VMEXIT_VMCALL:
   {
-    vmCallHandler(registers, &initiateShutdown);
+    STATS_recordVmCall(stats, registers->RCX);
+    incrementRIP = vmCallHandler(registers, &exitInformation, &initiateShutdown);
     break;
   }
   case VMEXIT_EPT_VIOLATION:
   {
-    eptViolationHandler();
+    eptViolationHandler(&exitInformation);
+    incrementRIP = FALSE;
+    break;
+  }
+  case VMEXIT_MONITOR_TRAP:
+  {
+    monitorTrapHandler();
+    incrementRIP = FALSE;
+    break;
+  }
+  case VMEXIT_VMFUNC:
+  {
+    vmFuncHandler();
+    incrementRIP = FALSE;
+    break;
+  }
+  case VMEXIT_PML_FULL:
+  {
+    pmlFullHandler();
+    incrementRIP = FALSE;
+    break;
+  }
+  case VMEXIT_PREEMPTION_TIMER:
+  {
+    preemptionTimerHandler(&exitInformation);
     incrementRIP = FALSE;
     break;
   }
@@ -82,14 +241,10 @@ BOOLEAN VMEXIT_handler(VMEXIT_Registers* const registers)
 
   if (incrementRIP)
   {
-    const UINT64 instructionLength = { 0 };
-    const UINT64 rip = { 0 };
-    __vmx_vmread(VMCS_VM_EXIT_INSTRUCTION_LENGTH, &instructionLength);
-    __vmx_vmread(VMCS_GUEST_RIP, &rip);
-    __vmx_vmwrite(VMCS_GUEST_RIP, rip + instructionLength);
+    __vmx_vmwrite(VMCS_GUEST_RIP, exitInformation.guestRip + exitInformation.instructionLength);
   }
 
-  __vmx_vmwrite(VMCS_GUEST_RSP, registers->RSP);
+  STATS_recordRootCycles(stats, __rdtsc() - entryTimestamp);
 
   return initiateShutdown;
 }
@@ -101,10 +256,9 @@ BOOLEAN VMEXIT_handler(VMEXIT_Registers* const registers)
 /**
  * @brief Handles CPUID VM exit
  *
- * Handles CPUID VM exits by executing CPUID instruction and returning
- * results. There are two CPUID functions that are modified:
- *  - IA32_CPUID_BASIC_INFORMATION_0: Vendor string is modified to "AvocadoIntel"
- *  - IA32_CPUID_BASIC_INFORMATION_1: Hypervisor present bit is set to TRUE
+ * Answers CPUID from the current core's cache when possible, otherwise executes CPUID and
+ * applies the same changes as CPUID_applyChanges does to cached leaves. Results are zero
+ * extended, as the instruction does.
  *
  * @param registers Guest registers
  *
@@ -112,49 +266,77 @@ BOOLEAN VMEXIT_handler(VMEXIT_Registers* const registers)
  */
 static VOID cpuidHandler(VMEXIT_Registers* const registers)
 {
-  const INT32 cpuidFunction = (INT32)registers->RAX;
-  const INT32 cpuidSubleaf = (INT32)registers->RCX;
+  const UINT32 cpuidFunction = (UINT32)registers->RAX;
+  const UINT32 cpuidSubleaf = (UINT32)registers->RCX;
 
   INT32 cpuid[4] = { 0 };
-  __cpuidex(cpuid, cpuidFunction, cpuidSubleaf);
-
-  if (cpuidFunction == IA32_CPUID_BASIC_INFORMATION_0)
-  {
-    IA32_CpuidBasicInformation0* const basicInformation0 = (IA32_CpuidBasicInformation0*)cpuid;
-    basicInformation0->vendor1 = 'covA';
-    basicInformation0->vendor2 = 'Ioda';
-    basicInformation0->vendor3 = 'letn';
-  }
-
-  if (cpuidFunction == IA32_CPUID_BASIC_INFORMATION_1)
+  if (!CPUID_readCached(&Context_getLogicalCore()->cpuidCache, cpuidFunction, cpuid))
   {
-    IA32_CpuidBasicInformation1* const basicInformation1 = (IA32_CpuidBasicInformation1*)cpuid;
-    basicInformation1->hypervisorPresentBit = TRUE;
+    __cpuidex(cpuid, cpuidFunction, cpuidSubleaf);
+    CPUID_applyChanges(cpuidFunction, cpuid);
   }
 
-  registers->RAX = cpuid[0];
-  registers->RBX = cpuid[1];
-  registers->RCX = cpuid[2];
-  registers->RDX = cpuid[3];
+  registers->RAX = (UINT32)cpuid[0];
+  registers->RBX = (UINT32)cpuid[1];
+  registers->RCX = (UINT32)cpuid[2];
+  registers->RDX = (UINT32)cpuid[3];
 }
 
 
 /**
  * @brief Handles VMCALL VM exit
  *
- * Handles VMCALLs. Currently, there are three VMCALLs:
+ * Handles VMCALLs. Currently, there are fifteen VMCALLs:
  *  - VMEXIT_VMCALL_INITIATE_SHUTDOWN: Initiates a shutdown of the VM
  *  - VMEXIT_VMCALL_MAP_PAGE: Changes EPT mapping
  *  - VMEXIT_VMCALL_UNMAP_PAGE: Removes EPT mapping change
+ *  - VMEXIT_VMCALL_MAP_BATCH: Changes multiple EPT mappings
+ *  - VMEXIT_VMCALL_UNMAP_BATCH: Removes multiple EPT mapping changes
+ *  - VMEXIT_VMCALL_APPLY_BATCH: Changes and removes multiple EPT mappings in order
+ *  - VMEXIT_VMCALL_GROUP_BATCH: Moves multiple EPT mapping changes to mapping groups
+ *  - VMEXIT_VMCALL_MAP_RANGE: Changes the mapping of a contiguous range
+ *  - VMEXIT_VMCALL_INVALIDATE_EPT: Invalidates this core's EPT caches
+ *  - VMEXIT_VMCALL_NOP: Only sets RAX to STATUS_SUCCESS, used to measure the VMCALL round trip
+ *  - VMEXIT_VMCALL_START_PML: Enables page-modification logging on this core
+ *  - VMEXIT_VMCALL_STOP_PML: Drains the PML buffer and disables page-modification logging
+ *  - VMEXIT_VMCALL_FLUSH_PML: Drains the PML buffer into this core's dirty ring
+ *  - VMEXIT_VMCALL_START_SAMPLING: Arms the VMX-preemption timer on this core
+ *  - VMEXIT_VMCALL_STOP_SAMPLING: Disables the VMX-preemption timer on this core
+ *
+ * Handlers that dereference guest pointers call VMCS_invalidateHostTlb first, since with
+ * VPID enabled root mode may still hold translations of buffers the guest has since freed.
+ *
+ * VMCALLs are accepted only from CPL 0, which is the DPL of the guest's SS. Otherwise an
+ * invalid opcode exception is injected, as if no hypervisor was present, so user mode can
+ * not pass pointers that root mode would dereference.
  *
  * @param registers Guest registers
+ * @param exitInformation Current VM exit information
  * @param initiateShutdown Pointer to a BOOLEAN that is set to TRUE on shutdown
  *
- * @return VOID
+ * @return TRUE if the VMCALL was handled and guest RIP should be incremented, FALSE if
+ * an exception was injected.
  */
-static VOID vmCallHandler(VMEXIT_Registers* const registers, BOOLEAN* const initiateShutdown)
+static BOOLEAN vmCallHandler(
+  VMEXIT_Registers* const registers,
+  const VMEXIT_ExitInformation* const exitInformation,
+  BOOLEAN* const initiateShutdown)
 {
+  UINT64 ssAccessRightsField = 0;
+  __vmx_vmread(VMCS_GUEST_SS_ACCESS_RIGHTS, &ssAccessRightsField);
+  const SEGMENTATION_VMCSSegmentAccessRights ssAccessRights =
+  {
+    .bits = (UINT32)ssAccessRightsField
+  };
+  if (ssAccessRights.segmentAccessRightsByte.descriptorPrivilegeLevel != 0)
+  {
+    injectInvalidOpcode();
+    return FALSE;
+  }
+
   const UINT64 vmCallCode = registers->RCX;
+  TRACE_recordVmCall(vmCallCode, registers->RDX, exitInformation->guestRip);
+
   switch (vmCallCode)
   {
   case VMEXIT_VMCALL_INITIATE_SHUTDOWN:
@@ -173,11 +355,73 @@ static VOID vmCallHandler(VMEXIT_Registers* const registers, BOOLEAN* const init
     vmCallUnmapPage(registers);
     break;
   }
+  case VMEXIT_VMCALL_MAP_BATCH:
+  {
+    vmCallMapBatch(registers);
+    break;
+  }
+  case VMEXIT_VMCALL_UNMAP_BATCH:
+  {
+    vmCallUnmapBatch(registers);
+    break;
+  }
+  case VMEXIT_VMCALL_APPLY_BATCH:
+  {
+    vmCallApplyBatch(registers);
+    break;
+  }
+  case VMEXIT_VMCALL_GROUP_BATCH:
+  {
+    vmCallGroupBatch(registers);
+    break;
+  }
+  case VMEXIT_VMCALL_MAP_RANGE:
+  {
+    vmCallMapRange(registers);
+    break;
+  }
+  case VMEXIT_VMCALL_INVALIDATE_EPT:
+  {
+    vmCallInvalidateEpt(registers);
+    break;
+  }
+  case VMEXIT_VMCALL_NOP:
+  {
+    registers->RAX = (UINT64)STATUS_SUCCESS;
+    break;
+  }
+  case VMEXIT_VMCALL_START_PML:
+  {
+    vmCallStartPml(registers);
+    break;
+  }
+  case VMEXIT_VMCALL_STOP_PML:
+  {
+    vmCallStopPml(registers);
+    break;
+  }
+  case VMEXIT_VMCALL_FLUSH_PML:
+  {
+    vmCallFlushPml(registers);
+    break;
+  }
+  case VMEXIT_VMCALL_START_SAMPLING:
+  {
+    vmCallStartSampling(registers);
+    break;
+  }
+  case VMEXIT_VMCALL_STOP_SAMPLING:
+  {
+    vmCallStopSampling(registers);
+    break;
+  }
   default:
   {
     break;
   }
   }
+
+  return TRUE;
 }
 
 
@@ -187,48 +431,135 @@ static VOID vmCallHandler(VMEXIT_Registers* const registers, BOOLEAN* const init
  * Handles EPT violations by swapping mapping to the one previously stored
  * int the Context_EptChangedMapping structure. Function will bugcheck if mapping is not
  * found or if the violation is not a data read, data write, or instruction fetch.
+ * In the shared EPT mode, the mapping could have been removed by another core in the
+ * meantime, in which case the access is simply retried.
+ *
+ * Accesses to regions left unpopulated when the EPT was created, typically MMIO outside
+ * of RAM, are mapped one to one by EPT_populate and retried. The tables are taken from the
+ * populate pool, which is refilled at PASSIVE_LEVEL once it runs low. If no table is left,
+ * the access is retried as well, until the pool has been refilled.
+ *
+ * Mappings that switch views often are MTF assisted. For those, a data access grants
+ * read/write/fetch access to the read/write page for a single instruction, and the fetch
+ * view is restored on the following MTF VM exit. This keeps code which reads a hooked page
+ * from bouncing between the views. An instruction which may itself be on the mapping would
+ * be fetched from the read/write page, so it takes the two exit path instead. In the shared
+ * EPT mode, the grant is visible to the other cores until the MTF VM exit, so they may fetch
+ * the read/write page during the step.
+ *
+ * With EPTP switching, the views are separate EPT hierarchies and the handler only switches
+ * the EPTP, without changing or invalidating any entries.
+ *
+ * Without EPTP switching, other mappings of the faulting mapping's group are switched to
+ * the same view in the same pass, and EPT caches are invalidated once for all of them, so
+ * a hook spanning several pages costs a single VM exit per view switch. Single stepped data
+ * accesses switch only the faulting mapping, which returns to the fetch view right after.
+ *
+ * With virtualization exceptions enabled, violations only get here if VE_handler could not
+ * resolve them by switching views, and delivery of virtualization exceptions is rearmed
+ * afterwards, whichever way the violation was resolved.
+ *
+ * @param exitInformation Current VM exit information
+ *
+ * @return VOID
+ */
+static VOID eptViolationHandler(const VMEXIT_ExitInformation* const exitInformation)
+{
+  resolveEptViolation(exitInformation);
+  if (Context_getContext()->isVeEnabled)
+  {
+    VE_rearm();
+  }
+}
+
+
+/**
+ * @brief Resolves an EPT violation for eptViolationHandler.
+ *
+ * @param exitInformation Current VM exit information
  *
  * @return VOID
  */
-static VOID eptViolationHandler(VOID)
+static VOID resolveEptViolation(const VMEXIT_ExitInformation* const exitInformation)
 {
-  VMEXIT_EptViolation eptViolation = { 0 };
-  __vmx_vmread(VMCS_EXIT_QUALIFICATION, &eptViolation.bits);
+  const VMEXIT_EptViolation eptViolation = { .bits = exitInformation->exitQualification };
 
   EPT_Address exitAddr = { 0 };
   __vmx_vmread(VMCS_GUEST_PHYSICAL_ADDRESS_FULL, &exitAddr.address);
   exitAddr.offset = 0;
 
-  const Context_LogicalCore* const thisCore = Context_getLogicalCore();
+  Context_LogicalCore* const thisCore = Context_getLogicalCore();
+  Context_EptMappingsData* const mappingData = thisCore->eptMappingData;
+  Context_lockEptMappings(mappingData);
 
-  const Context_EptChangedMapping* foundMapping = NULL;
-  for (UINT64 mappingIndex = 0; mappingIndex < CONTEXT_EPT_MAX_MAPPINGS; mappingIndex++)
+  Context_EptChangedMapping* const foundMapping =
+    MAPPING_TABLE_find(&mappingData->changedMappings, exitAddr.address);
+  if (foundMapping == NULL)
   {
-    const Context_EptChangedMapping* const currentMapping =
-      &thisCore->eptMappingData.changedMappings[mappingIndex];
-    if (currentMapping->valid && currentMapping->guestAddress == exitAddr.address)
+    if (!EPT_isPopulated(mappingData, exitAddr.address))
+    {
+      // Views populated so far stay populated, a failure is completed by a later retry
+      EPT_populate(mappingData, exitAddr.address);
+      Context_unlockEptMappings(mappingData);
+      return;
+    }
+
+    Context_unlockEptMappings(mappingData);
+    if (!Context_getContext()->isEptShared)
     {
-      foundMapping = currentMapping;
-      break;
+      KeBugCheck(BSOD_VMEXIT_EPT_NO_MAPPING);
     }
-  }
 
-  if (foundMapping == NULL)
-  {
-    KeBugCheck(BSOD_VMEXIT_EPT_NO_MAPPING);
+    EPT_invalidate(mappingData);
+    return;
   }
 
+  foundMapping->noOfViolations++;
+
   if (eptViolation.dataRead || eptViolation.dataWrite)
   {
-    EPT_changeMapping(foundMapping->guestAddress, foundMapping->hostRwAddress, TRUE, FALSE);
-    VMX_inveptAll();
+    updateThrashCounter(foundMapping, FALSE);
+    const BOOLEAN singleStep = foundMapping->isMtfAssisted && !thisCore->isMtfPending &&
+      !isInstructionOnMapping(exitInformation, eptViolation, exitAddr.address, foundMapping);
+    const BOOLEAN invalidate = grantView(mappingData, foundMapping, EPT_VIEW_READ, singleStep);
+    if (!singleStep)
+    {
+      grantGroupView(mappingData, foundMapping, EPT_VIEW_READ);
+    }
+    TRACE_recordEptViolation(
+      exitAddr.address,
+      eptViolation.bits,
+      exitInformation->guestRip,
+      EPT_VIEW_READ);
+    if (singleStep)
+    {
+      thisCore->isMtfPending = TRUE;
+      thisCore->mtfGuestAddress = foundMapping->guestAddress;
+      VMCS_setMonitorTrapFlag(TRUE);
+    }
+    Context_unlockEptMappings(mappingData);
+    if (invalidate)
+    {
+      EPT_invalidate(mappingData);
+    }
     return;
   }
 
   if (eptViolation.instructionFetch)
   {
-    EPT_changeMapping(foundMapping->guestAddress, foundMapping->hostFetchAddress, FALSE, TRUE);
-    VMX_inveptAll();
+    updateThrashCounter(foundMapping, TRUE);
+    const BOOLEAN invalidate = grantView(mappingData, foundMapping, EPT_VIEW_FETCH, FALSE);
+    grantGroupView(mappingData, foundMapping, EPT_VIEW_FETCH);
+    TRACE_recordEptViolation(
+      exitAddr.address,
+      eptViolation.bits,
+      exitInformation->guestRip,
+      EPT_VIEW_FETCH);
+    Context_unlockEptMappings(mappingData);
+    if (invalidate)
+    {
+      EPT_invalidate(mappingData);
+    }
     return;
   }
 
@@ -237,131 +568,933 @@ static VOID eptViolationHandler(VOID)
 
 
 /**
- * @brief Handles VMEXIT_VMCALL_MAP_PAGE
- *
- * Handles VMEXIT_VMCALL_MAP_PAGE VMCALL. It receives mapping in RDX, R8, and R9.
- * Mapping is stored in Context_EptChangedMapping structure, and guest access to
- * page is disabled. Function will fail if:
- * - any of the addresses are not page aligned
- * - any of the proviced addresses have their mappings changed
- * - guestAddress is used as a target in any other mappings
- * - all mapping slots are used
- * - the internal buffer used for page splitting is full
+ * @brief Handles Monitor Trap Flag VM exits
  *
- * The result is returned in RAX. It returns STATUS_SUCCESS on success,
- * and error code on failure.
- *
- * @param registers Guest registers
+ * Disables the MTF and restores the fetch view of the mapping single stepped by
+ * eptViolationHandler. With EPTP switching, fetch access is also removed from the read/write
+ * view. Nothing is restored if the mapping was removed in the meantime.
  *
  * @return VOID
  */
-static VOID vmCallMapPage(VMEXIT_Registers* const registers)
+static VOID monitorTrapHandler(VOID)
 {
-  const EPT_Address guestAddress = { .address = registers->RDX };
-  const EPT_Address hostRwAddress = { .address = registers->R8 };
-  const EPT_Address hostFetchAddress = { .address = registers->R9 };
+  VMCS_setMonitorTrapFlag(FALSE);
 
-  if (guestAddress.offset != 0 || hostRwAddress.offset != 0 || hostFetchAddress.offset != 0)
+  Context_LogicalCore* const thisCore = Context_getLogicalCore();
+  if (!thisCore->isMtfPending)
   {
-    registers->RAX = (UINT64)STATUS_UNSUCCESSFUL;
     return;
   }
+  thisCore->isMtfPending = FALSE;
 
-  Context_LogicalCore* const thisCore = Context_getLogicalCore();
-  Context_EptChangedMapping* const changedMappings =
-    thisCore->eptMappingData.changedMappings;
-  for (UINT64 mappingIndex = 0; mappingIndex < CONTEXT_EPT_MAX_MAPPINGS; mappingIndex++)
-  {
-    const Context_EptChangedMapping* const currentMapping = &changedMappings[mappingIndex];
-    if (currentMapping->valid &&
-      (currentMapping->guestAddress == guestAddress.address ||
-        currentMapping->hostFetchAddress == guestAddress.address ||
-        currentMapping->hostRwAddress == guestAddress.address ||
-        currentMapping->guestAddress == hostRwAddress.address ||
-        currentMapping->guestAddress == hostFetchAddress.address))
-    {
-      registers->RAX = (UINT64)STATUS_UNSUCCESSFUL;
-      return;
-    }
-  }
-
-  UINT64 selectedIndex = 0;
-  while (selectedIndex < CONTEXT_EPT_MAX_MAPPINGS && changedMappings[selectedIndex].valid)
-  {
-    selectedIndex++;
-  }
+  Context_EptMappingsData* const mappingData = thisCore->eptMappingData;
+  Context_lockEptMappings(mappingData);
 
-  if (selectedIndex >= CONTEXT_EPT_MAX_MAPPINGS)
+  const Context_EptChangedMapping* const foundMapping =
+    MAPPING_TABLE_find(&mappingData->changedMappings, thisCore->mtfGuestAddress);
+  if (foundMapping == NULL)
   {
-    registers->RAX = (UINT64)STATUS_UNSUCCESSFUL;
+    Context_unlockEptMappings(mappingData);
     return;
   }
 
-  NTSTATUS ntStatus = EPT_changeMapping(guestAddress.address, guestAddress.address, FALSE, FALSE);
-  if (!NT_SUCCESS(ntStatus))
+  if (EPT_getNoOfViews(mappingData) > 1)
   {
-    registers->RAX = ntStatus;
-    return;
+    EPT_changeRangeMapping(
+      mappingData,
+      EPT_VIEW_READ,
+      foundMapping->guestAddress,
+      foundMapping->hostRwAddress,
+      foundMapping->size,
+      TRUE,
+      FALSE);
   }
+  grantView(mappingData, foundMapping, EPT_VIEW_FETCH, FALSE);
+  Context_unlockEptMappings(mappingData);
+  EPT_invalidate(mappingData);
+}
+
+
+/**
+ * @brief Handles VMFUNC VM exits
+ *
+ * VMFUNC causes a VM exit only if the function or the EPTP list index is invalid,
+ * or if VM functions are disabled. An invalid opcode exception is injected in such case.
+ *
+ * @return VOID
+ */
+static VOID vmFuncHandler(VOID)
+{
+  injectInvalidOpcode();
+}
+
 
-  changedMappings[selectedIndex] = (Context_EptChangedMapping)
+/**
+ * @brief Injects an invalid opcode exception on the next VM entry.
+ *
+ * Guest RIP must not be incremented, the exception is delivered at the faulting instruction.
+ *
+ * @return VOID
+ */
+static VOID injectInvalidOpcode(VOID)
+{
+  const VMCS_InterruptionInformation interruptionInformation =
   {
-    .guestAddress = registers->RDX,
-    .hostRwAddress = registers->R8,
-    .hostFetchAddress = registers->R9,
+    .vector = VMCS_EXCEPTION_VECTOR_UD,
+    .interruptionType = VMCS_INTERRUPTION_TYPE_HARDWARE_EXCEPTION,
     .valid = TRUE
   };
+  __vmx_vmwrite(VMCS_VM_ENTRY_INTERRUPTION_INFORMATION, interruptionInformation.bits);
+}
 
-  VMX_inveptAll();
-  registers->RAX = (UINT64)STATUS_SUCCESS;
+
+/**
+ * @brief Handles PML full VM exits
+ *
+ * The exit occurs before the write that found the PML buffer full is logged, and the write
+ * is retried once the buffer is drained into the current core's dirty ring.
+ *
+ * @return VOID
+ */
+static VOID pmlFullHandler(VOID)
+{
+  DIRTY_LOG_drainPml();
 }
 
 
 /**
- * @brief Handles VMEXIT_VMCALL_UNMAP_PAGE
+ * @brief Handles VMX-preemption timer VM exits
  *
- * Handles VMEXIT_VMCALL_UNMAP_PAGE VMCALL. It receives guest address in RDX.
- * Mapping is removed from Context_EptChangedMapping structure, and EPT mapping
- * is restored to original. This function will fail if mapping is not found. Result is
- * returned in RAX. It returns STATUS_SUCCESS on success, and error code on failure.
+ * Records guest RIP and CR3 into the current core's trace ring, and arms the timer again
+ * with the sampling period. The timer expires between guest instructions, so the guest
+ * resumes at the sampled RIP.
  *
- * @param registers Guest registers
+ * @param exitInformation Current VM exit information
  *
  * @return VOID
  */
-static VOID vmCallUnmapPage(VMEXIT_Registers* const registers)
+static VOID preemptionTimerHandler(const VMEXIT_ExitInformation* const exitInformation)
 {
-  const UINT64 guestAddress = registers->RDX;
+  UINT64 guestCr3 = 0;
+  __vmx_vmread(VMCS_GUEST_CR3, &guestCr3);
+  TRACE_recordSample(exitInformation->guestRip, guestCr3);
+  __vmx_vmwrite(VMCS_GUEST_VMX_PREEMPTION_TIMER_VALUE, Context_getContext()->samplingPeriod);
+}
 
-  Context_LogicalCore* const thisCore = Context_getLogicalCore();
-  Context_EptChangedMapping* foundMapping = NULL;
-  for (UINT64 mappingIndex = 0; mappingIndex < CONTEXT_EPT_MAX_MAPPINGS; mappingIndex++)
+
+/**
+ * @brief Checks if the instruction causing an EPT violation may be on the mapping.
+ *
+ * Guest RIP is virtual, so it is compared against the guest linear address of the access,
+ * rebased to the start of the mapping. The instruction may span several bytes before its
+ * end reaches the mapping. Without a valid linear address, the instruction is assumed to be
+ * on the mapping. An instruction reaching the mapping through a different virtual alias is
+ * not detected.
+ *
+ * @param exitInformation Current VM exit information.
+ * @param eptViolation Exit qualification of the EPT violation.
+ * @param guestAddress Guest physical address of the accessed page.
+ * @param mapping Mapping containing the accessed page.
+ *
+ * @return TRUE if the instruction may be on the mapping, FALSE otherwise.
+ */
+static BOOLEAN isInstructionOnMapping(
+  const VMEXIT_ExitInformation* const exitInformation,
+  const VMEXIT_EptViolation eptViolation,
+  const UINT64 guestAddress,
+  const Context_EptChangedMapping* const mapping)
+{
+  if (!eptViolation.guestLinearAddressValid)
   {
-    Context_EptChangedMapping* const currentMapping =
-      &thisCore->eptMappingData.changedMappings[mappingIndex];
-    if (currentMapping->valid && currentMapping->guestAddress == guestAddress)
+    return TRUE;
+  }
+
+  UINT64 guestLinearAddress = 0;
+  __vmx_vmread(VMCS_GUEST_LINEAR_ADDRESS, &guestLinearAddress);
+  const UINT64 mappingStart =
+    (guestLinearAddress & ~(UINT64)(PAGE_SIZE - 1)) - (guestAddress - mapping->guestAddress);
+  const UINT64 rip = exitInformation->guestRip;
+
+  return rip + VMEXIT_MAX_INSTRUCTION_LENGTH > mappingStart &&
+    rip < mappingStart + mapping->size;
+}
+
+
+/**
+ * @brief Grants a view of a mapping to the current logical core.
+ *
+ * With EPTP switching, the core is switched to the hierarchy of the view. If singleStep
+ * is set, the read/write page is additionally made fetchable in the read/write view.
+ * Without EPTP switching, the page's entry is rewritten with the view's page and
+ * permissions, singleStep adds fetch access to the read/write view as well. Range mappings
+ * are rewritten as a whole, their tables are split when they are mapped, so this never fails.
+ * The mappings data lock must be held by the caller.
+ *
+ * @param mappingData Mappings data used by the current logical core.
+ * @param mapping Mapping to grant the view of.
+ * @param view EPT_VIEW_READ or EPT_VIEW_FETCH.
+ * @param singleStep TRUE if the read/write view should be fetchable.
+ *
+ * @return TRUE if EPT caches have to be invalidated, FALSE otherwise.
+ */
+static BOOLEAN grantView(
+  Context_EptMappingsData* const mappingData,
+  const Context_EptChangedMapping* const mapping,
+  const UINT64 view,
+  const BOOLEAN singleStep)
+{
+  const BOOLEAN isFetch = view == EPT_VIEW_FETCH;
+  if (EPT_getNoOfViews(mappingData) > 1)
+  {
+    if (singleStep)
     {
-      foundMapping = currentMapping;
-      break;
+      EPT_changeRangeMapping(
+        mappingData,
+        EPT_VIEW_READ,
+        mapping->guestAddress,
+        mapping->hostRwAddress,
+        mapping->size,
+        TRUE,
+        TRUE);
     }
+    EPT_switchView(mappingData, view);
+
+    return singleStep;
   }
 
-  if (foundMapping == NULL)
+  EPT_changeRangeMapping(
+    mappingData,
+    EPT_VIEW_READ,
+    mapping->guestAddress,
+    isFetch ? mapping->hostFetchAddress : mapping->hostRwAddress,
+    mapping->size,
+    !isFetch,
+    isFetch || singleStep);
+
+  return TRUE;
+}
+
+
+/**
+ * @brief Grants a view to all other mappings of a mapping's group.
+ *
+ * Needed only without EPTP switching, where every mapping's entry is rewritten separately.
+ * With EPTP switching, switching the EPTP already switches every member. Entries are
+ * rewritten without invalidating EPT caches, the caller invalidates them once for the whole
+ * group. The mappings data lock must be held by the caller.
+ *
+ * @param mappingData Mappings data used by the current logical core.
+ * @param mapping Mapping whose view was granted.
+ * @param view EPT_VIEW_READ or EPT_VIEW_FETCH.
+ *
+ * @return VOID
+ */
+static VOID grantGroupView(
+  Context_EptMappingsData* const mappingData,
+  const Context_EptChangedMapping* const mapping,
+  const UINT64 view)
+{
+  if (EPT_getNoOfViews(mappingData) > 1)
   {
-    registers->RAX = (UINT64)STATUS_UNSUCCESSFUL;
     return;
   }
 
-  NTSTATUS ntStatus = EPT_changeMapping(guestAddress, guestAddress, TRUE, TRUE);
-  if (!NT_SUCCESS(ntStatus))
+  const Context_EptMappingTable* const changedMappings = &mappingData->changedMappings;
+  const Context_EptChangedMapping* member =
+    MAPPING_TABLE_getNextGroupMember(changedMappings, mapping);
+  while (member != NULL && member != mapping)
   {
-    // Should never happen
-    registers->RAX = ntStatus;
-    return;
+    grantView(mappingData, member, view, FALSE);
+    member = MAPPING_TABLE_getNextGroupMember(changedMappings, member);
   }
+}
+
 
-  *foundMapping = (Context_EptChangedMapping){ 0 };
+/**
+ * @brief Counts view switches of a mapping.
+ *
+ * Switches are counted in windows of CONTEXT_EPT_THRASH_WINDOW TSC ticks. Once the number
+ * of switches in a window reaches the configured threshold, the mapping becomes MTF assisted
+ * until it is removed. The mappings data lock must be held by the caller.
+ *
+ * @param mapping Mapping whose view is switched.
+ * @param isFetch TRUE if the fetch view is granted, FALSE if the read/write view is granted.
+ *
+ * @return VOID
+ */
+static VOID updateThrashCounter(Context_EptChangedMapping* const mapping, const BOOLEAN isFetch)
+{
+  const UINT64 threshold = Context_getContext()->mtfThrashThreshold;
+  if (threshold == 0 || mapping->isMtfAssisted || mapping->isFetchView == isFetch)
+  {
+    return;
+  }
+  mapping->isFetchView = isFetch;
+
+  const UINT64 timestamp = __rdtsc();
+  if (timestamp - mapping->thrashWindowStart > CONTEXT_EPT_THRASH_WINDOW)
+  {
+    mapping->thrashWindowStart = timestamp;
+    mapping->noOfViewSwitches = 0;
+  }
+
+  mapping->noOfViewSwitches++;
+  mapping->isMtfAssisted = mapping->noOfViewSwitches >= threshold;
+}
+
+
+/**
+ * @brief Handles VMEXIT_VMCALL_MAP_PAGE
+ *
+ * Handles VMEXIT_VMCALL_MAP_PAGE VMCALL. It receives mapping in RDX, R8, and R9.
+ * The mapping is applied with mapPage and EPT caches are invalidated on success.
+ *
+ * The result is returned in RAX. It returns STATUS_SUCCESS on success,
+ * and error code on failure.
+ *
+ * @param registers Guest registers
+ *
+ * @return VOID
+ */
+static VOID vmCallMapPage(VMEXIT_Registers* const registers)
+{
+  Context_EptMappingsData* const mappingData = Context_getLogicalCore()->eptMappingData;
+  Context_lockEptMappings(mappingData);
+  const NTSTATUS ntStatus = mapPage(mappingData, registers->RDX, registers->R8, registers->R9);
+  Context_unlockEptMappings(mappingData);
+  if (NT_SUCCESS(ntStatus))
+  {
+    EPT_invalidate(mappingData);
+  }
+
+  registers->RAX = (UINT64)ntStatus;
+}
+
+
+/**
+ * @brief Handles VMEXIT_VMCALL_UNMAP_PAGE
+ *
+ * Handles VMEXIT_VMCALL_UNMAP_PAGE VMCALL. It receives guest address in RDX.
+ * The mapping change is removed with unmapPage and EPT caches are invalidated on success.
+ * Result is returned in RAX. It returns STATUS_SUCCESS on success, and error code on failure.
+ *
+ * @param registers Guest registers
+ *
+ * @return VOID
+ */
+static VOID vmCallUnmapPage(VMEXIT_Registers* const registers)
+{
+  Context_EptMappingsData* const mappingData = Context_getLogicalCore()->eptMappingData;
+  Context_lockEptMappings(mappingData);
+  const NTSTATUS ntStatus = unmapPage(mappingData, registers->RDX);
+  Context_unlockEptMappings(mappingData);
+  if (NT_SUCCESS(ntStatus))
+  {
+    EPT_invalidate(mappingData);
+  }
+
+  registers->RAX = (UINT64)ntStatus;
+}
+
+
+/**
+ * @brief Handles VMEXIT_VMCALL_MAP_BATCH
+ *
+ * Handles VMEXIT_VMCALL_MAP_BATCH VMCALL. It receives a pointer to an array of
+ * Context_EptChangedMapping structures in RDX, number of entries in R8 and a pointer to
+ * this core's status array in R9. Each mapping is applied with mapPage, and EPT caches
+ * are invalidated once, after the whole batch. RAX is set to STATUS_SUCCESS, results of
+ * individual mappings are stored in the status array.
+ *
+ * @param registers Guest registers
+ *
+ * @return VOID
+ */
+static VOID vmCallMapBatch(VMEXIT_Registers* const registers)
+{
+  const Context_EptChangedMapping* const mappings =
+    (const Context_EptChangedMapping*)registers->RDX;
+  const UINT64 noOfMappings = registers->R8;
+  NTSTATUS* const statuses = (NTSTATUS*)registers->R9;
+  VMCS_invalidateHostTlb();
+
+  Context_EptMappingsData* const mappingData = Context_getLogicalCore()->eptMappingData;
+  Context_lockEptMappings(mappingData);
+  BOOLEAN eptChanged = FALSE;
+  for (UINT64 mappingIndex = 0; mappingIndex < noOfMappings; mappingIndex++)
+  {
+    statuses[mappingIndex] = mapPage(
+      mappingData,
+      mappings[mappingIndex].guestAddress,
+      mappings[mappingIndex].hostRwAddress,
+      mappings[mappingIndex].hostFetchAddress);
+    eptChanged |= NT_SUCCESS(statuses[mappingIndex]);
+  }
+  Context_unlockEptMappings(mappingData);
+
+  if (eptChanged)
+  {
+    EPT_invalidate(mappingData);
+  }
+
+  registers->RAX = (UINT64)STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Handles VMEXIT_VMCALL_UNMAP_BATCH
+ *
+ * Handles VMEXIT_VMCALL_UNMAP_BATCH VMCALL. Arguments are the same as for
+ * VMEXIT_VMCALL_MAP_BATCH, only guest addresses of the mappings are used. Each mapping
+ * change is removed with unmapPage, and EPT caches are invalidated once, after the whole batch.
+ *
+ * @param registers Guest registers
+ *
+ * @return VOID
+ */
+static VOID vmCallUnmapBatch(VMEXIT_Registers* const registers)
+{
+  const Context_EptChangedMapping* const mappings =
+    (const Context_EptChangedMapping*)registers->RDX;
+  const UINT64 noOfMappings = registers->R8;
+  NTSTATUS* const statuses = (NTSTATUS*)registers->R9;
+  VMCS_invalidateHostTlb();
+
+  Context_EptMappingsData* const mappingData = Context_getLogicalCore()->eptMappingData;
+  Context_lockEptMappings(mappingData);
+  BOOLEAN eptChanged = FALSE;
+  for (UINT64 mappingIndex = 0; mappingIndex < noOfMappings; mappingIndex++)
+  {
+    statuses[mappingIndex] = unmapPage(mappingData, mappings[mappingIndex].guestAddress);
+    eptChanged |= NT_SUCCESS(statuses[mappingIndex]);
+  }
+  Context_unlockEptMappings(mappingData);
+
+  if (eptChanged)
+  {
+    EPT_invalidate(mappingData);
+  }
+
+  registers->RAX = (UINT64)STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Handles VMEXIT_VMCALL_APPLY_BATCH
+ *
+ * Handles VMEXIT_VMCALL_APPLY_BATCH VMCALL. Arguments are the same as for
+ * VMEXIT_VMCALL_MAP_BATCH. Mappings of zero size remove the change with unmapPage, the others
+ * are applied with mapPage, in the order of the array. EPT caches are invalidated once, after
+ * the whole batch.
+ *
+ * @param registers Guest registers
+ *
+ * @return VOID
+ */
+static VOID vmCallApplyBatch(VMEXIT_Registers* const registers)
+{
+  const Context_EptChangedMapping* const mappings =
+    (const Context_EptChangedMapping*)registers->RDX;
+  const UINT64 noOfMappings = registers->R8;
+  NTSTATUS* const statuses = (NTSTATUS*)registers->R9;
+  VMCS_invalidateHostTlb();
+
+  Context_EptMappingsData* const mappingData = Context_getLogicalCore()->eptMappingData;
+  Context_lockEptMappings(mappingData);
+  BOOLEAN eptChanged = FALSE;
+  for (UINT64 mappingIndex = 0; mappingIndex < noOfMappings; mappingIndex++)
+  {
+    const Context_EptChangedMapping* const mapping = &mappings[mappingIndex];
+    statuses[mappingIndex] = mapping->size == 0 ?
+      unmapPage(mappingData, mapping->guestAddress) :
+      mapPage(
+        mappingData,
+        mapping->guestAddress,
+        mapping->hostRwAddress,
+        mapping->hostFetchAddress);
+    eptChanged |= NT_SUCCESS(statuses[mappingIndex]);
+  }
+  Context_unlockEptMappings(mappingData);
+
+  if (eptChanged)
+  {
+    EPT_invalidate(mappingData);
+  }
+
+  registers->RAX = (UINT64)STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Handles VMEXIT_VMCALL_GROUP_BATCH
+ *
+ * Handles VMEXIT_VMCALL_GROUP_BATCH VMCALL. Arguments are the same as for
+ * VMEXIT_VMCALL_MAP_BATCH, only guest addresses and group IDs of the mappings are used.
+ * Each mapping change is moved to its group with MAPPING_TABLE_setGroup, a group ID of 0
+ * removes it from its group. No entry is changed, so EPT caches are not invalidated, members
+ * are switched to the same view by the next EPT violation of any of them.
+ *
+ * @param registers Guest registers
+ *
+ * @return VOID
+ */
+static VOID vmCallGroupBatch(VMEXIT_Registers* const registers)
+{
+  const Context_EptChangedMapping* const mappings =
+    (const Context_EptChangedMapping*)registers->RDX;
+  const UINT64 noOfMappings = registers->R8;
+  NTSTATUS* const statuses = (NTSTATUS*)registers->R9;
+  VMCS_invalidateHostTlb();
+
+  Context_EptMappingsData* const mappingData = Context_getLogicalCore()->eptMappingData;
+  Context_lockEptMappings(mappingData);
+  for (UINT64 mappingIndex = 0; mappingIndex < noOfMappings; mappingIndex++)
+  {
+    statuses[mappingIndex] = MAPPING_TABLE_setGroup(
+      &mappingData->changedMappings,
+      mappings[mappingIndex].guestAddress,
+      mappings[mappingIndex].groupId);
+  }
+  Context_unlockEptMappings(mappingData);
+
+  registers->RAX = (UINT64)STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Handles VMEXIT_VMCALL_MAP_RANGE
+ *
+ * Handles VMEXIT_VMCALL_MAP_RANGE VMCALL. It receives a pointer to a Context_EptChangedMapping
+ * structure describing the range in RDX. The range is applied with mapRange and EPT caches
+ * are invalidated, also on failure, since a failed change may have been split, partially
+ * applied and rolled back. Result is returned in RAX. It returns STATUS_SUCCESS on success,
+ * and error code on failure.
+ *
+ * @param registers Guest registers
+ *
+ * @return VOID
+ */
+static VOID vmCallMapRange(VMEXIT_Registers* const registers)
+{
+  const Context_EptChangedMapping* const range = (const Context_EptChangedMapping*)registers->RDX;
+  VMCS_invalidateHostTlb();
+
+  Context_EptMappingsData* const mappingData = Context_getLogicalCore()->eptMappingData;
+  Context_lockEptMappings(mappingData);
+  const NTSTATUS ntStatus = mapRange(mappingData, range);
+  Context_unlockEptMappings(mappingData);
+  EPT_invalidate(mappingData);
+
+  registers->RAX = (UINT64)ntStatus;
+}
+
+
+/**
+ * @brief Handles VMEXIT_VMCALL_INVALIDATE_EPT
+ *
+ * Handles VMEXIT_VMCALL_INVALIDATE_EPT VMCALL. It is used in the shared EPT mode, where
+ * the shared hierarchy is changed on a single core and the other cores only need to drop
+ * their cached translations. RAX is set to STATUS_SUCCESS.
+ *
+ * @param registers Guest registers
+ *
+ * @return VOID
+ */
+static VOID vmCallInvalidateEpt(VMEXIT_Registers* const registers)
+{
+  EPT_invalidate(Context_getLogicalCore()->eptMappingData);
+  registers->RAX = (UINT64)STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Handles VMEXIT_VMCALL_START_PML
+ *
+ * Handles VMEXIT_VMCALL_START_PML VMCALL. The PML buffer is emptied and page-modification
+ * logging is enabled on this core. Dirty flags are cleared afterwards by the caller, which
+ * also invalidates EPT caches. RAX is set to STATUS_SUCCESS, or to STATUS_NOT_SUPPORTED
+ * if page-modification logging is not enabled.
+ *
+ * @param registers Guest registers
+ *
+ * @return VOID
+ */
+static VOID vmCallStartPml(VMEXIT_Registers* const registers)
+{
+  if (!Context_getContext()->isPmlEnabled)
+  {
+    registers->RAX = (UINT64)STATUS_NOT_SUPPORTED;
+    return;
+  }
+
+  Context_LogicalCore* const thisCore = Context_getLogicalCore();
+  __vmx_vmwrite(VMCS_PML_INDEX, VMEXIT_PML_ENTRIES - 1);
+  VMCS_setPageModificationLogging(TRUE);
+  thisCore->isDirtyLogEnabled = TRUE;
+  registers->RAX = (UINT64)STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Handles VMEXIT_VMCALL_STOP_PML
+ *
+ * Handles VMEXIT_VMCALL_STOP_PML VMCALL. Entries left in the PML buffer are moved into this
+ * core's dirty ring and page-modification logging is disabled. RAX is set to STATUS_SUCCESS.
+ *
+ * @param registers Guest registers
+ *
+ * @return VOID
+ */
+static VOID vmCallStopPml(VMEXIT_Registers* const registers)
+{
+  Context_LogicalCore* const thisCore = Context_getLogicalCore();
+  if (thisCore->isDirtyLogEnabled)
+  {
+    VMCS_setPageModificationLogging(FALSE);
+    DIRTY_LOG_drainPml();
+    thisCore->isDirtyLogEnabled = FALSE;
+  }
+  registers->RAX = (UINT64)STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Handles VMEXIT_VMCALL_FLUSH_PML
+ *
+ * Handles VMEXIT_VMCALL_FLUSH_PML VMCALL. Entries in the PML buffer are moved into this
+ * core's dirty ring, so they can be read before the buffer is full. RAX is set
+ * to STATUS_SUCCESS.
+ *
+ * @param registers Guest registers
+ *
+ * @return VOID
+ */
+static VOID vmCallFlushPml(VMEXIT_Registers* const registers)
+{
+  if (Context_getLogicalCore()->isDirtyLogEnabled)
+  {
+    DIRTY_LOG_drainPml();
+  }
+  registers->RAX = (UINT64)STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Handles VMEXIT_VMCALL_START_SAMPLING
+ *
+ * Handles VMEXIT_VMCALL_START_SAMPLING VMCALL. The VMX-preemption timer is armed with
+ * Context_Context::samplingPeriod and enabled on this core. RAX is set to STATUS_SUCCESS,
+ * or to STATUS_NOT_SUPPORTED if sampling is not enabled.
+ *
+ * @param registers Guest registers
+ *
+ * @return VOID
+ */
+static VOID vmCallStartSampling(VMEXIT_Registers* const registers)
+{
+  const Context_Context* const context = Context_getContext();
+  if (!context->isSamplingEnabled)
+  {
+    registers->RAX = (UINT64)STATUS_NOT_SUPPORTED;
+    return;
+  }
+
+  __vmx_vmwrite(VMCS_GUEST_VMX_PREEMPTION_TIMER_VALUE, context->samplingPeriod);
+  VMCS_setPreemptionTimer(TRUE);
+  registers->RAX = (UINT64)STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Handles VMEXIT_VMCALL_STOP_SAMPLING
+ *
+ * Handles VMEXIT_VMCALL_STOP_SAMPLING VMCALL. The VMX-preemption timer is disabled on this
+ * core, samples already recorded stay in the trace ring. RAX is set to STATUS_SUCCESS.
+ *
+ * @param registers Guest registers
+ *
+ * @return VOID
+ */
+static VOID vmCallStopSampling(VMEXIT_Registers* const registers)
+{
+  if (Context_getContext()->isSamplingEnabled)
+  {
+    VMCS_setPreemptionTimer(FALSE);
+  }
+  registers->RAX = (UINT64)STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Changes the mapping of a single page.
+ *
+ * Mapping is stored in the changed mappings table, and guest access to
+ * page is disabled. With EPTP switching, the read/write view maps the page to hostRwAddress
+ * and the execute view to hostFetchAddress instead. Synchronous changes split the large
+ * page at PASSIVE_LEVEL beforehand, so only the page table entry is written here, otherwise
+ * the page is split here. EPT caches are not invalidated, it is up to the caller, as is
+ * holding the mappings data lock. Function will fail if:
+ * - any of the addresses are not page aligned
+ * - any of the proviced addresses have their mappings changed
+ * - guestAddress is used as a target in any other mappings
+ * - all mapping slots are used
+ * - the internal buffer used for page splitting is full
+ *
+ * @param mappingData Mappings data of the EPT hierarchy to change.
+ * @param guestAddress Guest physical address of the page.
+ * @param hostRwAddress Physical address used for read/write access.
+ * @param hostFetchAddress Physical address used for fetch access.
+ *
+ * @return STATUS_SUCCESS on success, error code otherwise.
+ */
+static NTSTATUS mapPage(
+  Context_EptMappingsData* const mappingData,
+  const UINT64 guestAddress,
+  const UINT64 hostRwAddress,
+  const UINT64 hostFetchAddress)
+{
+  const EPT_Address guest = { .address = guestAddress };
+  const EPT_Address hostRw = { .address = hostRwAddress };
+  const EPT_Address hostFetch = { .address = hostFetchAddress };
+
+  if (guest.offset != 0 || hostRw.offset != 0 || hostFetch.offset != 0)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  Context_EptMappingTable* const changedMappings = &mappingData->changedMappings;
+  if (MAPPING_TABLE_find(changedMappings, guestAddress) != NULL ||
+    MAPPING_TABLE_isHostAddressUsed(changedMappings, guestAddress) ||
+    MAPPING_TABLE_find(changedMappings, hostRwAddress) != NULL ||
+    MAPPING_TABLE_find(changedMappings, hostFetchAddress) != NULL)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  if (MAPPING_TABLE_isFull(changedMappings))
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  NTSTATUS ntStatus = STATUS_SUCCESS;
+  if (EPT_getNoOfViews(mappingData) > 1)
+  {
+    ntStatus =
+      EPT_changeMapping(mappingData, EPT_VIEW_READ, guestAddress, hostRwAddress, TRUE, FALSE);
+    if (!NT_SUCCESS(ntStatus))
+    {
+      return ntStatus;
+    }
+
+    ntStatus =
+      EPT_changeMapping(mappingData, EPT_VIEW_FETCH, guestAddress, hostFetchAddress, FALSE, TRUE);
+    if (!NT_SUCCESS(ntStatus))
+    {
+      EPT_changeMapping(mappingData, EPT_VIEW_READ, guestAddress, guestAddress, TRUE, TRUE);
+      return ntStatus;
+    }
+  }
+  else
+  {
+    ntStatus =
+      EPT_changeMapping(mappingData, EPT_VIEW_READ, guestAddress, guestAddress, FALSE, FALSE);
+    if (!NT_SUCCESS(ntStatus))
+    {
+      return ntStatus;
+    }
+  }
+  EPT_acquireSplitRange(mappingData, guestAddress, PAGE_SIZE);
+
+  const Context_EptChangedMapping mapping = (Context_EptChangedMapping)
+  {
+    .guestAddress = guestAddress,
+    .hostRwAddress = hostRwAddress,
+    .hostFetchAddress = hostFetchAddress,
+    .size = PAGE_SIZE,
+    .valid = TRUE
+  };
+
+  return MAPPING_TABLE_insert(changedMappings, &mapping);
+}
+
+
+/**
+ * @brief Changes the mapping of a physically contiguous range.
+ *
+ * Works like mapPage, but the whole range is stored as a single mapping, and parts of it
+ * aligned to 2MB or 1GB in both the guest and the host range are remapped by large pages
+ * without splitting. Without EPTP switching, the tables both views need are split here,
+ * so later view switches never need the split pool. A single page range is mapped with
+ * mapPage. If changing the EPT fails, the range is restored and the pages split for it are
+ * coalesced again. EPT caches are not invalidated, it is up to the caller, also on failure,
+ * as is holding the mappings data lock. Function will fail if:
+ * - any of the addresses or the size are not page aligned, or the size is 0
+ * - any page of the provided ranges has its mapping changed
+ * - any page of the guest range is used as a target in any other mappings, or in this
+ *   mapping at a different offset
+ * - all range slots are used
+ * - the internal buffer used for page splitting is full
+ *
+ * @param mappingData Mappings data of the EPT hierarchy to change.
+ * @param range Range to map, guestAddress, hostRwAddress, hostFetchAddress and size are used.
+ *
+ * @return STATUS_SUCCESS on success, error code otherwise.
+ */
+static NTSTATUS mapRange(
+  Context_EptMappingsData* const mappingData,
+  const Context_EptChangedMapping* const range)
+{
+  const UINT64 guestAddress = range->guestAddress;
+  const UINT64 hostRwAddress = range->hostRwAddress;
+  const UINT64 hostFetchAddress = range->hostFetchAddress;
+  const UINT64 size = range->size;
+
+  if (((guestAddress | hostRwAddress | hostFetchAddress | size) & (PAGE_SIZE - 1)) != 0 ||
+    size == 0 ||
+    guestAddress + size < guestAddress ||
+    hostRwAddress + size < hostRwAddress ||
+    hostFetchAddress + size < hostFetchAddress)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  if (size == PAGE_SIZE)
+  {
+    return mapPage(mappingData, guestAddress, hostRwAddress, hostFetchAddress);
+  }
+
+  // A host page inside the guest range is allowed only as the guest page itself
+  const BOOLEAN isRwOverlapping = hostRwAddress != guestAddress &&
+    hostRwAddress < guestAddress + size && guestAddress < hostRwAddress + size;
+  const BOOLEAN isFetchOverlapping = hostFetchAddress != guestAddress &&
+    hostFetchAddress < guestAddress + size && guestAddress < hostFetchAddress + size;
+
+  Context_EptMappingTable* const changedMappings = &mappingData->changedMappings;
+  if (isRwOverlapping || isFetchOverlapping ||
+    MAPPING_TABLE_isGuestRangeChanged(changedMappings, guestAddress, size) ||
+    MAPPING_TABLE_isHostRangeUsed(changedMappings, guestAddress, size) ||
+    MAPPING_TABLE_isGuestRangeChanged(changedMappings, hostRwAddress, size) ||
+    MAPPING_TABLE_isGuestRangeChanged(changedMappings, hostFetchAddress, size))
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  if (MAPPING_TABLE_isRangeTableFull(changedMappings))
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  NTSTATUS ntStatus = STATUS_SUCCESS;
+  if (EPT_getNoOfViews(mappingData) > 1)
+  {
+    ntStatus = EPT_changeRangeMapping(
+      mappingData, EPT_VIEW_READ, guestAddress, hostRwAddress, size, TRUE, FALSE);
+    if (NT_SUCCESS(ntStatus))
+    {
+      ntStatus = EPT_changeRangeMapping(
+        mappingData, EPT_VIEW_FETCH, guestAddress, hostFetchAddress, size, FALSE, TRUE);
+    }
+  }
+  else
+  {
+    // Split for both views first, the access is removed by the last change
+    ntStatus = EPT_changeRangeMapping(
+      mappingData, EPT_VIEW_READ, guestAddress, hostRwAddress, size, FALSE, FALSE);
+    if (NT_SUCCESS(ntStatus))
+    {
+      ntStatus = EPT_changeRangeMapping(
+        mappingData, EPT_VIEW_READ, guestAddress, hostFetchAddress, size, FALSE, FALSE);
+    }
+    if (NT_SUCCESS(ntStatus))
+    {
+      ntStatus = EPT_changeRangeMapping(
+        mappingData, EPT_VIEW_READ, guestAddress, guestAddress, size, FALSE, FALSE);
+    }
+  }
+
+  if (!NT_SUCCESS(ntStatus))
+  {
+    restoreRange(mappingData, guestAddress, size);
+    EPT_coalesceRange(mappingData, guestAddress, size);
+    return ntStatus;
+  }
+  EPT_acquireSplitRange(mappingData, guestAddress, size);
+
+  const Context_EptChangedMapping mapping = (Context_EptChangedMapping)
+  {
+    .guestAddress = guestAddress,
+    .hostRwAddress = hostRwAddress,
+    .hostFetchAddress = hostFetchAddress,
+    .size = size,
+    .valid = TRUE
+  };
+
+  return MAPPING_TABLE_insert(changedMappings, &mapping);
+}
+
+
+/**
+ * @brief Restores original mapping of a range in every view.
+ *
+ * Restoring never needs new tables, the range's tables were split when it was changed.
+ * The caller is responsible for holding the mappings data lock.
+ *
+ * @param mappingData Mappings data of the EPT hierarchy to change.
+ * @param guestAddress Guest physical address of the range.
+ * @param size Size of the range in bytes.
+ *
+ * @return STATUS_SUCCESS on success, error code otherwise.
+ */
+static NTSTATUS restoreRange(
+  Context_EptMappingsData* const mappingData,
+  const UINT64 guestAddress,
+  const UINT64 size)
+{
+  for (UINT64 view = 0; view < EPT_getNoOfViews(mappingData); view++)
+  {
+    const NTSTATUS ntStatus =
+      EPT_changeRangeMapping(mappingData, view, guestAddress, guestAddress, size, TRUE, TRUE);
+    if (!NT_SUCCESS(ntStatus))
+    {
+      // Should never happen
+      return ntStatus;
+    }
+  }
+
+  return STATUS_SUCCESS;
+}
+
+
+/**
+ * @brief Removes the mapping change of a single page or a range.
+ *
+ * Mapping is removed from the changed mappings table, and EPT mapping
+ * is restored to original in every view. If it was the last changed mapping in its 2MB region, the
+ * region is coalesced back into a large page. EPT caches are not invalidated and the mappings data lock
+ * is not taken, it is up to the caller. This function will fail if mapping is not found, ranges
+ * are found only by their first page.
+ *
+ * @param mappingData Mappings data of the EPT hierarchy to change.
+ * @param guestAddress Guest physical address of the page.
+ *
+ * @return STATUS_SUCCESS on success, error code otherwise.
+ */
+static NTSTATUS unmapPage(Context_EptMappingsData* const mappingData, const UINT64 guestAddress)
+{
+  const Context_EptChangedMapping* const mapping =
+    MAPPING_TABLE_find(&mappingData->changedMappings, guestAddress);
+  if (mapping == NULL || mapping->guestAddress != guestAddress)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  const UINT64 size = mapping->size;
+  const NTSTATUS ntStatus = restoreRange(mappingData, guestAddress, size);
+  if (!NT_SUCCESS(ntStatus))
+  {
+    return ntStatus;
+  }
+  EPT_releaseSplitRange(mappingData, guestAddress, size);
 
-  VMX_inveptAll();
-  registers->RAX = STATUS_SUCCESS;
+  return MAPPING_TABLE_remove(&mappingData->changedMappings, guestAddress);
 }
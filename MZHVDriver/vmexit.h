@@ -20,9 +20,13 @@
  * @see [Intel SDM, Vol. 3C, Appendix C](https://software.intel.com/en-us/articles/intel-sdm)
  */
  ///@{
-#define VMEXIT_CPUID          10
-#define VMEXIT_VMCALL         18
-#define VMEXIT_EPT_VIOLATION  48
+#define VMEXIT_CPUID             10
+#define VMEXIT_VMCALL            18
+#define VMEXIT_MONITOR_TRAP      37
+#define VMEXIT_EPT_VIOLATION     48
+#define VMEXIT_PREEMPTION_TIMER  52
+#define VMEXIT_VMFUNC            59
+#define VMEXIT_PML_FULL          62
 ///@}
 
 /**
@@ -34,6 +38,38 @@
 #define VMEXIT_VMCALL_INITIATE_SHUTDOWN  0xFFFFFFFF00000000
 #define VMEXIT_VMCALL_MAP_PAGE           0xF1337
 #define VMEXIT_VMCALL_UNMAP_PAGE         0xF2137
+#define VMEXIT_VMCALL_MAP_BATCH          0xF1338
+#define VMEXIT_VMCALL_UNMAP_BATCH        0xF2138
+#define VMEXIT_VMCALL_INVALIDATE_EPT     0xF3137
+#define VMEXIT_VMCALL_MAP_RANGE          0xF1339
+#define VMEXIT_VMCALL_APPLY_BATCH        0xF133A
+#define VMEXIT_VMCALL_GROUP_BATCH        0xF133B
+#define VMEXIT_VMCALL_NOP                0xF0137
+#define VMEXIT_VMCALL_START_PML          0xF4137
+#define VMEXIT_VMCALL_STOP_PML           0xF4138
+#define VMEXIT_VMCALL_FLUSH_PML          0xF4139
+#define VMEXIT_VMCALL_START_SAMPLING     0xF5137
+#define VMEXIT_VMCALL_STOP_SAMPLING      0xF5138
+///@}
+
+/**
+ * @name Page-modification log
+ * @brief Number of entries in the PML buffer, and the PML index after the last entry
+ * was written.
+ * @anchor VMEXITPageModificationLog
+ */
+///@{
+#define VMEXIT_PML_ENTRIES               512
+#define VMEXIT_PML_INDEX_FULL            0xFFFF
+///@}
+
+/**
+ * @name Maximum instruction length
+ * @brief Longest x86 instruction in bytes.
+ * @anchor VMEXITMaxInstructionLength
+ */
+///@{
+#define VMEXIT_MAX_INSTRUCTION_LENGTH    15
 ///@}
 
 
@@ -45,25 +81,21 @@
 /**
  * @brief Guest register state
  *
+ * Only registers the handlers read or write, and registers the C calling convention does not
+ * preserve, are saved. The remaining ones still hold guest values when handlers return.
+ * Guest RSP is stored in VMCS.
+ *
  * @note This structure is used to save and restore guest register state
  */
 typedef struct VMEXIT_Registers
 {
-  UINT64 R15;
-  UINT64 R14;
-  UINT64 R13;
-  UINT64 R12;
   UINT64 R11;
   UINT64 R10;
   UINT64 R9;
   UINT64 R8;
-  UINT64 RDI;
-  UINT64 RSI;
-  UINT64 RSP;
-  UINT64 RBP;
+  UINT64 RBX;
   UINT64 RDX;
   UINT64 RCX;
-  UINT64 RBX;
   UINT64 RAX;
 } VMEXIT_Registers;
 
@@ -103,9 +135,11 @@ typedef union VMEXIT_EptViolation
     UINT64 addressReadable : 1;
     UINT64 addresWriteable : 1;
     UINT64 addresExecutable : 1;
+    UINT64 _pad1 : 1;
+    UINT64 guestLinearAddressValid : 1;
     // There are more advanced fields in Exit Qualification for EPT Violations
     // See Table 28-7 in Intel SDM for details
-    UINT64 _pad1 : 58;
+    UINT64 _pad2 : 56;
   };
 } VMEXIT_EptViolation;
 #pragma pack(pop)
@@ -114,4 +148,4 @@ typedef union VMEXIT_EptViolation
 /**************************************************************************************************
 * Global function declarations
 **************************************************************************************************/
-BOOLEAN VMEXIT_handler(VMEXIT_Registers* registers);
+BOOLEAN VMEXIT_handler(VMEXIT_Registers* registers, const UINT64 exitReason);
@@ -7,12 +7,14 @@
  */
 
 
+#include "config.h"
 #include "context.h"
 #include "ept.h"
 #include "ia32.h"
 #include <intrin.h>
 #include "memory.h"
 #include "asmproc.h"
+#include "ve.h"
 #include "vmcs.h"
 #include "vmexit.h"
 #include "vmm.h"
@@ -20,9 +22,38 @@
 #include "vmxon.h"
 
 
+/**************************************************************************************************
+* Local type declarations
+**************************************************************************************************/
+/**
+ * @brief EPT setup done by a single worker thread.
+ *
+ * @param mappingData Mappings data to create the EPT hierarchy for.
+ * @param templateEptp Extended Page Table Pointer bits of the hierarchy to copy, 0 if none.
+ * @param processor Logical core the worker runs on.
+ * @param status Result of the setup.
+ */
+typedef struct VMM_EptSetupWork
+{
+  Context_EptMappingsData* mappingData;
+  UINT64 templateEptp;
+  PROCESSOR_NUMBER processor;
+  NTSTATUS status;
+} VMM_EptSetupWork;
+
+
 /**************************************************************************************************
 * Local function declarations
 **************************************************************************************************/
+static NTSTATUS setupEptHierarchies(Context_Context* const context);
+
+
+static NTSTATUS runEptSetupWorkers(VMM_EptSetupWork* const works, const UINT64 noOfWorks);
+
+
+static KSTART_ROUTINE eptSetupWorker;
+
+
 static KIPI_BROADCAST_WORKER virtualizeLogicalCore;
 
 
@@ -38,6 +69,17 @@ static NTSTATUS setControlRegisterBits(VOID);
 static KIPI_BROADCAST_WORKER restoreLogicalCore;
 
 
+static BOOLEAN isKvaShadowEnabled(VOID);
+
+
+// Exported by the kernel, but not declared by the WDK
+NTSYSAPI NTSTATUS NTAPI ZwQuerySystemInformation(
+  ULONG systemInformationClass,
+  PVOID systemInformation,
+  ULONG systemInformationLength,
+  PULONG returnLength);
+
+
 /**************************************************************************************************
 * Global function definitions
 **************************************************************************************************/
@@ -46,6 +88,7 @@ static KIPI_BROADCAST_WORKER restoreLogicalCore;
  * 
  * Encloses all steps required to virtualize system. It delegates creating
  * EPT structures and stating virtualization process on each logical core.
+ * In the shared EPT mode, a single EPT hierarchy is created for all logical cores.
  * 
  * @return STATUS_SUCCESS if system was virtualized successfully, an error code otherwise
  */
@@ -54,26 +97,76 @@ NTSTATUS VMM_enable(VOID)
   Context_Context* const context = Context_getContext();
   context->systemCR3 = (IA32_Cr3){ .bits = __readcr3() };
 
-  NTSTATUS status;
-  for (UINT64 logicalCoreIndex = 0;
-    logicalCoreIndex < context->noOfLogicalCores;
-    logicalCoreIndex++)
+  const IA32_VmxEptVpidCap eptVpidCap = { .bits = __readmsr(IA32_VMX_EPT_VPID_CAP) };
+  context->isInveptSingleContextSupported = eptVpidCap.invept && eptVpidCap.inveptSingleContext;
+  context->isEpt1GBPageSupported = eptVpidCap.pdpte1GBPages;
+  context->isEptAccessDirtySupported = eptVpidCap.accessedDirtyFlags;
+
+  const VMCS_PrimaryProcessorBasedVmExecutionControls allowedPrimaryControls =
   {
-    Context_LogicalCore* const logicalCore = &context->logicalCores[logicalCoreIndex];
+    .bits = (UINT32)(__readmsr(IA32_VMX_TRUE_PROCBASED_CTLS) >> 32)
+  };
+  context->mtfThrashThreshold =
+    allowedPrimaryControls.monitorTrapFlag ? Config_getConfig()->mtfThrashThreshold : 0;
 
-    status = EPT_setupDefaltStructures(&logicalCore->eptp);
-    if (!NT_SUCCESS(status))
-    {
-      VMM_disable();
-      return status;
-    }
+  // IA32_VMX_VMFUNC exists only if VM functions can be enabled
+  const VMCS_SecondaryProcessorBasedVmExecutionControls allowedSecondaryControls =
+  {
+    .bits = (UINT32)(__readmsr(IA32_VMX_PROCBASED_CTLS2) >> 32)
+  };
+  context->isEptpSwitchingEnabled = Config_getConfig()->eptpSwitching != 0 &&
+    allowedSecondaryControls.enableVmFunctions &&
+    ((IA32_VmxVmfunc){ .bits = __readmsr(IA32_VMX_VMFUNC) }).eptpSwitching;
+
+  // The #VE handler resolves violations by switching views, so it needs EPTP switching. The
+  // gate points to driver code, which is not mapped in user address spaces when KVA shadowing
+  // is enabled.
+  context->isVeEnabled = Config_getConfig()->virtualizationExceptions != 0 &&
+    context->isEptpSwitchingEnabled &&
+    allowedSecondaryControls.eptViolationVe &&
+    !isKvaShadowEnabled();
+
+  // Without single-context INVVPID, stale translations of a VPID could not be dropped
+  context->isVpidEnabled = Config_getConfig()->vpid != 0 &&
+    allowedSecondaryControls.enableVpid &&
+    eptVpidCap.invvpid &&
+    eptVpidCap.invvpidSingleContext;
+
+  // Samples are recorded into trace rings, the timer value must be saved across other exits
+  const VMCS_PinBasedVmExecutionControls allowedPinControls =
+  {
+    .bits = (UINT32)(__readmsr(IA32_VMX_TRUE_PINBASED_CTLS) >> 32)
+  };
+  const VMCS_PrimaryVmExitControls allowedExitControls =
+  {
+    .bits = (UINT32)(__readmsr(IA32_VMX_TRUE_EXIT_CTLS) >> 32)
+  };
+  context->isSamplingEnabled = Config_getConfig()->traceRingEvents != 0 &&
+    allowedPinControls.activateVmxPreemptionTimer &&
+    allowedExitControls.saveVmxPreemptionTimerValue;
+
+  // PML logs writes that set EPT dirty flags, the rings are allocated only if configured
+  context->isPmlEnabled = Config_getConfig()->dirtyRingPages != 0 &&
+    context->isEptAccessDirtySupported &&
+    allowedSecondaryControls.enablePML;
+
+  LARGE_INTEGER frequency = { 0 };
+  const LARGE_INTEGER setupStart = KeQueryPerformanceCounter(&frequency);
+  NTSTATUS status = setupEptHierarchies(context);
+  if (!NT_SUCCESS(status))
+  {
+    VMM_disable();
+    return status;
   }
+  const LARGE_INTEGER setupEnd = KeQueryPerformanceCounter(NULL);
+  context->eptSetupMicroseconds =
+    (UINT64)(setupEnd.QuadPart - setupStart.QuadPart) * 1000000 / (UINT64)frequency.QuadPart;
 
   status = (NTSTATUS)KeIpiGenericCall(virtualizeLogicalCore, 0);
 
   for (UINT64 logicalCoreIndex = 0; logicalCoreIndex < context->noOfLogicalCores; logicalCoreIndex++)
   {
-    const Context_LogicalCore* const logicalCore = &context->logicalCores[logicalCoreIndex];
+    const Context_LogicalCore* const logicalCore = context->logicalCores[logicalCoreIndex];
     if (!logicalCore->isVirtualized)
     {
       VMM_disable();
@@ -98,14 +191,27 @@ VOID VMM_disable(VOID)
   KeIpiGenericCall(restoreLogicalCore, 0);
 
   Context_Context* const context = Context_getContext();
-  for (UINT64 logicalCoreIndex = 0;
-    logicalCoreIndex < context->noOfLogicalCores;
-    logicalCoreIndex++)
+  for (UINT64 mappingsDataIndex = 0;
+    mappingsDataIndex < context->noOfEptMappingsData;
+    mappingsDataIndex++)
   {
-    Context_LogicalCore* const logicalCore = &context->logicalCores[logicalCoreIndex];
-    if (logicalCore->eptp != 0)
+    Context_EptMappingsData* const mappingData = context->eptMappingsData[mappingsDataIndex];
+    if (mappingData->eptp != 0)
     {
-      EPT_destroyEPTStructure(logicalCore->eptp);
+      EPT_destroyEPTStructure(mappingData->eptp);
+      mappingData->eptp = 0;
+    }
+
+    if (mappingData->fetchEptp != 0)
+    {
+      EPT_destroyEPTStructure(mappingData->fetchEptp);
+      mappingData->fetchEptp = 0;
+    }
+
+    if (mappingData->eptpList != NULL)
+    {
+      Memory_free(mappingData->eptpList);
+      mappingData->eptpList = NULL;
     }
   }
 }
@@ -114,11 +220,157 @@ VOID VMM_disable(VOID)
 /**************************************************************************************************
 * Local function definitions
 **************************************************************************************************/
+/**
+ * @brief Creates EPT hierarchies of all mappings data.
+ *
+ * The hierarchy of the first mappings data is created from the MTRRs and then used as
+ * a template for all the others, which are copied in parallel. Every hierarchy is allocated
+ * on the NUMA node of the first logical core using it, and created by a worker running on
+ * that core, so that it is also first touched there. Must be called at PASSIVE_LEVEL.
+ *
+ * @param context Driver context.
+ *
+ * @return STATUS_SUCCESS if all hierarchies were created, an error code otherwise
+ */
+static NTSTATUS setupEptHierarchies(Context_Context* const context)
+{
+  VMM_EptSetupWork* const works =
+    Memory_allocate(context->noOfEptMappingsData * sizeof(VMM_EptSetupWork), FALSE);
+  if (works == NULL)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  NTSTATUS status = STATUS_SUCCESS;
+  for (UINT64 mappingsDataIndex = 0;
+    mappingsDataIndex < context->noOfEptMappingsData;
+    mappingsDataIndex++)
+  {
+    works[mappingsDataIndex] = (VMM_EptSetupWork)
+    {
+      .mappingData = context->eptMappingsData[mappingsDataIndex],
+      .templateEptp = 0,
+      .status = STATUS_UNSUCCESSFUL
+    };
+
+    // Mappings data are indexed by logical cores, unless the EPT is shared
+    status = KeGetProcessorNumberFromIndex(
+      (ULONG)mappingsDataIndex,
+      &works[mappingsDataIndex].processor);
+    if (!NT_SUCCESS(status))
+    {
+      Memory_free(works);
+      return status;
+    }
+  }
+
+  status = runEptSetupWorkers(works, 1);
+  if (NT_SUCCESS(status) && context->noOfEptMappingsData > 1)
+  {
+    for (UINT64 mappingsDataIndex = 1;
+      mappingsDataIndex < context->noOfEptMappingsData;
+      mappingsDataIndex++)
+    {
+      works[mappingsDataIndex].templateEptp = context->eptMappingsData[0]->eptp;
+    }
+
+    status = runEptSetupWorkers(&works[1], context->noOfEptMappingsData - 1);
+  }
+
+  Memory_free(works);
+  return status;
+}
+
+
+/**
+ * @brief Runs EPT setup works in parallel
+ *
+ * Starts a system thread for every work and waits until all of the started threads
+ * terminate, even if some of them could not be started.
+ *
+ * @param works Works to run.
+ * @param noOfWorks Number of works.
+ *
+ * @return STATUS_SUCCESS if all works succeeded, an error code otherwise
+ */
+static NTSTATUS runEptSetupWorkers(VMM_EptSetupWork* const works, const UINT64 noOfWorks)
+{
+  HANDLE* const threads = Memory_allocate(noOfWorks * sizeof(HANDLE), FALSE);
+  if (threads == NULL)
+  {
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  OBJECT_ATTRIBUTES attributes = { 0 };
+  InitializeObjectAttributes(&attributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+  NTSTATUS status = STATUS_SUCCESS;
+  UINT64 noOfThreads = 0;
+  for (; noOfThreads < noOfWorks; noOfThreads++)
+  {
+    status = PsCreateSystemThread(
+      &threads[noOfThreads],
+      THREAD_ALL_ACCESS,
+      &attributes,
+      NULL,
+      NULL,
+      eptSetupWorker,
+      &works[noOfThreads]);
+    if (!NT_SUCCESS(status))
+    {
+      break;
+    }
+  }
+
+  for (UINT64 threadIndex = 0; threadIndex < noOfThreads; threadIndex++)
+  {
+    ZwWaitForSingleObject(threads[threadIndex], FALSE, NULL);
+    ZwClose(threads[threadIndex]);
+
+    if (NT_SUCCESS(status) && !NT_SUCCESS(works[threadIndex].status))
+    {
+      status = works[threadIndex].status;
+    }
+  }
+
+  Memory_free(threads);
+  return status;
+}
+
+
+/**
+ * @brief Creates EPT hierarchy of a single mappings data
+ *
+ * Is called in a system thread, which is first bound to the logical core of the work.
+ *
+ * @param argument Pointer to VMM_EptSetupWork
+ *
+ * @return VOID
+ */
+_Use_decl_annotations_
+static VOID eptSetupWorker(PVOID argument)
+{
+  VMM_EptSetupWork* const work = argument;
+
+  GROUP_AFFINITY affinity =
+  {
+    .Group = work->processor.Group,
+    .Mask = (KAFFINITY)1 << work->processor.Number
+  };
+  KeSetSystemGroupAffinityThread(&affinity, NULL);
+
+  work->status = EPT_setupDefaltStructures(work->mappingData, work->templateEptp);
+
+  PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+
 /**
  * @brief Virtualizes a single logical core
  * 
  * Is called on each logical core. It checks prerequisites, enables VMX,
- * sets up VMCS region, and enters VMCS.
+ * sets up VMCS region, and enters VMCS. Once in VMX non-root mode, the #VE handler
+ * is installed if virtualization exceptions are enabled.
  *
  * @param argument Unused
  * 
@@ -161,6 +413,11 @@ static ULONG_PTR virtualizeLogicalCore(ULONG_PTR argument)
   }
 
   Context_getLogicalCore()->isVirtualized = TRUE;
+  if (Context_getContext()->isVeEnabled)
+  {
+    VE_installHandler();
+  }
+
   return STATUS_SUCCESS;
 }
 
@@ -189,6 +446,31 @@ static NTSTATUS checkPrerequisites(VOID)
 }
 
 
+/**
+ * @brief Checks if kernel virtual address shadowing is enabled
+ * 
+ * Kernels without KVA shadowing do not know the information class, so a failure with
+ * STATUS_INVALID_INFO_CLASS means it is disabled. Any other failure is treated as enabled.
+ * 
+ * @return TRUE if KVA shadowing is enabled or could not be queried, FALSE otherwise
+ */
+static BOOLEAN isKvaShadowEnabled(VOID)
+{
+  ULONG kvaShadowFlags = 0;
+  const NTSTATUS status = ZwQuerySystemInformation(
+    VMM_SYSTEM_KERNEL_VA_SHADOW_INFORMATION,
+    &kvaShadowFlags,
+    sizeof(kvaShadowFlags),
+    NULL);
+  if (status == STATUS_INVALID_INFO_CLASS)
+  {
+    return FALSE;
+  }
+
+  return !NT_SUCCESS(status) || (kvaShadowFlags & VMM_KVA_SHADOW_ENABLED) != 0;
+}
+
+
 /**
  * @brief Check if VMX is supported in CPUID
  * 
@@ -281,6 +563,7 @@ static ULONG_PTR restoreLogicalCore(ULONG_PTR argument)
     VMX_vmcall(VMEXIT_VMCALL_INITIATE_SHUTDOWN, 0, 0, 0);
     thisLogicalCore->isVirtualized = FALSE;
   }
+  VE_uninstallHandler();
 
   return (NTSTATUS)STATUS_SUCCESS;
 }
@@ -10,6 +10,21 @@
 #include <ntddk.h>
 
 
+/**************************************************************************************************
+* Defines
+**************************************************************************************************/
+/**
+ * @name KVA shadow information
+ * @brief System information class reporting kernel virtual address shadowing, and the flag
+ * set in its first ULONG when shadowing is enabled.
+ * @anchor VMMKvaShadowInformation
+ */
+///@{
+#define VMM_SYSTEM_KERNEL_VA_SHADOW_INFORMATION  196
+#define VMM_KVA_SHADOW_ENABLED                   0x1
+///@}
+
+
 /**************************************************************************************************
 * Global function declarations
 **************************************************************************************************/
@@ -13,4 +13,25 @@
     RET
   VMX_inveptAll ENDP
 
+  VMX_invept PROC
+    MOV QWORD PTR [RSP - 16], RDX
+    MOV QWORD PTR [RSP - 8], 0
+    INVEPT RCX, OWORD PTR [RSP - 16]
+    RET
+  VMX_invept ENDP
+
+  VMX_invvpid PROC
+    MOV QWORD PTR [RSP - 16], RDX
+    MOV QWORD PTR [RSP - 8], R8
+    INVVPID RCX, OWORD PTR [RSP - 16]
+    RET
+  VMX_invvpid ENDP
+
+  VMX_vmfunc PROC
+    MOV EAX, ECX
+    MOV ECX, EDX
+    DB 0Fh, 01h, 0D4h
+    RET
+  VMX_vmfunc ENDP
+
 END
\ No newline at end of file
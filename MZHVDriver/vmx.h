@@ -10,6 +10,42 @@
 #include <ntddk.h>
 
 
+/**************************************************************************************************
+* Defines
+**************************************************************************************************/
+/**
+ * @name INVEPT types
+ * @brief Types of invalidation performed by INVEPT instruction
+ * @see [Intel SDM, Vol. 3C, Chapter 31 VMX Instruction Reference](https://software.intel.com/en-us/articles/intel-sdm)
+ * @anchor VMXInveptTypes
+ */
+///@{
+#define VMX_INVEPT_SINGLE_CONTEXT  1
+#define VMX_INVEPT_ALL_CONTEXT     2
+///@}
+
+/**
+ * @name INVVPID types
+ * @brief Types of invalidation performed by INVVPID instruction
+ * @see [Intel SDM, Vol. 3C, Chapter 31 VMX Instruction Reference](https://software.intel.com/en-us/articles/intel-sdm)
+ * @anchor VMXInvvpidTypes
+ */
+///@{
+#define VMX_INVVPID_INDIVIDUAL_ADDRESS  0
+#define VMX_INVVPID_SINGLE_CONTEXT      1
+///@}
+
+/**
+ * @name VM functions
+ * @brief Functions performed by VMFUNC instruction
+ * @see [Intel SDM, Vol. 3C, Chapter 26.5.6 VM Functions](https://software.intel.com/en-us/articles/intel-sdm)
+ * @anchor VMXVmFunctions
+ */
+///@{
+#define VMX_VMFUNC_EPTP_SWITCHING  0
+///@}
+
+
 /**************************************************************************************************
 * Global function declarations
 **************************************************************************************************/
@@ -35,3 +71,45 @@ NTSTATUS VMX_vmcall(const UINT64 rcx, const UINT64 rdx, const UINT64 r8, const U
  * @return VOID
  */
 VOID VMX_inveptAll(VOID);
+
+/**
+ * @brief Performs INVEPT instruction of a given type
+ * 
+ * This function performs INVEPT instruction with a descriptor holding the given EPTP.
+ * For single-context invalidation, only mappings derived from this EPTP are invalidated.
+ * 
+ * @param type INVEPT type, VMX_INVEPT_SINGLE_CONTEXT or VMX_INVEPT_ALL_CONTEXT
+ * @param eptp Extended Page Table Pointer bits
+ * 
+ * @return VOID
+ */
+VOID VMX_invept(const UINT64 type, const UINT64 eptp);
+
+/**
+ * @brief Performs INVVPID instruction of a given type
+ * 
+ * This function performs INVVPID instruction with a descriptor holding the given VPID
+ * and linear address. Only guest linear and combined mappings tagged with this VPID are
+ * invalidated, the linear address is used only for individual-address invalidation.
+ * 
+ * @param type INVVPID type, VMX_INVVPID_INDIVIDUAL_ADDRESS or VMX_INVVPID_SINGLE_CONTEXT
+ * @param vpid Virtual-processor identifier, nonzero
+ * @param linearAddress Guest linear address
+ * 
+ * @return VOID
+ */
+VOID VMX_invvpid(const UINT64 type, const UINT64 vpid, const UINT64 linearAddress);
+
+/**
+ * @brief Performs VMFUNC instruction
+ * 
+ * This function is executed by the guest. With function 0 (EPTP switching), it makes
+ * the current logical core use the EPT view with the given index, without a VM exit.
+ * An invalid function or index causes a VM exit, which injects an invalid opcode exception.
+ * 
+ * @param function VM function number, VMX_VMFUNC_EPTP_SWITCHING
+ * @param index EPTP list index, EPT_VIEW_READ or EPT_VIEW_FETCH
+ * 
+ * @return VOID
+ */
+VOID VMX_vmfunc(const UINT32 function, const UINT32 index);